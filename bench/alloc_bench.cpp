@@ -0,0 +1,295 @@
+// Heap allocations per statement relayed by a connection in steady state.
+//
+// A client session is relayed by a real connection, on one io_context as
+// in shared_nothing mode, to an in-process server answering every
+// COM_QUERY with a one row result set. After a warm-up the statements of
+// the measured run must not allocate: the exit status is 1 otherwise, so
+// the bench doubles as a regression check.
+//
+// Usage: alloc_bench [statements]
+
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "tracker/balancer.hpp"
+#include "tracker/connection.hpp"
+#include "tracker/server.hpp"
+
+namespace
+{
+
+// Only the allocations of the proxy thread are counted, once it is known
+boost::atomic<bool> counting (false);
+boost::thread::id proxy_thread;
+boost::atomic<uint64_t> allocations (0);
+
+} // namespace
+
+void *
+operator new (std::size_t n)
+{
+  if (counting.load (boost::memory_order_acquire)
+      && boost::this_thread::get_id () == proxy_thread)
+    allocations.fetch_add (1, boost::memory_order_relaxed);
+  if (void *p = std::malloc (n ? n : 1))
+    return p;
+  throw std::bad_alloc ();
+}
+
+// Out of line: inlined next to a builtin operator new, GCC takes the free
+// for a mismatched deallocation
+BOOST_NOINLINE void
+operator delete (void *p) BOOST_NOEXCEPT
+{
+  std::free (p);
+}
+
+// The other forms free through it, as the library's own do
+
+void
+operator delete[] (void *p) BOOST_NOEXCEPT
+{
+  operator delete (p);
+}
+
+#ifdef __cpp_sized_deallocation
+void
+operator delete (void *p, std::size_t) BOOST_NOEXCEPT
+{
+  operator delete (p);
+}
+
+void
+operator delete[] (void *p, std::size_t) BOOST_NOEXCEPT
+{
+  operator delete (p);
+}
+#endif
+
+namespace
+{
+
+typedef boost::asio::ip::tcp tcp;
+
+const std::size_t warm_up = 1000;
+
+const char greeting[] = "\x0a"
+                        "5.7.0-bench\0"
+                        "\x01\0\0\0"
+                        "aaaaaaaa\0"
+                        "\xff\xff"
+                        "\x21"
+                        "\x02\0"
+                        "\xff\xff"
+                        "\x15"
+                        "\0\0\0\0\0\0\0\0\0\0"
+                        "bbbbbbbbbbbb\0"
+                        "mysql_native_password";
+const char ok[] = "\0\0\0\x02\0\0";
+const char eof[] = "\xfe\0\0\x02";
+const char column[] = "\x03"
+                      "def\0\0\0\x01"
+                      "a\0\x0c\x21\0\x0b\0\0\0\xfd\0\0\0\0";
+
+void
+write_packet (tcp::socket &socket, uint8_t seq, const std::string &payload)
+{
+  uint8_t header[4] = { uint8_t (payload.size ()),
+                        uint8_t (payload.size () >> 8),
+                        uint8_t (payload.size () >> 16), seq };
+  std::vector<boost::asio::const_buffer> buffers;
+  buffers.push_back (boost::asio::buffer (header));
+  buffers.push_back (boost::asio::buffer (payload));
+  boost::asio::write (socket, buffers);
+}
+
+uint8_t
+read_packet (tcp::socket &socket, std::string &payload)
+{
+  uint8_t header[4];
+  boost::asio::read (socket, boost::asio::buffer (header));
+  payload.resize (header[0] | header[1] << 8 | header[2] << 16);
+  if (!payload.empty ())
+    boost::asio::read (socket, boost::asio::buffer (&payload[0],
+                                                    payload.size ()));
+  return header[3];
+}
+
+/// Server side: a handshake, then a result set for every statement.
+void
+serve (tcp::acceptor *acceptor)
+{
+  tcp::socket socket (acceptor->get_executor ());
+  acceptor->accept (socket);
+  socket.set_option (tcp::no_delay (true));
+
+  // Every literal keeps its terminating zero as last byte
+  std::string hello (greeting, sizeof greeting);
+  std::string done (ok, sizeof ok);
+  std::string end (eof, sizeof eof);
+  std::string definition (column, sizeof column);
+
+  std::string payload;
+  try
+    {
+      write_packet (socket, 0, hello);
+      write_packet (socket, read_packet (socket, payload) + 1, done);
+
+      for (;;)
+        {
+          uint8_t seq = read_packet (socket, payload);
+          if (payload[0] == 0x01)
+            return;
+
+          write_packet (socket, ++seq, std::string ("\x01", 1));
+          write_packet (socket, ++seq, definition);
+          write_packet (socket, ++seq, end);
+          write_packet (socket, ++seq, std::string ("\x01" "1", 2));
+          write_packet (socket, ++seq, end);
+        }
+    }
+  catch (const boost::system::system_error &)
+    {
+    }
+}
+
+/// Client side: log in, then run statements one after the other.
+class session
+{
+public:
+  explicit session (boost::asio::io_context &ioc) : socket_ (ioc) {}
+
+  tcp::socket &
+  socket ()
+  {
+    return socket_;
+  }
+
+  void
+  login ()
+  {
+    socket_.set_option (tcp::no_delay (true));
+    read_packet (socket_, payload_);
+
+    // CLIENT_LONG_PASSWORD, PROTOCOL_41, SECURE_CONNECTION and
+    // PLUGIN_AUTH, no password
+    std::string response ("\0\x82\x08\0"
+                          "\0\0\0\x01"
+                          "\x2d",
+                          9);
+    response.append (23, '\0');
+    response.append ("root\0\0", 6);
+    response.append ("mysql_native_password\0", 22);
+    write_packet (socket_, 1, response);
+    read_packet (socket_, payload_);
+  }
+
+  void
+  query ()
+  {
+    write_packet (socket_, 0, std::string ("\x03" "select 1", 9));
+
+    int eofs = 0;
+    while (eofs < 2)
+      {
+        read_packet (socket_, payload_);
+        if (uint8_t (payload_[0]) == 0xfe)
+          ++eofs;
+      }
+  }
+
+  void
+  quit ()
+  {
+    write_packet (socket_, 0, std::string ("\x01", 1));
+  }
+
+private:
+  tcp::socket socket_;
+  std::string payload_;
+};
+
+void
+run_proxy (boost::asio::io_context *ioc)
+{
+  proxy_thread = boost::this_thread::get_id ();
+  ioc->run ();
+}
+
+} // namespace
+
+int
+main (int argc, char *argv[])
+{
+  std::size_t statements = argc > 1 ? std::atoi (argv[1]) : 10000;
+
+  boost::asio::io_context proxy_context (1);
+  boost::asio::io_context client_context (1);
+
+  tcp::endpoint loopback (boost::asio::ip::address_v4::loopback (), 0);
+  tcp::acceptor server_acceptor (client_context, loopback);
+  tcp::acceptor proxy_acceptor (proxy_context, loopback);
+
+  mysqlproxy_tracker::server::backend_addresses.push_back (
+      "127.0.0.1:"
+      + boost::lexical_cast<std::string> (
+          server_acceptor.local_endpoint ().port ()));
+  mysqlproxy_tracker::server::balance_policy = "round-robin";
+
+  mysqlproxy_tracker::server::writer.reset (
+      new mysqlproxy_system::basic_logger (proxy_context, "Connection"));
+  boost::scoped_ptr<mysqlproxy_tracker::server::balancer> backends (
+      mysqlproxy_tracker::server::balancer::create (proxy_context, false));
+
+  boost::thread server (boost::bind (&serve, &server_acceptor));
+
+  session client (client_context);
+  client.socket ().connect (tcp::endpoint (
+      loopback.address (), proxy_acceptor.local_endpoint ().port ()));
+
+  mysqlproxy_tracker::server::connection_ptr relay (
+      new mysqlproxy_tracker::server::connection (
+          proxy_context, *mysqlproxy_tracker::server::writer, *backends));
+  proxy_acceptor.accept (relay->client_socket ());
+  relay->start ();
+  relay.reset ();
+
+  boost::asio::executor_work_guard<boost::asio::io_context::executor_type>
+      work (proxy_context.get_executor ());
+  boost::thread proxy (boost::bind (&run_proxy, &proxy_context));
+
+  client.login ();
+  for (std::size_t i = 0; i < warm_up; ++i)
+    client.query ();
+
+  counting.store (true, boost::memory_order_release);
+  for (std::size_t i = 0; i < statements; ++i)
+    client.query ();
+  counting.store (false, boost::memory_order_release);
+  uint64_t counted = allocations.load ();
+
+  client.quit ();
+  server.join ();
+  work.reset ();
+  proxy_context.stop ();
+  proxy.join ();
+
+  std::cout << statements << " statements, " << counted
+            << " allocations, " << double (counted) / statements
+            << " per statement" << std::endl;
+
+  return counted == 0 ? 0 : 1;
+}
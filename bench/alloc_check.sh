@@ -0,0 +1,3 @@
+#!/bin/sh
+# make check: relaying a statement in steady state must not allocate
+exec ./alloc_bench 2000
@@ -0,0 +1,104 @@
+// Throughput of the query digest over a corpus of typical statements.
+//
+// Usage: digest_bench [megabytes]
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "common/query_digest.hpp"
+
+namespace
+{
+
+typedef std::chrono::steady_clock clock_type;
+
+const char *const corpus[] = {
+  "SELECT id, name, email FROM users WHERE id = 42",
+  "select u.id, u.name from users u join orders o on o.user_id = u.id "
+  "where o.created_at > '2024-01-01 00:00:00' and o.status = 'paid' "
+  "order by o.created_at desc limit 50",
+  "SELECT `t0`.`id`, `t0`.`title`, `t0`.`body`, `t0`.`created_at` FROM "
+  "`posts` AS `t0` WHERE (`t0`.`author_id` = 1017) AND (`t0`.`deleted` = 0) "
+  "ORDER BY `t0`.`created_at` DESC LIMIT 20 OFFSET 40",
+  "UPDATE accounts SET balance = balance - 125.50, updated_at = NOW() WHERE "
+  "id = 9981 AND version = 17",
+  "INSERT INTO events (user_id, kind, payload, created_at) VALUES "
+  "(1, 'login', '{\"ip\": \"10.0.0.1\", \"agent\": \"Mozilla/5.0\"}', "
+  "'2024-05-01 10:00:00'), (2, 'logout', '{}', '2024-05-01 10:00:01'), "
+  "(3, 'login', '{\"ip\": \"10.0.0.7\"}', '2024-05-01 10:00:02')",
+  "SELECT * FROM products WHERE category_id IN (3, 17, 21, 44, 58, 91, 102, "
+  "117, 130, 145, 161, 178, 190, 204, 219, 233) AND price BETWEEN 10 AND "
+  "99.99",
+  "/* app=checkout,route=/cart */ SELECT SQL_NO_CACHE c.id, c.qty, "
+  "p.price FROM cart_items c JOIN products p ON p.id = c.product_id WHERE "
+  "c.cart_id = 'b7f3c2e1-4d5a-4c8e-9f10-2a3b4c5d6e7f'",
+  "DELETE FROM sessions WHERE expires_at < 1714557600",
+  "SELECT COUNT(*) FROM orders WHERE user_id = 77 AND status IN ('new', "
+  "'paid', 'shipped')",
+  "SET NAMES utf8mb4",
+  "SELECT @@session.transaction_isolation",
+  "INSERT INTO audit (actor, action, detail) VALUES ('admin', 'update', "
+  "'Changed the shipping address of order 5512 from \\'1 Main St\\' to "
+  "\\'22 Elm Rd\\' after a phone call with the customer, who asked for the "
+  "parcel to be left with a neighbour if nobody is at home')",
+  "select t.id, t.a, t.b, t.c, t.d, t.e from wide_table t where t.a = 1 and "
+  "t.b = 2 and t.c = 3 and t.d = 4 and t.e = 5 -- generated\n",
+};
+
+} // namespace
+
+int
+main (int argc, char *argv[])
+{
+  std::size_t megabytes = argc > 1 ? std::atoi (argv[1]) : 256;
+
+  std::vector<std::string> queries;
+  std::size_t corpus_bytes = 0;
+  for (std::size_t i = 0; i < sizeof (corpus) / sizeof (*corpus); i++)
+    {
+      queries.push_back (corpus[i]);
+      corpus_bytes += queries.back ().size ();
+    }
+
+  std::size_t rounds = megabytes * 1024 * 1024 / corpus_bytes + 1;
+
+  std::cout << "corpus: " << queries.size () << " statements, "
+            << corpus_bytes << " bytes, " << rounds << " rounds" << std::endl;
+
+  for (int scalar = 1; scalar >= 0; scalar--)
+    {
+      mysqlproxy_common::use_scalar_digest (scalar != 0);
+
+      mysqlproxy_common::query_digest digest;
+      uint64_t check = 0;
+
+      clock_type::time_point start = clock_type::now ();
+
+      for (std::size_t r = 0; r < rounds; r++)
+        for (std::size_t i = 0; i < queries.size (); i++)
+          {
+            mysqlproxy_common::make_digest (queries[i].data (),
+                                            queries[i].size (), digest);
+            check += digest.hash;
+          }
+
+      double seconds
+          = std::chrono::duration_cast<std::chrono::duration<double> > (
+                clock_type::now () - start)
+                .count ();
+      double bytes = double (corpus_bytes) * double (rounds);
+      double statements = double (queries.size ()) * double (rounds);
+
+      std::cout << std::setw (7) << mysqlproxy_common::digest_scanner ()
+                << ": " << std::fixed << std::setprecision (3)
+                << bytes / seconds / 1e9 << " GB/s, " << std::setprecision (1)
+                << seconds * 1e9 / statements << " ns/statement (check "
+                << std::hex << check << std::dec << ')' << std::endl;
+    }
+
+  return 0;
+}
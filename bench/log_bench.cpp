@@ -0,0 +1,109 @@
+// Cost of a CXXLOG_ call on the calling thread.
+//
+// Threads log a line shaped like the per-statement log of a connection as
+// fast as they can, the time per call is what an I/O thread would pay.
+// The logger thread formats and writes in the background; whatever it
+// cannot keep up with is dropped and reported in the output file.
+//
+// The same line is also timed at a level below the threshold, and sampled
+// 1 in 100 as --query-log-sample does.
+//
+// Usage: log_bench [threads] [calls per thread] [output file]
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "system/logger_service.hpp"
+
+namespace
+{
+
+typedef boost::asio::steady_timer::clock_type clock_type;
+
+enum mode
+{
+  logged,
+  filtered,
+  sampled
+};
+
+const char *const mode_names[] = { "logged", "filtered", "sampled 1/100" };
+
+void
+run (mysqlproxy_system::basic_logger *writer, mode m, std::size_t calls,
+     double *nanos)
+{
+  std::string digest ("select ? from t where id = ?");
+  uint64_t hash = 0x112195cd6b9783f5ULL;
+
+  clock_type::time_point start = clock_type::now ();
+  for (std::size_t i = 0; i < calls; ++i)
+    switch (m)
+      {
+      case logged:
+        CXXLOG_INFO (*writer, "on_packet: COM_QUERY \""
+                                  << digest << "\" (" << "read"
+                                  << ") digest " << std::hex << hash
+                                  << std::dec);
+        break;
+      case filtered:
+        CXXLOG_DEBUG (*writer, "on_packet: COM_QUERY \""
+                                   << digest << "\" (" << "read"
+                                   << ") digest " << std::hex << hash
+                                   << std::dec);
+        break;
+      case sampled:
+        CXXLOG_SAMPLED (*writer, INFO, 100,
+                        "on_packet: COM_QUERY \""
+                            << digest << "\" (" << "read" << ") digest "
+                            << std::hex << hash << std::dec);
+        break;
+      }
+
+  *nanos = double (boost::asio::chrono::duration_cast<
+                       boost::asio::chrono::nanoseconds> (clock_type::now ()
+                                                          - start)
+                       .count ())
+           / calls;
+}
+
+} // namespace
+
+int
+main (int argc, char *argv[])
+{
+  std::size_t threads = argc > 1 ? std::atoi (argv[1]) : 1;
+  std::size_t calls = argc > 2 ? std::atoi (argv[2]) : 1000000;
+  std::string file = argc > 3 ? argv[3] : "/dev/null";
+
+  boost::asio::io_context ioc;
+  mysqlproxy_system::basic_logger writer (ioc, "Bench");
+  writer.use_file (file);
+
+  for (int m = logged; m <= sampled; ++m)
+    {
+      std::vector<double> nanos (threads);
+      boost::thread_group group;
+      for (std::size_t i = 0; i < threads; ++i)
+        group.create_thread (
+            boost::bind (&run, &writer, mode (m), calls, &nanos[i]));
+      group.join_all ();
+
+      double total = 0;
+      for (std::size_t i = 0; i < threads; ++i)
+        total += nanos[i];
+
+      std::cout << mode_names[m] << ": " << threads << " threads, " << calls
+                << " calls each, " << std::fixed << std::setprecision (1)
+                << total / threads << " ns per call" << std::endl;
+    }
+
+  return 0;
+}
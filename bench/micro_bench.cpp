@@ -0,0 +1,454 @@
+// Per-operation cost of the pieces a relayed statement goes through.
+//
+// Each benchmark runs its operation in a loop, doubling the iteration
+// count until a run takes --min-time seconds, and reports wall and
+// process CPU nanoseconds per operation:
+//
+//   prefix_decode      packet header read from the receive ring
+//   frame_packet/N     an N byte packet received into the ring and framed
+//                      into a pooled buffer, as connection::dispatch does
+//   buffer_queue       framed packets queued for the write, copies of the
+//                      same payload reference as connection::buffer
+//   command_route      COM_QUERY text found, classified and digested, the
+//                      work on_packet does for a client statement
+//   digest_record      the statement accounted in digest_stats
+//   log_format_post    a CXXLOG_INFO line formatted and posted to the
+//                      logger thread
+//   log_filtered       a CXXLOG_DEBUG line below the threshold
+//   processor_post     a handler posted and run on the same thread
+//   processor_handoff  a handler posted to an io_context run by another
+//                      thread, until it has run
+//
+// --format json prints the results in the layout of Google Benchmark's
+// JSON output, --format csv one line per benchmark, for tracking runs
+// over time.
+//
+// Usage: micro_bench [--filter TEXT] [--min-time SECONDS]
+//                    [--format console|json|csv]
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/program_options.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "common/digest_stats.hpp"
+#include "common/mysql.hpp"
+#include "common/packet_pool.hpp"
+#include "common/processor.hpp"
+#include "common/query_classifier.hpp"
+#include "common/query_digest.hpp"
+#include "common/ring_buffer.hpp"
+#include "system/logger_service.hpp"
+
+namespace
+{
+
+typedef boost::asio::steady_timer::clock_type clock_type;
+
+const std::size_t header_length
+    = sizeof (mysqlproxy_common::protocol::prefix);
+
+const char statement[] = "select id, name from users where id = 42";
+
+// Results are folded into it so that no loop is optimized away
+volatile uint64_t sink;
+
+// A packet of n payload bytes, header included
+std::string
+packet (std::size_t n)
+{
+  std::string p (header_length + n, 'x');
+  p[0] = char (n);
+  p[1] = char (n >> 8);
+  p[2] = char (n >> 16);
+  p[3] = 0;
+  return p;
+}
+
+// As connection::buffer
+struct framed
+{
+  uint8_t header_[header_length];
+  mysqlproxy_common::packet_ptr data_;
+};
+
+uint64_t
+prefix_decode (std::size_t iterations)
+{
+  // Packets of varied lengths filling most of the ring
+  mysqlproxy_common::ring_buffer ring (64 * 1024);
+  std::vector<std::size_t> offsets;
+  std::size_t filled = 0;
+  for (std::size_t n = 1; filled + header_length + n < 60 * 1024;
+       n = n * 7 % 1021 + 1)
+    {
+      std::string p = packet (n);
+      boost::asio::buffer_copy (ring.prepare (), boost::asio::buffer (p));
+      ring.commit (p.size ());
+      offsets.push_back (filled);
+      filled += p.size ();
+    }
+
+  uint64_t sum = 0;
+  std::size_t offset = 0;
+  for (std::size_t i = 0; i < iterations; ++i)
+    {
+      mysqlproxy_common::protocol::prefix header;
+      ring.copy (offset, &header, header_length);
+      offset += header_length + header.payload_length;
+      sum += header.payload_length;
+      if (offset >= filled)
+        offset = 0;
+    }
+  return sum;
+}
+
+uint64_t
+frame_packet (std::size_t iterations, std::size_t payload)
+{
+  mysqlproxy_common::ring_buffer ring (16 * 1024);
+  std::string p = packet (payload);
+
+  uint64_t sum = 0;
+  for (std::size_t i = 0; i < iterations; ++i)
+    {
+      ring.reserve (p.size ());
+      boost::asio::buffer_copy (ring.prepare (), boost::asio::buffer (p));
+      ring.commit (p.size ());
+
+      mysqlproxy_common::protocol::prefix header;
+      ring.copy (0, &header, header_length);
+
+      framed f;
+      ring.copy (0, f.header_, header_length);
+      f.data_ = mysqlproxy_common::packet_pool::allocate (
+          header.payload_length);
+      ring.copy (header_length, f.data_->data (), header.payload_length);
+      ring.consume (header_length + header.payload_length);
+      sum += f.data_->data ()[0];
+    }
+  return sum;
+}
+
+uint64_t
+frame_packet_small (std::size_t iterations)
+{
+  return frame_packet (iterations, 64);
+}
+
+uint64_t
+frame_packet_large (std::size_t iterations)
+{
+  return frame_packet (iterations, 8192);
+}
+
+uint64_t
+buffer_queue (std::size_t iterations)
+{
+  framed f;
+  std::memset (f.header_, 0, sizeof (f.header_));
+  f.data_ = mysqlproxy_common::packet_pool::allocate (64);
+
+  // Drained as a write completion would
+  std::vector<framed> queue;
+  uint64_t sum = 0;
+  for (std::size_t i = 0; i < iterations; ++i)
+    {
+      queue.push_back (f);
+      if (queue.size () == 64)
+        {
+          sum += queue.size ();
+          queue.clear ();
+        }
+    }
+  return sum;
+}
+
+uint64_t
+command_route (std::size_t iterations)
+{
+  std::string payload (1, char (MYSQLPROXY_PROTOCOL_COM_QUERY));
+  payload += statement;
+  const uint8_t *data = reinterpret_cast<const uint8_t *> (payload.data ());
+
+  mysqlproxy_common::query_digest digest;
+  uint64_t sum = 0;
+  for (std::size_t i = 0; i < iterations; ++i)
+    {
+      const char *text;
+      std::size_t length;
+      if (mysqlproxy_common::protocol::query_text (
+              data, payload.size (), MYSQLPROXY_CLIENT_PROTOCOL_41, text,
+              length))
+        {
+          sum += mysqlproxy_common::classify_query (text, length);
+          mysqlproxy_common::make_digest (text, length, digest);
+          sum += digest.hash;
+        }
+    }
+  return sum;
+}
+
+uint64_t
+digest_record (std::size_t iterations)
+{
+  mysqlproxy_common::query_digest digest;
+  mysqlproxy_common::make_digest (statement, sizeof (statement) - 1, digest);
+
+  for (std::size_t i = 0; i < iterations; ++i)
+    mysqlproxy_common::digest_stats::record (digest, i & 1023, false, 1, 64);
+  return iterations;
+}
+
+boost::scoped_ptr<mysqlproxy_system::basic_logger> writer;
+
+uint64_t
+log_format_post (std::size_t iterations)
+{
+  std::string text (statement);
+  for (std::size_t i = 0; i < iterations; ++i)
+    CXXLOG_INFO (*writer, "on_packet: COM_QUERY \""
+                              << text << "\" (" << "read" << ") digest "
+                              << std::hex << i << std::dec);
+  return iterations;
+}
+
+uint64_t
+log_filtered (std::size_t iterations)
+{
+  std::string text (statement);
+  for (std::size_t i = 0; i < iterations; ++i)
+    CXXLOG_DEBUG (*writer, "on_packet: COM_QUERY \""
+                               << text << "\" (" << "read" << ") digest "
+                               << std::hex << i << std::dec);
+  return iterations;
+}
+
+boost::atomic<uint64_t> handled (0);
+
+void
+on_posted ()
+{
+  handled.fetch_add (1, boost::memory_order_release);
+}
+
+uint64_t
+processor_post (std::size_t iterations)
+{
+  boost::asio::io_context &ioc
+      = mysqlproxy_common::processor::instance ().io_context ();
+  for (std::size_t i = 0; i < iterations; ++i)
+    {
+      boost::asio::post (ioc, &on_posted);
+      ioc.poll_one ();
+    }
+  ioc.restart ();
+  return handled.load ();
+}
+
+void
+run_context (boost::asio::io_context *ioc)
+{
+  ioc->run ();
+}
+
+uint64_t
+processor_handoff (std::size_t iterations)
+{
+  boost::asio::io_context remote (1);
+  boost::asio::executor_work_guard<boost::asio::io_context::executor_type>
+      work (remote.get_executor ());
+  boost::thread runner (boost::bind (&run_context, &remote));
+
+  uint64_t base = handled.load ();
+  for (std::size_t i = 1; i <= iterations; ++i)
+    {
+      boost::asio::post (remote, &on_posted);
+      while (handled.load (boost::memory_order_acquire) != base + i)
+        ;
+    }
+
+  work.reset ();
+  runner.join ();
+  return handled.load ();
+}
+
+struct benchmark
+{
+  const char *name;
+  uint64_t (*run) (std::size_t iterations);
+};
+
+const benchmark benchmarks[] = {
+  { "prefix_decode", &prefix_decode },
+  { "frame_packet/64", &frame_packet_small },
+  { "frame_packet/8192", &frame_packet_large },
+  { "buffer_queue", &buffer_queue },
+  { "command_route", &command_route },
+  { "digest_record", &digest_record },
+  { "log_format_post", &log_format_post },
+  { "log_filtered", &log_filtered },
+  { "processor_post", &processor_post },
+  { "processor_handoff", &processor_handoff },
+};
+
+struct result
+{
+  std::string name;
+  std::size_t iterations;
+  double real_ns;
+  double cpu_ns;
+};
+
+double
+process_cpu_ns ()
+{
+  struct timespec ts;
+  ::clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+result
+measure (const benchmark &b, double min_time)
+{
+  result r;
+  r.name = b.name;
+
+  for (std::size_t n = 1;; n *= 2)
+    {
+      clock_type::time_point start = clock_type::now ();
+      double cpu = process_cpu_ns ();
+      sink = sink + b.run (n);
+      double real = double (boost::asio::chrono::duration_cast<
+                                boost::asio::chrono::nanoseconds> (
+                                clock_type::now () - start)
+                                .count ());
+      cpu = process_cpu_ns () - cpu;
+
+      if (real >= min_time * 1e9 || n >= (std::size_t (1) << 40))
+        {
+          r.iterations = n;
+          r.real_ns = real / n;
+          r.cpu_ns = cpu / n;
+          return r;
+        }
+    }
+}
+
+void
+print_json (const std::vector<result> &results)
+{
+  char date[32];
+  std::time_t now = std::time (0);
+  struct tm local;
+  ::localtime_r (&now, &local);
+  std::strftime (date, sizeof (date), "%Y-%m-%dT%H:%M:%S%z", &local);
+
+  std::cout << "{\n  \"context\": {\n    \"date\": \"" << date
+            << "\",\n    \"num_cpus\": "
+            << boost::thread::hardware_concurrency ()
+            << ",\n    \"reactor\": \""
+            << mysqlproxy_common::processor::reactor ()
+            << "\",\n    \"digest_scanner\": \""
+            << mysqlproxy_common::digest_scanner ()
+            << "\"\n  },\n  \"benchmarks\": [";
+
+  for (std::size_t i = 0; i < results.size (); ++i)
+    std::cout << (i ? "," : "") << "\n    {\n      \"name\": \""
+              << results[i].name << "\",\n      \"iterations\": "
+              << results[i].iterations << ",\n      \"real_time\": "
+              << results[i].real_ns << ",\n      \"cpu_time\": "
+              << results[i].cpu_ns << ",\n      \"time_unit\": \"ns\"\n    }";
+  std::cout << "\n  ]\n}" << std::endl;
+}
+
+} // namespace
+
+int
+main (int argc, char *argv[])
+{
+  std::string filter, format = "console";
+  double min_time = 0.5;
+
+  boost::program_options::options_description desc ("All options");
+  desc.add_options () (
+      "filter", boost::program_options::value<std::string> (&filter),
+      "Run the benchmarks whose name contains this text") (
+      "min-time",
+      boost::program_options::value<double> (&min_time)
+          ->default_value (min_time),
+      "Seconds a measured run takes at least") (
+      "format",
+      boost::program_options::value<std::string> (&format)
+          ->default_value (format),
+      "console, json or csv") ("help", "This message");
+
+  boost::program_options::variables_map vm;
+  try
+    {
+      boost::program_options::store (
+          boost::program_options::parse_command_line (argc, argv, desc), vm);
+      boost::program_options::notify (vm);
+    }
+  catch (const std::exception &e)
+    {
+      std::cerr << e.what () << "\n";
+      return 1;
+    }
+
+  if (vm.count ("help")
+      || (format != "console" && format != "json" && format != "csv"))
+    {
+      std::cout << "Usage: " << argv[0] << " [options]\n" << desc << "\n";
+      return 1;
+    }
+
+  // The logger thread writes to /dev/null while the callers are timed
+  boost::asio::io_context log_context;
+  writer.reset (new mysqlproxy_system::basic_logger (log_context, "Bench"));
+  writer->use_file ("/dev/null");
+
+  std::vector<result> results;
+  for (std::size_t i = 0; i < sizeof (benchmarks) / sizeof (*benchmarks); ++i)
+    if (filter.empty ()
+        || std::string (benchmarks[i].name).find (filter)
+               != std::string::npos)
+      {
+        results.push_back (measure (benchmarks[i], min_time));
+
+        if (format == "console")
+          std::cout << std::left << std::setw (20) << results.back ().name
+                    << std::right << std::fixed << std::setprecision (1)
+                    << std::setw (10) << results.back ().real_ns << " ns"
+                    << std::setw (10) << results.back ().cpu_ns
+                    << " ns CPU" << std::setw (14)
+                    << results.back ().iterations << " iterations"
+                    << std::endl;
+      }
+
+  if (format == "json")
+    print_json (results);
+  else if (format == "csv")
+    {
+      std::cout << "name,iterations,real_time,cpu_time,time_unit\n";
+      for (std::size_t i = 0; i < results.size (); ++i)
+        std::cout << results[i].name << ',' << results[i].iterations << ','
+                  << results[i].real_ns << ',' << results[i].cpu_ns << ",ns\n";
+      std::cout.flush ();
+    }
+
+  writer.reset ();
+  return 0;
+}
@@ -0,0 +1,262 @@
+// Bulk throughput of the passthrough relay, splice(2) through kernel pipes
+// against reading into a buffer and writing it out again.
+//
+// Sources write as fast as they can, the relay forwards to sinks that read
+// and drop the bytes. Sources and sinks run on one thread, the relay on
+// another, whose CPU time is what the two modes are compared by: bytes
+// per second through the relay and relay CPU seconds per GB moved.
+//
+// Usage: passthrough_bench [connections] [seconds] [write bytes]
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/placeholders.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include <time.h>
+
+#include "common/processor.hpp"
+#include "tracker/passthrough.hpp"
+
+namespace
+{
+
+typedef boost::asio::ip::tcp tcp;
+typedef boost::asio::steady_timer::clock_type clock_type;
+typedef mysqlproxy_tracker::server::passthrough passthrough;
+
+const std::size_t sink_buffer_size = 256 * 1024;
+
+/// Writes the same bytes over and over.
+class source : private boost::noncopyable
+{
+public:
+  source (boost::asio::io_context &ioc, std::size_t size)
+      : socket_ (ioc), out_ (size, 'x')
+  {
+  }
+
+  tcp::socket &
+  socket ()
+  {
+    return socket_;
+  }
+
+  void
+  start ()
+  {
+    boost::asio::async_write (
+        socket_, boost::asio::buffer (out_),
+        boost::bind (&source::on_write, this,
+                     boost::asio::placeholders::error));
+  }
+
+private:
+  void
+  on_write (const boost::system::error_code &err)
+  {
+    if (!err)
+      start ();
+  }
+
+  tcp::socket socket_;
+  std::vector<char> out_;
+};
+
+/// Reads and drops, counting the bytes.
+class sink : private boost::noncopyable
+{
+public:
+  explicit sink (boost::asio::io_context &ioc)
+      : socket_ (ioc), buffer_ (sink_buffer_size), bytes_ (0)
+  {
+  }
+
+  tcp::socket &
+  socket ()
+  {
+    return socket_;
+  }
+
+  void
+  start ()
+  {
+    socket_.async_read_some (
+        boost::asio::buffer (buffer_),
+        boost::bind (&sink::on_read, this, boost::asio::placeholders::error,
+                     boost::asio::placeholders::bytes_transferred));
+  }
+
+  uint64_t
+  bytes () const
+  {
+    return bytes_;
+  }
+
+private:
+  void
+  on_read (const boost::system::error_code &err, std::size_t length)
+  {
+    if (err)
+      return;
+
+    bytes_ += length;
+    start ();
+  }
+
+  tcp::socket socket_;
+  std::vector<char> buffer_;
+  uint64_t bytes_;
+};
+
+double
+thread_cpu_seconds ()
+{
+  timespec ts;
+  ::clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+run_context (boost::asio::io_context *ioc, double *cpu)
+{
+  double start = thread_cpu_seconds ();
+  ioc->run ();
+  *cpu = thread_cpu_seconds () - start;
+}
+
+void
+stop_contexts (boost::asio::io_context *load, boost::asio::io_context *relay)
+{
+  load->stop ();
+  relay->stop ();
+}
+
+void
+relay_ended (const boost::system::error_code &)
+{
+}
+
+// Run one mode, print its throughput and relay CPU cost
+void
+measure (bool zero_copy, std::size_t connections, int seconds,
+         std::size_t write_size)
+{
+  boost::asio::io_context relay_context (1);
+  boost::asio::io_context load_context (1);
+
+  tcp::acceptor relay_acceptor (relay_context,
+                                tcp::endpoint (tcp::v4 (), 0));
+  tcp::acceptor sink_acceptor (load_context, tcp::endpoint (tcp::v4 (), 0));
+
+  boost::asio::ip::address loopback
+      = boost::asio::ip::address_v4::loopback ();
+  tcp::endpoint relay_endpoint (loopback,
+                                relay_acceptor.local_endpoint ().port ());
+  tcp::endpoint sink_endpoint (loopback,
+                               sink_acceptor.local_endpoint ().port ());
+
+  std::vector<boost::shared_ptr<source> > sources;
+  std::vector<boost::shared_ptr<sink> > sinks;
+  std::vector<boost::shared_ptr<tcp::socket> > sockets;
+  std::vector<boost::shared_ptr<passthrough> > relays;
+
+  // Connections are set up synchronously before anything runs
+  for (std::size_t i = 0; i < connections; ++i)
+    {
+      boost::shared_ptr<source> s (new source (load_context, write_size));
+      s->socket ().connect (relay_endpoint);
+
+      boost::shared_ptr<tcp::socket> downstream (
+          new tcp::socket (relay_context));
+      relay_acceptor.accept (*downstream);
+
+      boost::shared_ptr<tcp::socket> upstream (
+          new tcp::socket (relay_context));
+      upstream->connect (sink_endpoint);
+
+      boost::shared_ptr<sink> k (new sink (load_context));
+      sink_acceptor.accept (k->socket ());
+
+      relays.push_back (boost::shared_ptr<passthrough> (new passthrough (
+          boost::asio::make_strand (relay_context), *downstream, *upstream,
+          zero_copy)));
+      sockets.push_back (downstream);
+      sockets.push_back (upstream);
+      sources.push_back (s);
+      sinks.push_back (k);
+    }
+
+  for (std::size_t i = 0; i < connections; ++i)
+    {
+      relays[i]->start (&relay_ended);
+      sinks[i]->start ();
+      sources[i]->start ();
+    }
+
+  boost::asio::steady_timer timer (load_context);
+  timer.expires_after (boost::asio::chrono::seconds (seconds));
+  timer.async_wait (
+      boost::bind (&stop_contexts, &load_context, &relay_context));
+
+  clock_type::time_point start = clock_type::now ();
+
+  double load_cpu = 0;
+  double relay_cpu = 0;
+  boost::thread load (boost::bind (&run_context, &load_context, &load_cpu));
+  boost::thread relay (
+      boost::bind (&run_context, &relay_context, &relay_cpu));
+
+  load.join ();
+  relay.join ();
+
+  double elapsed
+      = boost::asio::chrono::duration_cast<
+            boost::asio::chrono::duration<double> > (clock_type::now ()
+                                                     - start)
+            .count ();
+
+  uint64_t bytes = 0;
+  for (std::size_t i = 0; i < connections; ++i)
+    bytes += sinks[i]->bytes ();
+
+  double gigabytes = double (bytes) / 1e9;
+
+  std::cout << (relays.empty () || !relays[0]->zero_copy () ? "copy:   "
+                                                            : "splice: ")
+            << std::fixed << std::setprecision (2) << gigabytes / elapsed
+            << " GB/s, " << std::setprecision (3)
+            << (gigabytes > 0 ? relay_cpu / gigabytes : 0)
+            << " relay CPU s/GB, " << std::setprecision (0)
+            << 100 * relay_cpu / elapsed << "% of a core" << std::endl;
+}
+
+} // namespace
+
+int
+main (int argc, char *argv[])
+{
+  std::size_t connections = argc > 1 ? std::atoi (argv[1]) : 4;
+  int seconds = argc > 2 ? std::atoi (argv[2]) : 5;
+  std::size_t write_size = argc > 3 ? std::atoi (argv[3]) : 256 * 1024;
+
+  std::cout << "reactor: " << mysqlproxy_common::processor::reactor ()
+            << ", " << connections << " connections, " << write_size
+            << " byte writes" << std::endl;
+
+  measure (false, connections, seconds, write_size);
+  if (passthrough::zero_copy_supported ())
+    measure (true, connections, seconds, write_size);
+
+  return 0;
+}
@@ -0,0 +1,1593 @@
+// Statements per second through mysqlproxy_tracker, end to end.
+//
+// An in-process mock server answers the handshake with OK and every
+// COM_QUERY with a result set of --rows rows of --row-bytes bytes, an OK
+// packet ("do 0") or an ERR packet ("select error"). The tracker is
+// started in front of it on localhost, and --connections clients log in
+// through the tracker and run statements back to back, the share of OK
+// and ERR answers set by --ok-percent and --error-percent.
+//
+// After --warm-up seconds, --seconds seconds are measured: statements per
+// second, p50 and p99 latency, the CPU time per statement of the tracker
+// and of the bench itself, and the peak RSS of the tracker.
+//
+// With --check the bench is a pass/fail check of the response tracking
+// instead. The mock server answers result sets, errors, a multi-statement
+// batch, a field list and prepared statements with cursors, with and
+// without CLIENT_DEPRECATE_EOF, writing each response packet by packet.
+// Logins asking for caching_sha2_password get its fast authentication.
+// Clients run each scenario command by command and pipelined, and compare
+// what the tracker relays with what the server sent. A response that
+// stalls, differs or lets the next command through before its last packet
+// fails the check, and the exit status is 1.
+//
+// Usage: proxy_bench [--tracker PATH] [--connections N] [--seconds S]
+//                    [--rows N] [--row-bytes M] [-- tracker options]
+//        proxy_bench --check [--tracker PATH] [-- tracker options]
+
+#include <algorithm>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/placeholders.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/program_options.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <signal.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "common/digest_stats.hpp"
+
+namespace
+{
+
+typedef boost::asio::ip::tcp tcp;
+typedef boost::asio::steady_timer::clock_type clock_type;
+
+const char greeting[] = "\x0a"
+                        "5.7.0-bench\0"
+                        "\x01\0\0\0"
+                        "aaaaaaaa\0"
+                        "\xff\xf7"
+                        "\x21"
+                        "\x02\0"
+                        "\xff\x81"
+                        "\x15"
+                        "\0\0\0\0\0\0\0\0\0\0"
+                        "bbbbbbbbbbbb\0"
+                        "mysql_native_password";
+const char ok[] = "\0\0\0\x02\0\0";
+const char eof[] = "\xfe\0\0\x02";
+const char err[] = "\xff\x28\x04#42000mock error";
+const char column[] = "\x03"
+                      "def\0\0\0\x01"
+                      "a\0\x0c\x21\0\xff\xff\xff\0\xfd\0\0\0\0";
+
+const char result_query[] = "select rows";
+const char ok_query[] = "do 0";
+const char error_query[] = "select error";
+
+// Largest row whose length encoding stays below 0xfe
+const std::size_t max_row_bytes = 0xfffff0;
+
+void
+append_packet (std::string &out, uint8_t seq, const char *payload,
+               std::size_t size)
+{
+  char header[4] = { char (size), char (size >> 8), char (size >> 16),
+                     char (seq) };
+  out.append (header, sizeof (header));
+  out.append (payload, size);
+}
+
+/// Responses of the mock server, sequence ids from 1.
+struct responses
+{
+  responses (std::size_t rows, std::size_t row_bytes)
+  {
+    // Every literal but err keeps its terminating zero as last byte
+    append_packet (ok_packet, 1, ok, sizeof (ok));
+    append_packet (err_packet, 1, err, sizeof (err) - 1);
+
+    uint8_t seq = 1;
+    append_packet (result_set, seq++, "\x01", 1);
+    append_packet (result_set, seq++, column, sizeof (column));
+    append_packet (result_set, seq++, eof, sizeof (eof));
+
+    std::string row;
+    if (row_bytes < 251)
+      row.assign (1, char (row_bytes));
+    else if (row_bytes < 0x10000)
+      {
+        row.assign (1, '\xfc');
+        row += char (row_bytes);
+        row += char (row_bytes >> 8);
+      }
+    else
+      {
+        row.assign (1, '\xfd');
+        row += char (row_bytes);
+        row += char (row_bytes >> 8);
+        row += char (row_bytes >> 16);
+      }
+    row.append (row_bytes, 'x');
+
+    for (std::size_t i = 0; i < rows; ++i)
+      append_packet (result_set, seq++, row.data (), row.size ());
+    append_packet (result_set, seq++, eof, sizeof (eof));
+  }
+
+  std::string ok_packet;
+  std::string err_packet;
+  std::string result_set;
+};
+
+/// Mock server side of one connection.
+class mock_session : public boost::enable_shared_from_this<mock_session>,
+                     private boost::noncopyable
+{
+public:
+  mock_session (boost::asio::io_context &ioc, const responses &r)
+      : socket_ (ioc), responses_ (r), logged_in_ (false)
+  {
+  }
+
+  tcp::socket &
+  socket ()
+  {
+    return socket_;
+  }
+
+  void
+  start ()
+  {
+    socket_.set_option (tcp::no_delay (true));
+    out_.clear ();
+    append_packet (out_, 0, greeting, sizeof (greeting));
+    write (out_);
+  }
+
+private:
+  void
+  write (const std::string &out)
+  {
+    boost::asio::async_write (
+        socket_, boost::asio::buffer (out),
+        boost::bind (&mock_session::on_write, shared_from_this (),
+                     boost::asio::placeholders::error));
+  }
+
+  void
+  on_write (const boost::system::error_code &err)
+  {
+    if (err)
+      return;
+
+    boost::asio::async_read (
+        socket_, boost::asio::buffer (header_),
+        boost::bind (&mock_session::on_header, shared_from_this (),
+                     boost::asio::placeholders::error));
+  }
+
+  void
+  on_header (const boost::system::error_code &err)
+  {
+    if (err)
+      return;
+
+    payload_.resize (header_[0] | header_[1] << 8 | header_[2] << 16);
+    boost::asio::async_read (
+        socket_, boost::asio::buffer (payload_),
+        boost::bind (&mock_session::on_payload, shared_from_this (),
+                     boost::asio::placeholders::error));
+  }
+
+  void
+  on_payload (const boost::system::error_code &err)
+  {
+    if (err)
+      return;
+
+    // Any login is accepted
+    if (!logged_in_)
+      {
+        logged_in_ = true;
+        out_.clear ();
+        append_packet (out_, uint8_t (header_[3] + 1), ok, sizeof (ok));
+        write (out_);
+        return;
+      }
+
+    if (payload_.empty () || payload_[0] == 0x01)
+      return;
+
+    if (payload_[0] != 0x03)
+      write (responses_.ok_packet);
+    else if (payload_.size () == sizeof (error_query)
+             && !std::memcmp (&payload_[1], error_query,
+                              sizeof (error_query) - 1))
+      write (responses_.err_packet);
+    else if (payload_.size () == sizeof (ok_query)
+             && !std::memcmp (&payload_[1], ok_query, sizeof (ok_query) - 1))
+      write (responses_.ok_packet);
+    else
+      write (responses_.result_set);
+  }
+
+  tcp::socket socket_;
+  const responses &responses_;
+  bool logged_in_;
+  uint8_t header_[4];
+  std::vector<uint8_t> payload_;
+  std::string out_;
+};
+
+/// Accepts the tracker's connections to the mock server.
+class mock_server : private boost::noncopyable
+{
+public:
+  mock_server (boost::asio::io_context &ioc, const responses &r)
+      : ioc_ (ioc),
+        acceptor_ (
+            ioc, tcp::endpoint (boost::asio::ip::address_v4::loopback (), 0)),
+        responses_ (r)
+  {
+  }
+
+  unsigned short
+  port () const
+  {
+    return acceptor_.local_endpoint ().port ();
+  }
+
+  void
+  start ()
+  {
+    next_.reset (new mock_session (ioc_, responses_));
+    acceptor_.async_accept (
+        next_->socket (),
+        boost::bind (&mock_server::on_accept, this,
+                     boost::asio::placeholders::error));
+  }
+
+private:
+  void
+  on_accept (const boost::system::error_code &err)
+  {
+    if (err)
+      return;
+
+    next_->start ();
+    start ();
+  }
+
+  boost::asio::io_context &ioc_;
+  tcp::acceptor acceptor_;
+  const responses &responses_;
+  boost::shared_ptr<mock_session> next_;
+};
+
+// Status flags and capabilities the check mode looks at
+const uint16_t status_autocommit = 0x0002;
+const uint16_t status_more_results = 0x0008;
+const uint16_t status_cursor_exists = 0x0040;
+const uint16_t status_last_row_sent = 0x0080;
+const uint32_t client_deprecate_eof = 0x01000000;
+
+// Commands and cursor flags the check mode answers
+const uint8_t com_query = 0x03;
+const uint8_t com_field_list = 0x04;
+const uint8_t com_ping = 0x0e;
+const uint8_t com_stmt_prepare = 0x16;
+const uint8_t com_stmt_execute = 0x17;
+const uint8_t com_stmt_send_long_data = 0x18;
+const uint8_t com_stmt_close = 0x19;
+const uint8_t com_stmt_fetch = 0x1c;
+const uint8_t cursor_type_read_only = 0x01;
+
+const char sha2_plugin[] = "caching_sha2_password";
+const char empty_query[] = "select empty";
+const char multi_query[] = "select 1; do 0; select 2";
+
+// Packets of a response must all be relayed before the next command
+boost::atomic<std::size_t> early_commands (0);
+
+std::string
+ok_payload (uint16_t status, char header = '\0')
+{
+  // Affected rows, last insert id, status and warnings
+  std::string p (1, header);
+  p.append ("\0\0", 2);
+  p += char (status);
+  p += char (status >> 8);
+  p.append ("\0\0", 2);
+  return p;
+}
+
+/// EOF packet, or under CLIENT_DEPRECATE_EOF the OK packet replacing it.
+std::string
+end_payload (bool deprecate_eof, uint16_t status)
+{
+  if (deprecate_eof)
+    return ok_payload (status, '\xfe');
+
+  // Warnings before status
+  std::string p ("\xfe\0\0", 3);
+  p += char (status);
+  p += char (status >> 8);
+  return p;
+}
+
+/// Response of the check mode server to one command, sequence ids from 1.
+class check_answer
+{
+public:
+  check_answer (const std::string &command, bool deprecate_eof)
+      : deprecate_eof_ (deprecate_eof), seq_ (1)
+  {
+    uint8_t value = command.empty () ? 0 : uint8_t (command[0]);
+    std::string text = command.empty () ? "" : command.substr (1);
+
+    switch (value)
+      {
+      case com_query:
+        if (text == result_query)
+          result_set (3, false, status_autocommit);
+        else if (text == empty_query)
+          result_set (0, false, status_autocommit);
+        else if (text == error_query)
+          add (std::string (err, sizeof (err) - 1));
+        else if (text == multi_query)
+          {
+            result_set (1, false, status_autocommit | status_more_results);
+            add (ok_payload (status_autocommit | status_more_results));
+            result_set (2, false, status_autocommit);
+          }
+        else
+          add (ok_payload (status_autocommit));
+        break;
+
+      case com_field_list:
+        for (int i = 0; i < 2; ++i)
+          add (std::string (column, sizeof (column)));
+        add (end_payload (deprecate_eof_, status_autocommit));
+        break;
+
+      case com_stmt_prepare:
+        // Statement 1 with one column and two parameters
+        add (std::string ("\0\x01\0\0\0\x01\0\x02\0\0\0\0", 12));
+        definitions (2, status_autocommit);
+        definitions (1, status_autocommit);
+        break;
+
+      case com_stmt_execute:
+        if (command.size () > 5 && command[5] & cursor_type_read_only)
+          {
+            // The cursor is opened, its rows are fetched
+            add ("\x01");
+            definitions (1, status_autocommit | status_cursor_exists);
+            if (deprecate_eof_)
+              add (end_payload (true, status_autocommit
+                                          | status_cursor_exists));
+          }
+        else
+          result_set (2, true, status_autocommit);
+        break;
+
+      case com_stmt_fetch:
+        rows (2, true);
+        add (end_payload (deprecate_eof_, status_autocommit
+                                              | status_cursor_exists
+                                              | status_last_row_sent));
+        break;
+
+      case com_stmt_send_long_data:
+      case com_stmt_close:
+        // Nothing comes back
+        break;
+
+      default:
+        add (ok_payload (status_autocommit));
+        break;
+      }
+  }
+
+  const std::vector<std::string> &
+  packets () const
+  {
+    return packets_;
+  }
+
+private:
+  void
+  add (const std::string &payload)
+  {
+    packets_.push_back (std::string ());
+    append_packet (packets_.back (), seq_++, payload.data (),
+                   payload.size ());
+  }
+
+  void
+  definitions (std::size_t count, uint16_t status)
+  {
+    for (std::size_t i = 0; i < count; ++i)
+      add (std::string (column, sizeof (column)));
+
+    if (!deprecate_eof_)
+      add (end_payload (false, status));
+  }
+
+  void
+  rows (std::size_t count, bool binary)
+  {
+    // Binary rows have a header and an empty NULL bitmap
+    for (std::size_t i = 0; i < count; ++i)
+      add (binary ? std::string ("\0\0\x03" "abc", 6) : "\x03" "abc");
+  }
+
+  void
+  result_set (std::size_t count, bool binary, uint16_t status)
+  {
+    add ("\x01");
+    definitions (1, status_autocommit);
+    rows (count, binary);
+    add (end_payload (deprecate_eof_, status));
+  }
+
+  bool deprecate_eof_;
+  uint8_t seq_;
+  std::vector<std::string> packets_;
+};
+
+/// Check mode server side of one connection.
+///
+/// Reads go on while a response is written packet by packet, a short
+/// pause apart, so a command relayed before the end of the response is
+/// seen.
+class check_session : public boost::enable_shared_from_this<check_session>,
+                      private boost::noncopyable
+{
+public:
+  explicit check_session (boost::asio::io_context &ioc)
+      : socket_ (ioc), timer_ (ioc), logged_in_ (false),
+        deprecate_eof_ (false), writing_ (false), responding_ (false)
+  {
+  }
+
+  tcp::socket &
+  socket ()
+  {
+    return socket_;
+  }
+
+  void
+  start ()
+  {
+    socket_.set_option (tcp::no_delay (true));
+    std::string packet;
+    append_packet (packet, 0, greeting, sizeof (greeting));
+    respond (std::vector<std::string> (1, packet));
+    read ();
+  }
+
+private:
+  void
+  read ()
+  {
+    boost::asio::async_read (
+        socket_, boost::asio::buffer (header_),
+        boost::bind (&check_session::on_header, shared_from_this (),
+                     boost::asio::placeholders::error));
+  }
+
+  void
+  on_header (const boost::system::error_code &err)
+  {
+    if (err)
+      return;
+
+    payload_.resize (header_[0] | header_[1] << 8 | header_[2] << 16);
+    boost::asio::async_read (
+        socket_, boost::asio::buffer (payload_),
+        boost::bind (&check_session::on_payload, shared_from_this (),
+                     boost::asio::placeholders::error));
+  }
+
+  void
+  on_payload (const boost::system::error_code &err)
+  {
+    if (err)
+      return;
+
+    if (responding_)
+      ++early_commands;
+
+    // Any login is accepted
+    if (!logged_in_)
+      {
+        uint32_t capabilities = 0;
+        for (std::size_t i = 0; i < 4 && i < payload_.size (); ++i)
+          capabilities |= uint32_t (payload_[i]) << (8 * i);
+
+        logged_in_ = true;
+        deprecate_eof_ = capabilities & client_deprecate_eof;
+
+        // caching_sha2_password fast authentication: the OK follows its
+        // success without waiting for the client
+        std::vector<std::string> packets;
+        uint8_t seq = uint8_t (header_[3] + 1);
+        if (std::search (payload_.begin (), payload_.end (), sha2_plugin,
+                         sha2_plugin + sizeof (sha2_plugin) - 1)
+            != payload_.end ())
+          {
+            packets.push_back (std::string ());
+            append_packet (packets.back (), seq++, "\x01\x03", 2);
+          }
+        packets.push_back (std::string ());
+        append_packet (packets.back (), seq, ok, sizeof (ok));
+        respond (packets);
+      }
+    else
+      respond (check_answer (std::string (payload_.begin (), payload_.end ()),
+                             deprecate_eof_)
+                   .packets ());
+
+    read ();
+  }
+
+  void
+  respond (const std::vector<std::string> &packets)
+  {
+    for (std::size_t i = 0; i < packets.size (); ++i)
+      queue_.push_back (std::make_pair (packets[i], i + 1 == packets.size ()));
+
+    if (!writing_ && !queue_.empty ())
+      write_next ();
+  }
+
+  void
+  write_next ()
+  {
+    // The next command may come as soon as the last packet is sent
+    writing_ = true;
+    responding_ = !queue_.front ().second;
+    boost::asio::async_write (
+        socket_, boost::asio::buffer (queue_.front ().first),
+        boost::bind (&check_session::on_write, shared_from_this (),
+                     boost::asio::placeholders::error));
+  }
+
+  void
+  on_write (const boost::system::error_code &err)
+  {
+    if (err)
+      return;
+
+    queue_.pop_front ();
+    if (queue_.empty ())
+      {
+        writing_ = false;
+        return;
+      }
+
+    timer_.expires_after (boost::asio::chrono::milliseconds (2));
+    timer_.async_wait (boost::bind (&check_session::on_pause,
+                                    shared_from_this (),
+                                    boost::asio::placeholders::error));
+  }
+
+  void
+  on_pause (const boost::system::error_code &err)
+  {
+    if (!err)
+      write_next ();
+  }
+
+  tcp::socket socket_;
+  boost::asio::steady_timer timer_;
+  bool logged_in_;
+  bool deprecate_eof_;
+  bool writing_;
+  // Packets of the response are still to be written
+  bool responding_;
+  uint8_t header_[4];
+  std::vector<uint8_t> payload_;
+  // Packets to write, and whether each ends its response
+  std::deque<std::pair<std::string, bool> > queue_;
+};
+
+/// Accepts the tracker's connections to the check mode server.
+class check_server : private boost::noncopyable
+{
+public:
+  explicit check_server (boost::asio::io_context &ioc)
+      : ioc_ (ioc),
+        acceptor_ (
+            ioc, tcp::endpoint (boost::asio::ip::address_v4::loopback (), 0))
+  {
+  }
+
+  unsigned short
+  port () const
+  {
+    return acceptor_.local_endpoint ().port ();
+  }
+
+  void
+  start ()
+  {
+    next_.reset (new check_session (ioc_));
+    acceptor_.async_accept (
+        next_->socket (),
+        boost::bind (&check_server::on_accept, this,
+                     boost::asio::placeholders::error));
+  }
+
+private:
+  void
+  on_accept (const boost::system::error_code &err)
+  {
+    if (err)
+      return;
+
+    next_->start ();
+    start ();
+  }
+
+  boost::asio::io_context &ioc_;
+  tcp::acceptor acceptor_;
+  boost::shared_ptr<check_session> next_;
+};
+
+/// Commands sent together and the name reported when they fail.
+struct scenario
+{
+  std::string name;
+  std::vector<std::string> commands;
+};
+
+std::vector<scenario>
+check_scenarios ()
+{
+  // Statement 1, parameter 0, and an execution with both parameters bound
+  // as strings, the first one sent as long data
+  const std::string statement ("\x01\0\0\0", 4);
+  const std::string execute
+      = std::string (1, char (com_stmt_execute)) + statement;
+  const std::string parameters ("\x01\0\0\0\0\x01\xfd\0\xfd\0\x01x", 12);
+
+  std::vector<scenario> all (7);
+
+  all[0].name = "result set";
+  all[0].commands.push_back (std::string ("\x03") + result_query);
+
+  all[1].name = "empty result set";
+  all[1].commands.push_back (std::string ("\x03") + empty_query);
+
+  all[2].name = "error";
+  all[2].commands.push_back (std::string ("\x03") + error_query);
+
+  all[3].name = "multi-statement batch";
+  all[3].commands.push_back (std::string ("\x03") + multi_query);
+
+  all[4].name = "field list";
+  all[4].commands.push_back (std::string ("\x04" "t\0", 3));
+
+  all[5].name = "prepare, long data, execute and close";
+  all[5].commands.push_back ("\x16" "select ?, ?");
+  all[5].commands.push_back (std::string (1, char (com_stmt_send_long_data))
+                             + statement + std::string ("\0\0", 2) + "data");
+  all[5].commands.push_back (execute + '\0' + parameters);
+  all[5].commands.push_back (std::string (1, char (com_stmt_close))
+                             + statement);
+
+  all[6].name = "cursor";
+  all[6].commands.push_back ("\x16" "select ?, ?");
+  all[6].commands.push_back (execute + char (cursor_type_read_only)
+                             + parameters);
+  all[6].commands.push_back (std::string (1, char (com_stmt_fetch))
+                             + statement + std::string ("\x02\0\0\0", 4));
+  all[6].commands.push_back (std::string (1, char (com_stmt_close))
+                             + statement);
+
+  return all;
+}
+
+/// Runs the check scenarios on one connection through the tracker.
+class checker : private boost::noncopyable
+{
+public:
+  checker (const tcp::endpoint &proxy, bool deprecate_eof, bool pipelined,
+           bool fast_auth)
+      : socket_ (ioc_), proxy_ (proxy), deprecate_eof_ (deprecate_eof),
+        pipelined_ (pipelined), fast_auth_ (fast_auth), read_done_ (false)
+  {
+  }
+
+  /// Report the failures on std::cout, return true if there were none.
+  bool
+  run ()
+  {
+    std::string name = std::string (deprecate_eof_ ? "DEPRECATE_EOF"
+                                                   : "EOF")
+                       + (pipelined_ ? ", pipelined" : ", one by one")
+                       + (fast_auth_ ? ", " + std::string (sha2_plugin)
+                                     : "");
+
+    std::string error;
+    if (!login (error))
+      {
+        std::cout << name << ": login: " << error << std::endl;
+        return false;
+      }
+
+    std::vector<scenario> scenarios = check_scenarios ();
+    if (pipelined_)
+      {
+        scenario all;
+        all.name = "all scenarios at once";
+        for (std::size_t i = 0; i < scenarios.size (); ++i)
+          all.commands.insert (all.commands.end (),
+                               scenarios[i].commands.begin (),
+                               scenarios[i].commands.end ());
+        scenarios.push_back (all);
+      }
+
+    bool passed = true;
+    for (std::size_t i = 0; i < scenarios.size (); ++i)
+      if (!exchange (scenarios[i].commands, error))
+        {
+          std::cout << name << ": " << scenarios[i].name << ": " << error
+                    << std::endl;
+          passed = false;
+          break;
+        }
+
+    // Nothing may follow the last response
+    if (passed && !ping (error))
+      {
+        std::cout << name << ": final ping: " << error << std::endl;
+        passed = false;
+      }
+
+    if (passed)
+      std::cout << name << ": passed" << std::endl;
+    return passed;
+  }
+
+private:
+  bool
+  login (std::string &error)
+  {
+    boost::system::error_code err;
+    socket_.connect (proxy_, err);
+    if (err)
+      {
+        error = err.message ();
+        return false;
+      }
+    socket_.set_option (tcp::no_delay (true));
+
+    std::string header, greeting_payload;
+    if (!read_exact (4, header, error)
+        || !read_exact (uint8_t (header[0]) | uint8_t (header[1]) << 8,
+                        greeting_payload, error))
+      return false;
+
+    // Capabilities around the charset, after the version and the first
+    // part of the scramble
+    std::size_t at = greeting_payload.find ('\0', 1) + 1 + 4 + 9;
+    if (at + 7 > greeting_payload.size ())
+      {
+        error = "short greeting";
+        return false;
+      }
+    uint32_t offered = uint8_t (greeting_payload[at])
+                       | uint8_t (greeting_payload[at + 1]) << 8
+                       | uint8_t (greeting_payload[at + 5]) << 16
+                       | uint32_t (uint8_t (greeting_payload[at + 6])) << 24;
+    deprecate_eof_ = deprecate_eof_ && (offered & client_deprecate_eof);
+
+    // PROTOCOL_41, SECURE_CONNECTION, multiple statements and results,
+    // PLUGIN_AUTH, no password
+    std::string response ("\0\x82\x0f\0"
+                          "\0\0\0\x01"
+                          "\x2d",
+                          9);
+    if (deprecate_eof_)
+      response[3] = char (client_deprecate_eof >> 24);
+    response.append (23, '\0');
+    response.append ("root\0\0", 6);
+    if (fast_auth_)
+      response.append (sha2_plugin, sizeof (sha2_plugin));
+    else
+      response.append ("mysql_native_password\0", 22);
+
+    std::string out;
+    append_packet (out, 1, response.data (), response.size ());
+
+    // Up to the OK, past a fast authentication success or an empty token
+    // sent on an authentication switch
+    for (;;)
+      {
+        if (!out.empty ())
+          boost::asio::write (socket_, boost::asio::buffer (out), err);
+        if (err)
+          {
+            error = err.message ();
+            return false;
+          }
+
+        std::string answer;
+        if (!read_exact (4, header, error)
+            || !read_exact (uint8_t (header[0]), answer, error))
+          return false;
+
+        out.clear ();
+        if (answer == "\x01\x03")
+          continue;
+        if (!answer.empty () && answer[0] == '\xfe')
+          {
+            append_packet (out, uint8_t (header[3] + 1), "", 0);
+            continue;
+          }
+
+        if (answer.empty () || answer[0] != '\0')
+          {
+            error = "login refused";
+            return false;
+          }
+        return true;
+      }
+  }
+
+  bool
+  exchange (const std::vector<std::string> &commands, std::string &error)
+  {
+    std::string out, expected;
+    for (std::size_t i = 0; i < commands.size (); ++i)
+      {
+        append_packet (out, 0, commands[i].data (), commands[i].size ());
+
+        check_answer answer (commands[i], deprecate_eof_);
+        for (std::size_t j = 0; j < answer.packets ().size (); ++j)
+          expected += answer.packets ()[j];
+
+        if (!pipelined_ || i + 1 == commands.size ())
+          {
+            if (!send_and_check (out, expected, error))
+              return false;
+            out.clear ();
+            expected.clear ();
+          }
+
+        // A ping answered next shows the tracker saw the response end
+        if (!pipelined_ && !ping (error))
+          {
+            error = "response not ended: " + error;
+            return false;
+          }
+      }
+    return true;
+  }
+
+  bool
+  ping (std::string &error)
+  {
+    std::string command (1, char (com_ping)), out, expected;
+    append_packet (out, 0, command.data (), command.size ());
+    check_answer answer (command, deprecate_eof_);
+    expected = answer.packets ()[0];
+    return send_and_check (out, expected, error);
+  }
+
+  bool
+  send_and_check (const std::string &out, const std::string &expected,
+                  std::string &error)
+  {
+    boost::system::error_code err;
+    boost::asio::write (socket_, boost::asio::buffer (out), err);
+    if (err)
+      {
+        error = err.message ();
+        return false;
+      }
+
+    std::string received;
+    if (!read_exact (expected.size (), received, error))
+      return false;
+
+    if (received != expected)
+      {
+        std::size_t at = 0;
+        while (received[at] == expected[at])
+          ++at;
+        error = "response differs at byte "
+                + boost::lexical_cast<std::string> (at);
+        return false;
+      }
+    return true;
+  }
+
+  bool
+  read_exact (std::size_t size, std::string &out, std::string &error)
+  {
+    out.assign (size, '\0');
+    if (!size)
+      return true;
+
+    read_done_ = false;
+    read_bytes_ = 0;
+    boost::asio::async_read (
+        socket_, boost::asio::buffer (&out[0], size),
+        boost::bind (&checker::on_read, this,
+                     boost::asio::placeholders::error,
+                     boost::asio::placeholders::bytes_transferred));
+
+    ioc_.restart ();
+    ioc_.run_for (boost::asio::chrono::seconds (2));
+    if (!read_done_)
+      {
+        boost::system::error_code ignored_ec;
+        socket_.cancel (ignored_ec);
+        ioc_.restart ();
+        ioc_.run ();
+        error = "stalled after " + boost::lexical_cast<std::string> (
+                                       read_bytes_)
+                + " of " + boost::lexical_cast<std::string> (size)
+                + " bytes";
+        return false;
+      }
+
+    if (read_error_)
+      {
+        error = read_error_.message ();
+        return false;
+      }
+    return true;
+  }
+
+  void
+  on_read (const boost::system::error_code &err, std::size_t bytes)
+  {
+    read_error_ = err;
+    read_bytes_ = bytes;
+    read_done_ = err != boost::asio::error::operation_aborted;
+  }
+
+  boost::asio::io_context ioc_;
+  tcp::socket socket_;
+  tcp::endpoint proxy_;
+  bool deprecate_eof_;
+  bool pipelined_;
+  bool fast_auth_;
+  bool read_done_;
+  std::size_t read_bytes_;
+  boost::system::error_code read_error_;
+};
+
+// Clients count statements only while measuring
+boost::atomic<bool> measuring (false);
+
+/// Logs in through the tracker, then runs statements back to back.
+class client : private boost::noncopyable
+{
+public:
+  client (boost::asio::io_context &ioc, std::size_t id,
+          std::size_t ok_percent, std::size_t error_percent)
+      : socket_ (ioc), ok_percent_ (ok_percent),
+        error_percent_ (error_percent), next_ (id), statements_ (0),
+        errors_ (0), failed_ (false),
+        histogram_ (mysqlproxy_common::latency_buckets::count, 0)
+  {
+    append_packet (result_, 0, "\x03" "select rows",
+                   sizeof (result_query));
+    append_packet (ok_, 0, "\x03" "do 0", sizeof (ok_query));
+    append_packet (error_, 0, "\x03" "select error", sizeof (error_query));
+  }
+
+  void
+  start (const tcp::endpoint &proxy)
+  {
+    socket_.async_connect (proxy,
+                           boost::bind (&client::on_connect, this,
+                                        boost::asio::placeholders::error));
+  }
+
+  uint64_t
+  statements () const
+  {
+    return statements_;
+  }
+
+  uint64_t
+  errors () const
+  {
+    return errors_;
+  }
+
+  bool
+  failed () const
+  {
+    return failed_;
+  }
+
+  const std::vector<uint64_t> &
+  histogram () const
+  {
+    return histogram_;
+  }
+
+private:
+  void
+  on_connect (const boost::system::error_code &err)
+  {
+    if (fail (err))
+      return;
+
+    socket_.set_option (tcp::no_delay (true));
+    read (&client::on_greeting);
+  }
+
+  void
+  on_greeting (const boost::system::error_code &err)
+  {
+    if (fail (err))
+      return;
+
+    // CLIENT_LONG_PASSWORD, PROTOCOL_41, SECURE_CONNECTION and
+    // PLUGIN_AUTH, no password
+    std::string response ("\0\x82\x08\0"
+                          "\0\0\0\x01"
+                          "\x2d",
+                          9);
+    response.append (23, '\0');
+    response.append ("root\0\0", 6);
+    response.append ("mysql_native_password\0", 22);
+
+    out_.clear ();
+    append_packet (out_, 1, response.data (), response.size ());
+    boost::asio::async_write (
+        socket_, boost::asio::buffer (out_),
+        boost::bind (&client::on_login, this,
+                     boost::asio::placeholders::error));
+  }
+
+  void
+  on_login (const boost::system::error_code &err)
+  {
+    if (fail (err))
+      return;
+
+    read (&client::on_logged_in);
+  }
+
+  void
+  on_logged_in (const boost::system::error_code &err)
+  {
+    if (fail (err) || payload_.empty () || payload_[0] != 0x00)
+      {
+        failed_ = true;
+        return;
+      }
+
+    send ();
+  }
+
+  void
+  send ()
+  {
+    // Every hundred statements have the configured mix
+    std::size_t slot = next_++ % 100;
+    const std::string *out = &result_;
+    if (slot < error_percent_)
+      out = &error_;
+    else if (slot < error_percent_ + ok_percent_)
+      out = &ok_;
+
+    eofs_ = 0;
+    first_ = true;
+    sent_at_ = clock_type::now ();
+    boost::asio::async_write (
+        socket_, boost::asio::buffer (*out),
+        boost::bind (&client::on_send, this,
+                     boost::asio::placeholders::error));
+  }
+
+  void
+  on_send (const boost::system::error_code &err)
+  {
+    if (fail (err))
+      return;
+
+    read (&client::on_response);
+  }
+
+  void
+  on_response (const boost::system::error_code &err)
+  {
+    if (fail (err))
+      return;
+
+    bool done = true;
+    if (first_ && !payload_.empty () && payload_[0] == 0xff)
+      {
+        if (measuring.load (boost::memory_order_relaxed))
+          ++errors_;
+      }
+    else if (!first_ || (!payload_.empty () && payload_[0] != 0x00))
+      {
+        if (!payload_.empty () && payload_[0] == 0xfe
+            && payload_.size () < 9)
+          ++eofs_;
+        done = eofs_ == 2;
+      }
+    first_ = false;
+
+    if (!done)
+      {
+        read (&client::on_response);
+        return;
+      }
+
+    if (measuring.load (boost::memory_order_relaxed))
+      {
+        ++statements_;
+        histogram_[mysqlproxy_common::latency_buckets::index (
+            boost::asio::chrono::duration_cast<
+                boost::asio::chrono::microseconds> (clock_type::now ()
+                                                    - sent_at_)
+                .count ())]++;
+      }
+    send ();
+  }
+
+  typedef void (client::*handler) (const boost::system::error_code &);
+
+  void
+  read (handler next)
+  {
+    boost::asio::async_read (
+        socket_, boost::asio::buffer (header_),
+        boost::bind (&client::on_header, this,
+                     boost::asio::placeholders::error, next));
+  }
+
+  void
+  on_header (const boost::system::error_code &err, handler next)
+  {
+    if (fail (err))
+      return;
+
+    payload_.resize (header_[0] | header_[1] << 8 | header_[2] << 16);
+    boost::asio::async_read (socket_, boost::asio::buffer (payload_),
+                             boost::bind (next, this,
+                                          boost::asio::placeholders::error));
+  }
+
+  bool
+  fail (const boost::system::error_code &err)
+  {
+    // Aborted reads are the end of the run, not a failure
+    if (err && err != boost::asio::error::operation_aborted)
+      failed_ = true;
+    return bool (err);
+  }
+
+  tcp::socket socket_;
+  std::size_t ok_percent_;
+  std::size_t error_percent_;
+  std::size_t next_;
+  std::string result_;
+  std::string ok_;
+  std::string error_;
+  std::string out_;
+  uint8_t header_[4];
+  std::vector<uint8_t> payload_;
+  bool first_;
+  int eofs_;
+  clock_type::time_point sent_at_;
+
+  uint64_t statements_;
+  uint64_t errors_;
+  bool failed_;
+  std::vector<uint64_t> histogram_;
+};
+
+/// CPU seconds used so far by a process, from /proc.
+double
+process_cpu (pid_t pid)
+{
+  std::string path = "/proc/" + boost::lexical_cast<std::string> (pid)
+                     + "/stat";
+  std::FILE *f = std::fopen (path.c_str (), "r");
+  if (!f)
+    return 0;
+
+  char line[1024];
+  std::size_t n = std::fread (line, 1, sizeof (line) - 1, f);
+  std::fclose (f);
+  line[n] = '\0';
+
+  // utime and stime are the 14th and 15th fields, counted after the
+  // command name, which may contain spaces
+  const char *p = std::strrchr (line, ')');
+  unsigned long utime = 0, stime = 0;
+  if (!p
+      || std::sscanf (p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                             "%lu %lu",
+                      &utime, &stime)
+             != 2)
+    return 0;
+  return double (utime + stime) / ::sysconf (_SC_CLK_TCK);
+}
+
+/// Peak resident set of a process in KiB, from /proc.
+long
+process_peak_rss (pid_t pid)
+{
+  std::string path = "/proc/" + boost::lexical_cast<std::string> (pid)
+                     + "/status";
+  std::FILE *f = std::fopen (path.c_str (), "r");
+  if (!f)
+    return 0;
+
+  char line[256];
+  long kib = 0;
+  while (std::fgets (line, sizeof (line), f))
+    if (std::sscanf (line, "VmHWM: %ld kB", &kib) == 1)
+      break;
+  std::fclose (f);
+  return kib;
+}
+
+double
+self_cpu ()
+{
+  struct rusage usage;
+  ::getrusage (RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+         + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+/// Start the tracker, its output discarded, -1 on failure.
+pid_t
+spawn (const std::string &tracker, const std::vector<std::string> &args)
+{
+  std::vector<char *> argv;
+  argv.push_back (const_cast<char *> (tracker.c_str ()));
+  for (std::size_t i = 0; i < args.size (); ++i)
+    argv.push_back (const_cast<char *> (args[i].c_str ()));
+  argv.push_back (0);
+
+  pid_t pid = ::fork ();
+  if (pid == 0)
+    {
+      int null = ::open ("/dev/null", O_WRONLY);
+      ::dup2 (null, 1);
+      ::dup2 (null, 2);
+      ::execv (tracker.c_str (), &argv[0]);
+      ::_exit (127);
+    }
+  return pid;
+}
+
+/// Wait until the tracker accepts connections.
+bool
+wait_listening (const tcp::endpoint &proxy, pid_t pid)
+{
+  boost::asio::io_context ioc;
+  for (int i = 0; i < 100; ++i)
+    {
+      tcp::socket probe (ioc);
+      boost::system::error_code err;
+      probe.connect (proxy, err);
+      if (!err)
+        return true;
+
+      int status;
+      if (::waitpid (pid, &status, WNOHANG) == pid)
+        return false;
+      ::usleep (50000);
+    }
+  return false;
+}
+
+/// Phases of the run, driven by a timer on the client context.
+struct run
+{
+  run (boost::asio::io_context &ioc, pid_t tracker)
+      : ioc (ioc), timer (ioc), tracker (tracker), tracker_cpu (0),
+        bench_cpu (0), seconds (0)
+  {
+  }
+
+  void
+  on_warmed_up (const boost::system::error_code &err, int measured)
+  {
+    if (err)
+      return;
+
+    tracker_cpu = process_cpu (tracker);
+    bench_cpu = self_cpu ();
+    started = clock_type::now ();
+    measuring.store (true);
+
+    timer.expires_after (boost::asio::chrono::seconds (measured));
+    timer.async_wait (boost::bind (&run::on_measured, this,
+                                   boost::asio::placeholders::error));
+  }
+
+  void
+  on_measured (const boost::system::error_code &err)
+  {
+    if (err)
+      return;
+
+    measuring.store (false);
+    seconds = boost::asio::chrono::duration_cast<
+                  boost::asio::chrono::duration<double> > (clock_type::now ()
+                                                           - started)
+                  .count ();
+    tracker_cpu = process_cpu (tracker) - tracker_cpu;
+    bench_cpu = self_cpu () - bench_cpu;
+    ioc.stop ();
+  }
+
+  boost::asio::io_context &ioc;
+  boost::asio::steady_timer timer;
+  pid_t tracker;
+  clock_type::time_point started;
+  double tracker_cpu;
+  double bench_cpu;
+  double seconds;
+};
+
+void
+run_context (boost::asio::io_context *ioc)
+{
+  ioc->run ();
+}
+
+} // namespace
+
+int
+main (int argc, char *argv[])
+{
+  std::string tracker = "../tracker/mysqlproxy_tracker";
+  std::size_t connections = 64;
+  int seconds = 10;
+  int warm_up = 2;
+  std::size_t rows = 1;
+  std::size_t row_bytes = 16;
+  std::size_t ok_percent = 0;
+  std::size_t error_percent = 0;
+  std::size_t client_threads = 1;
+  std::size_t server_threads = 1;
+  bool check = false;
+  std::vector<std::string> tracker_options;
+
+  boost::program_options::options_description desc ("All options");
+  desc.add_options () (
+      "tracker",
+      boost::program_options::value<std::string> (&tracker)
+          ->default_value (tracker),
+      "Path of mysqlproxy_tracker") (
+      "connections",
+      boost::program_options::value<std::size_t> (&connections)
+          ->default_value (connections),
+      "Client connections") (
+      "seconds",
+      boost::program_options::value<int> (&seconds)->default_value (seconds),
+      "Seconds measured") (
+      "warm-up",
+      boost::program_options::value<int> (&warm_up)->default_value (warm_up),
+      "Seconds run before measuring") (
+      "rows",
+      boost::program_options::value<std::size_t> (&rows)->default_value (rows),
+      "Rows of a result set") (
+      "row-bytes",
+      boost::program_options::value<std::size_t> (&row_bytes)
+          ->default_value (row_bytes),
+      "Bytes of a row") (
+      "ok-percent",
+      boost::program_options::value<std::size_t> (&ok_percent)
+          ->default_value (ok_percent),
+      "Statements answered with an OK packet") (
+      "error-percent",
+      boost::program_options::value<std::size_t> (&error_percent)
+          ->default_value (error_percent),
+      "Statements answered with an ERR packet") (
+      "client-threads",
+      boost::program_options::value<std::size_t> (&client_threads)
+          ->default_value (client_threads),
+      "Threads running the clients") (
+      "server-threads",
+      boost::program_options::value<std::size_t> (&server_threads)
+          ->default_value (server_threads),
+      "Threads running the mock server") (
+      "check", boost::program_options::bool_switch (&check),
+      "Check the response tracking instead of measuring") (
+      "tracker-option",
+      boost::program_options::value<std::vector<std::string> > (
+          &tracker_options),
+      "Option passed to the tracker, given after --") ("help",
+                                                         "This message");
+
+  boost::program_options::positional_options_description positional;
+  positional.add ("tracker-option", -1);
+
+  boost::program_options::variables_map vm;
+  try
+    {
+      boost::program_options::store (
+          boost::program_options::command_line_parser (argc, argv)
+              .options (desc)
+              .positional (positional)
+              .run (),
+          vm);
+      boost::program_options::notify (vm);
+    }
+  catch (const std::exception &e)
+    {
+      std::cerr << e.what () << "\n";
+      return 1;
+    }
+
+  if (vm.count ("help") || row_bytes > max_row_bytes
+      || ok_percent + error_percent > 100 || !client_threads
+      || !server_threads)
+    {
+      std::cout << "Usage: " << argv[0] << " [options] [-- tracker options]\n"
+                << desc << "\n";
+      return 1;
+    }
+
+  // A finished run may close connections with writes pending
+  ::signal (SIGPIPE, SIG_IGN);
+
+  responses answers (rows, row_bytes);
+  boost::asio::io_context server_context;
+  mock_server server (server_context, answers);
+  check_server checks (server_context);
+  if (check)
+    {
+      // The check server keeps to one thread
+      checks.start ();
+      server_threads = 1;
+    }
+  else
+    server.start ();
+
+  // A free port for the tracker, released for it to bind
+  tcp::endpoint proxy;
+  {
+    tcp::acceptor probe (server_context,
+                         tcp::endpoint (
+                             boost::asio::ip::address_v4::loopback (), 0));
+    proxy = probe.local_endpoint ();
+  }
+
+  std::vector<std::string> args;
+  args.push_back ("-a");
+  args.push_back ("127.0.0.1");
+  args.push_back ("-p");
+  args.push_back (boost::lexical_cast<std::string> (proxy.port ()));
+  args.push_back ("--backend");
+  args.push_back ("127.0.0.1:"
+                  + boost::lexical_cast<std::string> (
+                      check ? checks.port () : server.port ()));
+  args.insert (args.end (), tracker_options.begin (), tracker_options.end ());
+
+  boost::thread_group server_threads_group;
+  for (std::size_t i = 0; i < server_threads; ++i)
+    server_threads_group.create_thread (
+        boost::bind (&run_context, &server_context));
+
+  pid_t pid = spawn (tracker, args);
+  if (pid < 0 || !wait_listening (proxy, pid))
+    {
+      std::cerr << tracker << " did not start\n";
+      server_context.stop ();
+      server_threads_group.join_all ();
+      return 1;
+    }
+
+  if (check)
+    {
+      bool passed = true;
+      for (int pipelined = 0; pipelined < 2; ++pipelined)
+        for (int deprecate_eof = 0; deprecate_eof < 2; ++deprecate_eof)
+          passed = checker (proxy, deprecate_eof, pipelined, false).run ()
+                   && passed;
+      passed = checker (proxy, false, false, true).run () && passed;
+
+      ::kill (pid, SIGTERM);
+      ::waitpid (pid, 0, 0);
+      server_context.stop ();
+      server_threads_group.join_all ();
+
+      if (early_commands)
+        {
+          std::cout << early_commands << " commands relayed before the end "
+                    << "of a response" << std::endl;
+          passed = false;
+        }
+      return passed ? 0 : 1;
+    }
+
+  boost::asio::io_context client_context;
+  std::vector<boost::shared_ptr<client> > clients;
+  for (std::size_t i = 0; i < connections; ++i)
+    {
+      clients.push_back (boost::shared_ptr<client> (
+          new client (client_context, i, ok_percent, error_percent)));
+      clients.back ()->start (proxy);
+    }
+
+  run phases (client_context, pid);
+  phases.timer.expires_after (boost::asio::chrono::seconds (warm_up));
+  phases.timer.async_wait (boost::bind (&run::on_warmed_up, &phases,
+                                        boost::asio::placeholders::error,
+                                        seconds));
+
+  boost::thread_group client_threads_group;
+  for (std::size_t i = 1; i < client_threads; ++i)
+    client_threads_group.create_thread (
+        boost::bind (&run_context, &client_context));
+  client_context.run ();
+  client_threads_group.join_all ();
+
+  long peak_rss = process_peak_rss (pid);
+  ::kill (pid, SIGTERM);
+  ::waitpid (pid, 0, 0);
+  server_context.stop ();
+  server_threads_group.join_all ();
+
+  uint64_t statements = 0, errors = 0;
+  std::size_t failed = 0;
+  mysqlproxy_common::digest_summary latency;
+  latency.histogram.assign (mysqlproxy_common::latency_buckets::count, 0);
+  for (std::size_t i = 0; i < clients.size (); ++i)
+    {
+      statements += clients[i]->statements ();
+      errors += clients[i]->errors ();
+      failed += clients[i]->failed ();
+      for (std::size_t j = 0; j < latency.histogram.size (); ++j)
+        latency.histogram[j] += clients[i]->histogram ()[j];
+    }
+
+  double per_statement = statements ? 1e6 / statements : 0;
+  std::cout << connections << " connections, " << rows << " rows of "
+            << row_bytes << " bytes, " << ok_percent << "% OK, "
+            << error_percent << "% ERR" << std::endl
+            << std::fixed << std::setprecision (0)
+            << statements / phases.seconds << " statements/s, " << errors
+            << " errors, " << failed << " connections failed" << std::endl
+            << "latency p50 " << latency.percentile (0.5) << "us p99 "
+            << latency.percentile (0.99) << "us" << std::endl
+            << std::setprecision (2) << "tracker CPU "
+            << phases.tracker_cpu * per_statement << "us/statement, peak RSS "
+            << peak_rss << " KiB" << std::endl
+            << "bench CPU " << phases.bench_cpu * per_statement
+            << "us/statement" << std::endl;
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,4 @@
+#!/bin/sh
+# make check: responses are tracked to their end, relayed and pooled
+./proxy_bench --check || exit 1
+exec ./proxy_bench --check -- --backend-user root
@@ -0,0 +1,312 @@
+// Round trips per second through an Asio relay, the forwarding pattern of
+// the proxy without its protocol handling.
+//
+// Clients send a packet, the relay forwards it to an echo server and the
+// echo back to the client. Clients and the echo server run on one thread,
+// the relay on another, both on the reactor the build selects
+// (configure --enable-io-uring), so comparing two builds compares the
+// syscall cost of the reactors.
+//
+// Usage: relay_bench [connections] [seconds] [payload bytes]
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/placeholders.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "common/processor.hpp"
+
+namespace
+{
+
+typedef boost::asio::ip::tcp tcp;
+typedef boost::asio::steady_timer::clock_type clock_type;
+
+const std::size_t relay_buffer_size = 16 * 1024;
+
+/// One direction of a relayed connection.
+class forwarder : private boost::noncopyable
+{
+public:
+  forwarder (tcp::socket &from, tcp::socket &to)
+      : from_ (from), to_ (to), buffer_ (relay_buffer_size), packets_ (0)
+  {
+  }
+
+  void
+  start ()
+  {
+    from_.async_read_some (
+        boost::asio::buffer (buffer_),
+        boost::bind (&forwarder::on_read, this,
+                     boost::asio::placeholders::error,
+                     boost::asio::placeholders::bytes_transferred));
+  }
+
+  uint64_t
+  packets () const
+  {
+    return packets_;
+  }
+
+private:
+  void
+  on_read (const boost::system::error_code &err, std::size_t length)
+  {
+    if (err)
+      return;
+
+    ++packets_;
+    boost::asio::async_write (
+        to_, boost::asio::buffer (buffer_.data (), length),
+        boost::bind (&forwarder::on_write, this,
+                     boost::asio::placeholders::error));
+  }
+
+  void
+  on_write (const boost::system::error_code &err)
+  {
+    if (!err)
+      start ();
+  }
+
+  tcp::socket &from_;
+  tcp::socket &to_;
+  std::vector<char> buffer_;
+  uint64_t packets_;
+};
+
+/// Sends a packet, waits for its echo, and again.
+class client : private boost::noncopyable
+{
+public:
+  client (boost::asio::io_context &ioc, std::size_t payload)
+      : socket_ (ioc), out_ (payload, 'x'), in_ (payload), round_trips_ (0)
+  {
+  }
+
+  tcp::socket &
+  socket ()
+  {
+    return socket_;
+  }
+
+  void
+  start ()
+  {
+    boost::asio::async_write (
+        socket_, boost::asio::buffer (out_),
+        boost::bind (&client::on_write, this,
+                     boost::asio::placeholders::error));
+  }
+
+  uint64_t
+  round_trips () const
+  {
+    return round_trips_;
+  }
+
+private:
+  void
+  on_write (const boost::system::error_code &err)
+  {
+    if (err)
+      return;
+
+    boost::asio::async_read (
+        socket_, boost::asio::buffer (in_),
+        boost::bind (&client::on_read, this,
+                     boost::asio::placeholders::error));
+  }
+
+  void
+  on_read (const boost::system::error_code &err)
+  {
+    if (err)
+      return;
+
+    ++round_trips_;
+    start ();
+  }
+
+  tcp::socket socket_;
+  std::vector<char> out_;
+  std::vector<char> in_;
+  uint64_t round_trips_;
+};
+
+/// Writes back what it reads.
+class echo : private boost::noncopyable
+{
+public:
+  explicit echo (boost::asio::io_context &ioc)
+      : socket_ (ioc), buffer_ (relay_buffer_size)
+  {
+  }
+
+  tcp::socket &
+  socket ()
+  {
+    return socket_;
+  }
+
+  void
+  start ()
+  {
+    socket_.async_read_some (
+        boost::asio::buffer (buffer_),
+        boost::bind (&echo::on_read, this, boost::asio::placeholders::error,
+                     boost::asio::placeholders::bytes_transferred));
+  }
+
+private:
+  void
+  on_read (const boost::system::error_code &err, std::size_t length)
+  {
+    if (err)
+      return;
+
+    boost::asio::async_write (
+        socket_, boost::asio::buffer (buffer_.data (), length),
+        boost::bind (&echo::on_write, this,
+                     boost::asio::placeholders::error));
+  }
+
+  void
+  on_write (const boost::system::error_code &err)
+  {
+    if (!err)
+      start ();
+  }
+
+  tcp::socket socket_;
+  std::vector<char> buffer_;
+};
+
+void
+run_context (boost::asio::io_context *ioc)
+{
+  ioc->run ();
+}
+
+void
+stop_contexts (boost::asio::io_context *load, boost::asio::io_context *relay)
+{
+  load->stop ();
+  relay->stop ();
+}
+
+} // namespace
+
+int
+main (int argc, char *argv[])
+{
+  std::size_t connections = argc > 1 ? std::atoi (argv[1]) : 64;
+  int seconds = argc > 2 ? std::atoi (argv[2]) : 5;
+  std::size_t payload = argc > 3 ? std::atoi (argv[3]) : 64;
+
+  boost::asio::io_context relay_context (1);
+  boost::asio::io_context load_context (1);
+
+  tcp::acceptor relay_acceptor (relay_context,
+                                tcp::endpoint (tcp::v4 (), 0));
+  tcp::acceptor echo_acceptor (load_context, tcp::endpoint (tcp::v4 (), 0));
+
+  boost::asio::ip::address loopback
+      = boost::asio::ip::address_v4::loopback ();
+  tcp::endpoint relay_endpoint (loopback,
+                                relay_acceptor.local_endpoint ().port ());
+  tcp::endpoint echo_endpoint (loopback,
+                               echo_acceptor.local_endpoint ().port ());
+
+  std::vector<boost::shared_ptr<client> > clients;
+  std::vector<boost::shared_ptr<echo> > echoes;
+  std::vector<boost::shared_ptr<tcp::socket> > sockets;
+  std::vector<boost::shared_ptr<forwarder> > forwarders;
+
+  // Connections are set up synchronously before anything runs
+  for (std::size_t i = 0; i < connections; ++i)
+    {
+      boost::shared_ptr<client> c (new client (load_context, payload));
+      c->socket ().connect (relay_endpoint);
+      c->socket ().set_option (tcp::no_delay (true));
+
+      boost::shared_ptr<tcp::socket> downstream (
+          new tcp::socket (relay_context));
+      relay_acceptor.accept (*downstream);
+      downstream->set_option (tcp::no_delay (true));
+
+      boost::shared_ptr<tcp::socket> upstream (
+          new tcp::socket (relay_context));
+      upstream->connect (echo_endpoint);
+      upstream->set_option (tcp::no_delay (true));
+
+      boost::shared_ptr<echo> e (new echo (load_context));
+      echo_acceptor.accept (e->socket ());
+      e->socket ().set_option (tcp::no_delay (true));
+
+      forwarders.push_back (boost::shared_ptr<forwarder> (
+          new forwarder (*downstream, *upstream)));
+      forwarders.push_back (boost::shared_ptr<forwarder> (
+          new forwarder (*upstream, *downstream)));
+      sockets.push_back (downstream);
+      sockets.push_back (upstream);
+      clients.push_back (c);
+      echoes.push_back (e);
+    }
+
+  for (std::size_t i = 0; i < forwarders.size (); ++i)
+    forwarders[i]->start ();
+  for (std::size_t i = 0; i < connections; ++i)
+    {
+      echoes[i]->start ();
+      clients[i]->start ();
+    }
+
+  boost::asio::steady_timer timer (load_context);
+  timer.expires_after (boost::asio::chrono::seconds (seconds));
+  timer.async_wait (
+      boost::bind (&stop_contexts, &load_context, &relay_context));
+
+  clock_type::time_point start = clock_type::now ();
+
+  boost::thread load (boost::bind (&run_context, &load_context));
+  boost::thread relay (boost::bind (&run_context, &relay_context));
+
+  load.join ();
+  relay.join ();
+
+  double elapsed
+      = boost::asio::chrono::duration_cast<
+            boost::asio::chrono::duration<double> > (clock_type::now ()
+                                                     - start)
+            .count ();
+
+  uint64_t round_trips = 0;
+  for (std::size_t i = 0; i < connections; ++i)
+    round_trips += clients[i]->round_trips ();
+
+  uint64_t packets = 0;
+  for (std::size_t i = 0; i < forwarders.size (); ++i)
+    packets += forwarders[i]->packets ();
+
+  std::cout << "reactor: " << mysqlproxy_common::processor::reactor ()
+            << ", " << connections << " connections, " << payload
+            << " byte packets" << std::endl
+            << std::fixed << std::setprecision (0)
+            << double (round_trips) / elapsed << " round trips/s, "
+            << double (packets) / elapsed << " relayed packets/s"
+            << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,76 @@
+#include "audit_log.hpp"
+
+#include <cstring>
+
+namespace mysqlproxy_common
+{
+uint64_t audit_segment_bytes = 256 * 1024 * 1024;
+std::size_t audit_flush_interval = 100;
+std::size_t audit_text_limit = 64 * 1024;
+
+const char audit_log::magic[4] = { 'M', 'P', 'X', 'A' };
+
+segment_log *audit_log::log_ = 0;
+
+void
+audit_log::open (const std::string &path)
+{
+  if (log_)
+    return;
+
+  log_ = new segment_log (magic, version, path, audit_segment_bytes,
+                          audit_flush_interval);
+}
+
+void
+audit_log::close ()
+{
+  delete log_;
+  log_ = 0;
+}
+
+void
+audit_log::record (const audit_event &event)
+{
+  record_header header;
+  std::memset (&header, 0, sizeof (header));
+
+  std::size_t text_length = event.text_length;
+  if (text_length > audit_text_limit)
+    {
+      text_length = audit_text_limit;
+      header.flags |= text_truncated;
+    }
+
+  header.text_length = uint32_t (text_length);
+  header.micros = event.micros;
+  header.digest = event.digest;
+  header.rows = event.rows;
+  header.latency = event.latency_micros > 0xffffffff
+                       ? 0xffffffff
+                       : uint32_t (event.latency_micros);
+  header.error = event.error;
+  header.command = event.command;
+
+  boost::asio::ip::address address = event.client.address ();
+  if (address.is_v4 ())
+    {
+      boost::asio::ip::address_v4::bytes_type bytes
+          = address.to_v4 ().to_bytes ();
+      header.family = 4;
+      std::memcpy (header.address, bytes.data (), bytes.size ());
+    }
+  else
+    {
+      boost::asio::ip::address_v6::bytes_type bytes
+          = address.to_v6 ().to_bytes ();
+      header.family = 6;
+      std::memcpy (header.address, bytes.data (), bytes.size ());
+    }
+  header.port = event.client.port ();
+
+  log_->append (event.micros, event.digest, &header, sizeof (header),
+                event.text, text_length);
+}
+
+} // namespace mysqlproxy_common
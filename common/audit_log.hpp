@@ -0,0 +1,102 @@
+#ifndef MYSQLPROXY_COMMON_AUDIT_LOG_HPP
+#define MYSQLPROXY_COMMON_AUDIT_LOG_HPP
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <cstddef>
+#include <string>
+
+#include "segment_log.hpp"
+
+namespace mysqlproxy_common
+{
+
+// Bytes after which a new audit segment is started
+extern uint64_t audit_segment_bytes;
+
+// Milliseconds a record waits at most before it is written
+extern std::size_t audit_flush_interval;
+
+// Bytes of statement text kept per record, the rest is cut
+extern std::size_t audit_text_limit;
+
+/// One client command and its outcome, as reported by a connection.
+struct audit_event
+{
+  // When the command arrived, microseconds since the epoch
+  int64_t micros;
+  boost::asio::ip::tcp::endpoint client;
+  // 0, which clients never send, for a relayed login
+  uint8_t command;
+  // Digest hash and statement text of a COM_QUERY, 0 and none otherwise
+  uint64_t digest;
+  const char *text;
+  std::size_t text_length;
+  uint64_t latency_micros;
+  // Code of the ERR Packet ending the response, 0 on success
+  uint16_t error;
+  uint64_t rows;
+};
+
+/// Binary log of every client command.
+/**
+ * Records are written to a segment_log, keyed by digest, so that readers
+ * skip the blocks without a digest they look for. A record is a
+ * record_header followed by the statement text.
+ */
+class audit_log : private boost::noncopyable
+{
+public:
+  static const char magic[4];
+  static const uint32_t version = 1;
+
+  struct record_header
+  {
+    // Bytes of the header, the text and the padding
+    uint32_t length;
+    uint32_t text_length;
+    int64_t micros;
+    uint64_t digest;
+    uint64_t rows;
+    // Microseconds, saturated
+    uint32_t latency;
+    uint16_t error;
+    uint8_t command;
+    // 4 or 6, the address is v4 in its first 4 bytes
+    uint8_t family;
+    uint8_t address[16];
+    uint16_t port;
+    uint8_t flags;
+    uint8_t reserved[5];
+  };
+
+  enum record_flags
+  {
+    text_truncated = 1
+  };
+
+  /// Start writing segments named path.YYYYmmdd-HHMMSS[.n], throws
+  /// std::runtime_error when the first cannot be created.
+  static void open (const std::string &path);
+
+  /// Write the pending records and stop the writer thread.
+  static void close ();
+
+  /// Set by open (), before any connection runs.
+  static bool
+  enabled ()
+  {
+    return log_ != 0;
+  }
+
+  /// Append a record to the block of the calling thread.
+  static void record (const audit_event &event);
+
+private:
+  static segment_log *log_;
+};
+
+} // namespace mysqlproxy_common
+
+#endif // MYSQLPROXY_COMMON_AUDIT_LOG_HPP
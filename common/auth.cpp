@@ -0,0 +1,135 @@
+#include "auth.hpp"
+
+#include <openssl/bio.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+
+namespace mysqlproxy_common
+{
+namespace auth
+{
+
+namespace
+{
+
+std::string
+digest (const EVP_MD *md, const std::string &data)
+{
+  unsigned char out[EVP_MAX_MD_SIZE];
+  unsigned int length = 0;
+
+  EVP_Digest (data.data (), data.size (), out, &length, md, 0);
+  return std::string (reinterpret_cast<const char *> (out), length);
+}
+
+std::string
+xor_string (const std::string &a, const std::string &b)
+{
+  std::string out (a);
+  for (std::size_t i = 0; i < out.size (); ++i)
+    out[i] ^= b[i % b.size ()];
+  return out;
+}
+
+} // namespace
+
+void
+random_scramble (std::size_t n, std::string &out)
+{
+  out.resize (n);
+  RAND_bytes (reinterpret_cast<unsigned char *> (&out[0]), int (n));
+
+  // The scramble travels as a NUL terminated string
+  for (std::size_t i = 0; i < n; ++i)
+    out[i] = char (0x21 + (static_cast<unsigned char> (out[i]) % 0x5e));
+}
+
+bool
+scramble_password (const std::string &plugin, const std::string &password,
+                   const std::string &scramble, std::string &out)
+{
+  out.clear ();
+
+  if (password.empty ())
+    return true;
+
+  // Only the first 20 bytes of the scramble are used by both plugins
+  std::string nonce = scramble.substr (0, 20);
+
+  if (plugin == MYSQLPROXY_AUTH_NATIVE_PASSWORD || plugin.empty ())
+    {
+      std::string stage1 = digest (EVP_sha1 (), password);
+      std::string stage2 = digest (EVP_sha1 (), stage1);
+      out = xor_string (stage1, digest (EVP_sha1 (), nonce + stage2));
+      return true;
+    }
+
+  if (plugin == MYSQLPROXY_AUTH_CACHING_SHA2_PASSWORD)
+    {
+      std::string stage1 = digest (EVP_sha256 (), password);
+      std::string stage2 = digest (EVP_sha256 (), stage1);
+      out = xor_string (stage1, digest (EVP_sha256 (), stage2 + nonce));
+      return true;
+    }
+
+  return false;
+}
+
+bool
+check_native_password (const std::string &token, const std::string &password,
+                       const std::string &scramble)
+{
+  std::string expected;
+  scramble_password (MYSQLPROXY_AUTH_NATIVE_PASSWORD, password, scramble,
+                     expected);
+
+  return token.size () == expected.size ()
+         && CRYPTO_memcmp (token.data (), expected.data (), token.size ())
+                == 0;
+}
+
+bool
+encrypt_password (const std::string &pem_key, const std::string &password,
+                  const std::string &scramble, std::string &out)
+{
+  BIO *bio = BIO_new_mem_buf (pem_key.data (), int (pem_key.size ()));
+  if (!bio)
+    return false;
+
+  EVP_PKEY *key = PEM_read_bio_PUBKEY (bio, 0, 0, 0);
+  BIO_free (bio);
+  if (!key)
+    return false;
+
+  std::string plain = xor_string (password + '\0', scramble.substr (0, 20));
+
+  bool ok = false;
+  EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new (key, 0);
+  if (ctx && EVP_PKEY_encrypt_init (ctx) > 0
+      && EVP_PKEY_CTX_set_rsa_padding (ctx, RSA_PKCS1_OAEP_PADDING) > 0)
+    {
+      std::size_t length = 0;
+      const unsigned char *in
+          = reinterpret_cast<const unsigned char *> (plain.data ());
+
+      if (EVP_PKEY_encrypt (ctx, 0, &length, in, plain.size ()) > 0)
+        {
+          out.resize (length);
+          ok = EVP_PKEY_encrypt (ctx,
+                                 reinterpret_cast<unsigned char *> (&out[0]),
+                                 &length, in, plain.size ())
+               > 0;
+          out.resize (length);
+        }
+    }
+
+  EVP_PKEY_CTX_free (ctx);
+  EVP_PKEY_free (key);
+  return ok;
+}
+
+} // namespace auth
+} // namespace mysqlproxy_common
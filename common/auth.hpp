@@ -0,0 +1,46 @@
+#ifndef MYSQLPROXY_COMMON_AUTH_HPP
+#define MYSQLPROXY_COMMON_AUTH_HPP
+
+#include <string>
+
+namespace mysqlproxy_common
+{
+namespace auth
+{
+
+#define MYSQLPROXY_AUTH_NATIVE_PASSWORD "mysql_native_password"
+#define MYSQLPROXY_AUTH_CACHING_SHA2_PASSWORD "caching_sha2_password"
+
+// caching_sha2_password AuthMoreData status bytes
+#define MYSQLPROXY_AUTH_SHA2_REQUEST_PUBLIC_KEY 0x02
+#define MYSQLPROXY_AUTH_SHA2_FAST_AUTH_SUCCESS 0x03
+#define MYSQLPROXY_AUTH_SHA2_PERFORM_FULL_AUTH 0x04
+
+/// Fill a scramble with n random printable bytes.
+void random_scramble (std::size_t n, std::string &out);
+
+/// Compute the client token of a plugin, false if it is not supported.
+/**
+ * mysql_native_password:
+ *   SHA1(password) XOR SHA1(scramble + SHA1(SHA1(password)))
+ * caching_sha2_password:
+ *   SHA256(password) XOR SHA256(SHA256(SHA256(password)) + scramble)
+ */
+bool scramble_password (const std::string &plugin,
+                        const std::string &password,
+                        const std::string &scramble, std::string &out);
+
+/// Check a mysql_native_password token against the expected password.
+bool check_native_password (const std::string &token,
+                            const std::string &password,
+                            const std::string &scramble);
+
+/// RSA encrypt a password for caching_sha2_password full authentication.
+bool encrypt_password (const std::string &pem_key,
+                       const std::string &password,
+                       const std::string &scramble, std::string &out);
+
+} // namespace auth
+} // namespace mysqlproxy_common
+
+#endif // MYSQLPROXY_COMMON_AUTH_HPP
@@ -0,0 +1,292 @@
+#include "digest_stats.hpp"
+
+#include <boost/atomic.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+#include <algorithm>
+#include <map>
+
+namespace mysqlproxy_common
+{
+std::size_t digest_stats_slots = 4096;
+
+namespace
+{
+
+// Entries looked at before a digest counts as other
+const std::size_t max_probe = 16;
+
+void
+add (boost::atomic<uint64_t> &counter, uint64_t n)
+{
+  counter.store (counter.load (boost::memory_order_relaxed) + n,
+                 boost::memory_order_relaxed);
+}
+
+bool
+by_total_latency (const digest_summary &a, const digest_summary &b)
+{
+  return a.total_micros > b.total_micros;
+}
+
+} // namespace
+
+std::size_t
+latency_buckets::index (uint64_t micros)
+{
+  if (micros < sub_buckets)
+    return std::size_t (micros);
+
+  std::size_t exponent = 63 - __builtin_clzll (micros);
+  if (exponent >= max_exponent)
+    return count - 1;
+
+  std::size_t shift = exponent - sub_bucket_bits;
+  return sub_buckets + shift * sub_buckets
+         + std::size_t ((micros >> shift) & (sub_buckets - 1));
+}
+
+uint64_t
+latency_buckets::value (std::size_t index)
+{
+  if (index < sub_buckets)
+    return index;
+
+  std::size_t shift = (index - sub_buckets) / sub_buckets;
+  uint64_t low = uint64_t (sub_buckets + (index - sub_buckets) % sub_buckets)
+                 << shift;
+
+  return low + (uint64_t (1) << shift) / 2;
+}
+
+digest_summary::digest_summary ()
+    : hash (0), text (), count (0), errors (0), rows (0), bytes (0),
+      total_micros (0), histogram (latency_buckets::count)
+{
+}
+
+uint64_t
+digest_summary::percentile (double q) const
+{
+  uint64_t total = 0;
+  for (std::size_t i = 0; i < histogram.size (); i++)
+    total += histogram[i];
+
+  if (!total)
+    return 0;
+
+  uint64_t rank = uint64_t (q * double (total));
+  if (rank >= total)
+    rank = total - 1;
+
+  uint64_t seen = 0;
+  for (std::size_t i = 0; i < histogram.size (); i++)
+    {
+      seen += histogram[i];
+      if (seen > rank)
+        return latency_buckets::value (i);
+    }
+
+  return latency_buckets::value (histogram.size () - 1);
+}
+
+struct digest_stats::entry : private boost::noncopyable
+{
+  entry (uint64_t h, const std::string &t) : hash (h), text (t)
+  {
+    count.store (0);
+    errors.store (0);
+    rows.store (0);
+    bytes.store (0);
+    total_micros.store (0);
+    for (std::size_t i = 0; i < latency_buckets::count; i++)
+      histogram[i].store (0);
+  }
+
+  const uint64_t hash;
+  const std::string text;
+
+  // Written by the owner thread only, read by snapshot ()
+  boost::atomic<uint64_t> count;
+  boost::atomic<uint64_t> errors;
+  boost::atomic<uint64_t> rows;
+  boost::atomic<uint64_t> bytes;
+  boost::atomic<uint64_t> total_micros;
+  boost::atomic<uint64_t> histogram[latency_buckets::count];
+};
+
+struct digest_stats::thread_table : private boost::noncopyable
+{
+  thread_table ();
+
+  entry *find (const query_digest &digest);
+
+  // An entry is published by storing its hash last
+  struct slot
+  {
+    boost::atomic<uint64_t> hash;
+    boost::atomic<entry *> value;
+  };
+
+  boost::scoped_array<slot> slots_;
+  std::size_t mask_;
+  std::size_t used_;
+
+  // Digests that found no free slot
+  entry other_;
+
+  // Tables outlive their threads so that snapshot () keeps counting them
+  static boost::mutex registry_mutex;
+  static std::vector<thread_table *> registry;
+};
+
+boost::mutex digest_stats::thread_table::registry_mutex;
+std::vector<digest_stats::thread_table *>
+    digest_stats::thread_table::registry;
+
+digest_stats::thread_table::thread_table ()
+    : slots_ (), mask_ (0), used_ (0), other_ (0, "(other)")
+{
+  std::size_t size = 16;
+  while (size < digest_stats_slots)
+    size <<= 1;
+
+  slots_.reset (new slot[size]);
+  mask_ = size - 1;
+
+  for (std::size_t i = 0; i < size; i++)
+    {
+      slots_[i].hash.store (0);
+      slots_[i].value.store (0);
+    }
+
+  boost::lock_guard<boost::mutex> lock (registry_mutex);
+  registry.push_back (this);
+}
+
+digest_stats::entry *
+digest_stats::thread_table::find (const query_digest &digest)
+{
+  // Zero marks a free slot
+  uint64_t hash = digest.hash ? digest.hash : 1;
+
+  for (std::size_t i = 0, n = std::size_t (hash) & mask_; i < max_probe;
+       i++, n = (n + 1) & mask_)
+    {
+      uint64_t h = slots_[n].hash.load (boost::memory_order_relaxed);
+
+      if (h == hash)
+        return slots_[n].value.load (boost::memory_order_relaxed);
+
+      if (h == 0)
+        {
+          // Keep probe sequences short
+          if (used_ >= mask_ / 4 * 3)
+            break;
+
+          entry *e = new entry (hash, digest.text);
+          slots_[n].value.store (e, boost::memory_order_relaxed);
+          slots_[n].hash.store (hash, boost::memory_order_release);
+          ++used_;
+          return e;
+        }
+    }
+
+  return &other_;
+}
+
+void
+digest_stats::keep (thread_table *)
+{
+}
+
+digest_stats::thread_table &
+digest_stats::local ()
+{
+  static boost::thread_specific_ptr<thread_table> table (&keep);
+
+  thread_table *p = table.get ();
+  if (!p)
+    {
+      p = new thread_table ();
+      table.reset (p);
+    }
+  return *p;
+}
+
+void
+digest_stats::record (const query_digest &digest, uint64_t micros,
+                      bool error, uint64_t rows, uint64_t bytes)
+{
+  entry *e = local ().find (digest);
+
+  add (e->count, 1);
+  if (error)
+    add (e->errors, 1);
+  add (e->rows, rows);
+  add (e->bytes, bytes);
+  add (e->total_micros, micros);
+  add (e->histogram[latency_buckets::index (micros)], 1);
+}
+
+namespace
+{
+template <typename Entry>
+void
+merge (std::map<uint64_t, digest_summary> &merged, const Entry &e)
+{
+  uint64_t count = e.count.load (boost::memory_order_relaxed);
+  if (!count)
+    return;
+
+  digest_summary &s = merged[e.hash];
+  if (s.text.empty ())
+    {
+      s.hash = e.hash;
+      s.text = e.text;
+    }
+
+  s.count += count;
+  s.errors += e.errors.load (boost::memory_order_relaxed);
+  s.rows += e.rows.load (boost::memory_order_relaxed);
+  s.bytes += e.bytes.load (boost::memory_order_relaxed);
+  s.total_micros += e.total_micros.load (boost::memory_order_relaxed);
+  for (std::size_t i = 0; i < latency_buckets::count; i++)
+    s.histogram[i] += e.histogram[i].load (boost::memory_order_relaxed);
+}
+} // namespace
+
+void
+digest_stats::snapshot (std::vector<digest_summary> &result)
+{
+  std::map<uint64_t, digest_summary> merged;
+
+  {
+    boost::lock_guard<boost::mutex> lock (thread_table::registry_mutex);
+
+    for (std::size_t t = 0; t < thread_table::registry.size (); t++)
+      {
+        thread_table &table = *thread_table::registry[t];
+
+        merge (merged, table.other_);
+
+        for (std::size_t i = 0; i <= table.mask_; i++)
+          if (table.slots_[i].hash.load (boost::memory_order_acquire))
+            merge (merged, *table.slots_[i].value.load (
+                               boost::memory_order_relaxed));
+      }
+  }
+
+  result.clear ();
+  result.reserve (merged.size ());
+  for (std::map<uint64_t, digest_summary>::const_iterator i = merged.begin ();
+       i != merged.end (); ++i)
+    result.push_back (i->second);
+
+  std::sort (result.begin (), result.end (), by_total_latency);
+}
+
+} // namespace mysqlproxy_common
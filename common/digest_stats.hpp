@@ -0,0 +1,84 @@
+#ifndef MYSQLPROXY_COMMON_DIGEST_STATS_HPP
+#define MYSQLPROXY_COMMON_DIGEST_STATS_HPP
+
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <string>
+#include <vector>
+
+#include "query_digest.hpp"
+
+namespace mysqlproxy_common
+{
+
+// Distinct digests each thread keeps apart, later ones are counted together
+extern std::size_t digest_stats_slots;
+
+/// Log-bucketed latency histogram layout.
+/**
+ * Microseconds below 8 have a bucket each, every power of two above is
+ * split in 8 buckets, so a bucket spans at most 12.5% of its values.
+ * Latencies from 2^32 microseconds on share the last bucket.
+ */
+struct latency_buckets
+{
+  static const std::size_t sub_bucket_bits = 3;
+  static const std::size_t sub_buckets = 1 << sub_bucket_bits;
+  static const std::size_t max_exponent = 32;
+  static const std::size_t count
+      = sub_buckets + (max_exponent - sub_bucket_bits) * sub_buckets;
+
+  static std::size_t index (uint64_t micros);
+
+  /// Midpoint of the values of a bucket.
+  static uint64_t value (std::size_t index);
+};
+
+/// Aggregates of one digest over all threads.
+struct digest_summary
+{
+  uint64_t hash;
+  std::string text;
+
+  uint64_t count;
+  uint64_t errors;
+  uint64_t rows;
+  uint64_t bytes;
+  uint64_t total_micros;
+  std::vector<uint64_t> histogram;
+
+  digest_summary ();
+
+  /// Latency in microseconds below which a fraction q of the statements
+  /// completed.
+  uint64_t percentile (double q) const;
+};
+
+/// Per-digest statement statistics.
+/**
+ * Each thread records into tables of its own, written without locks or
+ * read-modify-write instructions. Readers merge the tables of all threads.
+ */
+class digest_stats : private boost::noncopyable
+{
+public:
+  /// Account one statement on the calling thread.
+  static void record (const query_digest &digest, uint64_t micros,
+                      bool error, uint64_t rows, uint64_t bytes);
+
+  /// Merge the statistics of all threads, by decreasing total latency.
+  static void snapshot (std::vector<digest_summary> &result);
+
+private:
+  struct entry;
+  struct thread_table;
+
+  static thread_table &local ();
+
+  // Thread exit cleanup, tables are kept
+  static void keep (thread_table *table);
+};
+
+} // namespace mysqlproxy_common
+
+#endif // MYSQLPROXY_COMMON_DIGEST_STATS_HPP
@@ -0,0 +1,147 @@
+#ifndef MYSQLPROXY_COMMON_HANDLER_ALLOCATOR_HPP
+#define MYSQLPROXY_COMMON_HANDLER_ALLOCATOR_HPP
+
+#include <boost/config.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/type_traits/aligned_storage.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+#include <cstddef>
+#include <new>
+
+namespace mysqlproxy_common
+{
+
+/// Storage for the one asynchronous operation of a chain in flight.
+/**
+ * A chain of operations where each starts the next from its handler, such
+ * as the reads of one socket, needs a single block at a time: Asio frees
+ * the memory of an operation before its handler runs. The block is reused
+ * for every operation of the chain, larger or overlapping requests fall
+ * back to the heap.
+ */
+class handler_memory : private boost::noncopyable
+{
+public:
+  static const std::size_t size = 1024;
+
+  handler_memory () : in_use_ (false) {}
+
+  void *
+  allocate (std::size_t n)
+  {
+    if (!in_use_ && n <= size)
+      {
+        in_use_ = true;
+        return &storage_;
+      }
+    return ::operator new (n);
+  }
+
+  void
+  deallocate (void *p)
+  {
+    if (p == &storage_)
+      in_use_ = false;
+    else
+      ::operator delete (p);
+  }
+
+private:
+  boost::aligned_storage<size, boost::alignment_of<std::max_align_t>::value>::
+      type storage_;
+  bool in_use_;
+};
+
+/// Allocator over a handler_memory, for Asio's associated_allocator.
+template <typename T> class handler_allocator
+{
+public:
+  typedef T value_type;
+
+  explicit handler_allocator (handler_memory &memory) BOOST_NOEXCEPT
+      : memory_ (&memory)
+  {
+  }
+
+  template <typename U>
+  handler_allocator (const handler_allocator<U> &other) BOOST_NOEXCEPT
+      : memory_ (other.memory_)
+  {
+  }
+
+  T *
+  allocate (std::size_t n) const
+  {
+    return static_cast<T *> (memory_->allocate (sizeof (T) * n));
+  }
+
+  void
+  deallocate (T *p, std::size_t) const
+  {
+    memory_->deallocate (p);
+  }
+
+  bool
+  operator== (const handler_allocator &other) const BOOST_NOEXCEPT
+  {
+    return memory_ == other.memory_;
+  }
+
+  bool
+  operator!= (const handler_allocator &other) const BOOST_NOEXCEPT
+  {
+    return memory_ != other.memory_;
+  }
+
+private:
+  template <typename> friend class handler_allocator;
+
+  handler_memory *memory_;
+};
+
+/// Handler whose operations are allocated from a handler_memory.
+template <typename Handler> class custom_alloc_handler
+{
+public:
+  typedef handler_allocator<char> allocator_type;
+
+  custom_alloc_handler (handler_memory &memory, const Handler &handler)
+      : memory_ (memory), handler_ (handler)
+  {
+  }
+
+  allocator_type
+  get_allocator () const
+  {
+    return allocator_type (memory_);
+  }
+
+  template <typename Arg1>
+  void
+  operator() (const Arg1 &arg1)
+  {
+    handler_ (arg1);
+  }
+
+  template <typename Arg1, typename Arg2>
+  void
+  operator() (const Arg1 &arg1, const Arg2 &arg2)
+  {
+    handler_ (arg1, arg2);
+  }
+
+private:
+  handler_memory &memory_;
+  Handler handler_;
+};
+
+template <typename Handler>
+inline custom_alloc_handler<Handler>
+make_custom_alloc_handler (handler_memory &memory, const Handler &handler)
+{
+  return custom_alloc_handler<Handler> (memory, handler);
+}
+
+} // namespace mysqlproxy_common
+
+#endif // MYSQLPROXY_COMMON_HANDLER_ALLOCATOR_HPP
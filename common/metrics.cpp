@@ -0,0 +1,245 @@
+#include "metrics.hpp"
+
+#include <boost/atomic.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+namespace mysqlproxy_common
+{
+
+const uint64_t metrics::bucket_bounds[metrics::bucket_count]
+    = { 100,   250,    500,    1000,   2500,    5000,
+        10000, 25000, 50000, 100000, 250000, 1000000 };
+
+namespace
+{
+
+const std::size_t cache_line = 64;
+
+struct descriptor
+{
+  const char *name;
+  const char *labels;
+  const char *help;
+};
+
+// Entries of one metric family follow each other
+const descriptor counters[metrics::counter_count] = {
+  { "mysqlproxy_connections_accepted_total", "",
+    "Client connections accepted" },
+  { "mysqlproxy_bytes_total", "peer=\"client\",direction=\"received\"",
+    "Bytes read and written on the proxy sockets" },
+  { "mysqlproxy_bytes_total", "peer=\"client\",direction=\"sent\"", "" },
+  { "mysqlproxy_bytes_total", "peer=\"server\",direction=\"received\"", "" },
+  { "mysqlproxy_bytes_total", "peer=\"server\",direction=\"sent\"", "" },
+  { "mysqlproxy_packets_total", "peer=\"client\"",
+    "Protocol packets received" },
+  { "mysqlproxy_packets_total", "peer=\"server\"", "" },
+  { "mysqlproxy_errors_total", "kind=\"client_io\"", "Errors by kind" },
+  { "mysqlproxy_errors_total", "kind=\"server_io\"", "" },
+  { "mysqlproxy_errors_total", "kind=\"connect\"", "" },
+  { "mysqlproxy_errors_total", "kind=\"handshake\"", "" },
+  { "mysqlproxy_errors_total", "kind=\"auth\"", "" },
+  { "mysqlproxy_errors_total", "kind=\"checkout\"", "" },
+  { "mysqlproxy_errors_total", "kind=\"reset\"", "" },
+  { "mysqlproxy_errors_total", "kind=\"ping\"", "" },
+  { "mysqlproxy_errors_total", "kind=\"replay\"", "" },
+  { "mysqlproxy_result_cache_total", "event=\"hit\"",
+    "Result cache lookups and updates" },
+  { "mysqlproxy_result_cache_total", "event=\"miss\"", "" },
+  { "mysqlproxy_result_cache_total", "event=\"store\"", "" },
+  { "mysqlproxy_result_cache_total", "event=\"invalidation\"", "" },
+  { "mysqlproxy_coalesced_queries_total", "",
+    "Reads answered by an identical read in flight" },
+};
+
+const descriptor gauges[metrics::gauge_count] = {
+  { "mysqlproxy_client_connections", "", "Client connections open" },
+  { "mysqlproxy_pooled_sessions", "", "Pooled server sessions open" },
+  { "mysqlproxy_result_cache_bytes", "", "Bytes held by the result cache" },
+};
+
+const char *const connect_seconds = "mysqlproxy_backend_connect_seconds";
+
+template <typename T>
+void
+add_relaxed (boost::atomic<T> &value, T n)
+{
+  value.store (value.load (boost::memory_order_relaxed) + n,
+               boost::memory_order_relaxed);
+}
+
+void
+render_family (std::ostringstream &os, const descriptor &d, const char *type)
+{
+  if (*d.help)
+    os << "# HELP " << d.name << ' ' << d.help << '\n'
+       << "# TYPE " << d.name << ' ' << type << '\n';
+  os << d.name;
+  if (*d.labels)
+    os << '{' << d.labels << '}';
+  os << ' ';
+}
+
+} // namespace
+
+struct metrics::shard : private boost::noncopyable
+{
+  shard ();
+  ~shard ();
+
+  // The padding keeps other allocations off the cache lines of the values
+  char head_[cache_line];
+
+  // Written by the owner thread only, read by render ()
+  boost::atomic<uint64_t> counters_[counter_count];
+  boost::atomic<int64_t> gauges_[gauge_count];
+  boost::atomic<uint64_t> buckets_[bucket_count + 1];
+  boost::atomic<uint64_t> connect_micros_;
+
+  char tail_[cache_line];
+
+  struct totals
+  {
+    uint64_t counters[counter_count];
+    int64_t gauges[gauge_count];
+    uint64_t buckets[bucket_count + 1];
+    uint64_t connect_micros;
+  };
+
+  void fold (totals &t) const;
+
+  // Shards of the running threads and the values of the finished ones
+  static boost::mutex registry_mutex;
+  static std::vector<shard *> registry;
+  static totals retired;
+};
+
+boost::mutex metrics::shard::registry_mutex;
+std::vector<metrics::shard *> metrics::shard::registry;
+metrics::shard::totals metrics::shard::retired;
+
+metrics::shard::shard ()
+{
+  for (std::size_t i = 0; i < counter_count; ++i)
+    counters_[i].store (0);
+  for (std::size_t i = 0; i < gauge_count; ++i)
+    gauges_[i].store (0);
+  for (std::size_t i = 0; i <= bucket_count; ++i)
+    buckets_[i].store (0);
+  connect_micros_.store (0);
+
+  boost::lock_guard<boost::mutex> lock (registry_mutex);
+  registry.push_back (this);
+}
+
+metrics::shard::~shard ()
+{
+  boost::lock_guard<boost::mutex> lock (registry_mutex);
+  registry.erase (std::find (registry.begin (), registry.end (), this));
+  fold (retired);
+}
+
+void
+metrics::shard::fold (totals &t) const
+{
+  for (std::size_t i = 0; i < counter_count; ++i)
+    t.counters[i] += counters_[i].load (boost::memory_order_relaxed);
+  for (std::size_t i = 0; i < gauge_count; ++i)
+    t.gauges[i] += gauges_[i].load (boost::memory_order_relaxed);
+  for (std::size_t i = 0; i <= bucket_count; ++i)
+    t.buckets[i] += buckets_[i].load (boost::memory_order_relaxed);
+  t.connect_micros += connect_micros_.load (boost::memory_order_relaxed);
+}
+
+metrics::shard &
+metrics::local ()
+{
+  static boost::thread_specific_ptr<shard> instance;
+
+  shard *p = instance.get ();
+  if (!p)
+    {
+      p = new shard ();
+      instance.reset (p);
+    }
+  return *p;
+}
+
+void
+metrics::add (counter c, uint64_t n)
+{
+  add_relaxed (local ().counters_[c], n);
+}
+
+void
+metrics::adjust (gauge g, int64_t delta)
+{
+  add_relaxed (local ().gauges_[g], delta);
+}
+
+void
+metrics::observe_connect (uint64_t micros)
+{
+  shard &s = local ();
+
+  std::size_t i
+      = std::lower_bound (bucket_bounds, bucket_bounds + bucket_count, micros)
+        - bucket_bounds;
+  add_relaxed (s.buckets_[i], uint64_t (1));
+  add_relaxed (s.connect_micros_, micros);
+}
+
+void
+metrics::render (std::string &out)
+{
+  shard::totals t;
+  {
+    boost::lock_guard<boost::mutex> lock (shard::registry_mutex);
+
+    t = shard::retired;
+    for (std::size_t i = 0; i < shard::registry.size (); ++i)
+      shard::registry[i]->fold (t);
+  }
+
+  std::ostringstream os;
+
+  for (std::size_t i = 0; i < counter_count; ++i)
+    {
+      render_family (os, counters[i], "counter");
+      os << t.counters[i] << '\n';
+    }
+
+  for (std::size_t i = 0; i < gauge_count; ++i)
+    {
+      render_family (os, gauges[i], "gauge");
+      os << t.gauges[i] << '\n';
+    }
+
+  os << "# HELP " << connect_seconds
+     << " Time to open a usable server connection\n"
+     << "# TYPE " << connect_seconds << " histogram\n";
+
+  uint64_t cumulative = 0;
+  for (std::size_t i = 0; i <= bucket_count; ++i)
+    {
+      cumulative += t.buckets[i];
+      os << connect_seconds << "_bucket{le=\"";
+      if (i < bucket_count)
+        os << double (bucket_bounds[i]) / 1e6;
+      else
+        os << "+Inf";
+      os << "\"} " << cumulative << '\n';
+    }
+  os << connect_seconds << "_sum " << double (t.connect_micros) / 1e6 << '\n'
+     << connect_seconds << "_count " << cumulative << '\n';
+
+  out = os.str ();
+}
+
+} // namespace mysqlproxy_common
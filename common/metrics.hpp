@@ -0,0 +1,76 @@
+#ifndef MYSQLPROXY_COMMON_METRICS_HPP
+#define MYSQLPROXY_COMMON_METRICS_HPP
+
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <string>
+
+namespace mysqlproxy_common
+{
+
+/// Process-wide counters, gauges and the backend connect histogram.
+/**
+ * Every thread updates a shard of its own with relaxed loads and stores,
+ * no value is shared between threads on the forwarding path. Readers sum
+ * the shards of all threads, and those of finished threads are folded into
+ * a retired total.
+ */
+class metrics : private boost::noncopyable
+{
+public:
+  enum counter
+  {
+    connections_accepted,
+    client_bytes_received,
+    client_bytes_sent,
+    server_bytes_received,
+    server_bytes_sent,
+    client_packets,
+    server_packets,
+    errors_client_io,
+    errors_server_io,
+    errors_connect,
+    errors_handshake,
+    errors_auth,
+    errors_checkout,
+    errors_reset,
+    errors_ping,
+    errors_replay,
+    cache_hits,
+    cache_misses,
+    cache_stores,
+    cache_invalidations,
+    coalesced_queries,
+    counter_count
+  };
+
+  enum gauge
+  {
+    client_connections,
+    pooled_sessions,
+    cached_bytes,
+    gauge_count
+  };
+
+  // Upper bounds of the connect latency buckets, in microseconds
+  static const std::size_t bucket_count = 12;
+  static const uint64_t bucket_bounds[bucket_count];
+
+  static void add (counter c, uint64_t n = 1);
+  static void adjust (gauge g, int64_t delta);
+
+  /// Account the time it took to get a usable server connection.
+  static void observe_connect (uint64_t micros);
+
+  /// Sum the shards of all threads in the Prometheus text format.
+  static void render (std::string &out);
+
+private:
+  struct shard;
+
+  static shard &local ();
+};
+
+} // namespace mysqlproxy_common
+
+#endif // MYSQLPROXY_COMMON_METRICS_HPP
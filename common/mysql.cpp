@@ -0,0 +1,440 @@
+#include "mysql.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace mysqlproxy_common
+{
+namespace protocol
+{
+
+bool
+payload_reader::skip (std::size_t n)
+{
+  if (remaining () < n)
+    return false;
+  pos_ += n;
+  return true;
+}
+
+bool
+payload_reader::read_u8 (uint8_t &v)
+{
+  if (remaining () < 1)
+    return false;
+  v = data_[pos_++];
+  return true;
+}
+
+bool
+payload_reader::read_u16 (uint16_t &v)
+{
+  if (remaining () < 2)
+    return false;
+  v = uint16_t (data_[pos_] | data_[pos_ + 1] << 8);
+  pos_ += 2;
+  return true;
+}
+
+bool
+payload_reader::read_u32 (uint32_t &v)
+{
+  if (remaining () < 4)
+    return false;
+  v = uint32_t (data_[pos_]) | uint32_t (data_[pos_ + 1]) << 8
+      | uint32_t (data_[pos_ + 2]) << 16 | uint32_t (data_[pos_ + 3]) << 24;
+  pos_ += 4;
+  return true;
+}
+
+bool
+payload_reader::read_lenenc (uint64_t &v)
+{
+  uint8_t first;
+  if (!read_u8 (first))
+    return false;
+
+  std::size_t n = 0;
+  switch (first)
+    {
+    case 0xfc:
+      n = 2;
+      break;
+    case 0xfd:
+      n = 3;
+      break;
+    case 0xfe:
+      n = 8;
+      break;
+    default:
+      v = first;
+      return true;
+    }
+
+  if (remaining () < n)
+    return false;
+
+  v = 0;
+  for (std::size_t i = 0; i < n; ++i)
+    v |= uint64_t (data_[pos_ + i]) << (8 * i);
+  pos_ += n;
+  return true;
+}
+
+bool
+payload_reader::read_bytes (std::size_t n, std::string &v)
+{
+  if (remaining () < n)
+    return false;
+  v.assign (reinterpret_cast<const char *> (data_ + pos_), n);
+  pos_ += n;
+  return true;
+}
+
+bool
+payload_reader::read_lenenc_string (std::string &v)
+{
+  uint64_t n;
+  return read_lenenc (n) && read_bytes (n, v);
+}
+
+bool
+payload_reader::read_null_string (std::string &v)
+{
+  const void *end = std::memchr (data_ + pos_, 0, remaining ());
+  if (!end)
+    return false;
+
+  std::size_t n = static_cast<const uint8_t *> (end) - (data_ + pos_);
+  read_bytes (n, v);
+  ++pos_;
+  return true;
+}
+
+void
+payload_reader::read_rest (std::string &v)
+{
+  read_bytes (remaining (), v);
+}
+
+void
+payload_writer::write_u8 (uint8_t v)
+{
+  out_.push_back (char (v));
+}
+
+void
+payload_writer::write_u16 (uint16_t v)
+{
+  write_u8 (uint8_t (v));
+  write_u8 (uint8_t (v >> 8));
+}
+
+void
+payload_writer::write_u24 (uint32_t v)
+{
+  write_u16 (uint16_t (v));
+  write_u8 (uint8_t (v >> 16));
+}
+
+void
+payload_writer::write_u32 (uint32_t v)
+{
+  write_u16 (uint16_t (v));
+  write_u16 (uint16_t (v >> 16));
+}
+
+void
+payload_writer::write_lenenc (uint64_t v)
+{
+  if (v < 0xfb)
+    write_u8 (uint8_t (v));
+  else if (v <= 0xffff)
+    {
+      write_u8 (0xfc);
+      write_u16 (uint16_t (v));
+    }
+  else if (v <= 0xffffff)
+    {
+      write_u8 (0xfd);
+      write_u24 (uint32_t (v));
+    }
+  else
+    {
+      write_u8 (0xfe);
+      write_u32 (uint32_t (v));
+      write_u32 (uint32_t (v >> 32));
+    }
+}
+
+void
+payload_writer::write_bytes (const std::string &v)
+{
+  out_.append (v);
+}
+
+void
+payload_writer::write_lenenc_string (const std::string &v)
+{
+  write_lenenc (v.size ());
+  write_bytes (v);
+}
+
+void
+payload_writer::write_null_string (const std::string &v)
+{
+  write_bytes (v);
+  write_u8 (0);
+}
+
+void
+payload_writer::write_zeros (std::size_t n)
+{
+  out_.append (n, '\0');
+}
+
+bool
+parse_handshake (const uint8_t *data, std::size_t size, handshake &hs)
+{
+  payload_reader r (data, size);
+
+  std::string part1, part2;
+  uint16_t caps_low, caps_high;
+  uint8_t scramble_length;
+
+  if (!r.read_u8 (hs.protocol_version) || hs.protocol_version != 10
+      || !r.read_null_string (hs.server_version)
+      || !r.read_u32 (hs.connection_id) || !r.read_bytes (8, part1)
+      || !r.skip (1) || !r.read_u16 (caps_low) || !r.read_u8 (hs.charset)
+      || !r.read_u16 (hs.status) || !r.read_u16 (caps_high)
+      || !r.read_u8 (scramble_length) || !r.skip (10))
+    return false;
+
+  hs.capabilities = uint32_t (caps_low) | uint32_t (caps_high) << 16;
+
+  // The second part is at least 12 bytes followed by a NUL
+  std::size_t length = scramble_length > 8 ? scramble_length - 8 : 13;
+  if (length < 13)
+    length = 13;
+  if (!r.read_bytes (std::min (length, r.remaining ()), part2))
+    return false;
+
+  if (!part2.empty () && part2[part2.size () - 1] == '\0')
+    part2.erase (part2.size () - 1);
+  hs.scramble = part1 + part2;
+
+  hs.auth_plugin.clear ();
+  if (hs.capabilities & MYSQLPROXY_CLIENT_PLUGIN_AUTH)
+    {
+      if (!r.read_null_string (hs.auth_plugin))
+        r.read_rest (hs.auth_plugin);
+    }
+
+  return true;
+}
+
+void
+build_handshake (const handshake &hs, std::string &out)
+{
+  payload_writer w (out);
+
+  w.write_u8 (hs.protocol_version);
+  w.write_null_string (hs.server_version);
+  w.write_u32 (hs.connection_id);
+  w.write_bytes (hs.scramble.substr (0, 8));
+  w.write_u8 (0);
+  w.write_u16 (uint16_t (hs.capabilities));
+  w.write_u8 (hs.charset);
+  w.write_u16 (hs.status);
+  w.write_u16 (uint16_t (hs.capabilities >> 16));
+  w.write_u8 (uint8_t (hs.scramble.size () + 1));
+  w.write_zeros (10);
+  w.write_null_string (hs.scramble.substr (8));
+  w.write_null_string (hs.auth_plugin);
+}
+
+bool
+parse_handshake_response (const uint8_t *data, std::size_t size,
+                          handshake_response &resp)
+{
+  payload_reader r (data, size);
+
+  if (!r.read_u32 (resp.capabilities)
+      || !(resp.capabilities & MYSQLPROXY_CLIENT_PROTOCOL_41)
+      || !r.read_u32 (resp.max_packet_size) || !r.read_u8 (resp.charset)
+      || !r.skip (23) || !r.read_null_string (resp.user))
+    return false;
+
+  if (resp.capabilities & MYSQLPROXY_CLIENT_PLUGIN_AUTH_LENENC_CLIENT_DATA)
+    {
+      if (!r.read_lenenc_string (resp.auth_response))
+        return false;
+    }
+  else if (resp.capabilities & MYSQLPROXY_CLIENT_SECURE_CONNECTION)
+    {
+      uint8_t length;
+      if (!r.read_u8 (length) || !r.read_bytes (length, resp.auth_response))
+        return false;
+    }
+  else if (!r.read_null_string (resp.auth_response))
+    return false;
+
+  resp.database.clear ();
+  if (resp.capabilities & MYSQLPROXY_CLIENT_CONNECT_WITH_DB)
+    {
+      if (!r.read_null_string (resp.database))
+        r.read_rest (resp.database);
+    }
+
+  resp.auth_plugin.clear ();
+  if (resp.capabilities & MYSQLPROXY_CLIENT_PLUGIN_AUTH)
+    {
+      if (!r.read_null_string (resp.auth_plugin))
+        r.read_rest (resp.auth_plugin);
+    }
+
+  // Connection attributes are ignored
+  return true;
+}
+
+void
+build_handshake_response (const handshake_response &resp, std::string &out)
+{
+  payload_writer w (out);
+
+  w.write_u32 (resp.capabilities);
+  w.write_u32 (resp.max_packet_size);
+  w.write_u8 (resp.charset);
+  w.write_zeros (23);
+  w.write_null_string (resp.user);
+
+  if (resp.capabilities & MYSQLPROXY_CLIENT_PLUGIN_AUTH_LENENC_CLIENT_DATA)
+    w.write_lenenc_string (resp.auth_response);
+  else
+    {
+      w.write_u8 (uint8_t (resp.auth_response.size ()));
+      w.write_bytes (resp.auth_response);
+    }
+
+  if (resp.capabilities & MYSQLPROXY_CLIENT_CONNECT_WITH_DB)
+    w.write_null_string (resp.database);
+
+  if (resp.capabilities & MYSQLPROXY_CLIENT_PLUGIN_AUTH)
+    w.write_null_string (resp.auth_plugin);
+}
+
+bool
+parse_ok (const uint8_t *data, std::size_t size, ok_packet &ok)
+{
+  payload_reader r (data, size);
+
+  uint8_t header;
+  if (!r.read_u8 (header))
+    return false;
+
+  if (header == MYSQLPROXY_PROTOCOL_EOF_PACKET && size <= 5)
+    {
+      // EOF Packet: warnings before status. An OK Packet sent with an EOF
+      // header under CLIENT_DEPRECATE_EOF is at least 7 bytes
+      ok.affected_rows = ok.last_insert_id = 0;
+      return r.read_u16 (ok.warnings) && r.read_u16 (ok.status);
+    }
+
+  return (header == MYSQLPROXY_PROTOCOL_OK_PACKET
+          || header == MYSQLPROXY_PROTOCOL_EOF_PACKET)
+         && r.read_lenenc (ok.affected_rows)
+         && r.read_lenenc (ok.last_insert_id) && r.read_u16 (ok.status)
+         && r.read_u16 (ok.warnings);
+}
+
+void
+build_ok (uint16_t status, std::string &out)
+{
+  payload_writer w (out);
+
+  w.write_u8 (MYSQLPROXY_PROTOCOL_OK_PACKET);
+  w.write_lenenc (0); // affected rows
+  w.write_lenenc (0); // last insert id
+  w.write_u16 (status);
+  w.write_u16 (0); // warnings
+}
+
+bool
+parse_prepare_ok (const uint8_t *data, std::size_t size, prepare_ok &ok)
+{
+  payload_reader r (data, size);
+
+  uint8_t header;
+  return r.read_u8 (header) && header == MYSQLPROXY_PROTOCOL_OK_PACKET
+         && r.read_u32 (ok.statement_id) && r.read_u16 (ok.columns)
+         && r.read_u16 (ok.params) && r.skip (1) && r.read_u16 (ok.warnings);
+}
+
+bool
+parse_err (const uint8_t *data, std::size_t size, uint16_t &code,
+           std::string &message)
+{
+  payload_reader r (data, size);
+
+  uint8_t header;
+  if (!r.read_u8 (header) || header != MYSQLPROXY_PROTOCOL_ERR_PACKET
+      || !r.read_u16 (code))
+    return false;
+
+  // Skip the SQL state marker and state
+  if (r.remaining () >= 6 && data[3] == '#')
+    r.skip (6);
+
+  r.read_rest (message);
+  return true;
+}
+
+void
+build_err (uint16_t code, const char *sql_state, const std::string &message,
+           std::string &out)
+{
+  payload_writer w (out);
+
+  w.write_u8 (MYSQLPROXY_PROTOCOL_ERR_PACKET);
+  w.write_u16 (code);
+  w.write_u8 ('#');
+  w.write_bytes (std::string (sql_state, 5));
+  w.write_bytes (message);
+}
+
+bool
+query_text (const uint8_t *data, std::size_t size, uint32_t capabilities,
+            const char *&text, std::size_t &length)
+{
+  payload_reader r (data, size);
+
+  uint8_t com;
+  if (!r.read_u8 (com) || com != MYSQLPROXY_PROTOCOL_COM_QUERY)
+    return false;
+
+  if (capabilities & MYSQLPROXY_CLIENT_QUERY_ATTRIBUTES)
+    {
+      uint64_t parameter_count, parameter_set_count;
+      if (!r.read_lenenc (parameter_count)
+          || !r.read_lenenc (parameter_set_count) || parameter_count != 0)
+        return false;
+    }
+
+  length = r.remaining ();
+  text = reinterpret_cast<const char *> (data + (size - length));
+  return true;
+}
+
+void
+build_packet (uint8_t sequence_id, const std::string &payload,
+              std::string &out)
+{
+  payload_writer w (out);
+
+  w.write_u24 (uint32_t (payload.size ()));
+  w.write_u8 (sequence_id);
+  w.write_bytes (payload);
+}
+
+} // namespace protocol
+} // namespace mysqlproxy_common
@@ -3,14 +3,62 @@
 
 #include <boost/cstdint.hpp>
 
+#include <string>
+
 namespace mysqlproxy_common
 {
 namespace protocol
 {
+#define MYSQLPROXY_PROTOCOL_COM_QUIT 0x1
+#define MYSQLPROXY_PROTOCOL_COM_INIT_DB 0x2
 #define MYSQLPROXY_PROTOCOL_COM_QUERY 0x3
+#define MYSQLPROXY_PROTOCOL_COM_FIELD_LIST 0x4
+#define MYSQLPROXY_PROTOCOL_COM_STATISTICS 0x9
+#define MYSQLPROXY_PROTOCOL_COM_PING 0xe
+#define MYSQLPROXY_PROTOCOL_COM_CHANGE_USER 0x11
+#define MYSQLPROXY_PROTOCOL_COM_BINLOG_DUMP 0x12
+#define MYSQLPROXY_PROTOCOL_COM_STMT_PREPARE 0x16
+#define MYSQLPROXY_PROTOCOL_COM_STMT_EXECUTE 0x17
+#define MYSQLPROXY_PROTOCOL_COM_STMT_SEND_LONG_DATA 0x18
+#define MYSQLPROXY_PROTOCOL_COM_STMT_CLOSE 0x19
+#define MYSQLPROXY_PROTOCOL_COM_STMT_FETCH 0x1c
+#define MYSQLPROXY_PROTOCOL_COM_BINLOG_DUMP_GTID 0x1e
+#define MYSQLPROXY_PROTOCOL_COM_RESET_CONNECTION 0x1f
 #define MYSQLPROXY_PROTOCOL_OK_PACKET 0x00
 #define MYSQLPROXY_PROTOCOL_ERR_PACKET 0xff
 #define MYSQLPROXY_PROTOCOL_EOF_PACKET 0xfe
+#define MYSQLPROXY_PROTOCOL_LOCAL_INFILE_PACKET 0xfb
+#define MYSQLPROXY_PROTOCOL_AUTH_SWITCH_PACKET 0xfe
+#define MYSQLPROXY_PROTOCOL_AUTH_MORE_DATA_PACKET 0x01
+
+// Capability flags
+#define MYSQLPROXY_CLIENT_LONG_PASSWORD 0x00000001
+#define MYSQLPROXY_CLIENT_LONG_FLAG 0x00000004
+#define MYSQLPROXY_CLIENT_CONNECT_WITH_DB 0x00000008
+#define MYSQLPROXY_CLIENT_PROTOCOL_41 0x00000200
+#define MYSQLPROXY_CLIENT_SSL 0x00000800
+#define MYSQLPROXY_CLIENT_TRANSACTIONS 0x00002000
+#define MYSQLPROXY_CLIENT_SECURE_CONNECTION 0x00008000
+#define MYSQLPROXY_CLIENT_MULTI_STATEMENTS 0x00010000
+#define MYSQLPROXY_CLIENT_MULTI_RESULTS 0x00020000
+#define MYSQLPROXY_CLIENT_PS_MULTI_RESULTS 0x00040000
+#define MYSQLPROXY_CLIENT_PLUGIN_AUTH 0x00080000
+#define MYSQLPROXY_CLIENT_CONNECT_ATTRS 0x00100000
+#define MYSQLPROXY_CLIENT_PLUGIN_AUTH_LENENC_CLIENT_DATA 0x00200000
+#define MYSQLPROXY_CLIENT_SESSION_TRACK 0x00800000
+#define MYSQLPROXY_CLIENT_DEPRECATE_EOF 0x01000000
+#define MYSQLPROXY_CLIENT_QUERY_ATTRIBUTES 0x08000000
+
+// Server status flags
+#define MYSQLPROXY_SERVER_STATUS_IN_TRANS 0x0001
+#define MYSQLPROXY_SERVER_STATUS_AUTOCOMMIT 0x0002
+#define MYSQLPROXY_SERVER_MORE_RESULTS_EXISTS 0x0008
+#define MYSQLPROXY_SERVER_STATUS_CURSOR_EXISTS 0x0040
+
+// Error codes
+#define MYSQLPROXY_ER_HANDSHAKE_ERROR 1043
+#define MYSQLPROXY_ER_ACCESS_DENIED_ERROR 1045
+#define MYSQLPROXY_ER_UNKNOWN_ERROR 1105
 
 #pragma pack(push, 1)
 struct prefix
@@ -31,7 +79,138 @@ struct query
   char text[];
 };
 #pragma pack(pop)
+
+/// Initial Handshake Packet (protocol version 10).
+struct handshake
+{
+  uint8_t protocol_version;
+  std::string server_version;
+  uint32_t connection_id;
+  std::string scramble;
+  uint32_t capabilities;
+  uint8_t charset;
+  uint16_t status;
+  std::string auth_plugin;
+};
+
+/// Handshake Response Packet (protocol 4.1).
+struct handshake_response
+{
+  uint32_t capabilities;
+  uint32_t max_packet_size;
+  uint8_t charset;
+  std::string user;
+  std::string auth_response;
+  std::string database;
+  std::string auth_plugin;
+};
+
+/// OK Packet, also decoded from a status carrying EOF Packet.
+struct ok_packet
+{
+  uint64_t affected_rows;
+  uint64_t last_insert_id;
+  uint16_t status;
+  uint16_t warnings;
+};
+
+/// COM_STMT_PREPARE OK, followed by the definitions it counts.
+struct prepare_ok
+{
+  uint32_t statement_id;
+  uint16_t columns;
+  uint16_t params;
+  uint16_t warnings;
+};
+
+/// Sequential reader of a packet payload.
+/**
+ * Every accessor returns false once the payload is exhausted, leaving the
+ * output untouched.
+ */
+class payload_reader
+{
+public:
+  payload_reader (const uint8_t *data, std::size_t size)
+      : data_ (data), size_ (size), pos_ (0)
+  {
+  }
+
+  std::size_t
+  remaining () const
+  {
+    return size_ - pos_;
+  }
+
+  bool skip (std::size_t n);
+  bool read_u8 (uint8_t &v);
+  bool read_u16 (uint16_t &v);
+  bool read_u32 (uint32_t &v);
+  bool read_lenenc (uint64_t &v);
+  bool read_bytes (std::size_t n, std::string &v);
+  bool read_lenenc_string (std::string &v);
+  bool read_null_string (std::string &v);
+  void read_rest (std::string &v);
+
+private:
+  const uint8_t *data_;
+  std::size_t size_;
+  std::size_t pos_;
+};
+
+/// Payload builder, appends to a string.
+class payload_writer
+{
+public:
+  explicit payload_writer (std::string &out) : out_ (out) {}
+
+  void write_u8 (uint8_t v);
+  void write_u16 (uint16_t v);
+  void write_u24 (uint32_t v);
+  void write_u32 (uint32_t v);
+  void write_lenenc (uint64_t v);
+  void write_bytes (const std::string &v);
+  void write_lenenc_string (const std::string &v);
+  void write_null_string (const std::string &v);
+  void write_zeros (std::size_t n);
+
+private:
+  std::string &out_;
+};
+
+bool parse_handshake (const uint8_t *data, std::size_t size, handshake &hs);
+void build_handshake (const handshake &hs, std::string &out);
+
+bool parse_handshake_response (const uint8_t *data, std::size_t size,
+                               handshake_response &resp);
+void build_handshake_response (const handshake_response &resp,
+                               std::string &out);
+
+bool parse_ok (const uint8_t *data, std::size_t size, ok_packet &ok);
+void build_ok (uint16_t status, std::string &out);
+
+bool parse_prepare_ok (const uint8_t *data, std::size_t size,
+                       prepare_ok &ok);
+
+/// Decode code and message of an ERR Packet.
+bool parse_err (const uint8_t *data, std::size_t size, uint16_t &code,
+                std::string &message);
+void build_err (uint16_t code, const char *sql_state,
+                const std::string &message, std::string &out);
+
+/// Locate the statement of a COM_QUERY payload.
+/**
+ * Fails for queries carrying query attributes, whose values would have to
+ * be decoded to find the statement.
+ */
+bool query_text (const uint8_t *data, std::size_t size, uint32_t capabilities,
+                 const char *&text, std::size_t &length);
+
+/// Prepend a packet header to a payload.
+void build_packet (uint8_t sequence_id, const std::string &payload,
+                   std::string &out);
+
 } // namespace protocol
 } // mysqlproxy_common
 
-#endif // MYSQLPROXY_COMMON_MYSQL_HPP
\ No newline at end of file
+#endif // MYSQLPROXY_COMMON_MYSQL_HPP
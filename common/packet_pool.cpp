@@ -0,0 +1,174 @@
+#include "packet_pool.hpp"
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+#include <algorithm>
+#include <new>
+#include <vector>
+
+namespace mysqlproxy_common
+{
+std::size_t pool_cache_bytes = 1024 * 1024;
+
+struct packet_pool::thread_cache : private boost::noncopyable
+{
+  thread_cache ();
+  ~thread_cache ();
+
+  packet_buffer *free_[class_count];
+  std::size_t length_[class_count];
+
+  // Written by the owner thread only, read by stats ()
+  boost::atomic<uint64_t> hits_;
+  boost::atomic<uint64_t> misses_;
+
+  // Caches of the running threads and the counters of the finished ones
+  static boost::mutex registry_mutex;
+  static std::vector<thread_cache *> registry;
+  static statistics retired;
+};
+
+boost::mutex packet_pool::thread_cache::registry_mutex;
+std::vector<packet_pool::thread_cache *> packet_pool::thread_cache::registry;
+packet_pool::statistics packet_pool::thread_cache::retired = { 0, 0 };
+
+namespace
+{
+
+void
+increment (boost::atomic<uint64_t> &counter)
+{
+  counter.store (counter.load (boost::memory_order_relaxed) + 1,
+                 boost::memory_order_relaxed);
+}
+
+std::size_t
+size_class (std::size_t n)
+{
+  std::size_t shift = packet_pool::min_class_shift;
+  while ((std::size_t (1) << shift) < n)
+    ++shift;
+  return shift - packet_pool::min_class_shift;
+}
+
+void
+delete_buffer (packet_buffer *p)
+{
+  p->~packet_buffer ();
+  ::operator delete (p);
+}
+
+} // namespace
+
+packet_pool::thread_cache::thread_cache () : hits_ (0), misses_ (0)
+{
+  std::fill (free_, free_ + class_count, static_cast<packet_buffer *> (0));
+  std::fill (length_, length_ + class_count, 0);
+
+  boost::lock_guard<boost::mutex> lock (registry_mutex);
+  registry.push_back (this);
+}
+
+packet_pool::thread_cache::~thread_cache ()
+{
+  for (std::size_t i = 0; i < class_count; ++i)
+    while (free_[i])
+      {
+        packet_buffer *p = free_[i];
+        free_[i] = p->next_;
+        delete_buffer (p);
+      }
+
+  boost::lock_guard<boost::mutex> lock (registry_mutex);
+  registry.erase (std::find (registry.begin (), registry.end (), this));
+  retired.hits += hits_.load (boost::memory_order_relaxed);
+  retired.misses += misses_.load (boost::memory_order_relaxed);
+}
+
+packet_pool::thread_cache &
+packet_pool::local ()
+{
+  static boost::thread_specific_ptr<thread_cache> cache;
+
+  thread_cache *p = cache.get ();
+  if (!p)
+    {
+      p = new thread_cache ();
+      cache.reset (p);
+    }
+  return *p;
+}
+
+packet_ptr
+packet_pool::allocate (std::size_t n)
+{
+  std::size_t cls = size_class (n);
+  thread_cache &cache = local ();
+
+  packet_buffer *p = 0;
+  if (cls < class_count && cache.free_[cls])
+    {
+      p = cache.free_[cls];
+      cache.free_[cls] = p->next_;
+      --cache.length_[cls];
+      increment (cache.hits_);
+    }
+  else
+    {
+      std::size_t capacity = cls < class_count
+                                 ? std::size_t (1) << (cls + min_class_shift)
+                                 : n;
+      void *raw = ::operator new (sizeof (packet_buffer) + capacity);
+      p = new (raw) packet_buffer (cls, capacity);
+      increment (cache.misses_);
+    }
+
+  p->next_ = 0;
+  p->size_ = n;
+  return packet_ptr (p);
+}
+
+void
+packet_pool::release (packet_buffer *p)
+{
+  std::size_t cls = p->size_class_;
+  if (cls < class_count)
+    {
+      thread_cache &cache = local ();
+      std::size_t limit = pool_cache_bytes >> (cls + min_class_shift);
+      if (cache.length_[cls] < std::max (limit, std::size_t (1)))
+        {
+          p->next_ = cache.free_[cls];
+          cache.free_[cls] = p;
+          ++cache.length_[cls];
+          return;
+        }
+    }
+
+  delete_buffer (p);
+}
+
+packet_pool::statistics
+packet_pool::stats ()
+{
+  boost::lock_guard<boost::mutex> lock (thread_cache::registry_mutex);
+
+  statistics s = thread_cache::retired;
+  for (std::size_t i = 0; i < thread_cache::registry.size (); ++i)
+    {
+      thread_cache *cache = thread_cache::registry[i];
+      s.hits += cache->hits_.load (boost::memory_order_relaxed);
+      s.misses += cache->misses_.load (boost::memory_order_relaxed);
+    }
+  return s;
+}
+
+void
+packet_buffer::release (packet_buffer *p)
+{
+  packet_pool::release (p);
+}
+
+} // namespace mysqlproxy_common
@@ -0,0 +1,134 @@
+#ifndef MYSQLPROXY_COMMON_PACKET_POOL_HPP
+#define MYSQLPROXY_COMMON_PACKET_POOL_HPP
+
+#include <boost/assert.hpp>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace mysqlproxy_common
+{
+
+// Bytes of free buffers each thread keeps per size class
+extern std::size_t pool_cache_bytes;
+
+class packet_pool;
+
+/// Reference counted storage for a packet payload.
+/**
+ * Instances come from packet_pool and go back to the free list of the
+ * releasing thread once the last packet_ptr is gone, so a payload can be
+ * handed from the read path to a write gather list without being copied.
+ */
+class packet_buffer : private boost::noncopyable
+{
+public:
+  uint8_t *
+  data ()
+  {
+    return reinterpret_cast<uint8_t *> (this + 1);
+  }
+
+  const uint8_t *
+  data () const
+  {
+    return reinterpret_cast<const uint8_t *> (this + 1);
+  }
+
+  std::size_t
+  size () const
+  {
+    return size_;
+  }
+
+  std::size_t
+  capacity () const
+  {
+    return capacity_;
+  }
+
+  void
+  resize (std::size_t n)
+  {
+    BOOST_ASSERT (n <= capacity_);
+    size_ = n;
+  }
+
+  friend void
+  intrusive_ptr_add_ref (packet_buffer *p)
+  {
+    p->refs_.fetch_add (1, boost::memory_order_relaxed);
+  }
+
+  friend void
+  intrusive_ptr_release (packet_buffer *p)
+  {
+    if (p->refs_.fetch_sub (1, boost::memory_order_release) == 1)
+      {
+        boost::atomic_thread_fence (boost::memory_order_acquire);
+        release (p);
+      }
+  }
+
+private:
+  friend class packet_pool;
+
+  packet_buffer (std::size_t size_class, std::size_t capacity)
+      : refs_ (0), size_class_ (size_class), size_ (0), capacity_ (capacity),
+        next_ (0)
+  {
+  }
+
+  static void release (packet_buffer *p);
+
+  boost::atomic<uint32_t> refs_;
+  std::size_t size_class_;
+  std::size_t size_;
+  std::size_t capacity_;
+
+  // Free list link while cached by a thread
+  packet_buffer *next_;
+};
+
+typedef boost::intrusive_ptr<packet_buffer> packet_ptr;
+
+/// Per-thread size class pool of packet buffers.
+class packet_pool : private boost::noncopyable
+{
+public:
+  // Size classes are powers of two from 64 bytes to 1 MB, larger
+  // buffers are allocated and freed directly.
+  static const std::size_t min_class_shift = 6;
+  static const std::size_t class_count = 15;
+
+  struct statistics
+  {
+    uint64_t hits;
+    uint64_t misses;
+
+    double
+    hit_rate () const
+    {
+      return hits + misses ? double (hits) / double (hits + misses) : 0.0;
+    }
+  };
+
+  /// Get a buffer holding at least n bytes, with size () == n.
+  static packet_ptr allocate (std::size_t n);
+
+  /// Sum the counters of all threads.
+  static statistics stats ();
+
+private:
+  friend class packet_buffer;
+
+  struct thread_cache;
+
+  static thread_cache &local ();
+  static void release (packet_buffer *p);
+};
+
+} // namespace mysqlproxy_common
+
+#endif // MYSQLPROXY_COMMON_PACKET_POOL_HPP
@@ -6,6 +6,8 @@ namespace mysqlproxy_common
 {
 uint32_t pool_size = 0;
 
+bool shared_nothing = false;
+
 // Thread function
 void (*thread_func) (std::size_t) = 0;
 
@@ -30,6 +32,33 @@ processor::exec ()
   threads.join_all ();
 }
 
+boost::asio::io_context &
+processor::io_context (std::size_t index)
+{
+  if (!shared_nothing || index == 0)
+    return io_context_;
+
+  boost::lock_guard<boost::mutex> lock (mutex_);
+
+  while (contexts_.size () < index)
+    contexts_.push_back (boost::shared_ptr<boost::asio::io_context> (
+        new boost::asio::io_context (1)));
+
+  return *contexts_[index - 1];
+}
+
+void
+processor::stop ()
+{
+  processor &p = instance ();
+
+  p.io_context_.stop ();
+
+  boost::lock_guard<boost::mutex> lock (p.mutex_);
+  for (std::size_t i = 0; i < p.contexts_.size (); ++i)
+    p.contexts_[i]->stop ();
+}
+
 processor *processor::p_instance_ = 0;
 bool processor::destroyed_ = false;
 
@@ -4,9 +4,11 @@
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/signal_set.hpp>
 #include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/once.hpp>
+#include <vector>
 
 namespace mysqlproxy_common
 {
@@ -14,6 +16,9 @@ namespace mysqlproxy_common
 // Number threads for main loop
 extern uint32_t pool_size;
 
+// One io_context per thread instead of one shared by all threads
+extern bool shared_nothing;
+
 // Thread function
 extern void (*thread_func) (std::size_t);
 
@@ -60,11 +65,38 @@ public:
     return io_context_;
   }
 
+  // The io_context thread index runs, the shared one unless shared_nothing
+  boost::asio::io_context &io_context (std::size_t index);
+
   // Begin to execution app
   static void exec ();
 
+  // Demultiplexer the io_contexts were built with
+  static const char *
+  reactor ()
+  {
+#if defined(BOOST_ASIO_HAS_IO_URING_AS_DEFAULT)
+    return "io_uring";
+#elif defined(BOOST_ASIO_HAS_EPOLL)
+    return "epoll";
+#elif defined(BOOST_ASIO_HAS_KQUEUE)
+    return "kqueue";
+#elif defined(BOOST_ASIO_HAS_IOCP)
+    return "iocp";
+#else
+    return "select";
+#endif
+  }
+
+  // Stop every io_context, exec () returns once the threads are done
+  static void stop ();
+
 private:
-  processor () : io_context_ (), sig_set_ (io_context_, SIGINT, SIGTERM) {}
+  processor ()
+      : io_context_ (), sig_set_ (io_context_, SIGINT, SIGTERM), mutex_ (),
+        contexts_ ()
+  {
+  }
 
   BOOST_NORETURN BOOST_NOINLINE static void
   on_dead_reference ()
@@ -84,6 +116,10 @@ private:
 
   boost::asio::io_context io_context_;
   boost::asio::signal_set sig_set_;
+
+  // io_context of the threads past the first in shared_nothing mode
+  boost::mutex mutex_;
+  std::vector<boost::shared_ptr<boost::asio::io_context> > contexts_;
 };
 
 } // namespace mysqlproxy_common
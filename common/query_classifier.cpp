@@ -0,0 +1,524 @@
+#include "query_classifier.hpp"
+
+namespace mysqlproxy_common
+{
+
+namespace
+{
+
+struct token
+{
+  enum kind_type
+  {
+    word,
+    symbol,
+    // String literal or quoted identifier, never a keyword
+    quoted,
+    end,
+  };
+
+  kind_type kind;
+  const char *begin;
+  std::size_t length;
+};
+
+inline bool
+is_space (char c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f'
+         || c == '\v';
+}
+
+inline bool
+is_word_char (unsigned char c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+         || (c >= '0' && c <= '9') || c == '_' || c == '$' || c >= 0x80;
+}
+
+class lexer
+{
+public:
+  lexer (const char *text, std::size_t length)
+      : p_ (text), end_ (text + length)
+  {
+  }
+
+  token next ();
+
+private:
+  void skip_blank ();
+
+  const char *p_;
+  const char *end_;
+};
+
+void
+lexer::skip_blank ()
+{
+  while (p_ < end_)
+    {
+      char c = *p_;
+      std::size_t left = end_ - p_;
+
+      if (is_space (c))
+        ++p_;
+      else if (c == '#'
+               || (c == '-' && left >= 2 && p_[1] == '-'
+                   && (left == 2 || is_space (p_[2]))))
+        {
+          while (p_ < end_ && *p_ != '\n')
+            ++p_;
+        }
+      else if (c == '/' && left >= 3 && p_[1] == '*' && p_[2] == '!')
+        {
+          // Versioned comment, the server runs its body
+          p_ += 3;
+          while (p_ < end_ && *p_ >= '0' && *p_ <= '9')
+            ++p_;
+        }
+      else if (c == '/' && left >= 2 && p_[1] == '*')
+        {
+          p_ += 2;
+          while (end_ - p_ >= 2 && !(p_[0] == '*' && p_[1] == '/'))
+            ++p_;
+          p_ = end_ - p_ >= 2 ? p_ + 2 : end_;
+        }
+      else if (c == '*' && left >= 2 && p_[1] == '/')
+        // End of a versioned comment
+        p_ += 2;
+      else
+        break;
+    }
+}
+
+token
+lexer::next ()
+{
+  skip_blank ();
+
+  token t;
+  t.begin = p_;
+
+  if (p_ == end_)
+    {
+      t.kind = token::end;
+      t.length = 0;
+      return t;
+    }
+
+  unsigned char c = *p_;
+
+  if (c == '\'' || c == '"' || c == '`')
+    {
+      ++p_;
+      while (p_ < end_)
+        {
+          if (*p_ == '\\' && c != '`')
+            p_ += end_ - p_ >= 2 ? 2 : 1;
+          else if (*p_ == char (c))
+            {
+              // A doubled quote stands for itself
+              if (end_ - p_ >= 2 && p_[1] == char (c))
+                p_ += 2;
+              else
+                {
+                  ++p_;
+                  break;
+                }
+            }
+          else
+            ++p_;
+        }
+      t.kind = token::quoted;
+    }
+  else if (is_word_char (c))
+    {
+      while (p_ < end_ && is_word_char (*p_))
+        ++p_;
+      t.kind = token::word;
+    }
+  else
+    {
+      ++p_;
+      t.kind = token::symbol;
+    }
+
+  t.length = p_ - t.begin;
+  return t;
+}
+
+// Case insensitive match of a word against an upper case keyword
+bool
+is (const token &t, const char *keyword)
+{
+  if (t.kind != token::word)
+    return false;
+
+  std::size_t i = 0;
+  for (; i < t.length; ++i)
+    {
+      char c = t.begin[i];
+      if (c >= 'a' && c <= 'z')
+        c -= 'a' - 'A';
+      if (keyword[i] != c)
+        return false;
+    }
+
+  return keyword[i] == 0;
+}
+
+bool
+is_symbol (const token &t, char c)
+{
+  return t.kind == token::symbol && *t.begin == c;
+}
+
+// What the statement body mentions
+enum
+{
+  more_statements = 1 << 0,
+  locking_clause = 1 << 1,
+  into_clause = 1 << 2,
+  data_change = 1 << 3,
+  diagnostics_function = 1 << 4,
+  user_lock_function = 1 << 5,
+  autocommit_word = 1 << 6,
+  transaction_word = 1 << 7,
+  global_word = 1 << 8,
+  temporary_word = 1 << 9,
+  warnings_word = 1 << 10,
+  session_word = 1 << 11,
+  // := or INTO @var, outside of SET
+  variable_assignment = 1 << 12,
+};
+
+unsigned
+scan (lexer &lex)
+{
+  unsigned flags = 0;
+  token prev = { token::end, 0, 0 };
+
+  for (;;)
+    {
+      token t = lex.next ();
+
+      // INSERT () and REPLACE () are also string functions
+      if ((is (prev, "INSERT") || is (prev, "REPLACE")) && !is_symbol (t, '('))
+        flags |= data_change;
+
+      if (t.kind == token::end)
+        break;
+
+      if (is_symbol (t, ';'))
+        {
+          if (lex.next ().kind != token::end)
+            flags |= more_statements;
+          break;
+        }
+
+      if ((is_symbol (t, '=') && is_symbol (prev, ':'))
+          || (is_symbol (t, '@') && is (prev, "INTO")))
+        flags |= variable_assignment;
+
+      if (is_symbol (t, '('))
+        {
+          // Only the server taking the writes knows the ids it generated
+          if (is (prev, "LAST_INSERT_ID"))
+            flags |= data_change;
+          else if (is (prev, "FOUND_ROWS") || is (prev, "ROW_COUNT"))
+            flags |= diagnostics_function;
+          else if (is (prev, "GET_LOCK") || is (prev, "RELEASE_LOCK")
+                   || is (prev, "RELEASE_ALL_LOCKS")
+                   || is (prev, "IS_USED_LOCK") || is (prev, "IS_FREE_LOCK"))
+            flags |= user_lock_function;
+        }
+      else if (t.kind == token::word)
+        {
+          if ((is (t, "UPDATE") || is (t, "SHARE")) && is (prev, "FOR"))
+            flags |= locking_clause;
+          else if (is (t, "IN") && is (prev, "LOCK"))
+            flags |= locking_clause;
+          else if (is (t, "UPDATE") || is (t, "DELETE"))
+            flags |= data_change;
+          else if (is (t, "INTO"))
+            flags |= into_clause;
+          else if (is (t, "AUTOCOMMIT"))
+            flags |= autocommit_word;
+          else if (is (t, "TRANSACTION"))
+            flags |= transaction_word;
+          else if (is (t, "GLOBAL") || is (t, "PERSIST")
+                   || is (t, "PERSIST_ONLY"))
+            flags |= global_word;
+          else if (is (t, "TEMPORARY"))
+            flags |= temporary_word;
+          else if (is (t, "WARNINGS") || is (t, "ERRORS"))
+            flags |= warnings_word;
+          else if (is (t, "SESSION") || is (t, "LOCAL"))
+            flags |= session_word;
+        }
+
+      prev = t;
+    }
+
+  return flags;
+}
+
+// Words ending a table name where an alias could follow
+bool
+ends_table_list (const token &t)
+{
+  static const char *const words[]
+      = { "WHERE",  "JOIN",  "LEFT",   "RIGHT",  "INNER",         "OUTER",
+          "CROSS",  "NATURAL", "STRAIGHT_JOIN", "ON", "USING",  "GROUP",
+          "ORDER",  "LIMIT", "HAVING", "WINDOW", "SET",           "VALUES",
+          "VALUE",  "SELECT", "UNION", "FOR",   "LOCK",          "PARTITION",
+          "USE",    "IGNORE", "FORCE", "INTO",  "FROM",          "AS",
+          "EXCEPT", "INTERSECT", "RETURNING" };
+
+  for (std::size_t i = 0; i < sizeof (words) / sizeof (*words); ++i)
+    if (is (t, words[i]))
+      return true;
+  return false;
+}
+
+// The last part of a possibly qualified name starting at t, lower case
+bool
+table_name (lexer &lex, token t, std::string &name)
+{
+  if (t.kind != token::word
+      && !(t.kind == token::quoted && *t.begin == '`' && t.length >= 2))
+    return false;
+
+  for (;;)
+    {
+      if (t.kind == token::quoted)
+        name.assign (t.begin + 1, t.length - 2);
+      else
+        name.assign (t.begin, t.length);
+
+      lexer ahead = lex;
+      if (!is_symbol (ahead.next (), '.'))
+        break;
+
+      token part = ahead.next ();
+      if (part.kind != token::word && part.kind != token::quoted)
+        break;
+      lex = ahead;
+      t = part;
+    }
+
+  for (std::size_t i = 0; i < name.size (); ++i)
+    if (name[i] >= 'A' && name[i] <= 'Z')
+      name[i] += 'a' - 'A';
+  return true;
+}
+
+// A table name and the comma separated names following it
+void
+table_list (lexer &lex, std::vector<std::string> &tables)
+{
+  for (;;)
+    {
+      std::string name;
+      if (!table_name (lex, lex.next (), name))
+        return;
+      if (name != "dual")
+        tables.push_back (name);
+
+      // Optional alias
+      lexer ahead = lex;
+      token t = ahead.next ();
+      if (is (t, "AS"))
+        {
+          ahead.next ();
+          lex = ahead;
+        }
+      else if ((t.kind == token::word && !ends_table_list (t))
+               || t.kind == token::quoted)
+        lex = ahead;
+
+      ahead = lex;
+      if (!is_symbol (ahead.next (), ','))
+        return;
+      lex = ahead;
+    }
+}
+
+} // namespace
+
+bool
+referenced_tables (const char *text, std::size_t length,
+                   std::vector<std::string> &tables)
+{
+  lexer lex (text, length);
+
+  token first = lex.next ();
+  while (is_symbol (first, '('))
+    first = lex.next ();
+
+  if (is (first, "CALL"))
+    return false;
+
+  bool data_changed = !(is (first, "SELECT") || is (first, "WITH")
+                        || is (first, "TABLE") || is (first, "SHOW")
+                        || is (first, "DESCRIBE") || is (first, "DESC")
+                        || is (first, "EXPLAIN"));
+  std::size_t found = tables.size ();
+
+  if (is (first, "TABLE") || is (first, "UPDATE"))
+    table_list (lex, tables);
+
+  // Whether the clause open at each parenthesis depth is a table list,
+  // where a comma after a derived table starts another name
+  const std::size_t max_depth = 32;
+  bool in_tables[max_depth] = { false };
+  std::size_t depth = 0;
+
+  for (;;)
+    {
+      token t = lex.next ();
+      if (t.kind == token::end)
+        break;
+
+      if (is_symbol (t, ';'))
+        {
+          if (lex.next ().kind != token::end)
+            return false;
+          break;
+        }
+
+      if (is_symbol (t, '('))
+        {
+          if (++depth < max_depth)
+            in_tables[depth] = false;
+        }
+      else if (is_symbol (t, ')'))
+        {
+          if (depth)
+            --depth;
+        }
+      else if (is (t, "FROM") || is (t, "JOIN") || is (t, "UPDATE")
+               || is (t, "INTO") || is (t, "TABLE"))
+        {
+          table_list (lex, tables);
+          if (depth < max_depth)
+            in_tables[depth] = true;
+        }
+      else if (depth < max_depth && in_tables[depth])
+        {
+          if (is_symbol (t, ','))
+            table_list (lex, tables);
+          else if (ends_table_list (t))
+            in_tables[depth] = false;
+        }
+    }
+
+  return !data_changed || tables.size () > found;
+}
+
+query_class
+classify_query (const char *text, std::size_t length)
+{
+  lexer lex (text, length);
+
+  token first = lex.next ();
+  while (is_symbol (first, '('))
+    first = lex.next ();
+
+  unsigned flags = scan (lex);
+
+  if (flags & more_statements)
+    return query_write;
+
+  if (is (first, "SELECT") || is (first, "WITH") || is (first, "TABLE")
+      || is (first, "VALUES"))
+    {
+      if (flags & (user_lock_function | variable_assignment))
+        return query_sticky;
+      if (flags & (data_change | into_clause))
+        return query_write;
+      if (flags & diagnostics_function)
+        return query_diagnostics;
+      if (flags & locking_clause)
+        return query_locking_read;
+      return query_read;
+    }
+
+  if (is (first, "SHOW"))
+    return flags & warnings_word ? query_diagnostics : query_read;
+
+  if (is (first, "DESCRIBE") || is (first, "DESC") || is (first, "EXPLAIN")
+      || is (first, "HELP"))
+    return query_read;
+
+  if (is (first, "GET"))
+    return query_diagnostics;
+
+  if (is (first, "BEGIN") || is (first, "COMMIT") || is (first, "ROLLBACK")
+      || is (first, "SAVEPOINT") || is (first, "RELEASE") || is (first, "XA"))
+    return query_transaction;
+
+  if (is (first, "START"))
+    return flags & transaction_word ? query_transaction : query_write;
+
+  if (is (first, "SET"))
+    {
+      if (flags & global_word)
+        return query_write;
+      // SET SESSION TRANSACTION lasts, SET TRANSACTION only applies to the
+      // next transaction
+      if ((flags & (session_word | transaction_word))
+          == (session_word | transaction_word))
+        return query_session;
+      if (flags & autocommit_word)
+        return query_transaction;
+      if (flags & transaction_word)
+        return query_next_transaction;
+      if (flags & user_lock_function)
+        return query_sticky;
+      return query_session;
+    }
+
+  if (is (first, "USE"))
+    return query_session;
+
+  if (is (first, "LOCK") || is (first, "UNLOCK") || is (first, "PREPARE")
+      || is (first, "EXECUTE") || is (first, "DEALLOCATE")
+      || is (first, "HANDLER"))
+    return query_sticky;
+
+  if ((is (first, "CREATE") && (flags & temporary_word))
+      || (is (first, "DO") && (flags & user_lock_function)))
+    return query_sticky;
+
+  return query_write;
+}
+
+const char *
+query_class_name (query_class c)
+{
+  switch (c)
+    {
+    case query_read:
+      return "read";
+    case query_locking_read:
+      return "locking read";
+    case query_write:
+      return "write";
+    case query_transaction:
+      return "transaction";
+    case query_next_transaction:
+      return "next transaction";
+    case query_session:
+      return "session";
+    case query_diagnostics:
+      return "diagnostics";
+    case query_sticky:
+      return "sticky";
+    }
+
+  return "unknown";
+}
+
+} // namespace mysqlproxy_common
@@ -0,0 +1,62 @@
+#ifndef MYSQLPROXY_COMMON_QUERY_CLASSIFIER_HPP
+#define MYSQLPROXY_COMMON_QUERY_CLASSIFIER_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace mysqlproxy_common
+{
+
+/// What a statement needs from the server running it.
+enum query_class
+{
+  // SELECT, SHOW, DESCRIBE, EXPLAIN: any replica can answer
+  query_read,
+  // SELECT ... FOR UPDATE, FOR SHARE, LOCK IN SHARE MODE
+  query_locking_read,
+  // DML, DDL, LAST_INSERT_ID () and anything not recognised
+  query_write,
+  // BEGIN, START TRANSACTION, COMMIT, ROLLBACK, SAVEPOINT, XA,
+  // SET autocommit
+  query_transaction,
+  // SET TRANSACTION: characteristics of the next transaction, which must
+  // run on the same server
+  query_next_transaction,
+  // SET and USE, SET SESSION TRANSACTION: state every server of the
+  // session must see
+  query_session,
+  // SHOW WARNINGS, FOUND_ROWS (), ROW_COUNT (): about the previous
+  // statement, only the server that ran it can answer
+  query_diagnostics,
+  // State bound to the server it was created on: temporary tables,
+  // LOCK TABLES, user level locks, PREPARE, HANDLER, user variables
+  // assigned by SELECT
+  query_sticky,
+};
+
+/// Classify a COM_QUERY statement.
+/**
+ * A single pass over the text, skipping comments, whitespace, string
+ * literals and quoted identifiers. The bodies of versioned comments, which
+ * the server executes, count as statement text. Several statements in one
+ * query classify as query_write.
+ */
+query_class classify_query (const char *text, std::size_t length);
+
+const char *query_class_name (query_class c);
+
+/// Tables a statement names, lower case and without their database.
+/**
+ * Collects the names following FROM, JOIN, UPDATE, INTO and TABLE, and
+ * the comma separated lists they start. Tables reached through views,
+ * triggers or stored routines are not seen. False when the statement may
+ * change tables it does not name: CALL, several statements, or a data
+ * change without any name found.
+ */
+bool referenced_tables (const char *text, std::size_t length,
+                        std::vector<std::string> &tables);
+
+} // namespace mysqlproxy_common
+
+#endif // MYSQLPROXY_COMMON_QUERY_CLASSIFIER_HPP
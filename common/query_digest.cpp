@@ -0,0 +1,787 @@
+#include "query_digest.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define MYSQLPROXY_DIGEST_AVX2 __attribute__ ((target ("avx2")))
+#endif
+
+namespace mysqlproxy_common
+{
+
+std::size_t max_digest_length = 4096;
+
+namespace
+{
+
+// Bytes written past the length limit: the tail of a word copied a block
+// at a time, a space and (...)
+const std::size_t digest_slack = 128;
+
+enum
+{
+  word_char = 1,
+  space_char = 2,
+  digit_char = 4,
+  hex_char = 8,
+  // Operators written together: <=, <>, !=, :=, ||, &&
+  joined_first = 16,
+  joined_second = 32,
+  // A + or - after these is a sign
+  sign_context = 64,
+};
+
+struct char_table
+{
+  unsigned char flags[256];
+
+  char_table ()
+  {
+    for (int c = 0; c < 256; c++)
+      {
+        unsigned char f = 0;
+
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+            || (c >= '0' && c <= '9') || c == '_' || c == '$' || c >= 0x80)
+          f |= word_char;
+        if (c == ' ' || (c >= '\t' && c <= '\r'))
+          f |= space_char;
+        if (c >= '0' && c <= '9')
+          f |= digit_char | hex_char;
+        if ((c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'))
+          f |= hex_char;
+        if (c && std::strchr ("<>=!:|&", c))
+          f |= joined_first;
+        if (c && std::strchr ("<>=!|&", c))
+          f |= joined_second;
+        if (c && std::strchr ("=<>(,+-*/%!&|^~", c))
+          f |= sign_context;
+
+        flags[c] = f;
+      }
+  }
+};
+
+const char_table chars;
+
+inline bool
+has (char c, unsigned flag)
+{
+  return chars.flags[static_cast<unsigned char> (c)] & flag;
+}
+
+inline char
+to_lower (char c)
+{
+  return c >= 'A' && c <= 'Z' ? char (c + ('a' - 'A')) : c;
+}
+
+// Classification of one block of input
+struct block
+{
+  static const std::size_t size = 64;
+
+  // Bit i describes byte i
+  uint64_t word;
+  uint64_t space;
+  // The block lower cased, padded for 16 byte copies
+  char lower[size + 16];
+};
+
+// The vector work of make_digest, one implementation per instruction set
+struct scanner
+{
+  const char *name;
+
+  // Classify the block::size bytes at p
+  void (*classify) (const char *p, block &b);
+
+  // Offset of the first quote or backslash, end - p without one
+  std::size_t (*find_quote) (const char *p, const char *end, char quote);
+};
+
+void
+classify_scalar (const char *p, block &b)
+{
+  b.word = 0;
+  b.space = 0;
+
+  for (std::size_t i = 0; i < block::size; i++)
+    {
+      unsigned char f = chars.flags[static_cast<unsigned char> (p[i])];
+
+      b.word |= uint64_t (f & word_char ? 1 : 0) << i;
+      b.space |= uint64_t (f & space_char ? 1 : 0) << i;
+      b.lower[i] = to_lower (p[i]);
+    }
+}
+
+std::size_t
+find_quote_scalar (const char *p, const char *end, char quote)
+{
+  const char *begin = p;
+  while (p < end && *p != quote && *p != '\\')
+    ++p;
+  return p - begin;
+}
+
+const scanner scalar_scanner
+    = { "scalar", classify_scalar, find_quote_scalar };
+
+#ifdef __SSE2__
+// Bytes within [lo, hi], compared signed: bytes from 0x80 are below both
+inline __m128i
+in_range_sse2 (__m128i v, char lo, char hi)
+{
+  return _mm_and_si128 (_mm_cmpgt_epi8 (v, _mm_set1_epi8 (char (lo - 1))),
+                        _mm_cmplt_epi8 (v, _mm_set1_epi8 (char (hi + 1))));
+}
+
+void
+classify_sse2 (const char *p, block &b)
+{
+  b.word = 0;
+  b.space = 0;
+
+  for (std::size_t i = 0; i < block::size; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (p + i));
+
+      // Setting bit 5 folds A-Z onto a-z and nothing else onto them
+      __m128i w = in_range_sse2 (_mm_or_si128 (v, _mm_set1_epi8 (0x20)),
+                                 'a', 'z');
+      w = _mm_or_si128 (w, in_range_sse2 (v, '0', '9'));
+      w = _mm_or_si128 (w, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('_')));
+      w = _mm_or_si128 (w, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('$')));
+      w = _mm_or_si128 (w, _mm_cmplt_epi8 (v, _mm_setzero_si128 ()));
+
+      __m128i s = _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 (' ')),
+                                in_range_sse2 (v, '\t', '\r'));
+
+      __m128i upper = in_range_sse2 (v, 'A', 'Z');
+
+      b.word |= uint64_t (unsigned (_mm_movemask_epi8 (w))) << i;
+      b.space |= uint64_t (unsigned (_mm_movemask_epi8 (s))) << i;
+      _mm_storeu_si128 (
+          reinterpret_cast<__m128i *> (b.lower + i),
+          _mm_or_si128 (v, _mm_and_si128 (upper, _mm_set1_epi8 (0x20))));
+    }
+}
+
+std::size_t
+find_quote_sse2 (const char *p, const char *end, char quote)
+{
+  const char *begin = p;
+  __m128i q = _mm_set1_epi8 (quote);
+  __m128i backslash = _mm_set1_epi8 ('\\');
+
+  for (; end - p >= 16; p += 16)
+    {
+      __m128i v = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (p));
+      unsigned found = unsigned (_mm_movemask_epi8 (_mm_or_si128 (
+          _mm_cmpeq_epi8 (v, q), _mm_cmpeq_epi8 (v, backslash))));
+      if (found)
+        return p - begin + __builtin_ctz (found);
+    }
+
+  return p - begin + find_quote_scalar (p, end, quote);
+}
+
+const scanner sse2_scanner = { "sse2", classify_sse2, find_quote_sse2 };
+#endif // __SSE2__
+
+#ifdef MYSQLPROXY_DIGEST_AVX2
+MYSQLPROXY_DIGEST_AVX2 inline __m256i
+in_range_avx2 (__m256i v, char lo, char hi)
+{
+  return _mm256_and_si256 (
+      _mm256_cmpgt_epi8 (v, _mm256_set1_epi8 (char (lo - 1))),
+      _mm256_cmpgt_epi8 (_mm256_set1_epi8 (char (hi + 1)), v));
+}
+
+MYSQLPROXY_DIGEST_AVX2 void
+classify_avx2 (const char *p, block &b)
+{
+  b.word = 0;
+  b.space = 0;
+
+  for (std::size_t i = 0; i < block::size; i += 32)
+    {
+      __m256i v
+          = _mm256_loadu_si256 (reinterpret_cast<const __m256i *> (p + i));
+
+      __m256i w = in_range_avx2 (_mm256_or_si256 (v, _mm256_set1_epi8 (0x20)),
+                                 'a', 'z');
+      w = _mm256_or_si256 (w, in_range_avx2 (v, '0', '9'));
+      w = _mm256_or_si256 (w, _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('_')));
+      w = _mm256_or_si256 (w, _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('$')));
+      w = _mm256_or_si256 (w, _mm256_cmpgt_epi8 (_mm256_setzero_si256 (), v));
+
+      __m256i s
+          = _mm256_or_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 (' ')),
+                             in_range_avx2 (v, '\t', '\r'));
+
+      __m256i upper = in_range_avx2 (v, 'A', 'Z');
+
+      b.word |= uint64_t (unsigned (_mm256_movemask_epi8 (w))) << i;
+      b.space |= uint64_t (unsigned (_mm256_movemask_epi8 (s))) << i;
+      _mm256_storeu_si256 (
+          reinterpret_cast<__m256i *> (b.lower + i),
+          _mm256_or_si256 (v,
+                           _mm256_and_si256 (upper, _mm256_set1_epi8 (0x20))));
+    }
+}
+
+MYSQLPROXY_DIGEST_AVX2 std::size_t
+find_quote_avx2 (const char *p, const char *end, char quote)
+{
+  const char *begin = p;
+  __m256i q = _mm256_set1_epi8 (quote);
+  __m256i backslash = _mm256_set1_epi8 ('\\');
+
+  for (; end - p >= 32; p += 32)
+    {
+      __m256i v
+          = _mm256_loadu_si256 (reinterpret_cast<const __m256i *> (p));
+      unsigned found = unsigned (_mm256_movemask_epi8 (_mm256_or_si256 (
+          _mm256_cmpeq_epi8 (v, q), _mm256_cmpeq_epi8 (v, backslash))));
+      if (found)
+        return p - begin + __builtin_ctz (found);
+    }
+
+  return p - begin + find_quote_scalar (p, end, quote);
+}
+
+const scanner avx2_scanner = { "avx2", classify_avx2, find_quote_avx2 };
+#endif // MYSQLPROXY_DIGEST_AVX2
+
+const scanner *
+best_scanner ()
+{
+#ifdef MYSQLPROXY_DIGEST_AVX2
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    return &avx2_scanner;
+#endif
+#ifdef __SSE2__
+  return &sse2_scanner;
+#else
+  return &scalar_scanner;
+#endif
+}
+
+const scanner *const simd_scanner = best_scanner ();
+const scanner *active_scanner = simd_scanner;
+
+// Writes the digest of one statement into a buffer of limit + digest_slack
+// bytes
+class normalizer
+{
+public:
+  normalizer (const scanner &scan, char *out, std::size_t limit)
+      : scan_ (scan), base_ (out), out_ (out), limit_ (out + limit),
+        block_start_ (0), versioned_ (false), depth_ (0), collapsed_ (0)
+  {
+  }
+
+  std::size_t run (const char *p, const char *end);
+
+private:
+  static const std::size_t max_depth = 32;
+
+  // Classify the block starting at p
+  void load (const char *p, const char *end);
+
+  // Length of the run of bytes flagged by bits from p, copied lower cased
+  // to out unless it is 0
+  std::size_t span (const char *p, const char *end, uint64_t block::*bits,
+                    char *out);
+
+  const char *skip_comment (const char *p, const char *end);
+  const char *skip_quoted (const char *p, const char *end, char quote);
+  const char *number (const char *p, const char *end);
+  const char *word (const char *p, const char *end);
+  const char *quoted_name (const char *p, const char *end);
+  void symbol (char c, const char *next, const char *end);
+  void close_group ();
+
+  void placeholder ();
+
+  // Tokens are kept apart by a single space, except inside names,
+  // before commas and within parentheses and operators
+  void
+  separate (char next)
+  {
+    if (out_ == base_)
+      return;
+
+    char last = out_[-1];
+
+    if (last == '(' || last == '.' || last == '@' || next == ')'
+        || next == ',' || next == '.' || next == ';'
+        || (has (last, joined_first) && has (next, joined_second)))
+      return;
+
+    *out_++ = ' ';
+  }
+
+  // The innermost parentheses hold something else than a placeholder list
+  void
+  impure ()
+  {
+    if (depth_ && depth_ <= max_depth)
+      pure_[depth_ - 1] = false;
+  }
+
+  bool follows_word (const char *at, const char *word) const;
+  bool unary_sign () const;
+
+  const scanner &scan_;
+  char *base_;
+  char *out_;
+  char *limit_;
+
+  const char *block_start_;
+  block block_;
+
+  // Inside /*! ... */, whose */ is dropped
+  bool versioned_;
+
+  // Open parentheses, the first max_depth are tracked
+  std::size_t depth_;
+  std::size_t open_[max_depth];
+  bool pure_[max_depth];
+  // End of the last list collapsed to (...)
+  std::size_t collapsed_;
+};
+
+std::size_t
+normalizer::run (const char *p, const char *end)
+{
+  while (p < end && out_ < limit_)
+    {
+      char c = *p;
+      std::size_t left = end - p;
+
+      // Most separators are a single space, not worth a vector scan
+      if (c == ' ' && (left == 1 || p[1] != ' '))
+        ++p;
+      else if (has (c, space_char))
+        p += span (p, end, &block::space, 0);
+      else if (c == '#' || c == '/'
+               || (c == '-' && left >= 2 && p[1] == '-'
+                   && (left == 2 || has (p[2], space_char)))
+               || (c == '*' && versioned_ && left >= 2 && p[1] == '/'))
+        p = skip_comment (p, end);
+      else if (c == '\'' || c == '"')
+        {
+          p = skip_quoted (p, end, c);
+          placeholder ();
+        }
+      else if (c == '`')
+        p = quoted_name (p, end);
+      else if (has (c, digit_char)
+               || (c == '.' && left >= 2 && has (p[1], digit_char)))
+        p = number (p, end);
+      else if (has (c, word_char))
+        p = word (p, end);
+      else
+        {
+          symbol (c, p + 1, end);
+          ++p;
+        }
+    }
+
+  // A trailing delimiter does not make another statement
+  while (out_ > base_ && out_[-1] == ';')
+    --out_;
+
+  return std::min (out_, limit_) - base_;
+}
+
+void
+normalizer::load (const char *p, const char *end)
+{
+  block_start_ = p;
+
+  if (std::size_t (end - p) >= block::size)
+    {
+      scan_.classify (p, block_);
+      return;
+    }
+
+  // Zero bytes are neither words nor space, runs stop at the end
+  char tail[block::size];
+  std::memset (tail, 0, sizeof (tail));
+  std::memcpy (tail, p, end - p);
+  scan_.classify (tail, block_);
+}
+
+std::size_t
+normalizer::span (const char *p, const char *end, uint64_t block::*bits,
+                  char *out)
+{
+  std::size_t n = 0;
+
+  for (;;)
+    {
+      if (!block_start_ || p < block_start_ || p >= block_start_ + block::size)
+        load (p, end);
+
+      std::size_t offset = p - block_start_;
+      uint64_t stop = ~(block_.*bits) >> offset;
+      std::size_t k = stop ? std::size_t (__builtin_ctzll (stop))
+                           : block::size - offset;
+
+      if (out)
+        for (std::size_t i = 0; i < k; i += 16)
+          std::memcpy (out + n + i, block_.lower + offset + i, 16);
+
+      n += k;
+      p += k;
+
+      if (offset + k < block::size || p >= end || (out && out + n >= limit_))
+        return n;
+    }
+}
+
+const char *
+normalizer::skip_comment (const char *p, const char *end)
+{
+  std::size_t left = end - p;
+
+  if (*p == '*')
+    {
+      versioned_ = false;
+      return p + 2;
+    }
+
+  if (*p == '/')
+    {
+      if (left < 2 || p[1] != '*')
+        {
+          symbol ('/', p + 1, end);
+          return p + 1;
+        }
+
+      if (left >= 3 && p[2] == '!')
+        {
+          // The server runs the body of a versioned comment
+          versioned_ = true;
+          for (p += 3; p < end && has (*p, digit_char);)
+            ++p;
+          return p;
+        }
+
+      for (const char *q = p + 2;;)
+        {
+          const char *star
+              = static_cast<const char *> (std::memchr (q, '*', end - q));
+          if (!star || end - star < 2)
+            return end;
+          if (star[1] == '/')
+            return star + 2;
+          q = star + 1;
+        }
+    }
+
+  const char *eol = static_cast<const char *> (std::memchr (p, '\n', left));
+  return eol ? eol + 1 : end;
+}
+
+const char *
+normalizer::skip_quoted (const char *p, const char *end, char quote)
+{
+  const char *q = p + 1;
+
+  for (;;)
+    {
+      q += scan_.find_quote (q, end, quote);
+      if (q >= end)
+        return end;
+
+      if (*q == '\\')
+        q += quote == '`' ? 1 : 2;
+      else if (end - q >= 2 && q[1] == quote)
+        // A doubled quote stands for itself
+        q += 2;
+      else
+        return q + 1;
+    }
+}
+
+const char *
+normalizer::number (const char *p, const char *end)
+{
+  const char *q = p;
+
+  if (end - p >= 3 && p[0] == '0'
+      && (p[1] == 'x' || p[1] == 'X' || p[1] == 'b' || p[1] == 'B'))
+    {
+      for (q += 2; q < end && has (*q, hex_char);)
+        ++q;
+    }
+  else
+    {
+      while (q < end && has (*q, digit_char))
+        ++q;
+      if (q < end && *q == '.')
+        for (++q; q < end && has (*q, digit_char);)
+          ++q;
+      if (q < end && (*q == 'e' || *q == 'E'))
+        {
+          const char *e = q + 1;
+          if (e < end && (*e == '+' || *e == '-'))
+            ++e;
+          if (e < end && has (*e, digit_char))
+            for (q = e; q < end && has (*q, digit_char);)
+              ++q;
+        }
+    }
+
+  // Identifiers may start with digits
+  if (q < end && has (*q, word_char) && *p != '.')
+    return word (p, end);
+
+  placeholder ();
+  return q;
+}
+
+const char *
+normalizer::word (const char *p, const char *end)
+{
+  char *before = out_;
+  separate (*p);
+
+  char *start = out_;
+  std::size_t n = span (p, end, &block::word, out_);
+  out_ = std::min (out_ + n, limit_);
+  p += n;
+
+  // x'...', b'...', n'...' and _charset'...' are literals
+  if (p < end && *p == '\''
+      && ((n == 1 && (*start == 'x' || *start == 'b' || *start == 'n'))
+          || *start == '_'))
+    {
+      out_ = before;
+      placeholder ();
+      return skip_quoted (p, end, '\'');
+    }
+
+  impure ();
+  return p;
+}
+
+const char *
+normalizer::quoted_name (const char *p, const char *end)
+{
+  const char *q = skip_quoted (p, end, '`');
+
+  impure ();
+  separate ('`');
+
+  std::size_t n = std::min<std::size_t> (q - p, limit_ - out_);
+  std::memcpy (out_, p, n);
+  out_ += n;
+
+  return q;
+}
+
+void
+normalizer::symbol (char c, const char *next, const char *end)
+{
+  // A sign in front of a number is part of the literal
+  if ((c == '-' || c == '+') && next < end
+      && (has (*next, digit_char) || *next == '.') && unary_sign ())
+    return;
+
+  if (c == ')')
+    {
+      close_group ();
+      return;
+    }
+
+  if (c != ',')
+    impure ();
+
+  separate (c);
+
+  if (c == '(')
+    {
+      if (depth_ < max_depth)
+        {
+          open_[depth_] = out_ - base_;
+          pure_[depth_] = true;
+        }
+      ++depth_;
+    }
+
+  *out_++ = c;
+}
+
+void
+normalizer::close_group ()
+{
+  if (depth_ && --depth_ < max_depth && pure_[depth_] && out_[-1] == '?')
+    {
+      char *open = base_ + open_[depth_];
+
+      if (follows_word (open, "in") || follows_word (open, "values")
+          || follows_word (open, "value"))
+        {
+          out_ = open;
+          std::memcpy (out_, "(...)", 5);
+          out_ += 5;
+          collapsed_ = out_ - base_;
+          return;
+        }
+
+      // Further rows of a collapsed VALUES
+      if (collapsed_ && open == base_ + collapsed_ + 2
+          && base_[collapsed_] == ',')
+        {
+          out_ = base_ + collapsed_;
+          return;
+        }
+    }
+
+  impure ();
+  *out_++ = ')';
+}
+
+void
+normalizer::placeholder ()
+{
+  // (?, ?, ?) collapses to (?) as it is written
+  if (depth_ && depth_ <= max_depth && pure_[depth_ - 1] && out_[-1] == ',')
+    {
+      --out_;
+      return;
+    }
+
+  separate ('?');
+  *out_++ = '?';
+}
+
+bool
+normalizer::follows_word (const char *at, const char *word) const
+{
+  std::size_t n = std::strlen (word);
+
+  if (at > base_ && at[-1] == ' ')
+    --at;
+
+  if (std::size_t (at - base_) < n || std::memcmp (at - n, word, n) != 0)
+    return false;
+
+  return at - n == base_ || !has (at[-std::ptrdiff_t (n) - 1], word_char);
+}
+
+bool
+normalizer::unary_sign () const
+{
+  if (out_ == base_)
+    return true;
+
+  if (has (out_[-1], sign_context))
+    return true;
+
+  // Keywords an operand follows
+  static const char *const keywords[]
+      = { "select", "where", "and", "or", "not", "on", "having", "by",
+          "limit", "offset", "between", "like", "then", "else", "when",
+          "case", "set", "return", "interval", "values" };
+
+  for (std::size_t i = 0; i < sizeof (keywords) / sizeof (*keywords); i++)
+    if (follows_word (out_, keywords[i]))
+      return true;
+
+  return false;
+}
+
+} // namespace
+
+void
+make_digest (const char *text, std::size_t length, query_digest &digest)
+{
+  std::size_t limit = std::min (length * 2, max_digest_length);
+
+  digest.text.resize (limit + digest_slack);
+
+  normalizer n (*active_scanner, &digest.text[0], limit);
+  digest.text.resize (n.run (text, text + length));
+
+  digest.hash = digest_hash (digest.text.data (), digest.text.size ());
+}
+
+uint64_t
+digest_hash (const char *data, std::size_t length)
+{
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ (length * m);
+
+  const char *p = data;
+  const char *tail = data + (length & ~std::size_t (7));
+
+  for (; p != tail; p += 8)
+    {
+      uint64_t k;
+      std::memcpy (&k, p, sizeof (k));
+
+      k *= m;
+      k ^= k >> r;
+      k *= m;
+
+      h ^= k;
+      h *= m;
+    }
+
+  switch (length & 7)
+    {
+    case 7:
+      h ^= uint64_t (static_cast<unsigned char> (p[6])) << 48;
+      // fall through
+    case 6:
+      h ^= uint64_t (static_cast<unsigned char> (p[5])) << 40;
+      // fall through
+    case 5:
+      h ^= uint64_t (static_cast<unsigned char> (p[4])) << 32;
+      // fall through
+    case 4:
+      h ^= uint64_t (static_cast<unsigned char> (p[3])) << 24;
+      // fall through
+    case 3:
+      h ^= uint64_t (static_cast<unsigned char> (p[2])) << 16;
+      // fall through
+    case 2:
+      h ^= uint64_t (static_cast<unsigned char> (p[1])) << 8;
+      // fall through
+    case 1:
+      h ^= uint64_t (static_cast<unsigned char> (p[0]));
+      h *= m;
+    }
+
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+
+  return h;
+}
+
+const char *
+digest_scanner ()
+{
+  return active_scanner->name;
+}
+
+void
+use_scalar_digest (bool scalar)
+{
+  active_scanner = scalar ? &scalar_scanner : simd_scanner;
+}
+
+} // namespace mysqlproxy_common
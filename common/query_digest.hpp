@@ -0,0 +1,43 @@
+#ifndef MYSQLPROXY_COMMON_QUERY_DIGEST_HPP
+#define MYSQLPROXY_COMMON_QUERY_DIGEST_HPP
+
+#include <boost/cstdint.hpp>
+#include <cstddef>
+#include <string>
+
+namespace mysqlproxy_common
+{
+
+// Longest normalized text kept, the rest of a statement is not hashed
+extern std::size_t max_digest_length;
+
+/// Statement text with literals replaced by ? and its hash.
+struct query_digest
+{
+  std::string text;
+  uint64_t hash;
+};
+
+/// Normalize a COM_QUERY statement.
+/**
+ * Comments and whitespace are dropped, words are lower cased and separated
+ * by a single space, numbers, strings and hex or bit literals become ?.
+ * Placeholder lists after IN and the rows of VALUES collapse to (...).
+ * The bodies of versioned comments count as statement text, like
+ * classify_query does. Reuses the capacity of digest.text.
+ */
+void make_digest (const char *text, std::size_t length, query_digest &digest);
+
+/// 64-bit hash of a digest text (MurmurHash64A).
+uint64_t digest_hash (const char *data, std::size_t length);
+
+/// Instruction set of the scanner make_digest uses: "avx2", "sse2" or
+/// "scalar".
+const char *digest_scanner ();
+
+/// Use the portable scanner even where SIMD is available, for comparisons.
+void use_scalar_digest (bool scalar);
+
+} // namespace mysqlproxy_common
+
+#endif // MYSQLPROXY_COMMON_QUERY_DIGEST_HPP
@@ -0,0 +1,226 @@
+#include "result_cache.hpp"
+
+#include <boost/atomic.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+#include <list>
+#include <map>
+
+#include "metrics.hpp"
+#include "query_digest.hpp"
+
+namespace mysqlproxy_common
+{
+std::size_t result_cache_bytes = 64 * 1024 * 1024;
+std::size_t result_cache_entry_bytes = 1024 * 1024;
+
+namespace
+{
+
+const std::size_t shard_count = 16;
+
+// Tables hash to version slots, a collision only drops entries early
+const uint32_t table_slots = 4096;
+
+// Past the table slots, bumped by invalidate_all
+const uint32_t epoch_slot = table_slots;
+
+boost::atomic<uint64_t> versions[table_slots + 1];
+
+// Digest hash to TTL in milliseconds, read only once threads run
+std::map<uint64_t, std::size_t> rules;
+
+uint32_t
+slot_of (const std::string &table)
+{
+  return uint32_t (digest_hash (table.data (), table.size ()) % table_slots);
+}
+
+} // namespace
+
+struct result_cache::entry
+{
+  uint64_t key;
+  uint64_t scope;
+  std::string text;
+  clock_type::time_point expires;
+  dependencies deps;
+  response_ptr response;
+  std::size_t bytes;
+};
+
+struct result_cache::shard
+{
+  shard () : bytes (0) {}
+
+  typedef std::list<entry> lru_list;
+
+  boost::mutex mutex;
+  // Most recently used first
+  lru_list lru;
+  boost::unordered_map<uint64_t, lru_list::iterator> index;
+  std::size_t bytes;
+
+  void
+  erase (lru_list::iterator i)
+  {
+    bytes -= i->bytes;
+    metrics::adjust (metrics::cached_bytes, -int64_t (i->bytes));
+    index.erase (i->key);
+    lru.erase (i);
+  }
+};
+
+result_cache::shard &
+result_cache::shard_of (uint64_t key)
+{
+  static shard shards[shard_count];
+  return shards[key % shard_count];
+}
+
+void
+result_cache::add_rule (const std::string &statement, std::size_t ttl)
+{
+  query_digest digest;
+  make_digest (statement.data (), statement.size (), digest);
+  rules[digest.hash] = ttl;
+}
+
+bool
+result_cache::enabled ()
+{
+  return !rules.empty ();
+}
+
+std::size_t
+result_cache::ttl (uint64_t digest)
+{
+  std::map<uint64_t, std::size_t>::const_iterator i = rules.find (digest);
+  return i == rules.end () ? 0 : i->second;
+}
+
+void
+result_cache::snapshot (const std::vector<std::string> &tables,
+                        dependencies &deps)
+{
+  deps.clear ();
+  deps.push_back (std::make_pair (
+      epoch_slot, versions[epoch_slot].load (boost::memory_order_acquire)));
+
+  for (std::size_t i = 0; i < tables.size (); ++i)
+    {
+      uint32_t slot = slot_of (tables[i]);
+      deps.push_back (std::make_pair (
+          slot, versions[slot].load (boost::memory_order_acquire)));
+    }
+}
+
+bool
+result_cache::current (const dependencies &deps)
+{
+  for (std::size_t i = 0; i < deps.size (); ++i)
+    if (versions[deps[i].first].load (boost::memory_order_acquire)
+        != deps[i].second)
+      return false;
+  return true;
+}
+
+uint64_t
+result_cache::key (uint64_t scope, const char *text, std::size_t length)
+{
+  return digest_hash (text, length) ^ (scope * 0x9e3779b97f4a7c15ULL);
+}
+
+result_cache::response_ptr
+result_cache::find (uint64_t scope, const char *text, std::size_t length)
+{
+  uint64_t key = result_cache::key (scope, text, length);
+  shard &s = shard_of (key);
+  clock_type::time_point now = clock_type::now ();
+
+  boost::lock_guard<boost::mutex> lock (s.mutex);
+
+  boost::unordered_map<uint64_t, shard::lru_list::iterator>::iterator i
+      = s.index.find (key);
+  if (i == s.index.end ())
+    {
+      metrics::add (metrics::cache_misses);
+      return response_ptr ();
+    }
+
+  shard::lru_list::iterator e = i->second;
+  if (e->expires <= now || e->scope != scope
+      || e->text.compare (0, std::string::npos, text, length) != 0
+      || !current (e->deps))
+    {
+      s.erase (e);
+      metrics::add (metrics::cache_misses);
+      return response_ptr ();
+    }
+
+  s.lru.splice (s.lru.begin (), s.lru, e);
+  metrics::add (metrics::cache_hits);
+  return e->response;
+}
+
+void
+result_cache::store (uint64_t scope, const char *text, std::size_t length,
+                     const response_ptr &r, const dependencies &deps,
+                     std::size_t ttl)
+{
+  // What the entry holds on to, the pooled buffers whole
+  std::size_t bytes = length + sizeof (entry)
+                      + deps.size () * sizeof (deps[0])
+                      + r->packets.size () * sizeof (packet);
+  for (std::size_t i = 0; i < r->packets.size (); ++i)
+    bytes += r->packets[i].data->capacity ();
+  std::size_t budget = result_cache_bytes / shard_count;
+  if (bytes > budget)
+    return;
+
+  uint64_t key = result_cache::key (scope, text, length);
+  shard &s = shard_of (key);
+
+  entry e;
+  e.key = key;
+  e.scope = scope;
+  e.text.assign (text, length);
+  e.expires = clock_type::now () + boost::asio::chrono::milliseconds (ttl);
+  e.deps = deps;
+  e.response = r;
+  e.bytes = bytes;
+
+  boost::lock_guard<boost::mutex> lock (s.mutex);
+
+  boost::unordered_map<uint64_t, shard::lru_list::iterator>::iterator i
+      = s.index.find (key);
+  if (i != s.index.end ())
+    s.erase (i->second);
+
+  while (s.bytes + bytes > budget)
+    s.erase (--s.lru.end ());
+
+  s.lru.push_front (e);
+  s.index[key] = s.lru.begin ();
+  s.bytes += bytes;
+  metrics::adjust (metrics::cached_bytes, int64_t (bytes));
+  metrics::add (metrics::cache_stores);
+}
+
+void
+result_cache::invalidate (const std::vector<std::string> &tables)
+{
+  for (std::size_t i = 0; i < tables.size (); ++i)
+    versions[slot_of (tables[i])].fetch_add (1, boost::memory_order_release);
+  metrics::add (metrics::cache_invalidations);
+}
+
+void
+result_cache::invalidate_all ()
+{
+  versions[epoch_slot].fetch_add (1, boost::memory_order_release);
+  metrics::add (metrics::cache_invalidations);
+}
+
+} // namespace mysqlproxy_common
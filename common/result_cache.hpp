@@ -0,0 +1,106 @@
+#ifndef MYSQLPROXY_COMMON_RESULT_CACHE_HPP
+#define MYSQLPROXY_COMMON_RESULT_CACHE_HPP
+
+#include <boost/array.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "packet_pool.hpp"
+
+namespace mysqlproxy_common
+{
+
+// Bytes of responses the cache keeps, over all its shards
+extern std::size_t result_cache_bytes;
+
+// Largest response the cache keeps
+extern std::size_t result_cache_entry_bytes;
+
+/// Responses to COM_QUERY read statements, served without a server.
+/**
+ * Statements are cached only when a rule covers their digest, for the TTL
+ * of the rule. Entries are keyed by the exact statement text and the
+ * session scope it ran in, and kept in shards of LRU lists bounded by
+ * result_cache_bytes. The packets of a response are the pooled buffers it
+ * was relayed in, shared with the hits serving it.
+ *
+ * Writes seen by the proxy bump the versions of the tables they name. An
+ * entry remembers the versions of its tables from before its statement
+ * ran and is dropped on lookup when one has moved since. Writes by other
+ * clients of the servers are only covered by the TTL.
+ */
+class result_cache : private boost::noncopyable
+{
+public:
+  typedef boost::asio::steady_timer::clock_type clock_type;
+
+  struct packet
+  {
+    boost::array<uint8_t, 4> header;
+    packet_ptr data;
+  };
+
+  struct response
+  {
+    response () : bytes (0), rows (0) {}
+
+    std::vector<packet> packets;
+    std::size_t bytes;
+    uint64_t rows;
+  };
+
+  typedef boost::shared_ptr<const response> response_ptr;
+
+  // Table version slots and the versions read before a statement ran
+  typedef std::vector<std::pair<uint32_t, uint64_t> > dependencies;
+
+  /// Cache the statements with the digest of statement for ttl ms.
+  /**
+   * Rules are added before the threads start.
+   */
+  static void add_rule (const std::string &statement, std::size_t ttl);
+
+  static bool enabled ();
+
+  /// TTL of the rule covering a digest hash, 0 when not cached.
+  static std::size_t ttl (uint64_t digest);
+
+  /// Note the versions of tables before a statement reading them runs.
+  static void snapshot (const std::vector<std::string> &tables,
+                        dependencies &deps);
+
+  /// False when a write was seen to a table since deps were noted.
+  static bool current (const dependencies &deps);
+
+  /// Hash of text run in scope.
+  static uint64_t key (uint64_t scope, const char *text, std::size_t length);
+
+  /// The cached response to text in scope, empty when none is valid.
+  static response_ptr find (uint64_t scope, const char *text,
+                            std::size_t length);
+
+  static void store (uint64_t scope, const char *text, std::size_t length,
+                     const response_ptr &r, const dependencies &deps,
+                     std::size_t ttl);
+
+  /// Drop the entries reading any of tables.
+  static void invalidate (const std::vector<std::string> &tables);
+
+  /// Drop every entry, for writes whose tables are unknown.
+  static void invalidate_all ();
+
+private:
+  struct entry;
+  struct shard;
+
+  static shard &shard_of (uint64_t key);
+};
+
+} // namespace mysqlproxy_common
+
+#endif // MYSQLPROXY_COMMON_RESULT_CACHE_HPP
@@ -0,0 +1,157 @@
+#ifndef MYSQLPROXY_COMMON_RING_BUFFER_HPP
+#define MYSQLPROXY_COMMON_RING_BUFFER_HPP
+
+#include <boost/array.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/assert.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+#include "packet_pool.hpp"
+
+namespace mysqlproxy_common
+{
+
+/// Byte ring buffer used to receive a socket stream.
+/**
+ * The free space is exposed as (at most) two mutable buffers so that a
+ * single read_some fills everything the socket has ready, wrapping around
+ * the end of the storage. Readable bytes are inspected with copy() and
+ * released with consume(). The storage is taken from packet_pool so that
+ * connection churn does not hit the heap.
+ */
+class ring_buffer : private boost::noncopyable
+{
+public:
+  typedef boost::array<boost::asio::mutable_buffer, 2> mutable_buffers_type;
+
+  explicit ring_buffer (std::size_t capacity)
+      : data_ (), mask_ (0), head_ (0), tail_ (0)
+  {
+    reset (capacity);
+  }
+
+  /// Number of readable bytes.
+  std::size_t
+  size () const
+  {
+    return head_ - tail_;
+  }
+
+  bool
+  empty () const
+  {
+    return head_ == tail_;
+  }
+
+  std::size_t
+  capacity () const
+  {
+    return mask_ + 1;
+  }
+
+  /// Number of bytes that can be received without growing.
+  std::size_t
+  space () const
+  {
+    return capacity () - size ();
+  }
+
+  /// Get the free space as a buffer sequence for read_some.
+  mutable_buffers_type
+  prepare ()
+  {
+    std::size_t offset = head_ & mask_;
+    std::size_t first = std::min (space (), capacity () - offset);
+
+    mutable_buffers_type bufs;
+    bufs[0] = boost::asio::buffer (data_->data () + offset, first);
+    bufs[1] = boost::asio::buffer (data_->data (), space () - first);
+    return bufs;
+  }
+
+  /// Make n bytes of the prepared space readable.
+  void
+  commit (std::size_t n)
+  {
+    BOOST_ASSERT (n <= space ());
+    head_ += n;
+  }
+
+  /// Release n readable bytes.
+  void
+  consume (std::size_t n)
+  {
+    BOOST_ASSERT (n <= size ());
+    tail_ += n;
+  }
+
+  /// Copy n readable bytes starting at offset into dst.
+  void
+  copy (std::size_t offset, void *dst, std::size_t n) const
+  {
+    BOOST_ASSERT (offset + n <= size ());
+
+    std::size_t from = (tail_ + offset) & mask_;
+    std::size_t first = std::min (n, capacity () - from);
+
+    std::memcpy (dst, data_->data () + from, first);
+    std::memcpy (static_cast<uint8_t *> (dst) + first, data_->data (),
+                 n - first);
+  }
+
+  /// Grow the storage so that it holds at least n bytes.
+  void
+  reserve (std::size_t n)
+  {
+    if (n <= capacity ())
+      return;
+
+    std::size_t cap = round_up (n);
+    packet_ptr data = packet_pool::allocate (cap);
+
+    std::size_t len = size ();
+    copy (0, data->data (), len);
+
+    data_.swap (data);
+    mask_ = cap - 1;
+    tail_ = 0;
+    head_ = len;
+  }
+
+  /// Replace the storage of an empty buffer.
+  void
+  reset (std::size_t n)
+  {
+    BOOST_ASSERT (empty ());
+
+    std::size_t cap = round_up (n);
+    data_ = packet_pool::allocate (cap);
+    mask_ = cap - 1;
+    tail_ = head_ = 0;
+  }
+
+private:
+  static std::size_t
+  round_up (std::size_t n)
+  {
+    std::size_t cap = 1;
+    while (cap < n)
+      cap <<= 1;
+    return cap;
+  }
+
+  packet_ptr data_;
+  std::size_t mask_;
+
+  // Free running positions, wrapped with mask_ on access
+  std::size_t head_;
+  std::size_t tail_;
+};
+
+} // namespace mysqlproxy_common
+
+#endif // MYSQLPROXY_COMMON_RING_BUFFER_HPP
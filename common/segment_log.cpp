@@ -0,0 +1,532 @@
+#include "segment_log.hpp"
+
+#include <boost/bind/bind.hpp>
+#include <boost/chrono/chrono.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/throw_exception.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace mysqlproxy_common
+{
+
+namespace
+{
+
+// Blocks are sealed once they would grow past this
+const std::size_t block_size = 64 * 1024;
+
+// Sealed blocks waiting for the writer, newer ones are dropped beyond
+const std::size_t max_sealed_blocks = 1024;
+
+// Empty blocks kept for reuse
+const std::size_t max_spare_blocks = 64;
+
+#if defined(IOV_MAX)
+const std::size_t max_iovecs = IOV_MAX;
+#else
+const std::size_t max_iovecs = 16;
+#endif
+
+std::size_t
+padded (std::size_t n)
+{
+  return (n + 7) & ~std::size_t (7);
+}
+
+bool
+exists (const std::string &path)
+{
+  struct stat st;
+  return ::stat (path.c_str (), &st) == 0;
+}
+
+} // namespace
+
+struct segment_log::thread_block : private boost::noncopyable
+{
+  thread_block ();
+
+  // Fill in the header and hand the block to the writer, the caller holds
+  // mutex
+  void seal (segment_log &log);
+
+  boost::mutex mutex;
+  // The header, then the records
+  std::vector<char> data;
+  uint32_t count;
+  int64_t first_micros;
+  int64_t last_micros;
+  uint64_t key_filter[4];
+};
+
+struct segment_log::writer : private boost::noncopyable
+{
+  writer (segment_log &log, const std::string &path, uint64_t segment_bytes,
+          std::size_t flush_interval);
+
+  // Take a sealed block, leaving an empty one
+  void submit (std::vector<char> &block, uint32_t count);
+
+  void stop ();
+
+  void run ();
+  void open_segment ();
+  void write (std::deque<std::vector<char> > &blocks);
+
+  segment_log &log_;
+  std::string path_;
+  uint64_t segment_limit_;
+  std::size_t flush_interval_;
+  int fd_;
+  uint64_t segment_bytes_;
+
+  boost::mutex mutex_;
+  boost::condition_variable ready_;
+  std::deque<std::vector<char> > sealed_;
+  std::vector<std::vector<char> > spare_;
+  uint64_t dropped_;
+  bool stopping_;
+  boost::scoped_ptr<boost::thread> thread_;
+};
+
+segment_log::thread_block::thread_block ()
+    : count (0), first_micros (0), last_micros (0)
+{
+  data.reserve (block_size);
+  data.resize (sizeof (block_header));
+  std::fill (key_filter, key_filter + 4, 0);
+}
+
+void
+segment_log::thread_block::seal (segment_log &log)
+{
+  if (!count)
+    return;
+
+  block_header header;
+  std::memcpy (header.magic, log.magic_, sizeof (header.magic));
+  header.version = log.version_;
+  header.length = uint32_t (data.size () - sizeof (block_header));
+  header.count = count;
+  header.first_micros = first_micros;
+  header.last_micros = last_micros;
+  std::copy (key_filter, key_filter + 4, header.key_filter);
+  std::memcpy (&data[0], &header, sizeof (header));
+
+  log.writer_->submit (data, count);
+
+  data.resize (sizeof (block_header));
+  count = 0;
+  std::fill (key_filter, key_filter + 4, 0);
+}
+
+segment_log::writer::writer (segment_log &log, const std::string &path,
+                             uint64_t segment_bytes,
+                             std::size_t flush_interval)
+    : log_ (log), path_ (path), segment_limit_ (segment_bytes),
+      flush_interval_ (flush_interval), fd_ (-1), segment_bytes_ (0),
+      dropped_ (0), stopping_ (false)
+{
+  open_segment ();
+  if (fd_ == -1)
+    boost::throw_exception (std::runtime_error (
+        "segment_log: cannot create a segment of " + path + ": "
+        + std::strerror (errno)));
+
+  thread_.reset (new boost::thread (boost::bind (&writer::run, this)));
+}
+
+void
+segment_log::writer::submit (std::vector<char> &block, uint32_t count)
+{
+  {
+    boost::lock_guard<boost::mutex> lock (mutex_);
+
+    if (sealed_.size () >= max_sealed_blocks)
+      {
+        // The disk cannot keep up, keep the memory bounded
+        dropped_ += count;
+        block.clear ();
+        return;
+      }
+
+    sealed_.push_back (std::vector<char> ());
+    sealed_.back ().swap (block);
+
+    if (!spare_.empty ())
+      {
+        block.swap (spare_.back ());
+        spare_.pop_back ();
+      }
+  }
+
+  if (block.capacity () < block_size)
+    block.reserve (block_size);
+  ready_.notify_one ();
+}
+
+void
+segment_log::writer::stop ()
+{
+  {
+    boost::lock_guard<boost::mutex> lock (mutex_);
+    stopping_ = true;
+  }
+  ready_.notify_one ();
+  thread_->join ();
+
+  if (fd_ != -1)
+    ::close (fd_);
+  fd_ = -1;
+}
+
+void
+segment_log::writer::run ()
+{
+  typedef boost::chrono::steady_clock clock;
+
+  boost::chrono::milliseconds interval (flush_interval_);
+  clock::time_point next_seal = clock::now () + interval;
+  std::deque<std::vector<char> > batch;
+
+  boost::unique_lock<boost::mutex> lock (mutex_);
+  for (;;)
+    {
+      while (sealed_.empty () && !stopping_ && clock::now () < next_seal)
+        ready_.wait_until (lock, next_seal);
+
+      if (stopping_ || clock::now () >= next_seal)
+        {
+          // Blocks of threads that log little are written by time
+          lock.unlock ();
+          {
+            boost::lock_guard<boost::mutex> registry (log_.registry_mutex_);
+            for (std::size_t i = 0; i < log_.registry_.size (); i++)
+              {
+                thread_block &b = *log_.registry_[i];
+                boost::lock_guard<boost::mutex> block (b.mutex);
+                b.seal (log_);
+              }
+          }
+          lock.lock ();
+          next_seal = clock::now () + interval;
+        }
+
+      batch.swap (sealed_);
+      bool stopping = stopping_;
+      uint64_t dropped = dropped_;
+      dropped_ = 0;
+      lock.unlock ();
+
+      if (dropped)
+        std::cerr << path_ << ": " << dropped
+                  << " records dropped, the writer fell behind\n";
+
+      write (batch);
+
+      lock.lock ();
+      while (!batch.empty ())
+        {
+          if (spare_.size () < max_spare_blocks)
+            {
+              batch.front ().clear ();
+              spare_.push_back (std::vector<char> ());
+              spare_.back ().swap (batch.front ());
+            }
+          batch.pop_front ();
+        }
+
+      if (stopping && sealed_.empty ())
+        return;
+    }
+}
+
+void
+segment_log::writer::open_segment ()
+{
+  char stamp[32];
+  std::time_t now = std::time (0);
+  struct tm local;
+  ::localtime_r (&now, &local);
+  std::strftime (stamp, sizeof (stamp), "%Y%m%d-%H%M%S", &local);
+
+  std::string base = path_ + '.' + stamp;
+  std::string name = base;
+  for (int i = 1; exists (name); ++i)
+    {
+      char suffix[16];
+      std::snprintf (suffix, sizeof (suffix), ".%d", i);
+      name = base + suffix;
+    }
+
+  int fd = ::open (name.c_str (),
+                   O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0640);
+  if (fd == -1)
+    {
+      // Stay on the current segment
+      std::perror (name.c_str ());
+      return;
+    }
+
+  if (fd_ != -1)
+    ::close (fd_);
+  fd_ = fd;
+  segment_bytes_ = 0;
+}
+
+void
+segment_log::writer::write (std::deque<std::vector<char> > &blocks)
+{
+  std::vector<iovec> iov;
+
+  std::size_t next = 0;
+  while (next < blocks.size ())
+    {
+      if (segment_bytes_ >= segment_limit_)
+        open_segment ();
+
+      // One writev () per batch, the segment may pass the limit by one
+      iov.clear ();
+      for (std::size_t i = next;
+           i < blocks.size () && iov.size () < max_iovecs; ++i)
+        {
+          iovec v = { &blocks[i][0], blocks[i].size () };
+          iov.push_back (v);
+        }
+      next += iov.size ();
+
+      std::size_t first = 0;
+      while (first < iov.size ())
+        {
+          ssize_t n = ::writev (fd_, &iov[first], int (iov.size () - first));
+          if (n < 0)
+            {
+              if (errno == EINTR)
+                continue;
+              std::perror (path_.c_str ());
+              break;
+            }
+
+          segment_bytes_ += n;
+          while (first < iov.size () && std::size_t (n) >= iov[first].iov_len)
+            n -= iov[first++].iov_len;
+          if (first < iov.size ())
+            {
+              iov[first].iov_base = static_cast<char *> (iov[first].iov_base)
+                                    + n;
+              iov[first].iov_len -= n;
+            }
+        }
+    }
+}
+
+segment_log::segment_log (const char magic[4], uint32_t version,
+                          const std::string &path, uint64_t segment_bytes,
+                          std::size_t flush_interval)
+    : version_ (version), local_ (&keep), writer_ (0)
+{
+  std::memcpy (magic_, magic, sizeof (magic_));
+  writer_ = new writer (*this, path, segment_bytes, flush_interval);
+}
+
+segment_log::~segment_log ()
+{
+  writer_->stop ();
+  delete writer_;
+
+  for (std::size_t i = 0; i < registry_.size (); i++)
+    delete registry_[i];
+}
+
+void
+segment_log::keep (thread_block *)
+{
+}
+
+segment_log::thread_block &
+segment_log::local ()
+{
+  thread_block *p = local_.get ();
+  if (!p)
+    {
+      p = new thread_block ();
+      local_.reset (p);
+
+      boost::lock_guard<boost::mutex> lock (registry_mutex_);
+      registry_.push_back (p);
+    }
+  return *p;
+}
+
+void
+segment_log::append (int64_t micros, uint64_t key, const void *header,
+                     std::size_t header_size, const void *data,
+                     std::size_t data_size)
+{
+  std::size_t length = padded (header_size + data_size);
+  uint32_t length32 = uint32_t (length);
+
+  thread_block &b = local ();
+  boost::lock_guard<boost::mutex> lock (b.mutex);
+
+  if (b.data.size () + length > block_size)
+    b.seal (*this);
+
+  std::size_t offset = b.data.size ();
+  b.data.resize (offset + length);
+  std::memcpy (&b.data[offset], header, header_size);
+  std::memcpy (&b.data[offset], &length32, sizeof (length32));
+  if (data_size)
+    std::memcpy (&b.data[offset + header_size], data, data_size);
+
+  if (!b.count || micros < b.first_micros)
+    b.first_micros = micros;
+  if (!b.count || micros > b.last_micros)
+    b.last_micros = micros;
+  add_key (b.key_filter, key);
+  ++b.count;
+}
+
+void
+segment_log::add_key (uint64_t filter[4], uint64_t key)
+{
+  // Two bits out of 256, from independent parts of the key
+  std::size_t a = std::size_t (key) & 255;
+  std::size_t b = std::size_t (key >> 32) & 255;
+  filter[a >> 6] |= uint64_t (1) << (a & 63);
+  filter[b >> 6] |= uint64_t (1) << (b & 63);
+}
+
+bool
+segment_log::may_contain (const uint64_t filter[4], uint64_t key)
+{
+  std::size_t a = std::size_t (key) & 255;
+  std::size_t b = std::size_t (key >> 32) & 255;
+  return (filter[a >> 6] & (uint64_t (1) << (a & 63)))
+         && (filter[b >> 6] & (uint64_t (1) << (b & 63)));
+}
+
+segment_file::segment_file () : data_ (0), size_ (0), offset_ (0), damaged_ (0)
+{
+}
+
+segment_file::~segment_file ()
+{
+  if (data_)
+    ::munmap (const_cast<char *> (data_), size_);
+}
+
+bool
+segment_file::open (const std::string &path)
+{
+  int fd = ::open (path.c_str (), O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+
+  struct stat st;
+  if (::fstat (fd, &st) != 0)
+    {
+      int e = errno;
+      ::close (fd);
+      errno = e;
+      return false;
+    }
+
+  size_ = std::size_t (st.st_size);
+  if (size_ == 0)
+    {
+      ::close (fd);
+      return true;
+    }
+
+  void *mapped = ::mmap (0, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  int e = errno;
+  ::close (fd);
+  if (mapped == MAP_FAILED)
+    {
+      size_ = 0;
+      errno = e;
+      return false;
+    }
+
+  data_ = static_cast<const char *> (mapped);
+  return true;
+}
+
+bool
+segment_file::next (const char magic[4], uint32_t version,
+                    const segment_log::block_header *&header,
+                    const char *&records)
+{
+  const std::size_t header_size = sizeof (segment_log::block_header);
+
+  while (size_ - offset_ >= header_size)
+    {
+      const segment_log::block_header *h
+          = reinterpret_cast<const segment_log::block_header *> (data_
+                                                                 + offset_);
+
+      if (std::memcmp (h->magic, magic, 4) != 0 || h->version != version
+          || h->length > size_ - offset_ - header_size)
+        {
+          // Blocks start at multiples of 8, look for the next one
+          ++damaged_;
+          offset_ += 8;
+          while (size_ - offset_ >= header_size
+                 && std::memcmp (data_ + offset_, magic, 4) != 0)
+            offset_ += 8;
+          continue;
+        }
+
+      header = h;
+      records = data_ + offset_ + header_size;
+      offset_ += header_size + h->length;
+      return true;
+    }
+
+  return false;
+}
+
+bool
+segment_file::record (const segment_log::block_header &header,
+                      const char *records, std::size_t &offset,
+                      const char *&record, std::size_t header_size)
+{
+  if (offset >= header.length || header.length - offset < header_size)
+    return false;
+
+  uint32_t length;
+  std::memcpy (&length, records + offset, sizeof (length));
+  if (length < header_size || length > header.length - offset)
+    return false;
+
+  record = records + offset;
+  offset += length;
+  return true;
+}
+
+std::size_t
+segment_file::damaged () const
+{
+  return damaged_;
+}
+
+} // namespace mysqlproxy_common
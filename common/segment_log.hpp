@@ -0,0 +1,124 @@
+#ifndef MYSQLPROXY_COMMON_SEGMENT_LOG_HPP
+#define MYSQLPROXY_COMMON_SEGMENT_LOG_HPP
+
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace mysqlproxy_common
+{
+
+/// Append-only binary log of records, written in blocks.
+/**
+ * Each thread encodes its records into a block of its own, sealed when it
+ * is full or flush_interval has passed, so appending takes no lock another
+ * thread holds for long. A writer thread appends sealed blocks to the
+ * current segment with writev () and starts a new segment, named
+ * path.YYYYmmdd-HHMMSS[.n], once segment_bytes are reached.
+ *
+ * A segment is a sequence of blocks, each a block_header followed by its
+ * records. A record starts with its length as a uint32_t and is padded to
+ * a multiple of 8 bytes, so a segment can be mapped and walked in place.
+ * Integers are little endian. Blocks of different threads are not ordered
+ * by time: readers skip whole blocks by the time range and the key filter
+ * of their header.
+ */
+class segment_log : private boost::noncopyable
+{
+public:
+  struct block_header
+  {
+    // Tells the kind of log apart
+    char magic[4];
+    uint32_t version;
+    // Bytes of records following the header
+    uint32_t length;
+    uint32_t count;
+    // Range of the record times
+    int64_t first_micros;
+    int64_t last_micros;
+    // Bloom filter of the record keys, see may_contain ()
+    uint64_t key_filter[4];
+  };
+
+  /// Create the first segment, throws std::runtime_error on failure.
+  segment_log (const char magic[4], uint32_t version, const std::string &path,
+               uint64_t segment_bytes, std::size_t flush_interval);
+
+  /// Write the pending records and stop the writer thread.
+  ~segment_log ();
+
+  /// Append a record to the block of the calling thread.
+  /**
+   * The record is header followed by data, padded; its first 4 bytes are
+   * set to the padded length.
+   */
+  void append (int64_t micros, uint64_t key, const void *header,
+               std::size_t header_size, const void *data,
+               std::size_t data_size);
+
+  /// Note a key in a block filter.
+  static void add_key (uint64_t filter[4], uint64_t key);
+
+  /// False when no record of a block with this filter has the key.
+  static bool may_contain (const uint64_t filter[4], uint64_t key);
+
+private:
+  struct thread_block;
+  struct writer;
+
+  thread_block &local ();
+
+  // Thread exit cleanup, blocks are kept for the writer
+  static void keep (thread_block *block);
+
+  char magic_[4];
+  uint32_t version_;
+  boost::thread_specific_ptr<thread_block> local_;
+
+  // Blocks outlive their threads so that the destructor writes their
+  // records
+  boost::mutex registry_mutex_;
+  std::vector<thread_block *> registry_;
+
+  writer *writer_;
+};
+
+/// Read side of a segment, mapped into memory.
+class segment_file : private boost::noncopyable
+{
+public:
+  segment_file ();
+  ~segment_file ();
+
+  /// Map a segment, false with errno set on failure.
+  bool open (const std::string &path);
+
+  /// The next block with the given magic and version, false at the end.
+  /**
+   * Damaged blocks are skipped up to the next block header and counted.
+   */
+  bool next (const char magic[4], uint32_t version,
+             const segment_log::block_header *&header, const char *&records);
+
+  /// The record at offset of a block, false past its end or if damaged.
+  static bool record (const segment_log::block_header &header,
+                      const char *records, std::size_t &offset,
+                      const char *&record, std::size_t header_size);
+
+  std::size_t damaged () const;
+
+private:
+  const char *data_;
+  std::size_t size_;
+  std::size_t offset_;
+  std::size_t damaged_;
+};
+
+} // namespace mysqlproxy_common
+
+#endif // MYSQLPROXY_COMMON_SEGMENT_LOG_HPP
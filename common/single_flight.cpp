@@ -0,0 +1,92 @@
+#include "single_flight.hpp"
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+#include <vector>
+
+#include "metrics.hpp"
+
+namespace mysqlproxy_common
+{
+
+namespace
+{
+const std::size_t shard_count = 16;
+} // namespace
+
+struct single_flight::flight
+{
+  uint64_t scope;
+  std::string text;
+  result_cache::dependencies deps;
+  std::vector<waiter_type> waiters;
+};
+
+struct single_flight::shard
+{
+  boost::mutex mutex;
+  boost::unordered_map<uint64_t, flight> flights;
+};
+
+single_flight::shard &
+single_flight::shard_of (uint64_t key)
+{
+  static shard shards[shard_count];
+  return shards[key % shard_count];
+}
+
+single_flight::role
+single_flight::join (uint64_t key, uint64_t scope, const char *text,
+                     std::size_t length,
+                     const result_cache::dependencies &deps,
+                     const waiter_type &waiter)
+{
+  shard &s = shard_of (key);
+
+  boost::lock_guard<boost::mutex> lock (s.mutex);
+
+  boost::unordered_map<uint64_t, flight>::iterator i = s.flights.find (key);
+  if (i == s.flights.end ())
+    {
+      flight &f = s.flights[key];
+      f.scope = scope;
+      f.text.assign (text, length);
+      f.deps = deps;
+      return leader;
+    }
+
+  flight &f = i->second;
+  if (f.scope != scope
+      || f.text.compare (0, std::string::npos, text, length) != 0
+      || !result_cache::current (f.deps))
+    return bypass;
+
+  f.waiters.push_back (waiter);
+  metrics::add (metrics::coalesced_queries);
+  return follower;
+}
+
+void
+single_flight::land (uint64_t key, const result_cache::response_ptr &r)
+{
+  shard &s = shard_of (key);
+
+  std::vector<waiter_type> waiters;
+  {
+    boost::lock_guard<boost::mutex> lock (s.mutex);
+
+    boost::unordered_map<uint64_t, flight>::iterator i
+        = s.flights.find (key);
+    if (i == s.flights.end ())
+      return;
+
+    waiters.swap (i->second.waiters);
+    s.flights.erase (i);
+  }
+
+  for (std::size_t i = 0; i < waiters.size (); ++i)
+    waiters[i] (r);
+}
+
+} // namespace mysqlproxy_common
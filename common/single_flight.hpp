@@ -0,0 +1,62 @@
+#ifndef MYSQLPROXY_COMMON_SINGLE_FLIGHT_HPP
+#define MYSQLPROXY_COMMON_SINGLE_FLIGHT_HPP
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "result_cache.hpp"
+
+namespace mysqlproxy_common
+{
+
+/// Identical reads in flight, run once for all the clients sending them.
+/**
+ * The first client sending a read leads its flight and runs it on a
+ * server; clients sending the same text in the same session scope while
+ * it runs wait for the response of the leader instead. A read does not
+ * join a flight that started before a write to one of its tables was
+ * seen, it would miss the write.
+ *
+ * Waiters are called on the thread landing the flight and must post to
+ * their own executor. An empty response means the leader failed and the
+ * waiters have to run the read themselves.
+ */
+class single_flight : private boost::noncopyable
+{
+public:
+  typedef boost::function<void (const result_cache::response_ptr &)>
+      waiter_type;
+
+  enum role
+  {
+    // Run the read and land the flight
+    leader,
+    // Wait for the response of the leader
+    follower,
+    // Run the read alone
+    bypass
+  };
+
+  /// Lead the flight of text in scope or wait for it.
+  /**
+   * key is result_cache::key of text in scope. deps are the table versions
+   * of the leader, taken before it runs.
+   */
+  static role join (uint64_t key, uint64_t scope, const char *text,
+                    std::size_t length,
+                    const result_cache::dependencies &deps,
+                    const waiter_type &waiter);
+
+  /// Hand the response of the leader to the waiters and end the flight.
+  static void land (uint64_t key, const result_cache::response_ptr &r);
+
+private:
+  struct flight;
+  struct shard;
+
+  static shard &shard_of (uint64_t key);
+};
+
+} // namespace mysqlproxy_common
+
+#endif // MYSQLPROXY_COMMON_SINGLE_FLIGHT_HPP
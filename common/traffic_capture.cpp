@@ -0,0 +1,70 @@
+#include "traffic_capture.hpp"
+
+#include <boost/asio/detail/chrono.hpp> // boost::asio::chrono
+#include <boost/atomic.hpp>
+
+#include <cstring>
+
+namespace mysqlproxy_common
+{
+uint64_t capture_segment_bytes = 256 * 1024 * 1024;
+
+namespace
+{
+
+// Milliseconds a record waits at most before it is written
+const std::size_t capture_flush_interval = 100;
+
+boost::atomic<uint64_t> next_session (1);
+
+} // namespace
+
+const char traffic_capture::magic[4] = { 'M', 'P', 'X', 'C' };
+
+segment_log *traffic_capture::log_ = 0;
+
+void
+traffic_capture::open (const std::string &path)
+{
+  if (log_)
+    return;
+
+  log_ = new segment_log (magic, version, path, capture_segment_bytes,
+                          capture_flush_interval);
+}
+
+void
+traffic_capture::close ()
+{
+  delete log_;
+  log_ = 0;
+}
+
+uint64_t
+traffic_capture::new_session ()
+{
+  return next_session.fetch_add (1, boost::memory_order_relaxed);
+}
+
+void
+traffic_capture::record (uint64_t session, uint32_t index, record_kind kind,
+                         const void *payload, std::size_t length)
+{
+  record_header header;
+  std::memset (&header, 0, sizeof (header));
+
+  header.payload_length = uint32_t (length);
+  header.micros = boost::asio::chrono::duration_cast<
+                      boost::asio::chrono::microseconds> (
+                      boost::asio::chrono::system_clock::now ()
+                          .time_since_epoch ())
+                      .count ();
+  header.session = session;
+  header.index = index;
+  header.kind = uint8_t (kind);
+
+  log_->append (header.micros, session, &header, sizeof (header), payload,
+                length);
+}
+
+} // namespace mysqlproxy_common
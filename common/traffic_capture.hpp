@@ -0,0 +1,82 @@
+#ifndef MYSQLPROXY_COMMON_TRAFFIC_CAPTURE_HPP
+#define MYSQLPROXY_COMMON_TRAFFIC_CAPTURE_HPP
+
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <cstddef>
+#include <string>
+
+#include "segment_log.hpp"
+
+namespace mysqlproxy_common
+{
+
+// Bytes after which a new capture segment is started
+extern uint64_t capture_segment_bytes;
+
+/// Client commands of every session, as sent, for replay.
+/**
+ * Records are written to a segment_log keyed by session. A session has a
+ * session_open record with the user and the default database of the
+ * login, a command record with the payload of each client command, and a
+ * session_close record. The records of a session are numbered: with
+ * threads sharing an io_context, they may land in the blocks of several
+ * threads.
+ */
+class traffic_capture : private boost::noncopyable
+{
+public:
+  static const char magic[4];
+  static const uint32_t version = 1;
+
+  enum record_kind
+  {
+    // Payload: user, a zero byte, the default database
+    session_open,
+    // Payload: the client packet
+    command,
+    session_close
+  };
+
+  struct record_header
+  {
+    // Bytes of the header, the payload and the padding
+    uint32_t length;
+    uint32_t payload_length;
+    // Microseconds since the epoch
+    int64_t micros;
+    uint64_t session;
+    // Position within the session
+    uint32_t index;
+    uint8_t kind;
+    uint8_t reserved[3];
+  };
+
+  /// Start writing segments named path.YYYYmmdd-HHMMSS[.n], throws
+  /// std::runtime_error when the first cannot be created.
+  static void open (const std::string &path);
+
+  /// Write the pending records and stop the writer thread.
+  static void close ();
+
+  /// Set by open (), before any connection runs.
+  static bool
+  enabled ()
+  {
+    return log_ != 0;
+  }
+
+  /// Identifier of a new session, never 0.
+  static uint64_t new_session ();
+
+  /// Append a record stamped with the current time.
+  static void record (uint64_t session, uint32_t index, record_kind kind,
+                      const void *payload, std::size_t length);
+
+private:
+  static segment_log *log_;
+};
+
+} // namespace mysqlproxy_common
+
+#endif // MYSQLPROXY_COMMON_TRAFFIC_CAPTURE_HPP
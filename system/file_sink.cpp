@@ -0,0 +1,341 @@
+#define MYSQLPROXY_SYSTEM_SOURCE
+
+#include "file_sink.hpp"
+
+#include <boost/bind/bind.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/throw_exception.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#if defined(__linux__)
+#  include <sys/resource.h>
+#  include <sys/syscall.h>
+#endif // defined(__linux__)
+
+namespace mysqlproxy_system
+{
+namespace detail
+{
+
+namespace
+{
+
+#if defined(IOV_MAX)
+const std::size_t max_iovecs = IOV_MAX;
+#else
+const std::size_t max_iovecs = 16;
+#endif
+
+/// Leave the CPU and the disk to the I/O threads.
+void
+lower_priority ()
+{
+#if defined(__linux__)
+  pid_t tid = pid_t (::syscall (SYS_gettid));
+  ::setpriority (PRIO_PROCESS, id_t (tid), 19);
+
+  // ioprio_set (IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE)
+  const int ioprio_class_idle = 3;
+  const int ioprio_class_shift = 13;
+  ::syscall (SYS_ioprio_set, 1, tid, ioprio_class_idle << ioprio_class_shift);
+#endif // defined(__linux__)
+}
+
+bool
+exists (const std::string &path)
+{
+  struct stat st;
+  return ::stat (path.c_str (), &st) == 0;
+}
+
+} // namespace
+
+file_sink::file_sink ()
+    : fd_ (-1), used_ (0), pending_ (0), file_bytes_ (0), opened_ (0),
+      stopping_ (false)
+{
+}
+
+file_sink::~file_sink ()
+{
+  if (fd_ != -1)
+    {
+      write_pending ();
+      ::close (fd_);
+    }
+
+  if (compressor_)
+    {
+      {
+        boost::lock_guard<boost::mutex> lock (mutex_);
+        stopping_ = true;
+      }
+      ready_.notify_one ();
+      compressor_->join ();
+    }
+}
+
+void
+file_sink::open (const std::string &path, const log_file_options &options)
+{
+  int fd = ::open (path.c_str (), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                   0644);
+  if (fd == -1)
+    boost::throw_exception (
+        std::runtime_error ("mysqlproxy_service: Failed to open log file!"));
+
+  struct stat st;
+  if (::fstat (fd, &st) == 0)
+    file_bytes_ = st.st_size;
+  else
+    file_bytes_ = 0;
+
+  fd_ = fd;
+  path_ = path;
+  options_ = options;
+  opened_ = std::time (0);
+
+  if (options_.compress && !compressor_)
+    compressor_.reset (
+        new boost::thread (boost::bind (&file_sink::compress_loop, this)));
+}
+
+bool
+file_sink::is_open () const
+{
+  return fd_ != -1;
+}
+
+const log_file_options &
+file_sink::options () const
+{
+  return options_;
+}
+
+void
+file_sink::append (const char *data, std::size_t length)
+{
+  while (length)
+    {
+      if (used_ == 0 || chunks_[used_ - 1].size () == chunk_size)
+        {
+          if (used_ == chunks_.size ())
+            {
+              chunks_.push_back (std::string ());
+              chunks_.back ().reserve (chunk_size);
+            }
+          chunks_[used_++].clear ();
+        }
+
+      std::string &chunk = chunks_[used_ - 1];
+      std::size_t n = std::min (length, chunk_size - chunk.size ());
+      chunk.append (data, n);
+      data += n;
+      length -= n;
+      pending_ += n;
+    }
+}
+
+std::size_t
+file_sink::pending () const
+{
+  return pending_;
+}
+
+void
+file_sink::flush ()
+{
+  if (fd_ == -1)
+    return;
+
+  write_pending ();
+
+  std::time_t age = std::time (0) - opened_;
+  if ((options_.rotate_bytes && file_bytes_ >= options_.rotate_bytes)
+      || (options_.rotate_interval
+          && age >= std::time_t (options_.rotate_interval)))
+    rotate ();
+}
+
+void
+file_sink::write_pending ()
+{
+  std::vector<iovec> iov;
+  iov.reserve (std::min (used_, max_iovecs));
+
+  std::size_t next = 0;
+  while (next < used_)
+    {
+      iov.clear ();
+      for (std::size_t i = next; i < used_ && iov.size () < max_iovecs; ++i)
+        {
+          iovec v = { &chunks_[i][0], chunks_[i].size () };
+          iov.push_back (v);
+        }
+      next += iov.size ();
+
+      // Partial writes resume where they stopped
+      std::size_t first = 0;
+      while (first < iov.size ())
+        {
+          ssize_t n = ::writev (fd_, &iov[first], int (iov.size () - first));
+          if (n < 0)
+            {
+              if (errno == EINTR)
+                continue;
+              // Nothing better to do with a log that cannot be written
+              std::perror ("mysqlproxy_service: writev");
+              break;
+            }
+
+          file_bytes_ += n;
+          while (first < iov.size () && std::size_t (n) >= iov[first].iov_len)
+            n -= iov[first++].iov_len;
+          if (first < iov.size ())
+            {
+              iov[first].iov_base = static_cast<char *> (iov[first].iov_base)
+                                    + n;
+              iov[first].iov_len -= n;
+            }
+        }
+    }
+
+  used_ = 0;
+  pending_ = 0;
+}
+
+void
+file_sink::rotate ()
+{
+  std::string rotated = rotated_name ();
+  if (::rename (path_.c_str (), rotated.c_str ()) != 0)
+    {
+      std::perror ("mysqlproxy_service: rename");
+      opened_ = std::time (0);
+      return;
+    }
+
+  // Producers keep queueing meanwhile, the records wait in the ring
+  ::close (fd_);
+  fd_ = -1;
+  try
+    {
+      open (path_, options_);
+    }
+  catch (const std::exception &e)
+    {
+      // Back to stdout until use_file () is called again
+      std::fprintf (stderr, "%s\n", e.what ());
+    }
+
+  if (compressor_)
+    {
+      {
+        boost::lock_guard<boost::mutex> lock (mutex_);
+        rotated_.push_back (rotated);
+      }
+      ready_.notify_one ();
+    }
+}
+
+std::string
+file_sink::rotated_name ()
+{
+  char stamp[32];
+  std::time_t now = std::time (0);
+  struct tm local;
+  ::localtime_r (&now, &local);
+  std::strftime (stamp, sizeof (stamp), "%Y%m%d-%H%M%S", &local);
+
+  std::string base = path_ + '.' + stamp;
+  std::string name = base;
+  for (int i = 1; exists (name) || exists (name + ".gz"); ++i)
+    {
+      char suffix[16];
+      std::snprintf (suffix, sizeof (suffix), ".%d", i);
+      name = base + suffix;
+    }
+  return name;
+}
+
+void
+file_sink::compress_loop ()
+{
+  lower_priority ();
+
+  for (;;)
+    {
+      std::string path;
+      {
+        boost::unique_lock<boost::mutex> lock (mutex_);
+        while (rotated_.empty () && !stopping_)
+          ready_.wait (lock);
+        if (rotated_.empty ())
+          return;
+        path = rotated_.front ();
+        rotated_.pop_front ();
+      }
+
+      compress (path);
+    }
+}
+
+void
+file_sink::compress (const std::string &path)
+{
+  int in = ::open (path.c_str (), O_RDONLY | O_CLOEXEC);
+  if (in == -1)
+    return;
+
+  std::string target = path + ".gz";
+  gzFile out = ::gzopen (target.c_str (), "wb6");
+  if (!out)
+    {
+      ::close (in);
+      return;
+    }
+
+  std::vector<char> buffer (chunk_size);
+  bool ok = true;
+  for (;;)
+    {
+      ssize_t n = ::read (in, &buffer[0], buffer.size ());
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        {
+          ok = n == 0;
+          break;
+        }
+      if (::gzwrite (out, &buffer[0], unsigned (n)) != n)
+        {
+          ok = false;
+          break;
+        }
+    }
+
+  ::close (in);
+  if (::gzclose (out) != Z_OK)
+    ok = false;
+
+  // Keep the plain file when anything failed
+  if (ok)
+    ::unlink (path.c_str ());
+  else
+    ::unlink (target.c_str ());
+}
+
+} // namespace detail
+} // namespace mysqlproxy_system
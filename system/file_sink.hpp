@@ -0,0 +1,92 @@
+#ifndef MYSQLPROXY_SYSTEM_FILE_SINK_HPP
+#define MYSQLPROXY_SYSTEM_FILE_SINK_HPP
+
+#include "logger_service.hpp"
+
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <ctime>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace mysqlproxy_system
+{
+namespace detail
+{
+
+/// Log file written in large batches, rotated and compressed.
+/**
+ * Lines are appended to a list of fixed size chunks and written together
+ * with one writev () per flush, which the logger service calls once
+ * options.flush_bytes are pending or options.flush_interval has passed.
+ * The file is rotated after a flush that reaches rotate_bytes or
+ * rotate_interval: it is renamed with a time stamp and a new one is
+ * opened, so only the logger thread waits for it. Rotated files are
+ * gzipped by a thread of idle CPU and I/O priority.
+ *
+ * All but the constructor and the destructor run on the logger thread.
+ */
+class file_sink : private boost::noncopyable
+{
+public:
+  file_sink ();
+
+  /// Flushes, closes and waits for the pending compressions.
+  ~file_sink ();
+
+  /// Open path for appending, throws std::runtime_error.
+  void open (const std::string &path, const log_file_options &options);
+
+  bool is_open () const;
+
+  const log_file_options &options () const;
+
+  void append (const char *data, std::size_t length);
+
+  /// Bytes appended since the last flush.
+  std::size_t pending () const;
+
+  /// Write the pending bytes, then rotate if a limit is reached.
+  void flush ();
+
+private:
+  static const std::size_t chunk_size = 64 * 1024;
+
+  void write_pending ();
+  void rotate ();
+
+  /// Name of the next rotated file, unused so far.
+  std::string rotated_name ();
+
+  void compress_loop ();
+  static void compress (const std::string &path);
+
+  int fd_;
+  std::string path_;
+  log_file_options options_;
+
+  // Chunks up to used_ hold the pending bytes, the others wait for reuse
+  std::vector<std::string> chunks_;
+  std::size_t used_;
+  std::size_t pending_;
+
+  uint64_t file_bytes_;
+  std::time_t opened_;
+
+  // Rotated files waiting for compression, handed to compressor_
+  boost::mutex mutex_;
+  boost::condition_variable ready_;
+  std::deque<std::string> rotated_;
+  bool stopping_;
+  boost::scoped_ptr<boost::thread> compressor_;
+};
+
+} // namespace detail
+} // namespace mysqlproxy_system
+
+#endif // MYSQLPROXY_SYSTEM_FILE_SINK_HPP
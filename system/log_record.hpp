@@ -0,0 +1,304 @@
+#ifndef MYSQLPROXY_SYSTEM_LOG_RECORD_HPP
+#define MYSQLPROXY_SYSTEM_LOG_RECORD_HPP
+
+#include <boost/asio/detail/chrono.hpp> // boost::asio::chrono
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <cstddef>
+#include <cstring>
+#include <ios>
+#include <sstream>
+#include <string>
+
+namespace mysqlproxy_system
+{
+namespace detail
+{
+
+/// Constant part of a log statement, one per CXXLOG_ call site.
+struct log_site
+{
+  const char *function;
+};
+
+/// Mutable part of a sampled or rate limited call site.
+/**
+ * Static at the call site: the atomics are constant initialized, so the
+ * first call pays no guard.
+ */
+class log_sampler : private boost::noncopyable
+{
+public:
+  /// One call in n passes, none when n is 0.
+  bool
+  sample (std::size_t n)
+  {
+    return n && calls_.fetch_add (1, boost::memory_order_relaxed) % n == 0;
+  }
+
+  /// At most per_second calls pass in a second.
+  bool
+  admit (std::size_t per_second)
+  {
+    int64_t second = boost::asio::chrono::duration_cast<
+                         boost::asio::chrono::seconds> (
+                         boost::asio::chrono::steady_clock::now ()
+                             .time_since_epoch ())
+                         .count ();
+
+    int64_t window = window_.load (boost::memory_order_relaxed);
+    if (window != second
+        && window_.compare_exchange_strong (window, second,
+                                            boost::memory_order_relaxed))
+      calls_.store (0, boost::memory_order_relaxed);
+
+    return calls_.fetch_add (1, boost::memory_order_relaxed) < per_second;
+  }
+
+private:
+  boost::atomic<std::size_t> calls_;
+  boost::atomic<int64_t> window_;
+};
+
+/// A log message before formatting.
+/**
+ * The I/O thread only copies the arguments of the message into data,
+ * each as a tag byte followed by its binary value, the logger thread
+ * formats them. Arguments past the end of data are dropped and the
+ * message marked truncated.
+ */
+struct log_record
+{
+  static const std::size_t size = 512;
+  static const std::size_t identifier_size = 23;
+
+  enum tag
+  {
+    tag_string,   // uint16_t length, then the bytes
+    tag_char,     // char
+    tag_signed,   // int64_t
+    tag_unsigned, // uint64_t
+    tag_double,   // double
+    tag_pointer,  // const void *
+    tag_hex,      // integers that follow in hexadecimal
+    tag_dec,      // integers that follow in decimal
+    tag_oct       // integers that follow in octal
+  };
+
+  // Microseconds since the epoch, on the system clock
+  int64_t micros;
+  const log_site *site;
+  const void *caller;
+  uint16_t length;
+  uint8_t level;
+  bool truncated;
+  char identifier[identifier_size + 1];
+
+  char data[size - 4 * sizeof (void *) - identifier_size - 1];
+};
+
+/// Encodes the right hand sides of a << chain into a log_record.
+class record_stream : private boost::noncopyable
+{
+public:
+  explicit record_stream (log_record &record) : record_ (record)
+  {
+    record_.length = 0;
+    record_.truncated = false;
+  }
+
+  record_stream &
+  operator<< (const char *s)
+  {
+    put_string (s, std::strlen (s));
+    return *this;
+  }
+
+  record_stream &
+  operator<< (const std::string &s)
+  {
+    put_string (s.data (), s.size ());
+    return *this;
+  }
+
+  record_stream &
+  operator<< (char c)
+  {
+    put (log_record::tag_char, &c, sizeof (c));
+    return *this;
+  }
+
+  record_stream &
+  operator<< (unsigned char c)
+  {
+    return *this << char (c);
+  }
+
+  record_stream &
+  operator<< (bool b)
+  {
+    return put_signed (b);
+  }
+
+  record_stream &
+  operator<< (short n)
+  {
+    return put_signed (n);
+  }
+
+  record_stream &
+  operator<< (int n)
+  {
+    return put_signed (n);
+  }
+
+  record_stream &
+  operator<< (long n)
+  {
+    return put_signed (n);
+  }
+
+  record_stream &
+  operator<< (long long n)
+  {
+    return put_signed (n);
+  }
+
+  record_stream &
+  operator<< (unsigned short n)
+  {
+    return put_unsigned (n);
+  }
+
+  record_stream &
+  operator<< (unsigned int n)
+  {
+    return put_unsigned (n);
+  }
+
+  record_stream &
+  operator<< (unsigned long n)
+  {
+    return put_unsigned (n);
+  }
+
+  record_stream &
+  operator<< (unsigned long long n)
+  {
+    return put_unsigned (n);
+  }
+
+  record_stream &
+  operator<< (double d)
+  {
+    put (log_record::tag_double, &d, sizeof (d));
+    return *this;
+  }
+
+  record_stream &
+  operator<< (const void *p)
+  {
+    put (log_record::tag_pointer, &p, sizeof (p));
+    return *this;
+  }
+
+  /// std::hex, std::dec and std::oct, other manipulators are ignored.
+  record_stream &
+  operator<< (std::ios_base &(*manipulator) (std::ios_base &))
+  {
+    if (manipulator == &std::hex)
+      put (log_record::tag_hex, 0, 0);
+    else if (manipulator == &std::dec)
+      put (log_record::tag_dec, 0, 0);
+    else if (manipulator == &std::oct)
+      put (log_record::tag_oct, 0, 0);
+    return *this;
+  }
+
+  /// std::endl and std::flush, every message ends a line already.
+  record_stream &
+  operator<< (std::ostream &(*) (std::ostream &))
+  {
+    return *this;
+  }
+
+  /// Other types are formatted on the spot.
+  template <typename T>
+  record_stream &
+  operator<< (const T &value)
+  {
+    std::ostringstream os;
+    os << value;
+    return *this << os.str ();
+  }
+
+private:
+  record_stream &
+  put_signed (long long n)
+  {
+    int64_t v = n;
+    put (log_record::tag_signed, &v, sizeof (v));
+    return *this;
+  }
+
+  record_stream &
+  put_unsigned (unsigned long long n)
+  {
+    uint64_t v = n;
+    put (log_record::tag_unsigned, &v, sizeof (v));
+    return *this;
+  }
+
+  void
+  put_string (const char *s, std::size_t n)
+  {
+    if (record_.truncated)
+      return;
+
+    std::size_t room = sizeof (record_.data) - record_.length;
+    if (room < 1 + sizeof (uint16_t) + 1)
+      {
+        record_.truncated = true;
+        return;
+      }
+
+    room -= 1 + sizeof (uint16_t);
+    if (n > room)
+      {
+        n = room;
+        record_.truncated = true;
+      }
+
+    uint16_t length = uint16_t (n);
+    char *p = record_.data + record_.length;
+    *p++ = char (log_record::tag_string);
+    std::memcpy (p, &length, sizeof (length));
+    std::memcpy (p + sizeof (length), s, n);
+    record_.length += uint16_t (1 + sizeof (length) + n);
+  }
+
+  void
+  put (log_record::tag t, const void *value, std::size_t n)
+  {
+    if (record_.truncated || sizeof (record_.data) - record_.length < 1 + n)
+      {
+        record_.truncated = true;
+        return;
+      }
+
+    char *p = record_.data + record_.length;
+    *p = char (t);
+    if (n)
+      std::memcpy (p + 1, value, n);
+    record_.length += uint16_t (1 + n);
+  }
+
+  log_record &record_;
+};
+
+} // namespace detail
+} // namespace mysqlproxy_system
+
+#endif // MYSQLPROXY_SYSTEM_LOG_RECORD_HPP
@@ -2,38 +2,218 @@
 #define BOOST_ASIO_SOURCE
 
 #include "logger_service.hpp"
+#include "file_sink.hpp"
 
 #include <boost/asio/executor_work_guard.hpp>
 #include <boost/asio/io_context.hpp>
+#include <boost/asio/placeholders.hpp>
 #include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/atomic.hpp>
 #include <boost/date_time.hpp>
+#include <boost/date_time/c_local_time_adjustor.hpp>
 #include <boost/system/system_error.hpp>
 #include <boost/thread.hpp>
 #include <boost/throw_exception.hpp>
 
+#include <cstddef>
 #include <iostream>
 #include <locale>
 #include <sstream>
+#include <vector>
 
 namespace mysqlproxy_system
 {
+
+boost::atomic<int> log_threshold (detail::logger_service::LEVEL_INFO);
+
 namespace detail
 {
+
+namespace
+{
+
+// Messages queued at most, a power of two
+const std::size_t queue_capacity = 8192;
+
+// Messages written with one write
+const std::size_t batch_size = 256;
+
+// Indexed by logger_service::severity_level
+const char *const level_names[]
+    = { "DEBUG", "INFO", "WARNING", "ERROR", "CRITICAL" };
+
+int64_t
+now_micros ()
+{
+  return boost::asio::chrono::duration_cast<
+             boost::asio::chrono::microseconds> (
+             boost::asio::chrono::system_clock::now ().time_since_epoch ())
+      .count ();
+}
+
+/// Format the arguments encoded by record_stream.
+void
+decode (const log_record &record, std::ostream &os)
+{
+  const char *p = record.data;
+  const char *end = record.data + record.length;
+
+  while (p < end)
+    {
+      log_record::tag t = log_record::tag (*p++);
+      switch (t)
+        {
+        case log_record::tag_string:
+          {
+            uint16_t length;
+            std::memcpy (&length, p, sizeof (length));
+            os.write (p + sizeof (length), length);
+            p += sizeof (length) + length;
+            break;
+          }
+        case log_record::tag_char:
+          os << *p++;
+          break;
+        case log_record::tag_signed:
+          {
+            int64_t v;
+            std::memcpy (&v, p, sizeof (v));
+            os << v;
+            p += sizeof (v);
+            break;
+          }
+        case log_record::tag_unsigned:
+          {
+            uint64_t v;
+            std::memcpy (&v, p, sizeof (v));
+            os << v;
+            p += sizeof (v);
+            break;
+          }
+        case log_record::tag_double:
+          {
+            double v;
+            std::memcpy (&v, p, sizeof (v));
+            os << v;
+            p += sizeof (v);
+            break;
+          }
+        case log_record::tag_pointer:
+          {
+            const void *v;
+            std::memcpy (&v, p, sizeof (v));
+            os << v;
+            p += sizeof (v);
+            break;
+          }
+        case log_record::tag_hex:
+          os << std::hex;
+          break;
+        case log_record::tag_dec:
+          os << std::dec;
+          break;
+        case log_record::tag_oct:
+          os << std::oct;
+          break;
+        }
+    }
+
+  if (record.truncated)
+    os << "...";
+}
+
+} // namespace
+
 class logger_service_impl
 {
   friend class mysqlproxy_system::detail::logger_service;
 
+  /// Entry of the queue, ready for the consumer when sequence is one past
+  /// its position.
+  struct slot
+  {
+    boost::atomic<std::size_t> sequence;
+    log_record record;
+  };
+
   logger_service_impl ()
-      : work_io_context_ (),
+      : slots_ (queue_capacity), enqueue_ (0), dequeue_ (0),
+        draining_ (false), dropped_ (0), work_io_context_ (),
         work_ (boost::asio::make_work_guard (work_io_context_)),
         work_thread_ (new boost::thread (
             boost::bind (&boost::asio::io_context::run, &work_io_context_))),
         start_time_ (boost::posix_time::microsec_clock::local_time ()),
         loc (std::locale::classic (),
-             new ldt_facet (ldt_facet::iso_time_format_extended_specifier))
+             new ldt_facet (ldt_facet::iso_time_format_extended_specifier)),
+        flush_timer_ (work_io_context_), flush_armed_ (false)
+  {
+    for (std::size_t i = 0; i < slots_.size (); ++i)
+      slots_[i].sequence.store (i, boost::memory_order_relaxed);
+  }
+
+  /// Copy a record into the queue, any thread.
+  bool
+  push (const log_record &record)
   {
+    std::size_t pos = enqueue_.load (boost::memory_order_relaxed);
+    slot *s;
+    for (;;)
+      {
+        s = &slots_[pos & (queue_capacity - 1)];
+        std::size_t seq = s->sequence.load (boost::memory_order_acquire);
+        std::ptrdiff_t diff = std::ptrdiff_t (seq) - std::ptrdiff_t (pos);
+        if (diff == 0)
+          {
+            if (enqueue_.compare_exchange_weak (pos, pos + 1,
+                                                boost::memory_order_relaxed))
+              break;
+          }
+        else if (diff < 0)
+          return false;
+        else
+          pos = enqueue_.load (boost::memory_order_relaxed);
+      }
+
+    // The header and the used part of the arguments only
+    std::memcpy (&s->record, &record,
+                 offsetof (log_record, data) + record.length);
+    s->sequence.store (pos + 1, boost::memory_order_release);
+    return true;
   }
 
+  /// Take the oldest record, the logger thread only.
+  const log_record *
+  front ()
+  {
+    slot &s = slots_[dequeue_ & (queue_capacity - 1)];
+    if (s.sequence.load (boost::memory_order_acquire) != dequeue_ + 1)
+      return 0;
+    return &s.record;
+  }
+
+  void
+  pop ()
+  {
+    slot &s = slots_[dequeue_ & (queue_capacity - 1)];
+    s.sequence.store (dequeue_ + queue_capacity,
+                      boost::memory_order_release);
+    ++dequeue_;
+  }
+
+  std::vector<slot> slots_;
+  boost::atomic<std::size_t> enqueue_;
+  std::size_t dequeue_;
+
+  /// A drain () is posted or running.
+  boost::atomic<bool> draining_;
+
+  /// Messages lost to a full queue, reported by the next drain ().
+  boost::atomic<std::size_t> dropped_;
+
+  /// Text of a batch, written at once.
+  std::string batch_;
+
   /// Private io_context used for performing logging operations.
   boost::asio::io_context work_io_context_;
 
@@ -56,7 +236,11 @@ class logger_service_impl
   std::locale loc;
 
   /// The file to which log messages will be written.
-  std::ofstream ofstream_;
+  file_sink sink_;
+
+  /// Bounds the time the sink holds a message, armed while it holds any.
+  boost::asio::steady_timer flush_timer_;
+  bool flush_armed_;
 };
 
 void
@@ -82,6 +266,10 @@ logger_service::~logger_service ()
   private_->work_.reset ();
   if (private_->work_thread_)
     private_->work_thread_->join ();
+
+  // Messages queued after the last drain, written without waiting
+  drain ();
+  private_->sink_.flush ();
 }
 
 void
@@ -107,63 +295,67 @@ logger_service::destroy (impl_type &impl)
 }
 
 void
-logger_service::use_file (impl_type & /*impl*/, const std::string &file)
+logger_service::use_file (impl_type & /*impl*/, const std::string &file,
+                          const log_file_options &options)
 {
   // Pass the work of opening the file to the background thread.
   boost::asio::post (private_->work_io_context_,
-                     boost::bind (&logger_service::use_file_impl, this, file));
+                     boost::bind (&logger_service::use_file_impl, this, file,
+                                  options));
 }
 
 void
 logger_service::log (impl_type &impl, const std::string &message,
                      severity_level lv)
+{
+  // Without a call site, the message is written as is
+  static const log_site site = { 0 };
+
+  if (!log_enabled (lv))
+    return;
+
+  log_record record;
+  record_stream os (record);
+  os << message;
+  log (impl, record, site, 0, lv);
+}
+
+void
+logger_service::log (impl_type &impl, log_record &record,
+                     const log_site &site, const void *caller,
+                     severity_level lv)
 {
   using namespace boost::system::errc;
 
-  const char *level = 0;
-  switch (lv)
-    {
-    case LEVEL_DEBUG:
-      level = "DEBUG";
-      break;
-    case LEVEL_INFO:
-      level = "INFO";
-      break;
-    case LEVEL_WARNING:
-      level = "WARNING";
-      break;
-    case LEVEL_ERROR:
-      level = "ERROR";
-      break;
-    case LEVEL_CRITICAL:
-      level = "CRITICAL";
-      break;
-    default:
-      boost::throw_exception (
-          boost::system::system_error (make_error_code (invalid_argument),
-                                       "mysqlproxy_system.logger_service"));
-    }
+  if (lv < LEVEL_DEBUG || lv > LEVEL_CRITICAL)
+    boost::throw_exception (
+        boost::system::system_error (make_error_code (invalid_argument),
+                                     "mysqlproxy_system.logger_service"));
 
-  // Format the text to be logged.
-  std::ostringstream os;
-  os.imbue (private_->loc); // set date/time format
+  record.micros = now_micros ();
+  record.site = &site;
+  record.caller = caller;
+  record.level = uint8_t (lv);
 
-  boost::posix_time::ptime pt
-      = boost::posix_time::microsec_clock::local_time ();
-  os << '[' << pt << ']'; // current local time
-  os << '[' << pt - private_->start_time_ << ']';
-  os << '[' << level << ']';      // severity level
-  if (!impl->identifier.empty ()) // identifier
-    os << '[' << impl->identifier << ']' << '\t';
-  else
-    os << '\t';
+  std::size_t n = impl->identifier.size ();
+  if (n > log_record::identifier_size)
+    n = log_record::identifier_size;
+  std::memcpy (record.identifier, impl->identifier.data (), n);
+  record.identifier[n] = '\0';
 
-  os << message; // message
+  if (!private_->push (record))
+    {
+      private_->dropped_.fetch_add (1, boost::memory_order_relaxed);
+      return;
+    }
 
-  // Pass the work of writing to the file to the background thread.
-  boost::asio::post (private_->work_io_context_,
-                     boost::bind (&logger_service::log_impl, this,
-                                  boost::ref (impl), os.str ()));
+  // Wake the background thread unless it is already on its way; the fence
+  // pairs with the one in drain (), after which it looks at the queue again
+  boost::atomic_thread_fence (boost::memory_order_seq_cst);
+  if (!private_->draining_.load (boost::memory_order_relaxed)
+      && !private_->draining_.exchange (true, boost::memory_order_acquire))
+    boost::asio::post (private_->work_io_context_,
+                       boost::bind (&logger_service::drain, this));
 }
 
 void
@@ -187,7 +379,7 @@ logger_service::cerr (impl_type &impl, const std::string &message)
 bool
 logger_service::is_open_file (impl_type & /*impl*/)
 {
-  return private_->ofstream_.is_open ();
+  return private_->sink_.is_open ();
 }
 
 boost::asio::io_context &
@@ -197,30 +389,124 @@ logger_service::get_io_context ()
 }
 
 void
-logger_service::use_file_impl (const std::string &file)
+logger_service::use_file_impl (const std::string &file,
+                               const log_file_options &options)
 {
-  if (private_->ofstream_.is_open ())
+  if (private_->sink_.is_open ())
     return;
 
-  // private_->ofstream_.rdbuf()->pubsetbuf(0, 0); // unbuffered
-
-  private_->ofstream_.close ();
-  private_->ofstream_.clear ();
+  private_->sink_.open (file, options); // appending
+}
 
-  private_->ofstream_.open (file.c_str ()); // for writing only
+void
+logger_service::on_flush_timer (const boost::system::error_code &err)
+{
+  if (err == boost::asio::error::operation_aborted)
+    return;
 
-  if (!private_->ofstream_)
-    boost::throw_exception (
-        std::runtime_error ("mysqlproxy_service: Failed to open log file!"));
+  private_->flush_armed_ = false;
+  private_->sink_.flush ();
 }
 
 void
-logger_service::log_impl (impl_type & /*impl*/, const std::string &text)
+logger_service::drain ()
 {
-  if (private_->ofstream_.is_open ())
-    private_->ofstream_ << text << std::endl /*flush()*/;
-  else
-    std::cout << text << std::endl /*flush()*/;
+  std::ostringstream os;
+  os.imbue (private_->loc); // set date/time format
+
+  for (;;)
+    {
+      std::size_t count = 0;
+      const log_record *record;
+
+      private_->batch_.clear ();
+      while (count < batch_size && (record = private_->front ()))
+        {
+          // Format the text to be logged.
+          boost::posix_time::ptime pt
+              = boost::date_time::c_local_adjustor<boost::posix_time::ptime>::
+                  utc_to_local (boost::posix_time::from_time_t (0)
+                                + boost::posix_time::microseconds (
+                                    record->micros));
+
+          os.str (std::string ());
+          os << std::dec;
+          os << '[' << pt << ']'; // current local time
+          os << '[' << pt - private_->start_time_ << ']';
+          os << '[' << level_names[record->level] << ']'; // severity level
+          if (*record->identifier)                         // identifier
+            os << '[' << record->identifier << ']' << '\t';
+          else
+            os << '\t';
+
+          if (record->site->function) // call site
+            os << '(' << record->site->function << '@' << '0' << 'x'
+               << std::hex << reinterpret_cast<uintptr_t> (record->caller)
+               << std::dec << ')' << '\t';
+
+          decode (*record, os); // message
+          os << '\n';
+
+          private_->batch_ += os.str ();
+          private_->pop ();
+          ++count;
+        }
+
+      std::size_t dropped
+          = private_->dropped_.exchange (0, boost::memory_order_relaxed);
+      if (dropped)
+        {
+          os.str (std::string ());
+          os << '[' << boost::posix_time::microsec_clock::local_time ()
+             << "][WARNING]\t" << dropped
+             << " log messages dropped, queue full\n";
+          private_->batch_ += os.str ();
+        }
+
+      file_sink &sink = private_->sink_;
+      if (private_->batch_.empty ())
+        ;
+      else if (!sink.is_open ())
+        {
+          std::cout.write (private_->batch_.data (), private_->batch_.size ());
+          std::cout.flush ();
+        }
+      else
+        {
+          // Written once enough is collected or the oldest line waited long
+          // enough, whichever comes first
+          sink.append (private_->batch_.data (), private_->batch_.size ());
+          if (sink.pending () >= sink.options ().flush_bytes)
+            {
+              sink.flush ();
+              if (private_->flush_armed_)
+                {
+                  private_->flush_timer_.cancel ();
+                  private_->flush_armed_ = false;
+                }
+            }
+          else if (!private_->flush_armed_)
+            {
+              private_->flush_armed_ = true;
+              private_->flush_timer_.expires_after (
+                  boost::asio::chrono::milliseconds (
+                      sink.options ().flush_interval));
+              private_->flush_timer_.async_wait (
+                  boost::bind (&logger_service::on_flush_timer, this,
+                               boost::asio::placeholders::error));
+            }
+        }
+
+      if (count == batch_size)
+        continue;
+
+      // Idle: let the next push post again, unless one slipped in between
+      private_->draining_.store (false, boost::memory_order_relaxed);
+      boost::atomic_thread_fence (boost::memory_order_seq_cst);
+      if (!private_->front ()
+          || private_->draining_.exchange (true, boost::memory_order_acquire))
+        return;
+    }
 }
 
 void
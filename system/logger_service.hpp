@@ -2,16 +2,25 @@
 #define MYSQLPROXY_SYSTEM_LOGGER_SERVICE_HPP
 
 #include "config.hpp"
+#include "log_record.hpp"
 
 #include <boost/asio/execution_context.hpp>
+#include <boost/atomic.hpp>
 #include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/ref.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/system/error_code.hpp>
 #include <boost/type_traits/decay.hpp>
 
-#include <fstream>
-#include <sstream> // for CXXLOG_
+#include <sstream> // for CXXCOUT and CXXCERR
+
+// Lowest level compiled in, as a logger_service::severity_level; the
+// CXXLOG_ calls below it are dead code
+#if !defined(MYSQLPROXY_LOG_MIN_LEVEL)
+#  define MYSQLPROXY_LOG_MIN_LEVEL 0
+#endif // !defined(MYSQLPROXY_LOG_MIN_LEVEL)
 
 // _ReturnAddress (MSVC)
 #if defined(_MSC_VER)
@@ -21,6 +30,35 @@
 namespace mysqlproxy_system
 {
 
+// Lowest logger_service::severity_level logged, LEVEL_INFO unless set;
+// may change while running
+extern MYSQLPROXY_SYSTEM_API boost::atomic<int> log_threshold;
+
+/// How a log file is written, see basic_logger::use_file.
+struct log_file_options
+{
+  log_file_options ()
+      : flush_bytes (64 * 1024), flush_interval (100), rotate_bytes (0),
+        rotate_interval (0), compress (false)
+  {
+  }
+
+  // Bytes collected before they are written
+  std::size_t flush_bytes;
+
+  // Milliseconds a message waits at most before it is written
+  std::size_t flush_interval;
+
+  // Size after which the file is rotated, never when 0
+  uint64_t rotate_bytes;
+
+  // Seconds after which the file is rotated, never when 0
+  std::size_t rotate_interval;
+
+  // Gzip the rotated files in the background
+  bool compress;
+};
+
 namespace detail
 {
 class logger_service_impl;
@@ -99,12 +137,20 @@ public:
 
   /// Set the output file for the logger.
   MYSQLPROXY_SYSTEM_API void use_file (impl_type & /*impl*/,
-                                       const std::string &file);
+                                       const std::string &file,
+                                       const log_file_options &options);
 
   /// Log a message.
   MYSQLPROXY_SYSTEM_API void log (impl_type &impl, const std::string &message,
                                   severity_level lv);
 
+  /// Queue a message of the call site for formatting by the background
+  /// thread. Never blocks: when the queue is full the message is dropped and
+  /// counted.
+  MYSQLPROXY_SYSTEM_API void log (impl_type &impl, log_record &record,
+                                  const log_site &site, const void *caller,
+                                  severity_level lv);
+
   /// Output a message to stdout.
   MYSQLPROXY_SYSTEM_API void cout (impl_type &impl,
                                    const std::string &message);
@@ -121,17 +167,30 @@ public:
 private:
   /// Helper function used to open the output file from within the private
   /// io_context's thread.
-  void use_file_impl (const std::string &file);
+  void use_file_impl (const std::string &file,
+                      const log_file_options &options);
 
-  /// Helper function used to log a message from within the private
-  /// io_context's thread.
-  void log_impl (impl_type &impl, const std::string &text);
+  /// Write what the file sink collected, when flush_interval has passed.
+  void on_flush_timer (const boost::system::error_code &err);
+
+  /// Helper function used to format and write the queued messages from
+  /// within the private io_context's thread.
+  void drain ();
   void cout_impl (impl_type &impl, const std::string &text);
   void cerr_impl (impl_type &impl, const std::string &text);
 
   boost::scoped_ptr<detail::logger_service_impl> private_;
 };
 
+/// Checked by CXXLOG_ before the message is encoded.
+inline bool
+log_enabled (logger_service::severity_level lv)
+{
+  return lv >= MYSQLPROXY_LOG_MIN_LEVEL
+         && lv >= mysqlproxy_system::log_threshold.load (
+                boost::memory_order_relaxed);
+}
+
 template <typename Logger>
 void
 __do_log (Logger &l, const std::string &message,
@@ -141,6 +200,14 @@ __do_log (Logger &l, const std::string &message,
   boost::bind (&logger_type::log, boost::ref (l), _1, _2) (message, lv);
 }
 
+template <typename Logger>
+void
+__do_log (Logger &l, log_record &record, const log_site &site,
+          const void *caller, logger_service::severity_level lv)
+{
+  l.log (record, site, caller, lv);
+}
+
 template <typename Logger>
 void
 __do_cout (Logger &l, const std::string &message)
@@ -166,6 +233,15 @@ __do_log (boost::scoped_ptr<Logger> &l, const std::string &message,
   boost::bind (&logger_type::log, boost::ref (l), _1, _2) (message, lv);
 }
 
+template <typename Logger>
+void
+__do_log (boost::scoped_ptr<Logger> &l, log_record &record,
+          const log_site &site, const void *caller,
+          logger_service::severity_level lv)
+{
+  l->log (record, site, caller, lv);
+}
+
 template <typename Logger>
 void
 __do_cout (boost::scoped_ptr<Logger> &l, const std::string &message)
@@ -221,9 +297,10 @@ public:
 
   /// Set the output file.
   void
-  use_file (const std::string &file)
+  use_file (const std::string &file,
+            const log_file_options &options = log_file_options ())
   {
-    service_.use_file (impl_, file);
+    service_.use_file (impl_, file, options);
   }
 
   /// Log a message.
@@ -234,6 +311,14 @@ public:
     service_.log (impl_, message, lv);
   }
 
+  /// Log a message encoded at a call site.
+  void
+  log (detail::log_record &record, const detail::log_site &site,
+       const void *caller, service_type::severity_level lv)
+  {
+    service_.log (impl_, record, site, caller, lv);
+  }
+
   /// Output a message to stdout.
   void
   cout (const std::string &message)
@@ -265,25 +350,53 @@ private:
 } // namespace mysqlproxy_system
 
 #if !defined(_MSC_VER)
-#  define CXXLOG_(x, str_1, lv)                                               \
-    {                                                                         \
-      std::ostringstream os;                                                  \
-      os << '(' << __FUNCTION__ << '@' << '0' << 'x' << std::hex              \
-         << reinterpret_cast<uintptr_t> (__builtin_return_address (0)) << ')' \
-         << '\t' << str_1;                                                    \
-      mysqlproxy_system::detail::__do_log (x, os.str (), lv);                 \
-    }
+#  define CXXLOG_CALLER_ __builtin_return_address (0)
 #else // !defined(_MSC_VER)
-#  define CXXLOG_(x, str_1, lv)                                               \
-    {                                                                         \
-      std::ostringstream os;                                                  \
-      os << '(' << __FUNCTION__ << '@' << '0' << 'x' << std::hex              \
-         << reinterpret_cast<uintptr_t> (_ReturnAddress ()) << ')' << '\t'    \
-         << str_1;                                                            \
-      mysqlproxy_system::detail::__do_log (x, os.str (), lv);                 \
-    }
+#  define CXXLOG_CALLER_ _ReturnAddress ()
 #endif // !defined(_MSC_VER)
 
+// Only the arguments are copied on the calling thread, the logger thread
+// formats them
+#define CXXLOG_WRITE_(x, str_1, lv)                                           \
+  {                                                                           \
+    static const mysqlproxy_system::detail::log_site site_                    \
+        = { __FUNCTION__ };                                                   \
+    mysqlproxy_system::detail::log_record record_;                            \
+    mysqlproxy_system::detail::record_stream os (record_);                    \
+    os << str_1;                                                              \
+    mysqlproxy_system::detail::__do_log (x, record_, site_, CXXLOG_CALLER_,   \
+                                         lv);                                 \
+  }
+
+// Nothing is evaluated for a level that is filtered out
+#define CXXLOG_(x, str_1, lv)                                                 \
+  {                                                                           \
+    if (mysqlproxy_system::detail::log_enabled (lv))                          \
+      CXXLOG_WRITE_ (x, str_1, lv)                                            \
+  }
+
+#define CXXLOG_LEVEL_(level)                                                  \
+  mysqlproxy_system::detail::logger_service::LEVEL_##level
+
+// One call in n of this call site is logged, none when n is 0; level is
+// one of DEBUG, INFO, WARNING, ERROR or CRITICAL
+#define CXXLOG_SAMPLED(x, level, n, str_1)                                    \
+  {                                                                           \
+    static mysqlproxy_system::detail::log_sampler sampler_;                   \
+    if (mysqlproxy_system::detail::log_enabled (CXXLOG_LEVEL_ (level))        \
+        && sampler_.sample (n))                                               \
+      CXXLOG_WRITE_ (x, str_1, CXXLOG_LEVEL_ (level))                         \
+  }
+
+// At most per_second calls of this call site are logged every second
+#define CXXLOG_RATE_LIMITED(x, level, per_second, str_1)                      \
+  {                                                                           \
+    static mysqlproxy_system::detail::log_sampler sampler_;                   \
+    if (mysqlproxy_system::detail::log_enabled (CXXLOG_LEVEL_ (level))        \
+        && sampler_.admit (per_second))                                       \
+      CXXLOG_WRITE_ (x, str_1, CXXLOG_LEVEL_ (level))                         \
+  }
+
 // \r\n added after each string args
 // Helper macro-definitions for i/o output
 #define CXXLOG_INFO(x, str)                                                   \
@@ -0,0 +1,320 @@
+// Print the records of audit log segments (mysqlproxy_tracker --audit-log).
+//
+// Segments are mapped and walked block by block. Blocks whose time range
+// or digest filter rules out the selection are skipped without looking at
+// their records. Damaged blocks are skipped up to the next block header.
+//
+// Usage: mysqlproxy_audit_dump [--from TIME] [--to TIME] [--digest HEX]
+//                              [--stats] segment...
+//
+// TIME is local time as "YYYY-mm-dd HH:MM:SS" or seconds since the epoch.
+
+#include <boost/asio/ip/address.hpp>
+#include <boost/program_options.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "common/audit_log.hpp"
+#include "common/mysql.hpp"
+
+namespace
+{
+
+typedef mysqlproxy_common::audit_log audit_log;
+
+struct selection
+{
+  int64_t from;
+  int64_t to;
+  bool by_digest;
+  uint64_t digest;
+};
+
+struct statistics
+{
+  uint64_t blocks;
+  uint64_t blocks_skipped;
+  uint64_t blocks_damaged;
+  uint64_t records;
+  uint64_t records_printed;
+};
+
+bool
+parse_time (const std::string &text, int64_t &micros)
+{
+  char *end;
+  long long seconds = std::strtoll (text.c_str (), &end, 10);
+  if (!text.empty () && *end == '\0')
+    {
+      micros = int64_t (seconds) * 1000000;
+      return true;
+    }
+
+  struct tm local;
+  std::memset (&local, 0, sizeof (local));
+  const char *rest = ::strptime (text.c_str (), "%Y-%m-%d %H:%M:%S", &local);
+  if (!rest || *rest)
+    return false;
+
+  local.tm_isdst = -1;
+  micros = int64_t (std::mktime (&local)) * 1000000;
+  return true;
+}
+
+const char *
+command_name (uint8_t command)
+{
+  switch (command)
+    {
+    case 0:
+      return "login";
+    case MYSQLPROXY_PROTOCOL_COM_QUIT:
+      return "COM_QUIT";
+    case MYSQLPROXY_PROTOCOL_COM_INIT_DB:
+      return "COM_INIT_DB";
+    case MYSQLPROXY_PROTOCOL_COM_QUERY:
+      return "COM_QUERY";
+    case MYSQLPROXY_PROTOCOL_COM_STATISTICS:
+      return "COM_STATISTICS";
+    case MYSQLPROXY_PROTOCOL_COM_PING:
+      return "COM_PING";
+    case MYSQLPROXY_PROTOCOL_COM_CHANGE_USER:
+      return "COM_CHANGE_USER";
+    case MYSQLPROXY_PROTOCOL_COM_STMT_PREPARE:
+      return "COM_STMT_PREPARE";
+    case 0x17:
+      return "COM_STMT_EXECUTE";
+    case 0x19:
+      return "COM_STMT_CLOSE";
+    case MYSQLPROXY_PROTOCOL_COM_RESET_CONNECTION:
+      return "COM_RESET_CONNECTION";
+    }
+  return 0;
+}
+
+void
+print (const audit_log::record_header &r, const char *text)
+{
+  std::time_t seconds = std::time_t (r.micros / 1000000);
+  struct tm local;
+  ::localtime_r (&seconds, &local);
+  char stamp[32];
+  std::strftime (stamp, sizeof (stamp), "%Y-%m-%d %H:%M:%S", &local);
+
+  boost::asio::ip::address address;
+  if (r.family == 4)
+    {
+      boost::asio::ip::address_v4::bytes_type bytes;
+      std::memcpy (bytes.data (), r.address, bytes.size ());
+      address = boost::asio::ip::address_v4 (bytes);
+    }
+  else
+    {
+      boost::asio::ip::address_v6::bytes_type bytes;
+      std::memcpy (bytes.data (), r.address, bytes.size ());
+      address = boost::asio::ip::address_v6 (bytes);
+    }
+
+  char line[160];
+  std::snprintf (line, sizeof (line), "%s.%06d\t", stamp,
+                 int (r.micros % 1000000));
+  std::cout << line << address << ':' << r.port << '\t';
+
+  if (const char *name = command_name (r.command))
+    std::cout << name;
+  else
+    {
+      std::snprintf (line, sizeof (line), "0x%02x", r.command);
+      std::cout << line;
+    }
+
+  std::cout << '\t' << r.latency << "us\t";
+  if (r.error)
+    std::cout << "ERR " << r.error;
+  else
+    std::cout << "OK";
+  std::snprintf (line, sizeof (line), "\t%llu rows\t%016llx\t",
+                 (unsigned long long)r.rows, (unsigned long long)r.digest);
+  std::cout << line;
+
+  // One record per line
+  for (uint32_t i = 0; i < r.text_length; i++)
+    switch (text[i])
+      {
+      case '\n':
+        std::cout << "\\n";
+        break;
+      case '\t':
+        std::cout << "\\t";
+        break;
+      case '\\':
+        std::cout << "\\\\";
+        break;
+      default:
+        std::cout << text[i];
+        break;
+      }
+  if (r.flags & audit_log::text_truncated)
+    std::cout << "...";
+  std::cout << '\n';
+}
+
+void
+dump_block (const mysqlproxy_common::segment_log::block_header &h,
+            const char *records, const selection &s, statistics &stats)
+{
+  std::size_t offset = 0;
+  const char *p;
+  uint32_t i = 0;
+  for (; mysqlproxy_common::segment_file::record (
+           h, records, offset, p, sizeof (audit_log::record_header));
+       i++)
+    {
+      audit_log::record_header r;
+      std::memcpy (&r, p, sizeof (r));
+      if (r.text_length > r.length - sizeof (r))
+        break;
+
+      ++stats.records;
+      if (r.micros >= s.from && r.micros <= s.to
+          && (!s.by_digest || r.digest == s.digest))
+        {
+          print (r, p + sizeof (r));
+          ++stats.records_printed;
+        }
+    }
+
+  if (i != h.count)
+    ++stats.blocks_damaged;
+}
+
+bool
+dump (const std::string &path, const selection &s, statistics &stats)
+{
+  mysqlproxy_common::segment_file segment;
+  if (!segment.open (path))
+    {
+      std::perror (path.c_str ());
+      return false;
+    }
+
+  const mysqlproxy_common::segment_log::block_header *h;
+  const char *records;
+  while (segment.next (audit_log::magic, audit_log::version, h, records))
+    {
+      ++stats.blocks;
+      if (h->last_micros < s.from || h->first_micros > s.to
+          || (s.by_digest
+              && !mysqlproxy_common::segment_log::may_contain (
+                  h->key_filter, s.digest)))
+        {
+          ++stats.blocks_skipped;
+          continue;
+        }
+
+      dump_block (*h, records, s, stats);
+    }
+
+  stats.blocks_damaged += segment.damaged ();
+  return true;
+}
+
+} // namespace
+
+int
+main (int argc, char *argv[])
+{
+  std::string from, to, digest;
+  std::vector<std::string> segments;
+
+  boost::program_options::options_description desc ("All options");
+  desc.add_options () (
+      "from", boost::program_options::value<std::string> (&from),
+      "Records from this time on") (
+      "to", boost::program_options::value<std::string> (&to),
+      "Records up to this time") (
+      "digest", boost::program_options::value<std::string> (&digest),
+      "Records of this digest, in hexadecimal") (
+      "stats", "Count the blocks and records read and skipped") (
+      "segment",
+      boost::program_options::value<std::vector<std::string> > (&segments),
+      "Audit segment") ("help", "This message");
+
+  boost::program_options::positional_options_description positional;
+  positional.add ("segment", -1);
+
+  boost::program_options::variables_map vm;
+  try
+    {
+      boost::program_options::store (
+          boost::program_options::command_line_parser (argc, argv)
+              .options (desc)
+              .positional (positional)
+              .run (),
+          vm);
+      boost::program_options::notify (vm);
+    }
+  catch (const std::exception &e)
+    {
+      std::cerr << e.what () << "\n";
+      return 1;
+    }
+
+  if (vm.count ("help") || segments.empty ())
+    {
+      std::cout << "Usage: " << argv[0] << " [options] segment...\n"
+                << desc << "\n";
+      return 1;
+    }
+
+  selection s;
+  s.from = std::numeric_limits<int64_t>::min ();
+  s.to = std::numeric_limits<int64_t>::max ();
+  s.by_digest = !digest.empty ();
+  s.digest = 0;
+
+  if ((!from.empty () && !parse_time (from, s.from))
+      || (!to.empty () && !parse_time (to, s.to)))
+    {
+      std::cerr << "Times are \"YYYY-mm-dd HH:MM:SS\" or seconds since the "
+                   "epoch\n";
+      return 1;
+    }
+
+  // Up to the end of the last second
+  if (!to.empty ())
+    s.to += 999999;
+
+  if (s.by_digest)
+    {
+      char *end;
+      s.digest = std::strtoull (digest.c_str (), &end, 16);
+      if (*end)
+        {
+          std::cerr << "Bad digest \"" << digest << "\"\n";
+          return 1;
+        }
+    }
+
+  statistics stats;
+  std::memset (&stats, 0, sizeof (stats));
+
+  int status = 0;
+  for (std::size_t i = 0; i < segments.size (); i++)
+    if (!dump (segments[i], s, stats))
+      status = 1;
+
+  if (vm.count ("stats"))
+    std::cerr << stats.blocks << " blocks, " << stats.blocks_skipped
+              << " skipped, " << stats.blocks_damaged << " damaged; "
+              << stats.records << " records read, " << stats.records_printed
+              << " printed\n";
+
+  return status;
+}
@@ -0,0 +1,589 @@
+// Replay the sessions of a traffic capture (mysqlproxy_tracker --capture).
+//
+// Every captured session logs in as --user, changes to its default
+// database and sends its commands at the captured pace sped up --speed
+// times, or back to back with --speed 0. Sessions run concurrently, each
+// starting at its captured offset. Prepared statement commands are
+// skipped, their statement ids belong to the captured session.
+//
+// Throughput and latency percentiles of the replayed commands are
+// reported at the end.
+//
+// Usage: mysqlproxy_replay --user USER [--password PASSWORD] [--host HOST]
+//                          [--port PORT] [--speed X] [--threads N]
+//                          segment...
+
+#include <boost/asio/coroutine.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/placeholders.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/program_options.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common/digest_stats.hpp"
+#include "common/mysql.hpp"
+#include "common/traffic_capture.hpp"
+#include "tracker/backend.hpp"
+
+namespace
+{
+
+typedef boost::asio::ip::tcp tcp;
+typedef boost::asio::steady_timer::clock_type clock_type;
+typedef mysqlproxy_common::traffic_capture traffic_capture;
+
+struct command
+{
+  int64_t micros;
+  std::string payload;
+};
+
+/// The captured part of one session.
+struct script
+{
+  std::string database;
+  int64_t start;
+  std::vector<command> commands;
+};
+
+/// Counts of all sessions, merged as they finish.
+struct totals
+{
+  totals () : sessions (0), failed (0), sent (0), errors (0), skipped (0)
+  {
+    latency.histogram.assign (mysqlproxy_common::latency_buckets::count, 0);
+  }
+
+  boost::mutex mutex;
+  uint64_t sessions;
+  uint64_t failed;
+  uint64_t sent;
+  uint64_t errors;
+  uint64_t skipped;
+  mysqlproxy_common::digest_summary latency;
+};
+
+/// Collect the records of a segment by session and index.
+bool
+load (const std::string &path,
+      std::map<uint64_t, std::map<uint32_t, const char *> > &records,
+      std::vector<boost::shared_ptr<mysqlproxy_common::segment_file> >
+          &segments)
+{
+  boost::shared_ptr<mysqlproxy_common::segment_file> segment (
+      new mysqlproxy_common::segment_file ());
+  if (!segment->open (path))
+    {
+      std::perror (path.c_str ());
+      return false;
+    }
+  segments.push_back (segment);
+
+  const mysqlproxy_common::segment_log::block_header *h;
+  const char *data;
+  while (segment->next (traffic_capture::magic, traffic_capture::version, h,
+                        data))
+    {
+      std::size_t offset = 0;
+      const char *p;
+      while (mysqlproxy_common::segment_file::record (
+          *h, data, offset, p, sizeof (traffic_capture::record_header)))
+        {
+          traffic_capture::record_header r;
+          std::memcpy (&r, p, sizeof (r));
+          if (r.payload_length <= r.length - sizeof (r))
+            records[r.session][r.index] = p;
+        }
+    }
+
+  if (segment->damaged ())
+    std::cerr << path << ": " << segment->damaged ()
+              << " damaged blocks skipped\n";
+  return true;
+}
+
+/// Order the records of each session into its script.
+void
+assemble (const std::map<uint64_t, std::map<uint32_t, const char *> > &records,
+          std::vector<script> &scripts, int64_t &origin)
+{
+  typedef std::map<uint64_t, std::map<uint32_t, const char *> > by_session;
+
+  for (by_session::const_iterator s = records.begin (); s != records.end ();
+       ++s)
+    {
+      script sc;
+      sc.start = 0;
+      bool started = false;
+
+      for (std::map<uint32_t, const char *>::const_iterator i
+           = s->second.begin ();
+           i != s->second.end (); ++i)
+        {
+          traffic_capture::record_header r;
+          std::memcpy (&r, i->second, sizeof (r));
+          const char *payload = i->second + sizeof (r);
+
+          if (!started)
+            {
+              sc.start = r.micros;
+              started = true;
+            }
+
+          if (r.kind == traffic_capture::session_open)
+            {
+              const char *end = static_cast<const char *> (
+                  std::memchr (payload, '\0', r.payload_length));
+              if (end)
+                sc.database.assign (end + 1,
+                                    payload + r.payload_length - end - 1);
+            }
+          else if (r.kind == traffic_capture::command && r.payload_length)
+            {
+              command c;
+              c.micros = r.micros;
+              c.payload.assign (payload, r.payload_length);
+              sc.commands.push_back (c);
+            }
+        }
+
+      if (sc.commands.empty ())
+        continue;
+
+      if (scripts.empty () || sc.start < origin)
+        origin = sc.start;
+      scripts.push_back (sc);
+    }
+}
+
+/// Commands whose replay cannot mean the same as their capture.
+bool
+skipped (uint8_t command)
+{
+  switch (command)
+    {
+    case MYSQLPROXY_PROTOCOL_COM_CHANGE_USER:
+    case MYSQLPROXY_PROTOCOL_COM_STMT_PREPARE:
+    case 0x17: // COM_STMT_EXECUTE
+    case 0x18: // COM_STMT_SEND_LONG_DATA
+    case 0x19: // COM_STMT_CLOSE
+    case 0x1a: // COM_STMT_RESET
+    case 0x1c: // COM_STMT_FETCH
+    case 0x12: // COM_BINLOG_DUMP
+    case 0x1e: // COM_BINLOG_DUMP_GTID
+      return true;
+    }
+  return false;
+}
+
+/// One captured session played against the target.
+class replayer : public boost::enable_shared_from_this<replayer>,
+                 private boost::noncopyable
+{
+public:
+  replayer (boost::asio::io_context &io_context, const tcp::endpoint &target,
+            const script &s, clock_type::time_point start, int64_t origin,
+            double speed, totals &result)
+      : io_context_ (io_context), target_ (target), script_ (s),
+        start_ (start), origin_ (origin), speed_ (speed), result_ (result),
+        timer_ (io_context), next_ (0), command_ (0), sequence_id_ (0),
+        response_state_ (response_first), local_infile_ (false),
+        done_ (false), sent_ (0), errors_ (0), skipped_ (0),
+        histogram_ (mysqlproxy_common::latency_buckets::count, 0)
+  {
+  }
+
+  void
+  start ()
+  {
+    step (boost::system::error_code ());
+  }
+
+private:
+  enum response_state
+  {
+    response_first,
+    response_columns,
+    response_rows
+  };
+
+  // When a command captured at micros is due
+  clock_type::time_point
+  due (int64_t micros) const
+  {
+    if (speed_ <= 0)
+      return start_;
+    return start_
+           + boost::asio::chrono::microseconds (
+               int64_t (double (micros - origin_) / speed_));
+  }
+
+  void
+  step (const boost::system::error_code &err)
+  {
+    if (err)
+      {
+        finish (false);
+        return;
+      }
+
+    BOOST_ASIO_CORO_REENTER (coro_)
+    {
+      timer_.expires_at (due (script_.start));
+      BOOST_ASIO_CORO_YIELD timer_.async_wait (
+          boost::bind (&replayer::step, shared_from_this (),
+                       boost::asio::placeholders::error));
+
+      session_.reset (
+          new mysqlproxy_tracker::server::backend (io_context_, target_));
+      BOOST_ASIO_CORO_YIELD session_->async_open (
+          boost::bind (&replayer::step, shared_from_this (),
+                       boost::asio::placeholders::error));
+
+      if (!script_.database.empty ())
+        {
+          command_ = MYSQLPROXY_PROTOCOL_COM_INIT_DB;
+          out_.assign (1, char (command_));
+          out_ += script_.database;
+          sequence_id_ = 0xff;
+          BOOST_ASIO_CORO_YIELD write_packet ();
+          for (done_ = false; !done_;)
+            {
+              BOOST_ASIO_CORO_YIELD read_header ();
+              BOOST_ASIO_CORO_YIELD read_payload ();
+              done_ = end_of_response ();
+            }
+        }
+
+      for (next_ = 0; next_ < script_.commands.size (); ++next_)
+        {
+          command_ = uint8_t (script_.commands[next_].payload[0]);
+          if (command_ == MYSQLPROXY_PROTOCOL_COM_QUIT)
+            break;
+
+          if (skipped (command_))
+            {
+              ++skipped_;
+              continue;
+            }
+
+          timer_.expires_at (due (script_.commands[next_].micros));
+          BOOST_ASIO_CORO_YIELD timer_.async_wait (
+              boost::bind (&replayer::step, shared_from_this (),
+                           boost::asio::placeholders::error));
+
+          out_ = script_.commands[next_].payload;
+          sequence_id_ = 0xff;
+          sent_at_ = clock_type::now ();
+          BOOST_ASIO_CORO_YIELD write_packet ();
+
+          response_state_ = response_first;
+          for (done_ = false; !done_;)
+            {
+              BOOST_ASIO_CORO_YIELD read_header ();
+              BOOST_ASIO_CORO_YIELD read_payload ();
+              done_ = end_of_response ();
+
+              if (local_infile_)
+                {
+                  // No file to send, the empty packet ends the stream
+                  local_infile_ = false;
+                  out_.clear ();
+                  BOOST_ASIO_CORO_YIELD write_packet ();
+                }
+            }
+
+          ++sent_;
+          histogram_[mysqlproxy_common::latency_buckets::index (
+              boost::asio::chrono::duration_cast<
+                  boost::asio::chrono::microseconds> (clock_type::now ()
+                                                      - sent_at_)
+                  .count ())]++;
+        }
+
+      finish (true);
+    }
+  }
+
+  void
+  write_packet ()
+  {
+    std::string packet;
+    mysqlproxy_common::protocol::build_packet (++sequence_id_, out_, packet);
+    out_.swap (packet);
+
+    boost::asio::async_write (
+        session_->socket (), boost::asio::buffer (out_),
+        boost::bind (&replayer::step, shared_from_this (),
+                     boost::asio::placeholders::error));
+  }
+
+  void
+  read_header ()
+  {
+    boost::asio::async_read (
+        session_->socket (), boost::asio::buffer (header_),
+        boost::bind (&replayer::step, shared_from_this (),
+                     boost::asio::placeholders::error));
+  }
+
+  void
+  read_payload ()
+  {
+    const mysqlproxy_common::protocol::prefix *header
+        = reinterpret_cast<const mysqlproxy_common::protocol::prefix *> (
+            header_);
+    sequence_id_ = uint8_t (header->sequence_id);
+    payload_.resize (header->payload_length);
+
+    boost::asio::async_read (
+        session_->socket (), boost::asio::buffer (payload_),
+        boost::bind (&replayer::step, shared_from_this (),
+                     boost::asio::placeholders::error));
+  }
+
+  // Follow the response to command_, true at its last packet
+  bool
+  end_of_response ()
+  {
+    if (payload_.empty ())
+      return true;
+
+    uint8_t first = payload_[0];
+    if (first == MYSQLPROXY_PROTOCOL_ERR_PACKET)
+      {
+        ++errors_;
+        return true;
+      }
+
+    if (command_ != MYSQLPROXY_PROTOCOL_COM_QUERY)
+      return true;
+
+    bool eof = first == MYSQLPROXY_PROTOCOL_EOF_PACKET && payload_.size () < 9;
+
+    switch (response_state_)
+      {
+      case response_first:
+        if (first == 0xfb)
+          {
+            local_infile_ = true;
+            return false;
+          }
+        if (first != MYSQLPROXY_PROTOCOL_OK_PACKET)
+          {
+            response_state_ = response_columns;
+            return false;
+          }
+        break;
+
+      case response_columns:
+        if (eof)
+          response_state_ = response_rows;
+        return false;
+
+      case response_rows:
+        if (!eof)
+          return false;
+        response_state_ = response_first;
+        break;
+      }
+
+    mysqlproxy_common::protocol::ok_packet ok;
+    if (!mysqlproxy_common::protocol::parse_ok (&payload_[0],
+                                                payload_.size (), ok))
+      return true;
+    return !(ok.status & MYSQLPROXY_SERVER_MORE_RESULTS_EXISTS);
+  }
+
+  void
+  finish (bool completed)
+  {
+    if (session_)
+      session_->close ();
+
+    boost::lock_guard<boost::mutex> lock (result_.mutex);
+    ++result_.sessions;
+    if (!completed)
+      ++result_.failed;
+    result_.sent += sent_;
+    result_.errors += errors_;
+    result_.skipped += skipped_;
+    for (std::size_t i = 0; i < histogram_.size (); i++)
+      result_.latency.histogram[i] += histogram_[i];
+  }
+
+  boost::asio::io_context &io_context_;
+  tcp::endpoint target_;
+  const script &script_;
+  clock_type::time_point start_;
+  int64_t origin_;
+  double speed_;
+  totals &result_;
+
+  boost::asio::coroutine coro_;
+  boost::asio::steady_timer timer_;
+  mysqlproxy_tracker::server::backend_ptr session_;
+
+  std::size_t next_;
+  uint8_t command_;
+  uint8_t header_[sizeof (mysqlproxy_common::protocol::prefix)];
+  std::vector<uint8_t> payload_;
+  std::string out_;
+  uint8_t sequence_id_;
+  response_state response_state_;
+  bool local_infile_;
+  bool done_;
+  clock_type::time_point sent_at_;
+
+  uint64_t sent_;
+  uint64_t errors_;
+  uint64_t skipped_;
+  std::vector<uint64_t> histogram_;
+};
+
+} // namespace
+
+int
+main (int argc, char *argv[])
+{
+  std::string host = "127.0.0.1", port = "3306";
+  double speed = 1;
+  std::size_t threads = 1;
+  std::vector<std::string> segments;
+
+  boost::program_options::options_description desc ("All options");
+  desc.add_options () (
+      "host", boost::program_options::value<std::string> (&host)
+                  ->default_value (host),
+      "Address of the proxy") (
+      "port", boost::program_options::value<std::string> (&port)
+                  ->default_value (port),
+      "Port of the proxy") (
+      "user",
+      boost::program_options::value<std::string> (
+          &mysqlproxy_tracker::server::backend_user)
+          ->required (),
+      "User of every session") (
+      "password",
+      boost::program_options::value<std::string> (
+          &mysqlproxy_tracker::server::backend_password),
+      "Password of the user") (
+      "speed",
+      boost::program_options::value<double> (&speed)->default_value (speed),
+      "Times faster than captured, 0 for back to back commands") (
+      "threads",
+      boost::program_options::value<std::size_t> (&threads)
+          ->default_value (threads),
+      "Threads running the sessions") (
+      "segment",
+      boost::program_options::value<std::vector<std::string> > (&segments),
+      "Capture segment") ("help", "This message");
+
+  boost::program_options::positional_options_description positional;
+  positional.add ("segment", -1);
+
+  boost::program_options::variables_map vm;
+  try
+    {
+      boost::program_options::store (
+          boost::program_options::command_line_parser (argc, argv)
+              .options (desc)
+              .positional (positional)
+              .run (),
+          vm);
+      if (vm.count ("help") || !vm.count ("segment"))
+        {
+          std::cout << "Usage: " << argv[0] << " [options] segment...\n"
+                    << desc << "\n";
+          return 1;
+        }
+      boost::program_options::notify (vm);
+    }
+  catch (const std::exception &e)
+    {
+      std::cerr << e.what () << "\n";
+      return 1;
+    }
+
+  // The segments stay mapped until the scripts are assembled
+  std::vector<boost::shared_ptr<mysqlproxy_common::segment_file> > mapped;
+  std::map<uint64_t, std::map<uint32_t, const char *> > records;
+  for (std::size_t i = 0; i < segments.size (); i++)
+    if (!load (segments[i], records, mapped))
+      return 1;
+
+  std::vector<script> scripts;
+  int64_t origin = 0;
+  assemble (records, scripts, origin);
+  records.clear ();
+  mapped.clear ();
+
+  if (scripts.empty ())
+    {
+      std::cerr << "No captured commands\n";
+      return 1;
+    }
+
+  boost::asio::io_context io_context;
+  tcp::resolver resolver (io_context);
+  tcp::endpoint target;
+  try
+    {
+      target = *resolver.resolve (host, port).begin ();
+    }
+  catch (const std::exception &e)
+    {
+      std::cerr << host << ":" << port << ": " << e.what () << "\n";
+      return 1;
+    }
+
+  totals result;
+  clock_type::time_point start = clock_type::now ();
+  for (std::size_t i = 0; i < scripts.size (); i++)
+    boost::shared_ptr<replayer> (new replayer (io_context, target,
+                                               scripts[i], start, origin,
+                                               speed, result))
+        ->start ();
+
+  boost::thread_group group;
+  for (std::size_t i = 1; i < threads; i++)
+    group.create_thread (
+        boost::bind (&boost::asio::io_context::run, &io_context));
+  io_context.run ();
+  group.join_all ();
+
+  double seconds = double (boost::asio::chrono::duration_cast<
+                               boost::asio::chrono::microseconds> (
+                               clock_type::now () - start)
+                               .count ())
+                   / 1e6;
+
+  std::cout << result.sessions << " sessions, " << result.failed
+            << " failed; " << result.sent << " commands, " << result.errors
+            << " errors, " << result.skipped << " skipped in " << std::fixed
+            << std::setprecision (2) << seconds << " s, "
+            << std::setprecision (0) << result.sent / seconds
+            << " commands/s\n"
+            << "latency p50 " << result.latency.percentile (0.5) << "us p90 "
+            << result.latency.percentile (0.9) << "us p99 "
+            << result.latency.percentile (0.99) << "us p999 "
+            << result.latency.percentile (0.999) << "us" << std::endl;
+
+  return result.failed ? 1 : 0;
+}
@@ -0,0 +1,495 @@
+#include "backend.hpp"
+
+#include <boost/asio/placeholders.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/bind/bind.hpp>
+
+#include "common/auth.hpp"
+
+namespace mysqlproxy_tracker
+{
+namespace server
+{
+
+std::string backend_user;
+std::string backend_password;
+std::string backend_database;
+
+namespace
+{
+boost::system::error_code
+make_error (boost::system::errc::errc_t e)
+{
+  return boost::system::errc::make_error_code (e);
+}
+} // namespace
+
+backend::backend (boost::asio::io_context &io_context,
+                  const boost::asio::ip::tcp::endpoint &endpoint)
+    : socket_ (io_context), endpoint_ (endpoint), greeting_ (),
+      capabilities_ (0), sequence_id_ (0), step_ (0), done_ (false),
+      reset_supported_ (true), schema_changed_ (false), history_ (),
+      tainted_ (false), last_used_ (clock_type::now ())
+{
+}
+
+boost::asio::ip::tcp::socket &
+backend::socket ()
+{
+  return socket_;
+}
+
+const boost::asio::ip::tcp::endpoint &
+backend::endpoint () const
+{
+  return endpoint_;
+}
+
+void
+backend::async_open (const handler_type &handler)
+{
+  handler_ = handler;
+  coro_ = boost::asio::coroutine ();
+  history_.clear ();
+  tainted_ = false;
+  do_open (boost::system::error_code ());
+}
+
+void
+backend::async_reset (const handler_type &handler)
+{
+  handler_ = handler;
+  coro_ = boost::asio::coroutine ();
+  history_.clear ();
+  tainted_ = false;
+  do_reset (boost::system::error_code ());
+}
+
+void
+backend::async_ping (const handler_type &handler)
+{
+  handler_ = handler;
+  coro_ = boost::asio::coroutine ();
+  do_ping (boost::system::error_code ());
+}
+
+void
+backend::close ()
+{
+  boost::system::error_code ignored_ec;
+  socket_.close (ignored_ec);
+}
+
+const mysqlproxy_common::protocol::handshake &
+backend::greeting () const
+{
+  return greeting_;
+}
+
+uint32_t
+backend::capabilities () const
+{
+  return capabilities_;
+}
+
+const std::string &
+backend::last_error () const
+{
+  return last_error_;
+}
+
+void
+backend::schema_changed ()
+{
+  schema_changed_ = true;
+}
+
+const std::vector<std::string> &
+backend::history () const
+{
+  return history_;
+}
+
+void
+backend::applied (const std::string &command)
+{
+  // Running the same command twice in a row leaves the state unchanged
+  if (history_.empty () || history_.back () != command)
+    history_.push_back (command);
+}
+
+void
+backend::taint ()
+{
+  tainted_ = true;
+}
+
+bool
+backend::tainted () const
+{
+  return tainted_;
+}
+
+backend::clock_type::time_point
+backend::last_used () const
+{
+  return last_used_;
+}
+
+void
+backend::touch ()
+{
+  last_used_ = clock_type::now ();
+}
+
+void
+backend::do_open (const boost::system::error_code &err)
+{
+  namespace protocol = mysqlproxy_common::protocol;
+
+  if (err)
+    {
+      last_error_ = err.message ();
+      finish (err);
+      return;
+    }
+
+  BOOST_ASIO_CORO_REENTER (coro_)
+  {
+    step_ = &backend::do_open;
+    BOOST_ASIO_CORO_YIELD socket_.async_connect (
+        endpoint_, boost::bind (&backend::on_io, shared_from_this (),
+                                boost::asio::placeholders::error));
+
+    {
+      // A reset right after connect fails the next read instead
+      boost::system::error_code ignored_ec;
+      socket_.set_option (boost::asio::ip::tcp::no_delay (true), ignored_ec);
+    }
+
+    BOOST_ASIO_CORO_YIELD read_packet (&backend::do_open);
+
+    if (!protocol::parse_handshake (payload_.data (), payload_.size (),
+                                    greeting_))
+      {
+        uint16_t code;
+        if (!protocol::parse_err (payload_.data (), payload_.size (), code,
+                                  last_error_))
+          last_error_ = "malformed server greeting";
+        finish (make_error (boost::system::errc::protocol_error));
+        return;
+      }
+
+    {
+      protocol::handshake_response resp;
+      resp.capabilities = greeting_.capabilities & capabilities_mask;
+      if (backend_database.empty ())
+        resp.capabilities &= ~MYSQLPROXY_CLIENT_CONNECT_WITH_DB;
+      resp.max_packet_size = 0x1000000;
+      resp.charset = greeting_.charset;
+      resp.user = backend_user;
+      resp.database = backend_database;
+      resp.auth_plugin = greeting_.auth_plugin.empty ()
+                             ? MYSQLPROXY_AUTH_NATIVE_PASSWORD
+                             : greeting_.auth_plugin;
+
+      capabilities_ = resp.capabilities;
+      plugin_ = resp.auth_plugin;
+      scramble_ = greeting_.scramble;
+
+      if (!mysqlproxy_common::auth::scramble_password (
+              plugin_, backend_password, scramble_, resp.auth_response))
+        resp.auth_response.clear (); // expect an auth switch
+
+      out_.clear ();
+      protocol::build_handshake_response (resp, out_);
+    }
+
+    BOOST_ASIO_CORO_YIELD write_packet (out_, &backend::do_open);
+
+    for (done_ = false; !done_;)
+      {
+        BOOST_ASIO_CORO_YIELD read_packet (&backend::do_open);
+
+        {
+          boost::system::error_code ec = on_auth_packet ();
+          if (ec)
+            {
+              finish (ec);
+              return;
+            }
+        }
+
+        if (!done_ && !out_.empty ())
+          {
+            BOOST_ASIO_CORO_YIELD write_packet (out_, &backend::do_open);
+          }
+      }
+
+    finish (boost::system::error_code ());
+  }
+}
+
+void
+backend::do_reset (const boost::system::error_code &err)
+{
+  namespace protocol = mysqlproxy_common::protocol;
+
+  if (err)
+    {
+      last_error_ = err.message ();
+      finish (err);
+      return;
+    }
+
+  BOOST_ASIO_CORO_REENTER (coro_)
+  {
+    if (reset_supported_ && !schema_changed_)
+      {
+        sequence_id_ = 0xff;
+        BOOST_ASIO_CORO_YIELD write_packet (
+            std::string (1, char (MYSQLPROXY_PROTOCOL_COM_RESET_CONNECTION)),
+            &backend::do_reset);
+
+        BOOST_ASIO_CORO_YIELD read_packet (&backend::do_reset);
+
+        if (!payload_.empty ()
+            && payload_[0] == MYSQLPROXY_PROTOCOL_OK_PACKET)
+          {
+            finish (boost::system::error_code ());
+            return;
+          }
+
+        if (payload_.empty ()
+            || payload_[0] != MYSQLPROXY_PROTOCOL_ERR_PACKET)
+          {
+            last_error_ = "unexpected reply to COM_RESET_CONNECTION";
+            finish (make_error (boost::system::errc::protocol_error));
+            return;
+          }
+
+        // Server older than 5.7.3, log in again instead
+        reset_supported_ = false;
+      }
+
+    {
+      std::string token;
+      mysqlproxy_common::auth::scramble_password (plugin_, backend_password,
+                                                  scramble_, token);
+
+      protocol::payload_writer w (out_);
+      out_.clear ();
+      w.write_u8 (MYSQLPROXY_PROTOCOL_COM_CHANGE_USER);
+      w.write_null_string (backend_user);
+      w.write_u8 (uint8_t (token.size ()));
+      w.write_bytes (token);
+      w.write_null_string (backend_database);
+      w.write_u16 (greeting_.charset);
+      w.write_null_string (plugin_);
+    }
+
+    sequence_id_ = 0xff;
+    BOOST_ASIO_CORO_YIELD write_packet (out_, &backend::do_reset);
+
+    for (done_ = false; !done_;)
+      {
+        BOOST_ASIO_CORO_YIELD read_packet (&backend::do_reset);
+
+        {
+          boost::system::error_code ec = on_auth_packet ();
+          if (ec)
+            {
+              finish (ec);
+              return;
+            }
+        }
+
+        if (!done_ && !out_.empty ())
+          {
+            BOOST_ASIO_CORO_YIELD write_packet (out_, &backend::do_reset);
+          }
+      }
+
+    schema_changed_ = false;
+    finish (boost::system::error_code ());
+  }
+}
+
+void
+backend::do_ping (const boost::system::error_code &err)
+{
+  if (err)
+    {
+      last_error_ = err.message ();
+      finish (err);
+      return;
+    }
+
+  BOOST_ASIO_CORO_REENTER (coro_)
+  {
+    sequence_id_ = 0xff;
+    BOOST_ASIO_CORO_YIELD write_packet (
+        std::string (1, char (MYSQLPROXY_PROTOCOL_COM_PING)),
+        &backend::do_ping);
+
+    BOOST_ASIO_CORO_YIELD read_packet (&backend::do_ping);
+
+    if (payload_.empty () || payload_[0] != MYSQLPROXY_PROTOCOL_OK_PACKET)
+      {
+        last_error_ = "unexpected reply to COM_PING";
+        finish (make_error (boost::system::errc::protocol_error));
+        return;
+      }
+
+    finish (boost::system::error_code ());
+  }
+}
+
+boost::system::error_code
+backend::on_auth_packet ()
+{
+  namespace protocol = mysqlproxy_common::protocol;
+  namespace auth = mysqlproxy_common::auth;
+
+  out_.clear ();
+
+  if (payload_.empty ())
+    {
+      last_error_ = "empty authentication packet";
+      return make_error (boost::system::errc::protocol_error);
+    }
+
+  protocol::payload_reader r (payload_.data (), payload_.size ());
+  r.skip (1);
+
+  switch (payload_[0])
+    {
+    case MYSQLPROXY_PROTOCOL_OK_PACKET:
+      done_ = true;
+      return boost::system::error_code ();
+
+    case MYSQLPROXY_PROTOCOL_ERR_PACKET:
+      {
+        uint16_t code;
+        protocol::parse_err (payload_.data (), payload_.size (), code,
+                             last_error_);
+        return make_error (boost::system::errc::permission_denied);
+      }
+
+    case MYSQLPROXY_PROTOCOL_AUTH_SWITCH_PACKET:
+      r.read_null_string (plugin_);
+      r.read_rest (scramble_);
+      if (!scramble_.empty () && scramble_[scramble_.size () - 1] == '\0')
+        scramble_.erase (scramble_.size () - 1);
+
+      if (!auth::scramble_password (plugin_, backend_password, scramble_,
+                                    out_))
+        {
+          last_error_ = "unsupported authentication plugin " + plugin_;
+          return make_error (boost::system::errc::protocol_not_supported);
+        }
+
+      // An empty token still has to be sent
+      if (out_.empty ())
+        out_.push_back ('\0');
+      return boost::system::error_code ();
+
+    case MYSQLPROXY_PROTOCOL_AUTH_MORE_DATA_PACKET:
+      if (plugin_ != MYSQLPROXY_AUTH_CACHING_SHA2_PASSWORD)
+        break;
+
+      if (payload_.size () == 2
+          && payload_[1] == MYSQLPROXY_AUTH_SHA2_FAST_AUTH_SUCCESS)
+        return boost::system::error_code (); // OK follows
+
+      if (payload_.size () == 2
+          && payload_[1] == MYSQLPROXY_AUTH_SHA2_PERFORM_FULL_AUTH)
+        {
+          out_.push_back (char (MYSQLPROXY_AUTH_SHA2_REQUEST_PUBLIC_KEY));
+          return boost::system::error_code ();
+        }
+
+      {
+        std::string key;
+        r.read_rest (key);
+        if (!auth::encrypt_password (key, backend_password, scramble_, out_))
+          {
+            last_error_ = "cannot encrypt password with the server key";
+            return make_error (boost::system::errc::protocol_error);
+          }
+      }
+      return boost::system::error_code ();
+    }
+
+  last_error_ = "unexpected authentication packet";
+  return make_error (boost::system::errc::protocol_error);
+}
+
+void
+backend::read_packet (step_type step)
+{
+  step_ = step;
+
+  boost::asio::async_read (
+      socket_, boost::asio::buffer (header_),
+      boost::bind (&backend::on_read_header, shared_from_this (),
+                   boost::asio::placeholders::error));
+}
+
+void
+backend::on_read_header (const boost::system::error_code &err)
+{
+  if (err)
+    {
+      (this->*step_) (err);
+      return;
+    }
+
+  const mysqlproxy_common::protocol::prefix *header
+      = reinterpret_cast<const mysqlproxy_common::protocol::prefix *> (
+          header_.data ());
+
+  sequence_id_ = uint8_t (header->sequence_id);
+  payload_.resize (header->payload_length);
+
+  boost::asio::async_read (socket_, boost::asio::buffer (payload_),
+                           boost::bind (&backend::on_io, shared_from_this (),
+                                        boost::asio::placeholders::error));
+}
+
+void
+backend::write_packet (const std::string &payload, step_type step)
+{
+  step_ = step;
+
+  std::string packet;
+  mysqlproxy_common::protocol::build_packet (uint8_t (sequence_id_ + 1),
+                                             payload, packet);
+  out_.swap (packet);
+  ++sequence_id_;
+
+  boost::asio::async_write (
+      socket_, boost::asio::buffer (out_),
+      boost::bind (&backend::on_io, shared_from_this (),
+                   boost::asio::placeholders::error));
+}
+
+void
+backend::on_io (const boost::system::error_code &err)
+{
+  (this->*step_) (err);
+}
+
+void
+backend::finish (const boost::system::error_code &err)
+{
+  touch ();
+
+  handler_type handler;
+  handler.swap (handler_);
+  handler (err);
+}
+
+} // namespace server
+} // namespace mysqlproxy_tracker
@@ -0,0 +1,145 @@
+#ifndef MYSQLPROXY_TRACKER_BACKEND_HPP
+#define MYSQLPROXY_TRACKER_BACKEND_HPP
+
+#include <boost/array.hpp>
+#include <boost/asio/coroutine.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <string>
+#include <vector>
+
+#include "common/mysql.hpp"
+
+namespace mysqlproxy_tracker
+{
+namespace server
+{
+
+// Credentials of the pooled server sessions, also required from clients
+extern std::string backend_user;
+extern std::string backend_password;
+extern std::string backend_database;
+
+/// A server session opened and authenticated by the proxy itself.
+class backend : public boost::enable_shared_from_this<backend>,
+                private boost::noncopyable
+{
+public:
+  typedef boost::function<void (const boost::system::error_code &)>
+      handler_type;
+
+  typedef boost::asio::steady_timer::clock_type clock_type;
+
+  // Capabilities requested from the server and offered to clients
+  static const uint32_t capabilities_mask
+      = MYSQLPROXY_CLIENT_LONG_PASSWORD | MYSQLPROXY_CLIENT_LONG_FLAG
+        | MYSQLPROXY_CLIENT_CONNECT_WITH_DB | MYSQLPROXY_CLIENT_PROTOCOL_41
+        | MYSQLPROXY_CLIENT_TRANSACTIONS
+        | MYSQLPROXY_CLIENT_SECURE_CONNECTION
+        | MYSQLPROXY_CLIENT_MULTI_STATEMENTS
+        | MYSQLPROXY_CLIENT_MULTI_RESULTS | MYSQLPROXY_CLIENT_PS_MULTI_RESULTS
+        | MYSQLPROXY_CLIENT_PLUGIN_AUTH
+        | MYSQLPROXY_CLIENT_PLUGIN_AUTH_LENENC_CLIENT_DATA;
+
+  backend (boost::asio::io_context &io_context,
+           const boost::asio::ip::tcp::endpoint &endpoint);
+
+  boost::asio::ip::tcp::socket &socket ();
+
+  const boost::asio::ip::tcp::endpoint &endpoint () const;
+
+  /// Connect and log in as backend_user.
+  void async_open (const handler_type &handler);
+
+  /// Bring a logged in session back to its initial state.
+  /**
+   * Uses COM_RESET_CONNECTION, or COM_CHANGE_USER when the server does not
+   * support it or the default database has to be restored.
+   */
+  void async_reset (const handler_type &handler);
+
+  /// Check that an idle session is still open with COM_PING.
+  void async_ping (const handler_type &handler);
+
+  void close ();
+
+  /// Greeting received from the server.
+  const mysqlproxy_common::protocol::handshake &greeting () const;
+
+  /// Capabilities negotiated with the server.
+  uint32_t capabilities () const;
+
+  /// Server message of the last failed operation.
+  const std::string &last_error () const;
+
+  /// Mark the default database as changed by a client.
+  void schema_changed ();
+
+  /// SET and USE commands run since the session was opened or reset.
+  const std::vector<std::string> &history () const;
+  void applied (const std::string &command);
+
+  /// The session holds state its history does not describe, it is reset
+  /// before going back to the pool.
+  void taint ();
+  bool tainted () const;
+
+  /// Time of the last open, reset or check-in.
+  clock_type::time_point last_used () const;
+  void touch ();
+
+private:
+  typedef void (backend::*step_type) (const boost::system::error_code &);
+
+  void do_open (const boost::system::error_code &err);
+  void do_reset (const boost::system::error_code &err);
+  void do_ping (const boost::system::error_code &err);
+
+  // Packet helpers, complete with the current step
+  void read_packet (step_type step);
+  void write_packet (const std::string &payload, step_type step);
+  void on_read_header (const boost::system::error_code &err);
+  void on_io (const boost::system::error_code &err);
+
+  // Handle one packet of the authentication exchange, set done_ at OK
+  boost::system::error_code on_auth_packet ();
+
+  void finish (const boost::system::error_code &err);
+
+  boost::asio::ip::tcp::socket socket_;
+  boost::asio::ip::tcp::endpoint endpoint_;
+
+  mysqlproxy_common::protocol::handshake greeting_;
+  uint32_t capabilities_;
+  std::string plugin_;
+  std::string scramble_;
+
+  boost::array<uint8_t, sizeof (mysqlproxy_common::protocol::prefix)>
+      header_;
+  std::vector<uint8_t> payload_;
+  std::string out_;
+  uint8_t sequence_id_;
+
+  boost::asio::coroutine coro_;
+  step_type step_;
+  handler_type handler_;
+  bool done_;
+
+  bool reset_supported_;
+  bool schema_changed_;
+  std::vector<std::string> history_;
+  bool tainted_;
+  std::string last_error_;
+  clock_type::time_point last_used_;
+};
+
+typedef boost::shared_ptr<backend> backend_ptr;
+
+} // namespace server
+} // namespace mysqlproxy_tracker
+
+#endif // MYSQLPROXY_TRACKER_BACKEND_HPP
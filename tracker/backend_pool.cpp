@@ -0,0 +1,262 @@
+#include "backend_pool.hpp"
+
+#include <boost/asio/placeholders.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/thread/locks.hpp>
+
+#include "common/metrics.hpp"
+
+namespace mysqlproxy_tracker
+{
+namespace server
+{
+
+std::size_t pool_min_size = 4;
+std::size_t pool_max_size = 64;
+std::size_t pool_idle_timeout = 60;
+std::size_t pool_ping_interval = 30;
+
+namespace
+{
+typedef mysqlproxy_common::metrics metrics;
+} // namespace
+
+backend_pool::backend_pool (boost::asio::io_context &io_context,
+                            const boost::asio::ip::tcp::endpoint &endpoint,
+                            mysqlproxy_system::basic_logger &writer)
+    : io_context_ (io_context), endpoint_ (endpoint), writer_ (writer),
+      timer_ (io_context), size_ (0), greeting_ ()
+{
+}
+
+void
+backend_pool::start ()
+{
+  {
+    boost::lock_guard<boost::mutex> lock (mutex_);
+    while (size_ < pool_min_size)
+      open_locked ();
+  }
+
+  timer_.expires_after (boost::asio::chrono::seconds (1));
+  timer_.async_wait (boost::bind (&backend_pool::on_timer, this,
+                                  boost::asio::placeholders::error));
+}
+
+void
+backend_pool::async_acquire (const handler_type &handler)
+{
+  boost::lock_guard<boost::mutex> lock (mutex_);
+
+  if (!idle_.empty ())
+    {
+      // Most recently used first, its buffers are still warm
+      backend_ptr session = idle_.back ();
+      idle_.pop_back ();
+      boost::asio::post (io_context_,
+                         boost::bind (handler, boost::system::error_code (),
+                                      session));
+      return;
+    }
+
+  waiters_.push_back (handler);
+
+  if (size_ < pool_max_size)
+    open_locked ();
+}
+
+void
+backend_pool::release (backend_ptr session, bool reusable)
+{
+  if (!reusable)
+    {
+      discard (session);
+      return;
+    }
+
+  if (!session->tainted ())
+    {
+      boost::lock_guard<boost::mutex> lock (mutex_);
+      give_locked (session);
+      return;
+    }
+
+  session->async_reset (
+      boost::bind (&backend_pool::on_reset, this, session, _1));
+}
+
+const boost::asio::ip::tcp::endpoint &
+backend_pool::endpoint () const
+{
+  return endpoint_;
+}
+
+mysqlproxy_common::protocol::handshake
+backend_pool::greeting ()
+{
+  boost::lock_guard<boost::mutex> lock (mutex_);
+  return greeting_;
+}
+
+void
+backend_pool::open_locked ()
+{
+  ++size_;
+
+  backend_ptr session (new backend (io_context_, endpoint_));
+  session->async_open (boost::bind (&backend_pool::on_open, this, session,
+                                    backend::clock_type::now (), _1));
+}
+
+void
+backend_pool::give_locked (const backend_ptr &session)
+{
+  if (!waiters_.empty ())
+    {
+      handler_type handler = waiters_.front ();
+      waiters_.pop_front ();
+      boost::asio::post (io_context_,
+                         boost::bind (handler, boost::system::error_code (),
+                                      session));
+      return;
+    }
+
+  session->touch ();
+  idle_.push_back (session);
+}
+
+void
+backend_pool::on_open (backend_ptr session,
+                       backend::clock_type::time_point started,
+                       const boost::system::error_code &err)
+{
+  if (err)
+    {
+      CXXLOG_ERROR (writer_, "on_open: " << endpoint_ << ": "
+                                         << session->last_error ()
+                                         << std::endl);
+      metrics::add (metrics::errors_connect);
+      session->close ();
+
+      boost::lock_guard<boost::mutex> lock (mutex_);
+      --size_;
+
+      // Fail one waiter per failed attempt rather than retrying forever
+      if (!waiters_.empty ())
+        {
+          handler_type handler = waiters_.front ();
+          waiters_.pop_front ();
+          boost::asio::post (io_context_,
+                             boost::bind (handler, err, backend_ptr ()));
+        }
+      return;
+    }
+
+  metrics::observe_connect (
+      boost::asio::chrono::duration_cast<boost::asio::chrono::microseconds> (
+          backend::clock_type::now () - started)
+          .count ());
+  metrics::adjust (metrics::pooled_sessions, 1);
+
+  boost::lock_guard<boost::mutex> lock (mutex_);
+  greeting_ = session->greeting ();
+  give_locked (session);
+}
+
+void
+backend_pool::on_reset (backend_ptr session,
+                        const boost::system::error_code &err)
+{
+  if (err)
+    {
+      CXXLOG_WARNING (writer_, "on_reset: " << endpoint_ << ": "
+                                            << session->last_error ()
+                                            << std::endl);
+      metrics::add (metrics::errors_reset);
+      discard (session);
+      return;
+    }
+
+  boost::lock_guard<boost::mutex> lock (mutex_);
+  give_locked (session);
+}
+
+void
+backend_pool::on_ping (backend_ptr session,
+                       const boost::system::error_code &err)
+{
+  if (err)
+    {
+      CXXLOG_WARNING (writer_, "on_ping: " << endpoint_ << ": "
+                                           << session->last_error ()
+                                           << std::endl);
+      metrics::add (metrics::errors_ping);
+      discard (session);
+      return;
+    }
+
+  boost::lock_guard<boost::mutex> lock (mutex_);
+  give_locked (session);
+}
+
+void
+backend_pool::discard (const backend_ptr &session)
+{
+  session->close ();
+  metrics::adjust (metrics::pooled_sessions, -1);
+
+  boost::lock_guard<boost::mutex> lock (mutex_);
+  --size_;
+
+  if (!waiters_.empty () || size_ < pool_min_size)
+    open_locked ();
+}
+
+void
+backend_pool::on_timer (const boost::system::error_code &err)
+{
+  if (err == boost::asio::error::operation_aborted)
+    return;
+
+  {
+    boost::lock_guard<boost::mutex> lock (mutex_);
+
+    backend::clock_type::time_point deadline
+        = backend::clock_type::now ()
+          - boost::asio::chrono::seconds (pool_idle_timeout);
+
+    // The front of idle_ holds the least recently used sessions
+    while (!idle_.empty () && size_ > pool_min_size
+           && idle_.front ()->last_used () < deadline)
+      {
+        idle_.front ()->close ();
+        idle_.pop_front ();
+        --size_;
+        metrics::adjust (metrics::pooled_sessions, -1);
+      }
+
+    // Ping the rest before the server's wait_timeout drops them, out of
+    // idle_ so that they are not checked out meanwhile
+    deadline = backend::clock_type::now ()
+               - boost::asio::chrono::seconds (pool_ping_interval);
+
+    while (!idle_.empty () && idle_.front ()->last_used () < deadline)
+      {
+        backend_ptr session = idle_.front ();
+        idle_.pop_front ();
+        session->async_ping (
+            boost::bind (&backend_pool::on_ping, this, session, _1));
+      }
+
+    while (size_ < pool_min_size)
+      open_locked ();
+  }
+
+  timer_.expires_after (boost::asio::chrono::seconds (1));
+  timer_.async_wait (boost::bind (&backend_pool::on_timer, this,
+                                  boost::asio::placeholders::error));
+}
+
+} // namespace server
+} // namespace mysqlproxy_tracker
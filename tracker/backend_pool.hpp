@@ -0,0 +1,87 @@
+#ifndef MYSQLPROXY_TRACKER_BACKEND_POOL_HPP
+#define MYSQLPROXY_TRACKER_BACKEND_POOL_HPP
+
+#include <boost/asio/steady_timer.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <deque>
+
+#include "backend.hpp"
+#include "system/logger_service.hpp"
+
+namespace mysqlproxy_tracker
+{
+namespace server
+{
+
+// Sessions kept open per backend, even when idle
+extern std::size_t pool_min_size;
+
+// Upper bound of sessions per backend, further checkouts wait
+extern std::size_t pool_max_size;
+
+// Seconds after which idle sessions above pool_min_size are closed
+extern std::size_t pool_idle_timeout;
+
+// Seconds after which the sessions kept idle are pinged, below the server's
+// wait_timeout and any NAT timeout on the way
+extern std::size_t pool_ping_interval;
+
+/// Warm, authenticated sessions to one server.
+class backend_pool : private boost::noncopyable
+{
+public:
+  typedef boost::function<void (const boost::system::error_code &,
+                                backend_ptr)>
+      handler_type;
+
+  backend_pool (boost::asio::io_context &io_context,
+                const boost::asio::ip::tcp::endpoint &endpoint,
+                mysqlproxy_system::basic_logger &writer);
+
+  /// Open pool_min_size sessions and start the idle eviction timer.
+  void start ();
+
+  /// Check out a session, the handler is posted to the io_context.
+  void async_acquire (const handler_type &handler);
+
+  /// Check in a session. Tainted sessions are reset before going idle,
+  /// others keep their history for the next client to build on.
+  void release (backend_ptr session, bool reusable);
+
+  const boost::asio::ip::tcp::endpoint &endpoint () const;
+
+  /// Greeting of the most recently opened session.
+  mysqlproxy_common::protocol::handshake greeting ();
+
+private:
+  // Must be called with mutex_ held
+  void open_locked ();
+  void give_locked (const backend_ptr &session);
+
+  void on_open (backend_ptr session, backend::clock_type::time_point started,
+                const boost::system::error_code &err);
+  void on_reset (backend_ptr session, const boost::system::error_code &err);
+  void on_ping (backend_ptr session, const boost::system::error_code &err);
+  void on_timer (const boost::system::error_code &err);
+  void discard (const backend_ptr &session);
+
+  boost::asio::io_context &io_context_;
+  boost::asio::ip::tcp::endpoint endpoint_;
+  mysqlproxy_system::basic_logger &writer_;
+  boost::asio::steady_timer timer_;
+
+  boost::mutex mutex_;
+  std::deque<backend_ptr> idle_;
+  std::deque<handler_type> waiters_;
+
+  // Open, opening and checked out sessions
+  std::size_t size_;
+  mysqlproxy_common::protocol::handshake greeting_;
+};
+
+} // namespace server
+} // namespace mysqlproxy_tracker
+
+#endif // MYSQLPROXY_TRACKER_BACKEND_POOL_HPP
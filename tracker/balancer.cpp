@@ -0,0 +1,382 @@
+#include "balancer.hpp"
+
+#include <boost/thread/locks.hpp>
+#include <cmath>
+#include <stdexcept>
+
+#include "backend_pool.hpp"
+
+namespace mysqlproxy_tracker
+{
+namespace server
+{
+
+std::vector<std::string> backend_addresses;
+std::string primary_address;
+std::string balance_policy = "peak-ewma";
+std::size_t ewma_decay = 10000;
+std::size_t failure_backoff = 5;
+
+namespace
+{
+
+// Latency charged to a server that could not be reached, in microseconds
+const double failure_penalty = 1e6;
+
+boost::asio::ip::tcp::endpoint
+resolve (boost::asio::ip::tcp::resolver &resolver, const std::string &address)
+{
+  std::string::size_type colon = address.rfind (':');
+  if (colon == std::string::npos)
+    throw std::invalid_argument ("backend \"" + address
+                                 + "\" is not host:port");
+
+  std::string host = address.substr (0, colon);
+  if (host.size () > 1 && host[0] == '[' && host[host.size () - 1] == ']')
+    host = host.substr (1, host.size () - 2);
+
+  return *resolver.resolve (host, address.substr (colon + 1)).begin ();
+}
+
+class round_robin_balancer : public balancer
+{
+public:
+  round_robin_balancer () : next_ (0) {}
+
+protected:
+  upstream &
+  choose (const std::vector<upstream *> &candidates,
+          upstream::clock_type::time_point)
+  {
+    return *candidates[next_.fetch_add (1) % candidates.size ()];
+  }
+
+private:
+  boost::atomic<std::size_t> next_;
+};
+
+class least_outstanding_balancer : public balancer
+{
+protected:
+  upstream &
+  choose (const std::vector<upstream *> &candidates,
+          upstream::clock_type::time_point)
+  {
+    upstream *best = candidates[0];
+
+    for (std::size_t i = 1; i < candidates.size (); i++)
+      {
+        upstream *u = candidates[i];
+
+        // Sessions break ties while the servers are idle
+        if (u->outstanding () < best->outstanding ()
+            || (u->outstanding () == best->outstanding ()
+                && u->sessions () < best->sessions ()))
+          best = u;
+      }
+
+    return *best;
+  }
+};
+
+class peak_ewma_balancer : public balancer
+{
+protected:
+  upstream &
+  choose (const std::vector<upstream *> &candidates,
+          upstream::clock_type::time_point now)
+  {
+    upstream *best = candidates[0];
+    double best_cost = best->cost (now);
+
+    for (std::size_t i = 1; i < candidates.size (); i++)
+      {
+        double cost = candidates[i]->cost (now);
+
+        if (cost < best_cost
+            || (cost == best_cost
+                && candidates[i]->sessions () < best->sessions ()))
+          {
+            best = candidates[i];
+            best_cost = cost;
+          }
+      }
+
+    return *best;
+  }
+};
+
+} // namespace
+
+upstream::upstream (const boost::asio::ip::tcp::endpoint &endpoint)
+    : endpoint_ (endpoint), pool_ (), sessions_ (0), outstanding_ (0),
+      down_until_ (0), ewma_ (0), stamp_ (clock_type::now ())
+{
+}
+
+upstream::~upstream () {}
+
+const boost::asio::ip::tcp::endpoint &
+upstream::endpoint () const
+{
+  return endpoint_;
+}
+
+backend_pool *
+upstream::pool ()
+{
+  return pool_.get ();
+}
+
+void
+upstream::open_pool (boost::asio::io_context &io_context,
+                     mysqlproxy_system::basic_logger &writer)
+{
+  pool_.reset (new backend_pool (io_context, endpoint_, writer));
+  pool_->start ();
+}
+
+void
+upstream::session_started ()
+{
+  sessions_.fetch_add (1);
+}
+
+void
+upstream::session_ended ()
+{
+  sessions_.fetch_sub (1);
+}
+
+void
+upstream::request_started ()
+{
+  outstanding_.fetch_add (1);
+}
+
+void
+upstream::request_finished (clock_type::duration latency)
+{
+  outstanding_.fetch_sub (1);
+
+  double rtt = double (
+      boost::asio::chrono::duration_cast<boost::asio::chrono::microseconds> (
+          latency)
+          .count ());
+
+  boost::lock_guard<boost::mutex> lock (mutex_);
+
+  clock_type::time_point now = clock_type::now ();
+  double elapsed = double (
+      boost::asio::chrono::duration_cast<boost::asio::chrono::milliseconds> (
+          now - stamp_)
+          .count ());
+  stamp_ = now;
+
+  // Peaks are taken at once, recoveries are averaged over ewma_decay
+  if (rtt > ewma_)
+    ewma_ = rtt;
+  else
+    {
+      double w = std::exp (-elapsed / double (ewma_decay));
+      ewma_ = ewma_ * w + rtt * (1 - w);
+    }
+}
+
+void
+upstream::request_cancelled ()
+{
+  outstanding_.fetch_sub (1);
+}
+
+void
+upstream::failed ()
+{
+  down_until_.store ((clock_type::now ()
+                      + boost::asio::chrono::seconds (failure_backoff))
+                         .time_since_epoch ()
+                         .count ());
+
+  boost::lock_guard<boost::mutex> lock (mutex_);
+  stamp_ = clock_type::now ();
+  if (ewma_ < failure_penalty)
+    ewma_ = failure_penalty;
+}
+
+bool
+upstream::available (clock_type::time_point now) const
+{
+  return now.time_since_epoch ().count () >= down_until_.load ();
+}
+
+std::size_t
+upstream::sessions () const
+{
+  return sessions_.load ();
+}
+
+std::size_t
+upstream::outstanding () const
+{
+  return outstanding_.load ();
+}
+
+double
+upstream::cost (clock_type::time_point now)
+{
+  double ewma;
+  double elapsed;
+  {
+    boost::lock_guard<boost::mutex> lock (mutex_);
+    ewma = ewma_;
+    elapsed = double (
+        boost::asio::chrono::duration_cast<boost::asio::chrono::milliseconds> (
+            now - stamp_)
+            .count ());
+  }
+
+  // Decay towards zero while no response is seen, so that a server which
+  // was slow once gets probed again
+  if (elapsed > 0)
+    ewma *= std::exp (-elapsed / double (ewma_decay));
+
+  return ewma * double (outstanding_.load () + 1);
+}
+
+balancer *
+balancer::create (boost::asio::io_context &io_context, bool pooled)
+{
+  balancer *result;
+
+  if (balance_policy == "round-robin")
+    result = new round_robin_balancer;
+  else if (balance_policy == "least-outstanding")
+    result = new least_outstanding_balancer;
+  else if (balance_policy == "peak-ewma")
+    result = new peak_ewma_balancer;
+  else
+    throw std::invalid_argument ("unknown balance policy \"" + balance_policy
+                                 + "\"");
+
+  result->pooled_ = pooled;
+
+  // A primary alone takes the reads as well
+  if (backend_addresses.empty () && !primary_address.empty ())
+    {
+      backend_addresses.push_back (primary_address);
+      primary_address.clear ();
+    }
+
+  if (backend_addresses.empty ())
+    backend_addresses.push_back ("127.0.0.1:3306");
+
+  try
+    {
+      // The proxy must log in to both servers of a client itself
+      if (!primary_address.empty () && !pooled)
+        throw std::invalid_argument ("splitting reads from writes needs "
+                                     "pooled sessions");
+
+      boost::asio::ip::tcp::resolver resolver (io_context);
+
+      if (!primary_address.empty ())
+        result->primary_.reset (
+            new upstream (resolve (resolver, primary_address)));
+
+      for (std::size_t i = 0; i < backend_addresses.size (); i++)
+        result->upstreams_.push_back (upstream_ptr (
+            new upstream (resolve (resolver, backend_addresses[i]))));
+    }
+  catch (...)
+    {
+      delete result;
+      throw;
+    }
+
+  return result;
+}
+
+balancer::balancer () : upstreams_ (), primary_ (), pooled_ (false) {}
+
+balancer::~balancer () {}
+
+void
+balancer::start (boost::asio::io_context &io_context,
+                 mysqlproxy_system::basic_logger &writer)
+{
+  if (!pooled_)
+    return;
+
+  for (std::size_t i = 0; i < upstreams_.size (); i++)
+    upstreams_[i]->open_pool (io_context, writer);
+
+  if (primary_)
+    primary_->open_pool (io_context, writer);
+}
+
+upstream &
+balancer::select ()
+{
+  upstream::clock_type::time_point now = upstream::clock_type::now ();
+
+  std::vector<upstream *> candidates;
+  candidates.reserve (upstreams_.size ());
+
+  for (std::size_t i = 0; i < upstreams_.size (); i++)
+    if (upstreams_[i]->available (now))
+      candidates.push_back (upstreams_[i].get ());
+
+  // With every server failing, keep trying all of them
+  if (candidates.empty ())
+    for (std::size_t i = 0; i < upstreams_.size (); i++)
+      candidates.push_back (upstreams_[i].get ());
+
+  return choose (candidates, now);
+}
+
+upstream *
+balancer::primary ()
+{
+  return primary_.get ();
+}
+
+const std::vector<upstream_ptr> &
+balancer::upstreams () const
+{
+  return upstreams_;
+}
+
+bool
+balancer::pooled () const
+{
+  return pooled_;
+}
+
+mysqlproxy_common::protocol::handshake
+balancer::greeting ()
+{
+  mysqlproxy_common::protocol::handshake hs
+      = mysqlproxy_common::protocol::handshake ();
+
+  if (primary_)
+    {
+      hs = primary_->pool ()->greeting ();
+      if (!hs.server_version.empty ())
+        return hs;
+    }
+
+  for (std::size_t i = 0; i < upstreams_.size (); i++)
+    {
+      if (!upstreams_[i]->pool ())
+        continue;
+
+      hs = upstreams_[i]->pool ()->greeting ();
+      if (!hs.server_version.empty ())
+        break;
+    }
+
+  return hs;
+}
+
+} // namespace server
+} // namespace mysqlproxy_tracker
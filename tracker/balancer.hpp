@@ -0,0 +1,145 @@
+#ifndef MYSQLPROXY_TRACKER_BALANCER_HPP
+#define MYSQLPROXY_TRACKER_BALANCER_HPP
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <string>
+#include <vector>
+
+#include "common/mysql.hpp"
+#include "system/logger_service.hpp"
+
+namespace mysqlproxy_tracker
+{
+namespace server
+{
+
+class backend_pool;
+
+// Servers the sessions are spread over, as "host:port"
+extern std::vector<std::string> backend_addresses;
+
+// Server taking the writes when reads go to backend_addresses, as
+// "host:port"
+extern std::string primary_address;
+
+// One of "round-robin", "least-outstanding" or "peak-ewma"
+extern std::string balance_policy;
+
+// Milliseconds over which the peak-ewma latency decays
+extern std::size_t ewma_decay;
+
+// Seconds a server is skipped after a failed connect
+extern std::size_t failure_backoff;
+
+/// A server and its current load.
+class upstream : private boost::noncopyable
+{
+public:
+  typedef boost::asio::steady_timer::clock_type clock_type;
+
+  explicit upstream (const boost::asio::ip::tcp::endpoint &endpoint);
+
+  ~upstream ();
+
+  const boost::asio::ip::tcp::endpoint &endpoint () const;
+
+  /// Session pool, 0 when relaying transparently.
+  backend_pool *pool ();
+
+  void open_pool (boost::asio::io_context &io_context,
+                  mysqlproxy_system::basic_logger &writer);
+
+  void session_started ();
+  void session_ended ();
+
+  /// A command was sent, its response is pending.
+  void request_started ();
+
+  /// The response of a command is complete.
+  void request_finished (clock_type::duration latency);
+
+  /// The response of a command will not be seen.
+  void request_cancelled ();
+
+  /// Connecting or logging in failed.
+  void failed ();
+
+  bool available (clock_type::time_point now) const;
+
+  std::size_t sessions () const;
+  std::size_t outstanding () const;
+
+  /// Latency average weighted by the outstanding requests.
+  double cost (clock_type::time_point now);
+
+private:
+  boost::asio::ip::tcp::endpoint endpoint_;
+  boost::scoped_ptr<backend_pool> pool_;
+
+  boost::atomic<std::size_t> sessions_;
+  boost::atomic<std::size_t> outstanding_;
+  boost::atomic<clock_type::rep> down_until_;
+
+  // Peak EWMA of the response latency in microseconds
+  boost::mutex mutex_;
+  double ewma_;
+  clock_type::time_point stamp_;
+};
+
+typedef boost::shared_ptr<upstream> upstream_ptr;
+
+/// Chooses the server of new sessions.
+class balancer : private boost::noncopyable
+{
+public:
+  /// Resolve backend_addresses and build the policy named balance_policy.
+  /**
+   * Throws std::invalid_argument for an unknown policy, a malformed
+   * address, or a primary_address without pooling.
+   */
+  static balancer *create (boost::asio::io_context &io_context, bool pooled);
+
+  virtual ~balancer ();
+
+  /// Open a session pool per server when pooling.
+  void start (boost::asio::io_context &io_context,
+              mysqlproxy_system::basic_logger &writer);
+
+  /// Pick the server of a new session, a replica when splitting.
+  upstream &select ();
+
+  /// Server of the writes, 0 unless splitting reads from writes.
+  upstream *primary ();
+
+  const std::vector<upstream_ptr> &upstreams () const;
+
+  bool pooled () const;
+
+  /// Greeting of the first server a pooled session was opened to.
+  mysqlproxy_common::protocol::handshake greeting ();
+
+protected:
+  balancer ();
+
+  /// Choose among the servers for which available () holds, all of them
+  /// when none is available.
+  virtual upstream &choose (const std::vector<upstream *> &candidates,
+                            upstream::clock_type::time_point now)
+      = 0;
+
+private:
+  std::vector<upstream_ptr> upstreams_;
+  upstream_ptr primary_;
+  bool pooled_;
+};
+
+} // namespace server
+} // namespace mysqlproxy_tracker
+
+#endif // MYSQLPROXY_TRACKER_BALANCER_HPP
@@ -1,31 +1,105 @@
 #include "connection.hpp"
 
 //#include <boost/asio/connect.hpp>
+#include <boost/asio/bind_executor.hpp>
 #include <boost/asio/placeholders.hpp>
-#include <boost/asio/read.hpp>
+#include <boost/asio/post.hpp>
 #include <boost/asio/write.hpp>
+#include <boost/atomic.hpp>
 #include <boost/bind/bind.hpp>
 //#include <boost/asio/ip/basic_endpoint.hpp>
 
-// temporarety!
-const char *mysql_address = "127.0.0.1";
-const uint16_t mysql_port = 3306;
+#include <algorithm>
+#include <cctype>
+
+#include "backend_pool.hpp"
+#include "common/audit_log.hpp"
+#include "common/auth.hpp"
+#include "common/digest_stats.hpp"
+#include "common/metrics.hpp"
+#include "common/query_classifier.hpp"
+#include "common/query_digest.hpp"
+#include "common/single_flight.hpp"
+#include "common/traffic_capture.hpp"
 
 namespace mysqlproxy_tracker
 {
 namespace server
 {
+std::size_t read_buffer_size = 16 * 1024;
+std::size_t high_watermark = 1024 * 1024;
+std::size_t low_watermark = 256 * 1024;
+std::size_t cut_through_size = 64 * 1024;
+bool multiplex = false;
+bool coalesce = false;
+std::size_t query_log_sample = 0;
+bool passthrough_copy = false;
+
+namespace
+{
+typedef mysqlproxy_common::metrics metrics;
+
+boost::atomic<uint32_t> connection_id (1);
+
+// SET and USE commands kept for sessions checked out later
+const std::size_t max_session_history = 1024;
+
+// Socket errors logged per second, every disconnect ends with one
+const std::size_t io_error_log_rate = 100;
+
+// USE changes the default database, which a session reset keeps
+bool
+is_use_statement (const char *text, std::size_t length)
+{
+  std::size_t i = 0;
+  while (i < length && std::isspace (static_cast<unsigned char> (text[i])))
+    ++i;
+
+  return length - i > 3 && (text[i] == 'u' || text[i] == 'U')
+         && (text[i + 1] == 's' || text[i + 1] == 'S')
+         && (text[i + 2] == 'e' || text[i + 2] == 'E')
+         && (std::isspace (static_cast<unsigned char> (text[i + 3]))
+             || text[i + 3] == '`');
+}
+} // namespace
+
 connection::connection (boost::asio::io_context &io_context,
-                        mysqlproxy_system::basic_logger &writer)
-    : strand_ (boost::asio::make_strand (io_context)),
-      server_socket_ (strand_), client_socket_ (strand_), writer_ (writer)
+                        mysqlproxy_system::basic_logger &writer,
+                        balancer &backends, bool passthrough)
+    : io_context_ (io_context),
+      strand_ (boost::asio::make_strand (io_context)),
+      client_socket_ (io_context), client_endpoint_ (), writer_ (writer),
+      backends_ (backends), route_ (write_route),
+      statement_route_ (write_route), server_buffer_ (read_buffer_size),
+      client_buffer_ (read_buffer_size), server_stream_ (), client_stream_ (),
+      uploading_ (false), infile_ (false), queued_bytes_ (0),
+      read_paused_ (false), response_done_ (false), awaiting_response_ (false),
+      closing_ (false), stopped_ (false), state_ (auth_state), client_ (),
+      client_sequence_id_ (0), sequence_shift_ (0), client_command_ (0),
+      response_state_ (response_first), response_left_ (0),
+      prepare_columns_ (0), deprecate_eof_ (false), request_start_ (),
+      pending_ (), login_ (false), record_ (false), replaying_ (false),
+      sticky_ (false), direct_ (passthrough), passthrough_ (passthrough),
+      relay_ (), next_transaction_ (false),
+      server_status_ (MYSQLPROXY_SERVER_STATUS_AUTOCOMMIT),
+      response_error_ (false), response_error_code_ (0), session_history_ (),
+      digest_ (), query_start_ (), response_rows_ (0), response_bytes_ (0),
+      capture_session_ (0), capture_index_ (0),
+      command_class_ (mysqlproxy_common::query_write), cache_scope_ (0),
+      cache_fill_ (), cache_ttl_ (0), cache_deps_ (), flight_ (0),
+      leading_ (false), written_tables_ (), written_unknown_ (false)
 {
+  for (std::size_t i = 0; i < 2; i++)
+    {
+      sessions_[i].upstream_ = 0;
+      sessions_[i].synced_ = 0;
+    }
 }
 
 boost::asio::ip::tcp::socket &
 connection::server_socket ()
 {
-  return server_socket_;
+  return sessions_[route_].backend_->socket ();
 }
 
 boost::asio::ip::tcp::socket &
@@ -37,11 +111,36 @@ connection::client_socket ()
 void
 connection::start ()
 {
-  server_socket_.async_connect (
-      boost::asio::ip::tcp::endpoint (
-          boost::asio::ip::make_address (mysql_address), mysql_port),
-      boost::bind (&connection::handle_connect, shared_from_this (),
-                   boost::asio::placeholders::error));
+  // Responses end with small packets that must not wait for an ACK
+  boost::system::error_code ignored_ec;
+  client_socket_.set_option (boost::asio::ip::tcp::no_delay (true),
+                             ignored_ec);
+  if (mysqlproxy_common::audit_log::enabled ())
+    client_endpoint_ = client_socket_.remote_endpoint (ignored_ec);
+
+  metrics::adjust (metrics::client_connections, 1);
+
+  if (backends_.pooled () && !direct_)
+    {
+      send_greeting ();
+      return;
+    }
+
+  held_session &session = sessions_[route_];
+  // What a passthrough client runs is unknown, it may write
+  session.upstream_ = direct_ && backends_.primary () ? backends_.primary ()
+                                                      : &backends_.select ();
+  session.upstream_->session_started ();
+
+  session.backend_.reset (
+      new backend (io_context_, session.upstream_->endpoint ()));
+  request_start_ = upstream::clock_type::now ();
+  session.backend_->socket ().async_connect (
+      session.backend_->endpoint (),
+      boost::asio::bind_executor (
+          strand_, boost::bind (&connection::handle_connect,
+                                 shared_from_this (),
+                                 boost::asio::placeholders::error)));
 }
 
 void
@@ -49,140 +148,1605 @@ connection::handle_connect (const boost::system::error_code &err)
 {
   if (!err)
     {
-      do_read (server_socket_);
+      boost::system::error_code ignored_ec;
+      server_socket ().set_option (boost::asio::ip::tcp::no_delay (true),
+                                   ignored_ec);
+      metrics::observe_connect (
+          boost::asio::chrono::duration_cast<
+              boost::asio::chrono::microseconds> (
+              upstream::clock_type::now () - request_start_)
+              .count ());
+      if (direct_)
+        start_passthrough ();
+      else
+        do_read (server_socket ());
     }
   else
     {
-      CXXLOG_ERROR (writer_,
-                    "handle_connect: " << err.message () << std::endl);
+      upstream *server = sessions_[route_].upstream_;
+
+      CXXLOG_ERROR (writer_, "handle_connect: " << server->endpoint () << ": "
+                                                << err.message ()
+                                                << std::endl);
+      metrics::add (metrics::errors_connect);
+      server->failed ();
+      stop ();
+    }
+}
+
+void
+connection::start_passthrough ()
+{
+  // Commands the client sent after the one switching go first
+  if (!client_buffer_.empty ())
+    {
+      buffer chunk;
+      chunk.raw_ = true;
+      std::size_t n = client_buffer_.size ();
+      chunk.data_ = mysqlproxy_common::packet_pool::allocate (n);
+      client_buffer_.copy (0, chunk.data_->data (), n);
+      client_buffer_.consume (n);
+
+      for_write_.push_back (chunk);
+      queued_bytes_ += n;
+      do_write (server_socket ());
+      return;
+    }
+
+  relay_.reset (new passthrough (strand_, client_socket_, server_socket (),
+                                 !passthrough_copy));
+  relay_->start (boost::bind (&connection::on_passthrough_end,
+                              shared_from_this (),
+                              boost::asio::placeholders::error));
+}
+
+void
+connection::on_passthrough_end (const boost::system::error_code &err)
+{
+  if (!stopped_ && err != boost::asio::error::eof)
+    CXXLOG_RATE_LIMITED (writer_, ERROR, io_error_log_rate,
+                         "on_passthrough_end: " << err.message ());
+
+  stop ();
+}
+
+void
+connection::stop ()
+{
+  if (stopped_)
+    return;
+  stopped_ = true;
+
+  metrics::adjust (metrics::client_connections, -1);
+
+  land_flight (mysqlproxy_common::result_cache::response_ptr ());
+
+  boost::system::error_code ignored_ec;
+  client_socket_.close (ignored_ec);
+
+  if (capture_session_)
+    mysqlproxy_common::traffic_capture::record (
+        capture_session_, capture_index_++,
+        mysqlproxy_common::traffic_capture::session_close, 0, 0);
+
+  for (std::size_t i = 0; i < 2; i++)
+    {
+      held_session &session = sessions_[i];
+      bool active = route (i) == route_;
+
+      if (!session.upstream_)
+        continue;
+
+      if (active && awaiting_response_)
+        session.upstream_->request_cancelled ();
+      session.upstream_->session_ended ();
+
+      if (!session.backend_)
+        continue;
+
+      if (session.upstream_->pool () && !direct_)
+        {
+          // Open transactions and server-bound state must not reach the
+          // next client
+          if (pinned ())
+            session.backend_->taint ();
+
+          // A session can be handed to another client only between
+          // commands
+          session.upstream_->pool ()->release (
+              session.backend_,
+              !active
+                  || (state_ == relay_state && !awaiting_response_
+                      && server_buffer_.empty ()));
+        }
+      else
+        session.backend_->close ();
     }
 }
 
 void
 connection::do_read (boost::asio::ip::tcp::socket &sock)
 {
-  buffer &buf = &sock == &server_socket_ ? server_buffer_ : client_buffer_;
+  if (!dispatch (sock))
+    return;
+
+  bool client = &sock == &client_socket_;
+  mysqlproxy_common::ring_buffer &buf
+      = client ? client_buffer_ : server_buffer_;
 
-  boost::asio::async_read (
-      sock, boost::asio::buffer (buf.header_),
-      boost::bind (&connection::on_read_header, shared_from_this (),
-                   boost::ref (sock), boost::asio::placeholders::error,
-                   boost::asio::placeholders::bytes_transferred));
+  sock.async_read_some (
+      buf.prepare (),
+      boost::asio::bind_executor (
+          strand_,
+          mysqlproxy_common::make_custom_alloc_handler (
+              client ? client_read_memory_ : server_read_memory_,
+              boost::bind (&connection::on_read, shared_from_this (),
+                           boost::ref (sock), boost::asio::placeholders::error,
+                           boost::asio::placeholders::bytes_transferred))));
 }
 
 void
 connection::do_write (boost::asio::ip::tcp::socket &sock)
 {
-  std::vector<boost::asio::const_buffer> buffers;
+  BOOST_ASSERT (writing_.empty ());
+  writing_.swap (for_write_);
 
-  for (std::size_t i = 0; i < for_write_.size (); i++)
+  write_buffers_.clear ();
+  for (std::size_t i = 0; i < writing_.size (); i++)
     {
-      buffers.push_back (boost::asio::buffer (for_write_[i].header_));
-      buffers.push_back (boost::asio::buffer (for_write_[i].data_));
+      if (!writing_[i].raw_)
+        write_buffers_.push_back (boost::asio::buffer (writing_[i].header_));
+      write_buffers_.push_back (boost::asio::buffer (
+          writing_[i].data_->data (), writing_[i].data_->size ()));
     }
 
   boost::asio::async_write (
-      sock, buffers,
-      boost::bind (&connection::on_write, shared_from_this (),
-                   boost::ref (sock), boost::asio::placeholders::error,
-                   boost::asio::placeholders::bytes_transferred));
+      sock, buffer_range (write_buffers_),
+      boost::asio::bind_executor (
+          strand_,
+          mysqlproxy_common::make_custom_alloc_handler (
+              write_memory_,
+              boost::bind (&connection::on_write, shared_from_this (),
+                           boost::ref (sock), boost::asio::placeholders::error,
+                           boost::asio::placeholders::bytes_transferred))));
 }
 
 void
-connection::on_read_header (boost::asio::ip::tcp::socket &sock,
-                            const boost::system::error_code &err,
-                            std::size_t /*bytes_transferred*/)
+connection::on_read (boost::asio::ip::tcp::socket &sock,
+                     const boost::system::error_code &err,
+                     std::size_t bytes_transferred)
 {
+  bool client = &sock == &client_socket_;
+
   if (err)
     {
-      CXXLOG_ERROR (writer_,
-                    "on_read_header: " << err.message () << std::endl);
+      if (!stopped_)
+        {
+          CXXLOG_RATE_LIMITED (writer_, ERROR, io_error_log_rate,
+                               "on_read: " << err.message ());
+          if (err != boost::asio::error::eof)
+            metrics::add (client ? metrics::errors_client_io
+                                 : metrics::errors_server_io);
+        }
+      stop ();
       return;
     }
 
-  buffer &buf = &sock == &server_socket_ ? server_buffer_ : client_buffer_;
+  metrics::add (client ? metrics::client_bytes_received
+                       : metrics::server_bytes_received,
+                bytes_transferred);
 
-  mysqlproxy_common::protocol::prefix *header
-      = reinterpret_cast<mysqlproxy_common::protocol::prefix *> (
-          buf.header_.data ());
+  mysqlproxy_common::ring_buffer &buf
+      = client ? client_buffer_ : server_buffer_;
 
-  buf.data_.resize (header->payload_length);
+  buf.commit (bytes_transferred);
 
-  boost::asio::async_read (
-      sock, boost::asio::buffer (buf.data_),
-      boost::bind (&connection::on_read_data, shared_from_this (),
-                   boost::ref (sock), boost::asio::placeholders::error,
-                   boost::asio::placeholders::bytes_transferred));
+  do_read (sock);
 }
 
-void
-connection::on_read_data (boost::asio::ip::tcp::socket &sock,
-                          const boost::system::error_code &err,
-                          std::size_t bytes_transferred)
+bool
+connection::dispatch (boost::asio::ip::tcp::socket &sock)
 {
-  if (err)
+  bool client = &sock == &client_socket_;
+  mysqlproxy_common::ring_buffer &buf = client ? client_buffer_
+                                               : server_buffer_;
+  stream &s = client ? client_stream_ : server_stream_;
+  metrics::counter packets = client ? metrics::client_packets
+                                    : metrics::server_packets;
+
+  for (;;)
     {
-      CXXLOG_ERROR (writer_, "on_read_data: " << err.message () << std::endl);
-      return;
+      if (s.left_ > 0)
+        {
+          if (buf.empty ())
+            break;
+          if (!relay_stream (sock))
+            return false;
+          continue;
+        }
+
+      if (buf.size () < header_lenght)
+        break;
+
+      mysqlproxy_common::protocol::prefix header;
+      buf.copy (0, &header, header_lenght);
+
+      std::size_t packet_length = header_lenght + header.payload_length;
+      std::size_t size = header.payload_length;
+
+      if (buf.size () < packet_length)
+        {
+          std::size_t start = header_lenght + cut_through_size;
+
+          if (header.payload_length <= cut_through_size
+              || !streamable (sock, header))
+            {
+              // Packet larger than the ring, make room for all of it
+              buf.reserve (packet_length);
+              break;
+            }
+
+          // The rest follows as it arrives, the ring only grows to hold
+          // the start looked at
+          if (buf.size () < start)
+            {
+              buf.reserve (start);
+              break;
+            }
+          size = buf.size () - header_lenght;
+        }
+
+      buffer packet;
+      buf.copy (0, packet.header_.data (), header_lenght);
+      packet.data_ = mysqlproxy_common::packet_pool::allocate (size);
+      buf.copy (header_lenght, packet.data_->data (), size);
+      buf.consume (header_lenght + size);
+
+      if (buf.empty () && buf.capacity () > read_buffer_size)
+        buf.reset (read_buffer_size);
+
+      s.left_ = header.payload_length - size;
+      s.continuation_ = s.continued_;
+      s.continued_ = header.payload_length == 0xffffff;
+
+      metrics::add (packets);
+
+      if (!on_packet (sock, packet))
+        return false;
+    }
+
+  // Uploads go out before more is read from the client
+  if (client && uploading_ && !for_write_.empty ())
+    {
+      if (writing_.empty ())
+        do_write (server_socket ());
+      return false;
+    }
+
+  return true;
+}
+
+bool
+connection::streamable (
+    boost::asio::ip::tcp::socket &sock,
+    const mysqlproxy_common::protocol::prefix &header) const
+{
+  if (&sock == &client_socket_)
+    // The start of a command is enough to route it
+    return uploading_ || (state_ == relay_state && header.sequence_id == 0);
+
+  return server_stream_.continued_
+         || (awaiting_response_ && !replaying_
+             && response_state_ == response_rows);
+}
+
+bool
+connection::relay_stream (boost::asio::ip::tcp::socket &sock)
+{
+  bool client = &sock == &client_socket_;
+  mysqlproxy_common::ring_buffer &buf = client ? client_buffer_
+                                               : server_buffer_;
+  stream &s = client ? client_stream_ : server_stream_;
+
+  // The rest of a command waits until the command was sent
+  if (client && !uploading_)
+    return false;
+
+  buffer chunk;
+  chunk.raw_ = true;
+  std::size_t n = std::min (s.left_, buf.size ());
+  chunk.data_ = mysqlproxy_common::packet_pool::allocate (n);
+  buf.copy (0, chunk.data_->data (), n);
+  buf.consume (n);
+  s.left_ -= n;
+
+  if (buf.empty () && buf.capacity () > read_buffer_size)
+    buf.reset (read_buffer_size);
+
+  for_write_.push_back (chunk);
+  queued_bytes_ += n;
+
+  if (client)
+    {
+      if (s.left_ > 0 || infile_ || s.continued_)
+        return true;
+
+      uploading_ = false;
+      if (writing_.empty ())
+        do_write (server_socket ());
+      return false;
+    }
+
+  response_bytes_ += n;
+
+  if (writing_.empty ())
+    do_write (client_socket_);
+
+  if (queued_bytes_ >= high_watermark)
+    {
+      read_paused_ = true;
+      return false;
     }
 
-  buffer &buf = &sock == &server_socket_ ? server_buffer_ : client_buffer_;
+  return true;
+}
+
+bool
+connection::upload (const buffer &buf)
+{
+  for_write_.push_back (buf);
+  queued_bytes_ += header_lenght + buf.data_->size ();
+
+  // The file of LOAD DATA LOCAL ends with an empty packet, a long command
+  // with a packet shorter than 0xffffff bytes
+  if (client_stream_.left_ > 0
+      || (infile_ ? buf.data_->size () > 0 : client_stream_.continued_))
+    return true;
+
+  uploading_ = false;
+  infile_ = false;
+  if (writing_.empty ())
+    do_write (server_socket ());
+  return false;
+}
+
+bool
+connection::partial_command () const
+{
+  return client_stream_.left_ > 0 || client_stream_.continued_;
+}
+
+bool
+connection::on_packet (boost::asio::ip::tcp::socket &sock, buffer &buf)
+{
+  if (buf.data_->size () == 0)
+    buf.data_->data ()[0] = 0;
 
-  mysqlproxy_common::protocol::command *com
-      = reinterpret_cast<mysqlproxy_common::protocol::command *> (
-          buf.data_.data ());
+  const mysqlproxy_common::protocol::command *com
+      = reinterpret_cast<const mysqlproxy_common::protocol::command *> (
+          buf.data_->data ());
 
-  if (&buf == &client_buffer_)
+  if (&sock == &client_socket_)
     {
-      if (com->value == MYSQLPROXY_PROTOCOL_COM_QUERY)
+      if (uploading_)
+        return upload (buf);
+
+      client_sequence_id_ = buf.header_[3];
+
+      login_ = false;
+
+      if (state_ == auth_state && !backends_.pooled ())
+        {
+          // Relayed handshake, only note the client capabilities
+          mysqlproxy_common::protocol::parse_handshake_response (
+              buf.data_->data (), buf.data_->size (), client_);
+          state_ = relay_state;
+          login_ = true;
+          reset_cache_scope ();
+          // Pooled sessions never negotiate it, the server relayed here does
+          deprecate_eof_
+              = client_.capabilities & MYSQLPROXY_CLIENT_DEPRECATE_EOF;
+        }
+      else if (state_ != relay_state)
+        return on_auth_packet (buf);
+
+      if (backends_.pooled ())
         {
-          mysqlproxy_common::protocol::query *query
-              = reinterpret_cast<mysqlproxy_common::protocol::query *> (
-                  com->data);
+          switch (com->value)
+            {
+            case MYSQLPROXY_PROTOCOL_COM_QUIT:
+              // Keep the pooled session open
+              stop ();
+              return false;
 
-          CXXLOG_INFO (writer_, "on_read_data: "
-                                    << "COM_QUERY \"" << query->text << "\""
-                                    << std::endl);
+            case MYSQLPROXY_PROTOCOL_COM_CHANGE_USER:
+              send_error (MYSQLPROXY_ER_UNKNOWN_ERROR, "HY000",
+                          "COM_CHANGE_USER is not supported by the proxy");
+              return false;
+            }
         }
 
-      client_command_ = com->value;
+      // A replay could not send the part of a long command not received
+      if (mysqlproxy_common::traffic_capture::enabled () && !login_
+          && !partial_command ())
+        capture (buf);
+
+      pending_ = buf;
+      query_start_ = upstream::clock_type::now ();
+      response_rows_ = 0;
+      response_bytes_ = 0;
+      route_ = route_command (buf);
+      sequence_shift_ = 0;
+
+      if ((mysqlproxy_common::result_cache::enabled () || coalesce)
+          && cached_response ())
+        return false;
+
+      // One command at a time: the next one stays buffered until the
+      // response has been relayed.
+      execute ();
+      return false;
     }
-  else
+
+  held_session &session = sessions_[route_];
+
+  if (replaying_)
     {
-      mysqlproxy_common::protocol::command *com_cl
-          = reinterpret_cast<mysqlproxy_common::protocol::command *> (
-              client_buffer_.data_.data ());
+      // Responses to the session history are not for the client
+      if (!end_of_response (buf))
+        return true;
+
+      replaying_ = false;
+      awaiting_response_ = false;
+      session.upstream_->request_finished (upstream::clock_type::now ()
+                                           - request_start_);
 
-      if (com->value != MYSQLPROXY_PROTOCOL_OK_PACKET
-          && com->value != MYSQLPROXY_PROTOCOL_ERR_PACKET
-          && com->value != MYSQLPROXY_PROTOCOL_EOF_PACKET
-          && client_command_ == MYSQLPROXY_PROTOCOL_COM_QUERY)
+      if (!response_error_)
+        session.backend_->applied (session_history_[session.synced_]);
+      else
         {
-          for_write_.push_back (buf);
+          CXXLOG_WARNING (writer_, "on_packet: "
+                                       << session.upstream_->endpoint ()
+                                       << ": replaying \""
+                                       << session_history_[session.synced_]
+                                              .substr (1)
+                                       << "\" failed" << std::endl);
+          metrics::add (metrics::errors_replay);
+          session.backend_->taint ();
+        }
+
+      ++session.synced_;
+      execute ();
+      return false;
+    }
+
+  buf.header_[3] += sequence_shift_;
 
-          do_read (server_socket_);
-          return;
+  if (cache_fill_)
+    {
+      std::size_t bytes = header_lenght + buf.data_->size ();
+      if (server_stream_.left_ > 0
+          || cache_fill_->bytes + bytes
+                 > mysqlproxy_common::result_cache_entry_bytes)
+        {
+          cache_fill_.reset ();
+          land_flight (mysqlproxy_common::result_cache::response_ptr ());
+        }
+      else
+        {
+          mysqlproxy_common::result_cache::packet p;
+          p.header = buf.header_;
+          p.data = buf.data_;
+          cache_fill_->packets.push_back (p);
+          cache_fill_->bytes += bytes;
         }
     }
 
+  // Server packets are relayed to the client as they arrive; only the end
+  // of the response hands the turn back to the client. Continuations are
+  // part of the packet before them.
+  response_done_ = !server_stream_.continuation_ && end_of_response (buf);
+  response_bytes_ += header_lenght + buf.data_->size ();
+
+  if (response_done_ && awaiting_response_)
+    finish_command (session);
+
   for_write_.push_back (buf);
-  do_write (&sock == &server_socket_ ? client_socket_ : server_socket_);
+  queued_bytes_ += header_lenght + buf.data_->size ();
+
+  if (writing_.empty ())
+    do_write (client_socket_);
+
+  // The client sends the file asked for once this is written
+  if (response_done_ || uploading_)
+    return false;
+
+  if (queued_bytes_ >= high_watermark)
+    {
+      read_paused_ = true;
+      return false;
+    }
+
+  return true;
+}
+
+bool
+connection::end_of_response (const buffer &buf)
+{
+  const uint8_t *data = buf.data_->data ();
+  std::size_t size = buf.data_->size ();
+
+  mysqlproxy_common::protocol::ok_packet ok;
+
+  // Rows and definitions never start with 0xff
+  if (data[0] == MYSQLPROXY_PROTOCOL_ERR_PACKET)
+    {
+      response_state_ = response_first;
+      response_error_ = true;
+      response_error_code_
+          = size >= 3 ? uint16_t (data[1] | data[2] << 8) : 0;
+      return true;
+    }
+
+  // In a relayed login the OK follows a caching_sha2_password fast
+  // authentication without waiting for the client. Any other packet but
+  // OK or ERR asks the client for the next step.
+  if (client_command_ == 0 && size == 2
+      && data[0] == MYSQLPROXY_PROTOCOL_AUTH_MORE_DATA_PACKET
+      && data[1] == MYSQLPROXY_AUTH_SHA2_FAST_AUTH_SUCCESS)
+    return false;
+
+  switch (client_command_)
+    {
+    case MYSQLPROXY_PROTOCOL_COM_QUERY:
+    case MYSQLPROXY_PROTOCOL_COM_FIELD_LIST:
+    case MYSQLPROXY_PROTOCOL_COM_STMT_PREPARE:
+    case MYSQLPROXY_PROTOCOL_COM_STMT_EXECUTE:
+    case MYSQLPROXY_PROTOCOL_COM_STMT_FETCH:
+      break;
+
+    default:
+      // Packets past the end of a response are not status reports
+      if (awaiting_response_ && data[0] == MYSQLPROXY_PROTOCOL_OK_PACKET
+          && mysqlproxy_common::protocol::parse_ok (data, size, ok))
+        server_status_ = ok.status;
+      return true;
+    }
+
+  // A row whose first value is 0xfe long takes 9 bytes at least, and under
+  // CLIENT_DEPRECATE_EOF one of 2^24 bytes a full packet
+  bool eof = data[0] == MYSQLPROXY_PROTOCOL_EOF_PACKET
+             && size < (deprecate_eof_ ? 0xffffff : 9);
+
+  switch (response_state_)
+    {
+    case response_first:
+      if (client_command_ == MYSQLPROXY_PROTOCOL_COM_STMT_PREPARE)
+        {
+          mysqlproxy_common::protocol::prepare_ok prepared;
+          if (!mysqlproxy_common::protocol::parse_prepare_ok (data, size,
+                                                              prepared))
+            return true;
+
+          response_left_ = prepared.params;
+          prepare_columns_ = prepared.columns;
+          response_state_ = response_params;
+          return response_left_ == 0 && end_of_definitions ();
+        }
+
+      if (client_command_ == MYSQLPROXY_PROTOCOL_COM_QUERY
+          && data[0] == MYSQLPROXY_PROTOCOL_LOCAL_INFILE_PACKET)
+        {
+          // The OK or ERR for the file comes once the client sent it
+          uploading_ = true;
+          infile_ = true;
+          return false;
+        }
+
+      if (data[0] != MYSQLPROXY_PROTOCOL_OK_PACKET)
+        {
+          mysqlproxy_common::protocol::payload_reader r (data, size);
+          if (!r.read_lenenc (response_left_) || response_left_ == 0)
+            return true;
+
+          response_state_ = response_columns;
+          return false;
+        }
+      break;
+
+    case response_params:
+    case response_columns:
+      if (--response_left_ > 0)
+        return false;
+      if (!deprecate_eof_)
+        {
+          response_state_ = response_state_ == response_params
+                                ? response_params_eof
+                                : response_columns_eof;
+          return false;
+        }
+      return end_of_definitions ();
+
+    case response_params_eof:
+      return end_of_definitions ();
+
+    case response_columns_eof:
+      // A cursor was opened instead of sending the rows
+      if (client_command_ == MYSQLPROXY_PROTOCOL_COM_STMT_EXECUTE
+          && mysqlproxy_common::protocol::parse_ok (data, size, ok)
+          && (ok.status & MYSQLPROXY_SERVER_STATUS_CURSOR_EXISTS))
+        {
+          response_state_ = response_first;
+          server_status_ = ok.status;
+          return true;
+        }
+      return end_of_definitions ();
+
+    case response_rows:
+      if (!eof)
+        {
+          ++response_rows_;
+          return false;
+        }
+      response_state_ = response_first;
+      break;
+
+    case response_fields:
+      if (!eof)
+        return false;
+      response_state_ = response_first;
+      break;
+    }
+
+  if (!mysqlproxy_common::protocol::parse_ok (data, size, ok))
+    return true;
+
+  server_status_ = ok.status;
+
+  // Multi-statements and CALL chain further results
+  return !(ok.status & MYSQLPROXY_SERVER_MORE_RESULTS_EXISTS);
+}
+
+bool
+connection::end_of_definitions ()
+{
+  if (response_state_ == response_params
+      || response_state_ == response_params_eof)
+    {
+      response_left_ = prepare_columns_;
+      prepare_columns_ = 0;
+      response_state_ = response_columns;
+      if (response_left_ > 0)
+        return false;
+    }
+
+  if (client_command_ == MYSQLPROXY_PROTOCOL_COM_STMT_PREPARE)
+    {
+      response_state_ = response_first;
+      return true;
+    }
+
+  response_state_ = response_rows;
+  return false;
 }
 
 void
-connection::on_write (boost::asio::ip::tcp::socket &sock,
-                      const boost::system::error_code &err,
-                      std::size_t /*bytes_transferred*/)
+connection::finish_command (held_session &session)
 {
-  if (err)
+  upstream::clock_type::time_point now = upstream::clock_type::now ();
+
+  awaiting_response_ = false;
+  session.upstream_->request_finished (now - request_start_);
+
+  uint64_t micros = boost::asio::chrono::duration_cast<
+                        boost::asio::chrono::microseconds> (
+                        now - query_start_)
+                        .count ();
+
+  if (client_command_ == MYSQLPROXY_PROTOCOL_COM_QUERY)
+    mysqlproxy_common::digest_stats::record (digest_, micros, response_error_,
+                                             response_rows_, response_bytes_);
+
+  if (mysqlproxy_common::audit_log::enabled () && pending_.data_)
+    audit (micros);
+
+  if ((mysqlproxy_common::result_cache::enabled () || coalesce)
+      && pending_.data_)
+    update_cache ();
+
+  if (record_ && !response_error_)
+    {
+      std::string command (
+          reinterpret_cast<const char *> (pending_.data_->data ()),
+          pending_.data_->size ());
+
+      if (session_history_.size () < max_session_history)
+        {
+          if (session_history_.empty () || session_history_.back () != command)
+            session_history_.push_back (command);
+
+          session.backend_->applied (command);
+          session.synced_ = session_history_.size ();
+        }
+      else
+        {
+          CXXLOG_WARNING (writer_, "finish_command: session history full, \""
+                                       << command.substr (1)
+                                       << "\" keeps the session"
+                                       << std::endl);
+          sticky_ = true;
+          session.backend_->taint ();
+        }
+    }
+
+  record_ = false;
+  pending_.data_.reset ();
+
+  if (multiplex && !pinned ())
+    check_in ();
+}
+
+void
+connection::audit (uint64_t micros)
+{
+  const uint8_t *data = pending_.data_->data ();
+  std::size_t size = pending_.data_->size ();
+
+  mysqlproxy_common::audit_event event;
+  event.micros = boost::asio::chrono::duration_cast<
+                     boost::asio::chrono::microseconds> (
+                     boost::asio::chrono::system_clock::now ()
+                         .time_since_epoch ())
+                     .count ()
+                 - int64_t (micros);
+  event.client = client_endpoint_;
+  event.command = login_ ? 0 : data[0];
+  event.digest = 0;
+  event.text = 0;
+  event.text_length = 0;
+  event.latency_micros = micros;
+  event.error = response_error_ ? response_error_code_ : 0;
+  event.rows = response_rows_;
+
+  if (event.command == MYSQLPROXY_PROTOCOL_COM_QUERY
+      && mysqlproxy_common::protocol::query_text (
+          data, size, client_.capabilities, event.text, event.text_length))
+    event.digest = digest_.hash;
+
+  mysqlproxy_common::audit_log::record (event);
+}
+
+void
+connection::capture (const buffer &buf)
+{
+  typedef mysqlproxy_common::traffic_capture traffic_capture;
+
+  if (!capture_session_)
     {
-      CXXLOG_ERROR (writer_, "on_read_data: " << err.message () << std::endl);
+      capture_session_ = traffic_capture::new_session ();
+
+      std::string login (client_.user);
+      login += '\0';
+      login += client_.database;
+      traffic_capture::record (capture_session_, capture_index_++,
+                               traffic_capture::session_open, login.data (),
+                               login.size ());
+    }
+
+  traffic_capture::record (capture_session_, capture_index_++,
+                           traffic_capture::command, buf.data_->data (),
+                           buf.data_->size ());
+}
+
+void
+connection::send_greeting ()
+{
+  namespace protocol = mysqlproxy_common::protocol;
+
+  protocol::handshake server = backends_.greeting ();
+
+  protocol::handshake hs;
+  hs.protocol_version = 10;
+  hs.server_version
+      = server.server_version.empty () ? "5.7.0" : server.server_version;
+  hs.connection_id = connection_id.fetch_add (1);
+  mysqlproxy_common::auth::random_scramble (20, scramble_);
+  hs.scramble = scramble_;
+  hs.capabilities = backend::capabilities_mask;
+  if (server.capabilities)
+    hs.capabilities &= server.capabilities;
+  hs.charset = server.charset ? server.charset : 45; // utf8mb4_general_ci
+  hs.status = MYSQLPROXY_SERVER_STATUS_AUTOCOMMIT;
+  hs.auth_plugin = MYSQLPROXY_AUTH_NATIVE_PASSWORD;
+
+  std::string payload;
+  protocol::build_handshake (hs, payload);
+
+  queue_packet (0, payload);
+  response_done_ = true;
+  do_write (client_socket_);
+}
+
+bool
+connection::on_auth_packet (buffer &buf)
+{
+  namespace protocol = mysqlproxy_common::protocol;
+  namespace auth = mysqlproxy_common::auth;
+
+  const uint8_t *data = buf.data_->data ();
+  std::size_t size = buf.data_->size ();
+
+  if (state_ == auth_switch_state)
+    {
+      on_authenticated (auth::check_native_password (
+          std::string (reinterpret_cast<const char *> (data), size),
+          backend_password, scramble_));
+      return false;
+    }
+
+  if (state_ != auth_state
+      || !protocol::parse_handshake_response (data, size, client_)
+      || (client_.capabilities & MYSQLPROXY_CLIENT_SSL))
+    {
+      metrics::add (metrics::errors_handshake);
+      send_error (MYSQLPROXY_ER_HANDSHAKE_ERROR, "08S01", "Bad handshake");
+      closing_ = true;
+      return false;
+    }
+
+  if (!client_.auth_plugin.empty ()
+      && client_.auth_plugin != MYSQLPROXY_AUTH_NATIVE_PASSWORD)
+    {
+      // Ask for a mysql_native_password token instead
+      std::string payload;
+      protocol::payload_writer w (payload);
+      w.write_u8 (MYSQLPROXY_PROTOCOL_AUTH_SWITCH_PACKET);
+      w.write_null_string (MYSQLPROXY_AUTH_NATIVE_PASSWORD);
+      w.write_null_string (scramble_);
+
+      state_ = auth_switch_state;
+      queue_packet (uint8_t (client_sequence_id_ + 1), payload);
+      response_done_ = true;
+      do_write (client_socket_);
+      return false;
+    }
+
+  on_authenticated (auth::check_native_password (
+      client_.auth_response, backend_password, scramble_));
+  return false;
+}
+
+void
+connection::on_authenticated (bool success)
+{
+  if (!success || client_.user != backend_user)
+    {
+      metrics::add (metrics::errors_auth);
+      send_error (MYSQLPROXY_ER_ACCESS_DENIED_ERROR, "28000",
+                  "Access denied for user '" + client_.user + "'");
+      closing_ = true;
       return;
     }
 
-  for_write_.clear ();
+  state_ = checkout_state;
+  route_ = backends_.primary () ? read_route : write_route;
+  reset_cache_scope ();
 
-  do_read (sock);
+  // Without a database to check, the first command checks a session out
+  if (multiplex && client_.database.empty ())
+    on_checkout ();
+  else
+    acquire ();
+}
+
+void
+connection::acquire ()
+{
+  held_session &session = sessions_[route_];
+
+  session.upstream_ = route_ == write_route && backends_.primary ()
+                          ? backends_.primary ()
+                          : &backends_.select ();
+  session.upstream_->session_started ();
+  session.upstream_->pool ()->async_acquire (boost::bind (
+      &connection::on_acquire, shared_from_this (), _1, _2));
+}
+
+void
+connection::on_acquire (const boost::system::error_code &err,
+                        backend_ptr session)
+{
+  boost::asio::post (strand_,
+                     boost::bind (&connection::handle_acquire,
+                                  shared_from_this (), err, session));
+}
+
+void
+connection::handle_acquire (const boost::system::error_code &err,
+                            backend_ptr session)
+{
+  held_session &held = sessions_[route_];
+
+  if (stopped_)
+    {
+      if (!err)
+        held.upstream_->pool ()->release (session, true);
+      return;
+    }
+
+  if (err)
+    {
+      checkout_failed ();
+      return;
+    }
+
+  // State left by other clients must be cleared unless this client set it
+  // up the same way
+  const std::vector<std::string> &applied = session->history ();
+  if (session->tainted () || applied.size () > session_history_.size ()
+      || !std::equal (applied.begin (), applied.end (),
+                      session_history_.begin ()))
+    {
+      session->async_reset (boost::bind (&connection::on_reset,
+                                         shared_from_this (), session, _1));
+      return;
+    }
+
+  held.backend_ = session;
+  held.synced_ = applied.size ();
+  on_checkout ();
+}
+
+void
+connection::on_reset (backend_ptr session,
+                      const boost::system::error_code &err)
+{
+  boost::asio::post (strand_,
+                     boost::bind (&connection::handle_reset,
+                                  shared_from_this (), session, err));
+}
+
+void
+connection::handle_reset (backend_ptr session,
+                          const boost::system::error_code &err)
+{
+  held_session &held = sessions_[route_];
+
+  if (err)
+    {
+      CXXLOG_WARNING (writer_, "handle_reset: "
+                                   << held.upstream_->endpoint () << ": "
+                                   << session->last_error () << std::endl);
+      metrics::add (metrics::errors_reset);
+    }
+
+  if (stopped_ || err)
+    {
+      held.upstream_->pool ()->release (session, !err);
+      if (err && !stopped_)
+        checkout_failed ();
+      return;
+    }
+
+  held.backend_ = session;
+  held.synced_ = 0;
+  on_checkout ();
+}
+
+void
+connection::checkout_failed ()
+{
+  held_session &held = sessions_[route_];
+
+  metrics::add (metrics::errors_checkout);
+
+  held.upstream_->failed ();
+  held.upstream_->session_ended ();
+  held.upstream_ = 0;
+  pending_.data_.reset ();
+
+  send_error (MYSQLPROXY_ER_UNKNOWN_ERROR, "HY000",
+              "No server session available");
+  if (state_ == checkout_state)
+    closing_ = true;
+}
+
+void
+connection::on_checkout ()
+{
+  if (state_ != checkout_state)
+    {
+      execute ();
+      return;
+    }
+
+  state_ = relay_state;
+
+  if (!client_.database.empty ())
+    {
+      // The reply to COM_INIT_DB completes the client login
+      std::string payload (1, char (MYSQLPROXY_PROTOCOL_COM_INIT_DB));
+      payload += client_.database;
+
+      pending_ = make_packet (0, payload);
+      record_ = true;
+      sequence_shift_ = client_sequence_id_;
+      execute ();
+      return;
+    }
+
+  std::string payload;
+  mysqlproxy_common::protocol::build_ok (MYSQLPROXY_SERVER_STATUS_AUTOCOMMIT,
+                                         payload);
+
+  queue_packet (uint8_t (client_sequence_id_ + 1), payload);
+  response_done_ = true;
+  do_write (client_socket_);
+}
+
+void
+connection::check_in ()
+{
+  for (std::size_t i = 0; i < 2; i++)
+    {
+      held_session &session = sessions_[i];
+
+      if (!session.backend_)
+        continue;
+
+      session.upstream_->session_ended ();
+      session.upstream_->pool ()->release (session.backend_,
+                                           server_buffer_.empty ());
+      session.upstream_ = 0;
+      session.backend_.reset ();
+      session.synced_ = 0;
+    }
+}
+
+connection::route
+connection::route_command (const buffer &buf)
+{
+  namespace common = mysqlproxy_common;
+
+  const uint8_t *data = buf.data_->data ();
+  std::size_t size = buf.data_->size ();
+
+  common::query_class kind = common::query_write;
+  const char *text;
+  std::size_t length;
+
+  switch (data[0])
+    {
+    case MYSQLPROXY_PROTOCOL_COM_QUERY:
+      if (!common::protocol::query_text (data, size, client_.capabilities,
+                                         text, length))
+        break;
+
+      kind = common::classify_query (text, length);
+      common::make_digest (text, length, digest_);
+      command_class_ = kind;
+
+      CXXLOG_SAMPLED (writer_, INFO, query_log_sample,
+                      "on_packet: "
+                          << "COM_QUERY \"" << digest_.text << "\" ("
+                          << common::query_class_name (kind) << ") digest "
+                          << std::hex << digest_.hash << std::dec);
+      break;
+
+    case MYSQLPROXY_PROTOCOL_COM_INIT_DB:
+      kind = common::query_session;
+      break;
+
+    case MYSQLPROXY_PROTOCOL_COM_PING:
+    case MYSQLPROXY_PROTOCOL_COM_STATISTICS:
+      kind = common::query_diagnostics;
+      break;
+
+    case MYSQLPROXY_PROTOCOL_COM_STMT_PREPARE:
+      // Statement ids belong to the session
+      kind = common::query_sticky;
+      break;
+
+    case MYSQLPROXY_PROTOCOL_COM_BINLOG_DUMP:
+    case MYSQLPROXY_PROTOCOL_COM_BINLOG_DUMP_GTID:
+      // The session streams events from then on
+      kind = common::query_sticky;
+      break;
+    }
+
+  // Only the start of a long command was looked at, it may write anything
+  if (partial_command ())
+    {
+      kind = common::query_write;
+      if (data[0] == MYSQLPROXY_PROTOCOL_COM_QUERY)
+        command_class_ = kind;
+    }
+
+  record_ = backends_.pooled () && kind == common::query_session;
+
+  route target = route_;
+
+  if (backends_.primary () && !pinned ())
+    {
+      switch (kind)
+        {
+        case common::query_read:
+          target = read_route;
+          break;
+
+        case common::query_session:
+          break;
+
+        case common::query_diagnostics:
+          target = statement_route_;
+          break;
+
+        default:
+          target = write_route;
+          break;
+        }
+    }
+
+  if (kind != common::query_session && kind != common::query_diagnostics)
+    {
+      statement_route_ = target;
+      next_transaction_ = kind == common::query_next_transaction;
+    }
+
+  if (kind == common::query_sticky)
+    sticky_ = true;
+
+  return target;
+}
+
+bool
+connection::pinned () const
+{
+  return sticky_ || next_transaction_ || in_transaction ();
+}
+
+bool
+connection::in_transaction () const
+{
+  return (server_status_ & MYSQLPROXY_SERVER_STATUS_IN_TRANS)
+         || !(server_status_ & MYSQLPROXY_SERVER_STATUS_AUTOCOMMIT);
+}
+
+bool
+connection::cached_response ()
+{
+  namespace common = mysqlproxy_common;
+
+  const uint8_t *data = pending_.data_->data ();
+  std::size_t size = pending_.data_->size ();
+
+  cache_fill_.reset ();
+
+  if (data[0] == MYSQLPROXY_PROTOCOL_COM_CHANGE_USER
+      || data[0] == MYSQLPROXY_PROTOCOL_COM_RESET_CONNECTION)
+    cache_scope_ = 0;
+
+  if (data[0] != MYSQLPROXY_PROTOCOL_COM_QUERY)
+    return false;
+
+  const char *text;
+  std::size_t length;
+  if (partial_command ()
+      || !common::protocol::query_text (data, size, client_.capabilities,
+                                        text, length))
+    {
+      // Query attributes or the part not received yet hide the statement,
+      // it may write anything
+      common::result_cache::invalidate_all ();
+      written_unknown_ = true;
+      return false;
+    }
+
+  std::vector<std::string> tables;
+
+  switch (command_class_)
+    {
+    case common::query_read:
+      break;
+
+    case common::query_sticky:
+      // Temporary tables and user variables change what reads return
+      cache_scope_ = 0;
+      // Fall through
+
+    case common::query_write:
+      if (common::referenced_tables (text, length, tables))
+        {
+          common::result_cache::invalidate (tables);
+          written_tables_.insert (written_tables_.end (), tables.begin (),
+                                  tables.end ());
+        }
+      else
+        {
+          common::result_cache::invalidate_all ();
+          written_unknown_ = true;
+        }
+      return false;
+
+    default:
+      return false;
+    }
+
+  if (!cache_scope_ || client_sequence_id_ != 0 || in_transaction ())
+    return false;
+
+  std::size_t ttl = common::result_cache::ttl (digest_.hash);
+  if (!ttl && !coalesce)
+    return false;
+
+  if (ttl)
+    {
+      common::result_cache::response_ptr cached
+          = common::result_cache::find (cache_scope_, text, length);
+      if (cached)
+        {
+          serve_response (cached);
+          return true;
+        }
+    }
+
+  common::referenced_tables (text, length, tables);
+  common::result_cache::snapshot (tables, cache_deps_);
+  cache_ttl_ = ttl;
+
+  if (coalesce)
+    {
+      uint64_t key = common::result_cache::key (cache_scope_, text, length);
+
+      switch (common::single_flight::join (
+          key, cache_scope_, text, length, cache_deps_,
+          boost::bind (&connection::on_coalesced, shared_from_this (), _1)))
+        {
+        case common::single_flight::follower:
+          return true;
+
+        case common::single_flight::leader:
+          flight_ = key;
+          leading_ = true;
+          break;
+
+        case common::single_flight::bypass:
+          break;
+        }
+    }
+
+  if (ttl || leading_)
+    cache_fill_.reset (new common::result_cache::response ());
+  return false;
+}
+
+void
+connection::serve_response (
+    const mysqlproxy_common::result_cache::response_ptr &r)
+{
+  namespace common = mysqlproxy_common;
+
+  for (std::size_t i = 0; i < r->packets.size (); ++i)
+    {
+      buffer packet;
+      packet.header_ = r->packets[i].header;
+      packet.data_ = r->packets[i].data;
+      for_write_.push_back (packet);
+    }
+  queued_bytes_ += r->bytes;
+  response_done_ = true;
+
+  response_error_ = false;
+  response_error_code_ = 0;
+  response_rows_ = r->rows;
+  response_bytes_ = r->bytes;
+
+  uint64_t micros = boost::asio::chrono::duration_cast<
+                        boost::asio::chrono::microseconds> (
+                        upstream::clock_type::now () - query_start_)
+                        .count ();
+  common::digest_stats::record (digest_, micros, false, response_rows_,
+                                response_bytes_);
+  if (common::audit_log::enabled ())
+    audit (micros);
+  pending_.data_.reset ();
+
+  if (writing_.empty ())
+    do_write (client_socket_);
+}
+
+void
+connection::on_coalesced (
+    const mysqlproxy_common::result_cache::response_ptr &r)
+{
+  boost::asio::post (strand_, boost::bind (&connection::handle_coalesced,
+                                           shared_from_this (), r));
+}
+
+void
+connection::handle_coalesced (
+    const mysqlproxy_common::result_cache::response_ptr &r)
+{
+  if (stopped_)
+    return;
+
+  // The leader failed, run the read here
+  if (!r)
+    execute ();
+  else
+    serve_response (r);
+}
+
+void
+connection::land_flight (
+    const mysqlproxy_common::result_cache::response_ptr &r)
+{
+  if (!leading_)
+    return;
+
+  leading_ = false;
+  mysqlproxy_common::single_flight::land (flight_, r);
+}
+
+void
+connection::update_cache ()
+{
+  namespace common = mysqlproxy_common;
+
+  const uint8_t *data = pending_.data_->data ();
+  std::size_t size = pending_.data_->size ();
+  const char *text;
+  std::size_t length;
+
+  if (cache_fill_)
+    {
+      if (!response_error_ && !in_transaction ()
+          && common::protocol::query_text (data, size, client_.capabilities,
+                                           text, length))
+        {
+          cache_fill_->rows = response_rows_;
+          if (cache_ttl_)
+            common::result_cache::store (cache_scope_, text, length,
+                                         cache_fill_, cache_deps_,
+                                         cache_ttl_);
+          land_flight (cache_fill_);
+        }
+      cache_fill_.reset ();
+    }
+  land_flight (common::result_cache::response_ptr ());
+
+  // Reads that ran while the write did may have been cached, and the
+  // writes of a transaction are only seen by others once it ends
+  if (written_unknown_)
+    common::result_cache::invalidate_all ();
+  else if (!written_tables_.empty ())
+    common::result_cache::invalidate (written_tables_);
+
+  if (!in_transaction ())
+    {
+      written_tables_.clear ();
+      written_unknown_ = false;
+    }
+
+  if (cache_scope_ && !response_error_
+      && (data[0] == MYSQLPROXY_PROTOCOL_COM_INIT_DB
+          || (data[0] == MYSQLPROXY_PROTOCOL_COM_QUERY
+              && command_class_ == common::query_session)))
+    cache_scope_ = ((cache_scope_ * 0x9e3779b97f4a7c15ULL)
+                    ^ common::digest_hash (
+                        reinterpret_cast<const char *> (data), size))
+                   | 1;
+}
+
+void
+connection::reset_cache_scope ()
+{
+  std::string state (client_.user);
+  state += '\0';
+  state += client_.database;
+  state += '\0';
+  state += char (client_.charset);
+  state.append (reinterpret_cast<const char *> (&client_.capabilities),
+                sizeof (client_.capabilities));
+
+  // Never 0, which stands for no caching
+  cache_scope_ = mysqlproxy_common::digest_hash (state.data (), state.size ())
+                 | 1;
+}
+
+void
+connection::execute ()
+{
+  held_session &session = sessions_[route_];
+
+  if (!session.backend_)
+    {
+      acquire ();
+      return;
+    }
+
+  buffer command = pending_;
+
+  // Catch up with the SET and USE commands run on the other session
+  replaying_ = session.synced_ < session_history_.size ();
+  if (replaying_)
+    command = make_packet (0, session_history_[session.synced_]);
+
+  // The rest of a long command follows once its start was sent
+  uploading_ = !replaying_ && partial_command ();
+
+  const uint8_t *data = command.data_->data ();
+  std::size_t size = command.data_->size ();
+
+  note_schema (session, data, size);
+
+  // Login and authentication packets relayed past the first are no
+  // commands, whatever their first byte
+  client_command_ = command.header_[3] == 0 ? data[0] : 0;
+  switch (client_command_)
+    {
+    case MYSQLPROXY_PROTOCOL_COM_FIELD_LIST:
+      response_state_ = response_fields;
+      break;
+
+    case MYSQLPROXY_PROTOCOL_COM_STMT_FETCH:
+      response_state_ = response_rows;
+      break;
+
+    case MYSQLPROXY_PROTOCOL_COM_BINLOG_DUMP:
+    case MYSQLPROXY_PROTOCOL_COM_BINLOG_DUMP_GTID:
+      // Events follow until the server or the replica disconnects
+      passthrough_ = true;
+      response_state_ = response_first;
+      break;
+
+    default:
+      response_state_ = response_first;
+      break;
+    }
+  response_error_ = false;
+  response_error_code_ = 0;
+  awaiting_response_ = true;
+  request_start_ = upstream::clock_type::now ();
+  session.upstream_->request_started ();
+
+  for_write_.push_back (command);
+  queued_bytes_ += header_lenght + size;
+
+  do_write (server_socket ());
+}
+
+void
+connection::note_schema (held_session &session, const uint8_t *data,
+                         std::size_t size)
+{
+  if (!backends_.pooled ())
+    return;
+
+  const char *text;
+  std::size_t length;
+
+  if (data[0] == MYSQLPROXY_PROTOCOL_COM_INIT_DB
+      || (data[0] == MYSQLPROXY_PROTOCOL_COM_QUERY
+          && mysqlproxy_common::protocol::query_text (
+              data, size, client_.capabilities, text, length)
+          && is_use_statement (text, length)))
+    session.backend_->schema_changed ();
+}
+
+connection::buffer
+connection::make_packet (uint8_t sequence_id, const std::string &payload)
+{
+  buffer packet;
+
+  mysqlproxy_common::protocol::prefix *header
+      = reinterpret_cast<mysqlproxy_common::protocol::prefix *> (
+          packet.header_.data ());
+  header->payload_length = uint32_t (payload.size ());
+  header->sequence_id = sequence_id;
+
+  packet.data_ = mysqlproxy_common::packet_pool::allocate (payload.size ());
+  std::copy (payload.begin (), payload.end (), packet.data_->data ());
+
+  return packet;
+}
+
+void
+connection::queue_packet (uint8_t sequence_id, const std::string &payload)
+{
+  for_write_.push_back (make_packet (sequence_id, payload));
+  queued_bytes_ += header_lenght + payload.size ();
+}
+
+void
+connection::send_error (uint16_t code, const char *sql_state,
+                        const std::string &message)
+{
+  std::string payload;
+  mysqlproxy_common::protocol::build_err (code, sql_state, message, payload);
+
+  queue_packet (uint8_t (client_sequence_id_ + 1), payload);
+  response_done_ = true;
+
+  // Reads waiting for this one run on their own
+  land_flight (mysqlproxy_common::result_cache::response_ptr ());
+
+  // The rest of a long command would be taken for the next commands
+  if (state_ == relay_state && partial_command ())
+    closing_ = true;
+
+  if (writing_.empty ())
+    do_write (client_socket_);
+}
+
+void
+connection::do_relay ()
+{
+  if (!for_write_.empty ())
+    do_write (client_socket_);
+
+  if (read_paused_ && queued_bytes_ <= low_watermark)
+    {
+      read_paused_ = false;
+      do_read (server_socket ());
+    }
+
+  if (response_done_ && queued_bytes_ == 0)
+    {
+      response_done_ = false;
+      do_read (client_socket_);
+    }
+  else if (uploading_ && queued_bytes_ == 0)
+    do_read (client_socket_);
+}
+
+void
+connection::on_write (boost::asio::ip::tcp::socket &sock,
+                      const boost::system::error_code &err,
+                      std::size_t bytes_transferred)
+{
+  if (err)
+    {
+      if (!stopped_)
+        {
+          CXXLOG_RATE_LIMITED (writer_, ERROR, io_error_log_rate,
+                               "on_write: " << err.message ());
+          metrics::add (&sock == &client_socket_ ? metrics::errors_client_io
+                                                 : metrics::errors_server_io);
+        }
+      stop ();
+      return;
+    }
+
+  metrics::add (&sock == &client_socket_ ? metrics::client_bytes_sent
+                                         : metrics::server_bytes_sent,
+                bytes_transferred);
+
+  writing_.clear ();
+  queued_bytes_ -= bytes_transferred;
+
+  if (closing_ && queued_bytes_ == 0)
+    stop ();
+  else if (&sock == &client_socket_)
+    do_relay ();
+  else if (!for_write_.empty ())
+    do_write (sock);
+  else if (passthrough_)
+    start_passthrough ();
+  else if (uploading_)
+    do_read (client_socket_);
+  else if (awaiting_response_
+           && (client_command_ == MYSQLPROXY_PROTOCOL_COM_STMT_CLOSE
+               || client_command_
+                      == MYSQLPROXY_PROTOCOL_COM_STMT_SEND_LONG_DATA))
+    {
+      // Nothing comes back, the client may send its next command
+      response_done_ = true;
+      finish_command (sessions_[route_]);
+      do_relay ();
+    }
+  else
+    do_read (sock);
 }
 } // namespace server
-} // namespace mysqlproxy_tracker
\ No newline at end of file
+} // namespace mysqlproxy_tracker
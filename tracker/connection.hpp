@@ -9,7 +9,16 @@
 #include <boost/shared_ptr.hpp>
 #include <vector>
 
+#include "backend.hpp"
+#include "balancer.hpp"
+#include "common/handler_allocator.hpp"
 #include "common/mysql.hpp"
+#include "common/packet_pool.hpp"
+#include "common/query_classifier.hpp"
+#include "common/query_digest.hpp"
+#include "common/result_cache.hpp"
+#include "common/ring_buffer.hpp"
+#include "passthrough.hpp"
 #include "system/logger_service.hpp"
 
 namespace mysqlproxy_tracker
@@ -17,12 +26,47 @@ namespace mysqlproxy_tracker
 namespace server
 {
 
+// Initial size of the per-direction receive ring
+extern std::size_t read_buffer_size;
+
+// Bytes queued for the client above which reading from the server is paused
+extern std::size_t high_watermark;
+
+// Bytes queued for the client below which reading from the server resumes
+extern std::size_t low_watermark;
+
+// Payload size above which packets are relayed as their bytes arrive when
+// no more than their start is looked at
+extern std::size_t cut_through_size;
+
+// Check pooled sessions in between statements and transactions instead of
+// holding them until the client disconnects
+extern bool multiplex;
+
+// Run identical reads in flight at the same time once, sharing the response
+extern bool coalesce;
+
+// Log one COM_QUERY in this many, none when 0
+extern std::size_t query_log_sample;
+
+// Copy the unparsed traffic through user space instead of splicing it
+// through kernel pipes
+extern bool passthrough_copy;
+
 class connection : public boost::enable_shared_from_this<connection>,
                    private boost::noncopyable
 {
 public:
-  explicit connection (boost::asio::io_context &io_context,
-                       mysqlproxy_system::basic_logger &writer);
+  /// Without pools the client handshake is relayed to a server connected
+  /// for this client only, otherwise the proxy authenticates the client and
+  /// checks out a pooled session. Either way the server is picked by
+  /// backends. With a primary, reads go to a second session on a replica.
+  /// When multiplexing, pooled sessions are only held while a statement or
+  /// transaction runs. A passthrough connection gets a server of its own
+  /// and its bytes are relayed both ways without being parsed.
+  connection (boost::asio::io_context &io_context,
+              mysqlproxy_system::basic_logger &writer, balancer &backends,
+              bool passthrough = false);
 
   boost::asio::ip::tcp::socket &server_socket ();
   boost::asio::ip::tcp::socket &client_socket ();
@@ -33,37 +77,358 @@ private:
   static const std::size_t header_lenght
       = sizeof (mysqlproxy_common::protocol::prefix);
 
+  // Copies share the payload
   struct buffer
   {
+    buffer () : header_ (), raw_ (false) {}
+
     boost::array<uint8_t, header_lenght> header_;
-    std::vector<uint8_t> data_;
+    mysqlproxy_common::packet_ptr data_;
+    // Part of a packet relayed as it arrives, written without header_
+    bool raw_;
+  };
+
+  // Framing of the packets of one direction
+  struct stream
+  {
+    stream () : left_ (0), continuation_ (false), continued_ (false) {}
+
+    // Payload bytes of the current packet still to relay as they arrive
+    std::size_t left_;
+    // The current packet continues the previous one, of 0xffffff bytes
+    bool continuation_;
+    // The current packet is 0xffffff bytes, the next one continues it
+    bool continued_;
+  };
+
+  // Buffer sequence over a gather list, copied into the write operation
+  // instead of the list itself
+  class buffer_range
+  {
+  public:
+    typedef boost::asio::const_buffer value_type;
+    typedef const boost::asio::const_buffer *const_iterator;
+
+    explicit buffer_range (const std::vector<boost::asio::const_buffer> &v)
+        : begin_ (v.empty () ? 0 : &v[0]), end_ (begin_ + v.size ())
+    {
+    }
+
+    const_iterator
+    begin () const
+    {
+      return begin_;
+    }
+
+    const_iterator
+    end () const
+    {
+      return end_;
+    }
+
+  private:
+    const_iterator begin_;
+    const_iterator end_;
+  };
+
+  enum state
+  {
+    // Waiting for the Handshake Response of the client
+    auth_state,
+    // Waiting for the reply to an Auth Switch Request
+    auth_switch_state,
+    // Waiting for a pooled session
+    checkout_state,
+    // Relaying commands
+    relay_state,
+  };
+
+  // Session a command runs on
+  enum route
+  {
+    // The primary when splitting, the only session otherwise
+    write_route,
+    read_route,
+  };
+
+  // A server session of the client
+  struct held_session
+  {
+    upstream *upstream_;
+    backend_ptr backend_;
+    // Entries of session_history_ the session has run
+    std::size_t synced_;
+  };
+
+  // Position in the response to a command returning result sets or
+  // definitions
+  enum response_state
+  {
+    // OK, ERR, the column count of a result set or a COM_STMT_PREPARE OK
+    response_first,
+    // Parameter definitions of a prepared statement, response_left_ more
+    response_params,
+    // Column definitions, response_left_ more
+    response_columns,
+    // EOF after the definitions, without CLIENT_DEPRECATE_EOF
+    response_params_eof,
+    response_columns_eof,
+    // Rows up to the EOF, or OK under CLIENT_DEPRECATE_EOF, ending the
+    // result set
+    response_rows,
+    // COM_FIELD_LIST column definitions up to their EOF
+    response_fields,
   };
 
   void handle_connect (const boost::system::error_code &err);
 
+  // Stop parsing and relay the rest of the traffic as it is
+  void start_passthrough ();
+  void on_passthrough_end (const boost::system::error_code &err);
+
+  // Close both sockets, cancelling any outstanding operations
+  void stop ();
+
   void do_read (boost::asio::ip::tcp::socket &sock);
   void do_write (boost::asio::ip::tcp::socket &sock);
-  void on_read_header (boost::asio::ip::tcp::socket &sock,
-                       const boost::system::error_code &err,
-                       std::size_t bytes_transferred);
-  void on_read_data (boost::asio::ip::tcp::socket &sock,
-                     const boost::system::error_code &err,
-                     std::size_t bytes_transferred);
+  void do_relay ();
+  void on_read (boost::asio::ip::tcp::socket &sock,
+                const boost::system::error_code &err,
+                std::size_t bytes_transferred);
+
+  // Frame the packets buffered for sock, return true if more data is needed
+  bool dispatch (boost::asio::ip::tcp::socket &sock);
+
+  // Whether the packet starting with header may be relayed before all of
+  // it was received
+  bool streamable (boost::asio::ip::tcp::socket &sock,
+                   const mysqlproxy_common::protocol::prefix &header) const;
+
+  // Relay the buffered bytes of the packet streamed from sock, return true
+  // to keep reading from sock
+  bool relay_stream (boost::asio::ip::tcp::socket &sock);
+
+  // Relay a client packet belonging to the command sent, return true to
+  // keep reading the client
+  bool upload (const buffer &buf);
+
+  // Only the start of the command in pending_ was received
+  bool partial_command () const;
+
+  // Handle one packet, return true to keep reading from sock
+  bool on_packet (boost::asio::ip::tcp::socket &sock, buffer &buf);
+
+  // Follow the response to the last command, return true at its last packet
+  bool end_of_response (const buffer &buf);
+
+  // Past the last definition of a block, return true at the end of the
+  // response
+  bool end_of_definitions ();
+
+  // Account for the command whose response just completed
+  void finish_command (held_session &session);
+
+  // Add the command that just completed to the audit log
+  void audit (uint64_t micros);
+
+  // Add a client command to the traffic capture
+  void capture (const buffer &buf);
   void on_write (boost::asio::ip::tcp::socket &sock,
                  const boost::system::error_code &err,
                  std::size_t bytes_transferred);
 
+  // Client authentication against the pool credentials
+  void send_greeting ();
+  bool on_auth_packet (buffer &buf);
+  void on_authenticated (bool success);
+  void on_acquire (const boost::system::error_code &err, backend_ptr session);
+  void handle_acquire (const boost::system::error_code &err,
+                       backend_ptr session);
+  void on_reset (backend_ptr session, const boost::system::error_code &err);
+  void handle_reset (backend_ptr session,
+                     const boost::system::error_code &err);
+  void checkout_failed ();
+
+  // Continue with the session of route_, or finish the login
+  void on_checkout ();
+
+  // Give both sessions back to their pools
+  void check_in ();
+
+  // Pick the session of a client command, note what it changes
+  route route_command (const buffer &buf);
+
+  // Commands stay on their session inside transactions and once
+  // server-bound state was created
+  bool pinned () const;
+
+  bool in_transaction () const;
+
+  // Answer pending_ from the result cache or the response of an identical
+  // read in flight, or get ready to cache and share its response; note the
+  // tables a write changes
+  bool cached_response ();
+
+  // Send a response collected earlier as the answer to pending_
+  void serve_response (
+      const mysqlproxy_common::result_cache::response_ptr &r);
+
+  // Response of the flight pending_ waited for, empty when it failed
+  void on_coalesced (const mysqlproxy_common::result_cache::response_ptr &r);
+  void handle_coalesced (
+      const mysqlproxy_common::result_cache::response_ptr &r);
+
+  // Hand the response to the reads waiting for the flight led
+  void land_flight (const mysqlproxy_common::result_cache::response_ptr &r);
+
+  // Store the completed response, invalidate what the command wrote and
+  // follow the session state the cache scope stands for
+  void update_cache ();
+
+  // Scope of a freshly logged in session
+  void reset_cache_scope ();
+
+  // Run pending_ on the session of route_, checking it out and replaying
+  // the session history first where needed
+  void execute ();
+  void acquire ();
+
+  // Mark the session as needing a full reset if the command changes the
+  // default database
+  void note_schema (held_session &session, const uint8_t *data,
+                    std::size_t size);
+
+  buffer make_packet (uint8_t sequence_id, const std::string &payload);
+
+  // Queue a packet generated by the proxy
+  void queue_packet (uint8_t sequence_id, const std::string &payload);
+  void send_error (uint16_t code, const char *sql_state,
+                   const std::string &message);
+
+  boost::asio::io_context &io_context_;
   boost::asio::strand<boost::asio::io_context::executor_type> strand_;
 
-  boost::asio::ip::tcp::socket server_socket_;
+  // Operation memory of the reads of each socket and of the writes, one
+  // write is in flight at a time
+  mysqlproxy_common::handler_memory client_read_memory_;
+  mysqlproxy_common::handler_memory server_read_memory_;
+  mysqlproxy_common::handler_memory write_memory_;
+
   boost::asio::ip::tcp::socket client_socket_;
+  // Address of the client, for the audit log
+  boost::asio::ip::tcp::endpoint client_endpoint_;
 
   mysqlproxy_system::basic_logger &writer_;
 
-  buffer server_buffer_;
-  buffer client_buffer_;
+  balancer &backends_;
+  held_session sessions_[2];
+  // Session of the command in progress
+  route route_;
+  // Session of the last statement, asked by SHOW WARNINGS and the like
+  route statement_route_;
+
+  mysqlproxy_common::ring_buffer server_buffer_;
+  mysqlproxy_common::ring_buffer client_buffer_;
+  stream server_stream_;
+  stream client_stream_;
+  // Client packets go to the server as part of the command sent: the rest
+  // of a long command or, for infile_, the file of LOAD DATA LOCAL
+  bool uploading_;
+  bool infile_;
+  // Packets waiting for the next write
   std::vector<buffer> for_write_;
+  // Packets of the write in progress
+  std::vector<buffer> writing_;
+  // Gather list of writing_, kept to reuse its capacity
+  std::vector<boost::asio::const_buffer> write_buffers_;
+  // Payload and header bytes held by for_write_ and writing_
+  std::size_t queued_bytes_;
+
+  // Server reads are suspended until the queue drains to low_watermark
+  bool read_paused_;
+  // The last packet of the server response has been received
+  bool response_done_;
+  // A command was sent to the server and its response is not complete
+  bool awaiting_response_;
+  // Close the client once the queued packets are written
+  bool closing_;
+  bool stopped_;
+
+  state state_;
+  std::string scramble_;
+  mysqlproxy_common::protocol::handshake_response client_;
+  uint8_t client_sequence_id_;
+  // Added to the sequence ids of server packets
+  uint8_t sequence_shift_;
+
   uint8_t client_command_;
+  response_state response_state_;
+  // Definitions left in the current block, and the column definitions
+  // following the parameters of a prepared statement
+  uint64_t response_left_;
+  uint16_t prepare_columns_;
+  // Result sets and definitions end with OK instead of EOF packets
+  bool deprecate_eof_;
+  // When the pending command was sent to the server
+  upstream::clock_type::time_point request_start_;
+
+  // Client command waiting for its session, then for its response
+  buffer pending_;
+  // pending_ is the relayed Handshake Response of the client
+  bool login_;
+  // Add pending_ to session_history_ once it succeeded
+  bool record_;
+  // The responses to session_history_ entries are dropped
+  bool replaying_;
+  // Temporary tables, locks or prepared statements live on the session
+  bool sticky_;
+  // Accepted by the passthrough listener, the server was connected for
+  // this client even when pooling
+  bool direct_;
+  // Relay unparsed once the command sent was written, replication clients
+  // only get a stream of events back
+  bool passthrough_;
+  passthrough_ptr relay_;
+  // SET TRANSACTION applies to the next transaction on the same session
+  bool next_transaction_;
+  // Status flags of the last OK or EOF Packet
+  uint16_t server_status_;
+  // The last response ended with an ERR Packet
+  bool response_error_;
+  // Error code of that packet
+  uint16_t response_error_code_;
+  // SET and USE commands, run on sessions checked out later
+  std::vector<std::string> session_history_;
+  // Normalized text of the last COM_QUERY
+  mysqlproxy_common::query_digest digest_;
+  // When the client command arrived, before waiting for a session
+  upstream::clock_type::time_point query_start_;
+  // Rows and bytes relayed for the client command
+  uint64_t response_rows_;
+  uint64_t response_bytes_;
+  // Session of the traffic capture, 0 until the first command, and the
+  // number of its records
+  uint64_t capture_session_;
+  uint32_t capture_index_;
+  // Class of the last COM_QUERY
+  mysqlproxy_common::query_class command_class_;
+  // Hash of the session state cached responses depend on: user, default
+  // database, character set and the SET and USE statements run; 0 when
+  // the state is not known and nothing is cached
+  uint64_t cache_scope_;
+  // Response collected for the cache, the TTL of its rule and the
+  // versions of its tables before it ran
+  boost::shared_ptr<mysqlproxy_common::result_cache::response> cache_fill_;
+  std::size_t cache_ttl_;
+  mysqlproxy_common::result_cache::dependencies cache_deps_;
+  // Key of the flight of identical reads pending_ leads
+  uint64_t flight_;
+  bool leading_;
+  // Tables written by the command in progress and the open transaction,
+  // invalidated again once they complete
+  std::vector<std::string> written_tables_;
+  // A write whose tables are unknown
+  bool written_unknown_;
 };
 
 typedef boost::shared_ptr<connection> connection_ptr;
@@ -71,4 +436,4 @@ typedef boost::shared_ptr<connection> connection_ptr;
 } // namespace server
 } // namespace mysqlproxy_tracker
 
-#endif // MYSQLPROXY_TRACKER_CONNECTION_HPP
\ No newline at end of file
+#endif // MYSQLPROXY_TRACKER_CONNECTION_HPP
@@ -0,0 +1,258 @@
+#include "metrics_server.hpp"
+
+#include <boost/asio/bind_executor.hpp>
+#include <boost/asio/placeholders.hpp>
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/bind/bind.hpp>
+
+#include <istream>
+#include <sstream>
+#include <vector>
+
+#include "common/digest_stats.hpp"
+#include "common/metrics.hpp"
+
+namespace mysqlproxy_tracker
+{
+namespace server
+{
+
+std::string metrics_address = "127.0.0.1";
+std::string metrics_port;
+std::size_t metrics_digests = 20;
+
+namespace
+{
+
+// Longest request head read, and how long a scraper may take to send it
+const std::size_t max_request_size = 8192;
+const int request_timeout = 5;
+
+const char *const digest_seconds = "mysqlproxy_digest_latency_seconds";
+const char *const digest_errors = "mysqlproxy_digest_errors_total";
+
+// Label value with the characters the text format escapes
+void
+write_label (std::ostringstream &os, const std::string &value)
+{
+  for (std::size_t i = 0; i < value.size (); ++i)
+    switch (value[i])
+      {
+      case '\\':
+        os << "\\\\";
+        break;
+      case '"':
+        os << "\\\"";
+        break;
+      case '\n':
+        os << "\\n";
+        break;
+      default:
+        os << value[i];
+        break;
+      }
+}
+
+void
+write_digest_labels (std::ostringstream &os,
+                     const mysqlproxy_common::digest_summary &d)
+{
+  os << "digest=\"" << std::hex << d.hash << std::dec << "\",query=\"";
+  write_label (os, d.text);
+  os << '"';
+}
+
+/// Append the statistics of the digests with the most total latency.
+void
+render_digests (std::string &out)
+{
+  if (!metrics_digests)
+    return;
+
+  std::vector<mysqlproxy_common::digest_summary> digests;
+  mysqlproxy_common::digest_stats::snapshot (digests);
+  if (digests.size () > metrics_digests)
+    digests.resize (metrics_digests);
+
+  static const double quantiles[] = { 0.5, 0.99, 0.999 };
+
+  std::ostringstream os;
+  os << "# HELP " << digest_seconds << " Statement latency per query digest\n"
+     << "# TYPE " << digest_seconds << " summary\n";
+  for (std::size_t i = 0; i < digests.size (); ++i)
+    {
+      const mysqlproxy_common::digest_summary &d = digests[i];
+
+      for (std::size_t q = 0; q < sizeof (quantiles) / sizeof (*quantiles);
+           ++q)
+        {
+          os << digest_seconds << '{';
+          write_digest_labels (os, d);
+          os << ",quantile=\"" << quantiles[q] << "\"} "
+             << double (d.percentile (quantiles[q])) / 1e6 << '\n';
+        }
+
+      os << digest_seconds << "_sum{";
+      write_digest_labels (os, d);
+      os << "} " << double (d.total_micros) / 1e6 << '\n'
+         << digest_seconds << "_count{";
+      write_digest_labels (os, d);
+      os << "} " << d.count << '\n';
+    }
+
+  os << "# HELP " << digest_errors << " Statements failed per query digest\n"
+     << "# TYPE " << digest_errors << " counter\n";
+  for (std::size_t i = 0; i < digests.size (); ++i)
+    {
+      os << digest_errors << '{';
+      write_digest_labels (os, digests[i]);
+      os << "} " << digests[i].errors << '\n';
+    }
+
+  out += os.str ();
+}
+
+} // namespace
+
+metrics_session::metrics_session (boost::asio::io_context &ioc)
+    : strand_ (boost::asio::make_strand (ioc)), socket_ (strand_),
+      timer_ (strand_), request_ (max_request_size), response_ ()
+{
+}
+
+boost::asio::ip::tcp::socket &
+metrics_session::socket ()
+{
+  return socket_;
+}
+
+void
+metrics_session::start ()
+{
+  timer_.expires_after (boost::asio::chrono::seconds (request_timeout));
+  timer_.async_wait (boost::asio::bind_executor (
+      strand_, boost::bind (&metrics_session::on_timeout, shared_from_this (),
+                            boost::asio::placeholders::error)));
+
+  boost::asio::async_read_until (
+      socket_, request_, "\r\n\r\n",
+      boost::asio::bind_executor (
+          strand_,
+          boost::bind (&metrics_session::on_read, shared_from_this (),
+                       boost::asio::placeholders::error,
+                       boost::asio::placeholders::bytes_transferred)));
+}
+
+void
+metrics_session::on_read (const boost::system::error_code &err, std::size_t)
+{
+  if (err)
+    {
+      if (err == boost::asio::error::not_found)
+        respond ("431 Request Header Fields Too Large", "");
+      else
+        timer_.cancel ();
+      return;
+    }
+
+  std::istream is (&request_);
+  std::string method, target;
+  is >> method >> target;
+
+  if (method != "GET")
+    {
+      respond ("405 Method Not Allowed", "");
+      return;
+    }
+
+  if (target != "/metrics")
+    {
+      respond ("404 Not Found", "");
+      return;
+    }
+
+  std::string body;
+  mysqlproxy_common::metrics::render (body);
+  render_digests (body);
+  respond ("200 OK", body);
+}
+
+void
+metrics_session::respond (const char *status, const std::string &body)
+{
+  std::ostringstream os;
+  os << "HTTP/1.1 " << status << "\r\n"
+     << "Content-Type: text/plain; version=0.0.4\r\n"
+     << "Content-Length: " << body.size () << "\r\n"
+     << "Connection: close\r\n\r\n"
+     << body;
+  response_ = os.str ();
+
+  boost::asio::async_write (
+      socket_, boost::asio::buffer (response_),
+      boost::asio::bind_executor (
+          strand_, boost::bind (&metrics_session::on_write,
+                                shared_from_this (),
+                                boost::asio::placeholders::error)));
+}
+
+void
+metrics_session::on_write (const boost::system::error_code &)
+{
+  boost::system::error_code ignored_ec;
+  socket_.shutdown (boost::asio::ip::tcp::socket::shutdown_both, ignored_ec);
+  timer_.cancel ();
+}
+
+void
+metrics_session::on_timeout (const boost::system::error_code &err)
+{
+  if (err == boost::asio::error::operation_aborted)
+    return;
+
+  boost::system::error_code ignored_ec;
+  socket_.close (ignored_ec);
+}
+
+metrics_listener::metrics_listener (boost::asio::io_context &ioc)
+    : io_context_ (ioc), acceptor_ (io_context_), new_session_ ()
+{
+}
+
+void
+metrics_listener::run (const std::string &address, const std::string &port)
+{
+  boost::asio::ip::tcp::resolver resolver (io_context_);
+  boost::asio::ip::tcp::endpoint endpoint
+      = *resolver.resolve (address, port).begin ();
+  acceptor_.open (endpoint.protocol ());
+  acceptor_.set_option (boost::asio::ip::tcp::acceptor::reuse_address (true));
+  acceptor_.bind (endpoint);
+  acceptor_.listen ();
+
+  start_accept ();
+}
+
+void
+metrics_listener::start_accept ()
+{
+  new_session_.reset (new metrics_session (io_context_));
+  acceptor_.async_accept (new_session_->socket (),
+                          boost::bind (&metrics_listener::handle_accept, this,
+                                       boost::asio::placeholders::error));
+}
+
+void
+metrics_listener::handle_accept (const boost::system::error_code &e)
+{
+  if (!e)
+    {
+      new_session_->start ();
+    }
+
+  start_accept ();
+}
+
+} // namespace server
+} // namespace mysqlproxy_tracker
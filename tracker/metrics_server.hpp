@@ -0,0 +1,73 @@
+#ifndef MYSQLPROXY_TRACKER_METRICS_SERVER_HPP
+#define MYSQLPROXY_TRACKER_METRICS_SERVER_HPP
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <string>
+
+namespace mysqlproxy_tracker
+{
+namespace server
+{
+
+// Address and port of the metrics endpoint, disabled without a port
+extern std::string metrics_address;
+extern std::string metrics_port;
+
+// Digests exported, by decreasing total latency
+extern std::size_t metrics_digests;
+
+/// One HTTP request for the metrics, answered then closed.
+class metrics_session
+    : public boost::enable_shared_from_this<metrics_session>,
+      private boost::noncopyable
+{
+public:
+  explicit metrics_session (boost::asio::io_context &ioc);
+
+  boost::asio::ip::tcp::socket &socket ();
+
+  void start ();
+
+private:
+  void on_read (const boost::system::error_code &err, std::size_t length);
+  void on_write (const boost::system::error_code &err);
+  void on_timeout (const boost::system::error_code &err);
+
+  void respond (const char *status, const std::string &body);
+
+  // The timeout and the request handlers do not run concurrently
+  boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+  boost::asio::ip::tcp::socket socket_;
+  boost::asio::steady_timer timer_;
+  boost::asio::streambuf request_;
+  std::string response_;
+};
+
+/// Serves GET /metrics in the Prometheus text format.
+class metrics_listener : private boost::noncopyable
+{
+public:
+  explicit metrics_listener (boost::asio::io_context &ioc);
+
+  void run (const std::string &address, const std::string &port);
+
+private:
+  void start_accept ();
+  void handle_accept (const boost::system::error_code &e);
+
+  boost::asio::io_context &io_context_;
+  boost::asio::ip::tcp::acceptor acceptor_;
+
+  boost::shared_ptr<metrics_session> new_session_;
+};
+
+} // namespace server
+} // namespace mysqlproxy_tracker
+
+#endif // MYSQLPROXY_TRACKER_METRICS_SERVER_HPP
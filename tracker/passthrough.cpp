@@ -0,0 +1,297 @@
+#include "passthrough.hpp"
+
+#include <boost/asio/bind_executor.hpp>
+#include <boost/asio/placeholders.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/bind/bind.hpp>
+
+#include <cerrno>
+
+#if defined(__linux__)
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif // defined(__linux__)
+
+namespace mysqlproxy_tracker
+{
+namespace server
+{
+
+namespace
+{
+typedef mysqlproxy_common::metrics metrics;
+
+// Bytes a pipe is asked to hold, the kernel default is 64 KiB
+const int pipe_size = 256 * 1024;
+
+// Bytes read at a time without zero copy
+const std::size_t copy_size = 64 * 1024;
+
+// Splices of one direction before the other connections get their turn
+const std::size_t max_rounds = 16;
+} // namespace
+
+passthrough::passthrough (const strand_type &strand,
+                          boost::asio::ip::tcp::socket &client,
+                          boost::asio::ip::tcp::socket &server,
+                          bool zero_copy)
+    : strand_ (strand), zero_copy_ (zero_copy && zero_copy_supported ()),
+      done_ (false), handler_ ()
+{
+  directions_[0].from_ = &client;
+  directions_[0].to_ = &server;
+  directions_[0].received_ = metrics::client_bytes_received;
+  directions_[0].sent_ = metrics::server_bytes_sent;
+  directions_[1].from_ = &server;
+  directions_[1].to_ = &client;
+  directions_[1].received_ = metrics::server_bytes_received;
+  directions_[1].sent_ = metrics::client_bytes_sent;
+
+  for (std::size_t i = 0; i < 2; i++)
+    {
+      directions_[i].pipe_[0] = directions_[i].pipe_[1] = -1;
+      directions_[i].piped_ = 0;
+    }
+
+#if defined(__linux__)
+  for (std::size_t i = 0; zero_copy_ && i < 2; i++)
+    {
+      if (::pipe2 (directions_[i].pipe_, O_NONBLOCK | O_CLOEXEC) != 0)
+        {
+          // Out of descriptors, copy instead
+          zero_copy_ = false;
+          break;
+        }
+
+      // Fewer splices per byte; the limit of unprivileged processes may
+      // keep the default size
+      ::fcntl (directions_[i].pipe_[1], F_SETPIPE_SZ, pipe_size);
+    }
+#endif // defined(__linux__)
+
+  if (!zero_copy_)
+    for (std::size_t i = 0; i < 2; i++)
+      directions_[i].buffer_.resize (copy_size);
+}
+
+passthrough::~passthrough ()
+{
+#if defined(__linux__)
+  for (std::size_t i = 0; i < 2; i++)
+    for (std::size_t j = 0; j < 2; j++)
+      if (directions_[i].pipe_[j] >= 0)
+        ::close (directions_[i].pipe_[j]);
+#endif // defined(__linux__)
+}
+
+bool
+passthrough::zero_copy_supported ()
+{
+#if defined(__linux__)
+  return true;
+#else
+  return false;
+#endif // defined(__linux__)
+}
+
+bool
+passthrough::zero_copy () const
+{
+  return zero_copy_;
+}
+
+void
+passthrough::start (const handler_type &handler)
+{
+  handler_ = handler;
+
+  if (!zero_copy_)
+    {
+      copy (0);
+      copy (1);
+      return;
+    }
+
+  // splice(2) fails with EAGAIN instead of blocking the thread
+  boost::system::error_code err;
+  for (std::size_t i = 0; i < 2 && !err; i++)
+    directions_[i].from_->native_non_blocking (true, err);
+  if (err)
+    {
+      finish (err);
+      return;
+    }
+
+  transfer (0);
+  transfer (1);
+}
+
+void
+passthrough::transfer (std::size_t i)
+{
+#if defined(__linux__)
+  direction &d = directions_[i];
+
+  for (std::size_t round = 0; round < max_rounds && !done_; round++)
+    {
+      if (d.piped_ == 0)
+        {
+          ssize_t n = ::splice (d.from_->native_handle (), 0, d.pipe_[1], 0,
+                                pipe_size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+          if (n == 0)
+            {
+              finish (boost::asio::error::eof);
+              return;
+            }
+          if (n < 0)
+            {
+              if (errno == EINTR)
+                continue;
+              if (errno == EAGAIN)
+                wait (i, *d.from_, boost::asio::socket_base::wait_read);
+              else
+                finish (boost::system::error_code (
+                    errno, boost::system::system_category ()));
+              return;
+            }
+
+          d.piped_ = n;
+          metrics::add (d.received_, n);
+        }
+
+      ssize_t n = ::splice (d.pipe_[0], 0, d.to_->native_handle (), 0,
+                            d.piped_, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno == EAGAIN)
+            wait (i, *d.to_, boost::asio::socket_base::wait_write);
+          else
+            finish (boost::system::error_code (
+                errno, boost::system::system_category ()));
+          return;
+        }
+
+      d.piped_ -= n;
+      metrics::add (d.sent_, n);
+    }
+
+  if (done_)
+    return;
+
+  // Still more to move, after the handlers already queued
+  boost::asio::post (strand_, boost::bind (&passthrough::transfer,
+                                           shared_from_this (), i));
+#else
+  (void)i;
+  finish (boost::asio::error::operation_not_supported);
+#endif // defined(__linux__)
+}
+
+void
+passthrough::wait (std::size_t i, boost::asio::ip::tcp::socket &sock,
+                   boost::asio::socket_base::wait_type what)
+{
+  sock.async_wait (
+      what, boost::asio::bind_executor (
+                strand_, mysqlproxy_common::make_custom_alloc_handler (
+                             directions_[i].memory_,
+                             boost::bind (&passthrough::on_ready,
+                                          shared_from_this (), i,
+                                          boost::asio::placeholders::error))));
+}
+
+void
+passthrough::on_ready (std::size_t i, const boost::system::error_code &err)
+{
+  if (done_)
+    return;
+
+  if (err)
+    {
+      finish (err);
+      return;
+    }
+
+  transfer (i);
+}
+
+void
+passthrough::copy (std::size_t i)
+{
+  direction &d = directions_[i];
+
+  d.from_->async_read_some (
+      boost::asio::buffer (d.buffer_),
+      boost::asio::bind_executor (
+          strand_,
+          mysqlproxy_common::make_custom_alloc_handler (
+              d.memory_,
+              boost::bind (&passthrough::on_copy_read, shared_from_this (), i,
+                           boost::asio::placeholders::error,
+                           boost::asio::placeholders::bytes_transferred))));
+}
+
+void
+passthrough::on_copy_read (std::size_t i,
+                           const boost::system::error_code &err,
+                           std::size_t bytes_transferred)
+{
+  if (done_)
+    return;
+
+  if (err)
+    {
+      finish (err);
+      return;
+    }
+
+  direction &d = directions_[i];
+  metrics::add (d.received_, bytes_transferred);
+
+  boost::asio::async_write (
+      *d.to_, boost::asio::buffer (d.buffer_.data (), bytes_transferred),
+      boost::asio::bind_executor (
+          strand_,
+          mysqlproxy_common::make_custom_alloc_handler (
+              d.memory_,
+              boost::bind (&passthrough::on_copy_write, shared_from_this (),
+                           i, boost::asio::placeholders::error,
+                           boost::asio::placeholders::bytes_transferred))));
+}
+
+void
+passthrough::on_copy_write (std::size_t i,
+                            const boost::system::error_code &err,
+                            std::size_t bytes_transferred)
+{
+  if (done_)
+    return;
+
+  if (err)
+    {
+      finish (err);
+      return;
+    }
+
+  metrics::add (directions_[i].sent_, bytes_transferred);
+  copy (i);
+}
+
+void
+passthrough::finish (const boost::system::error_code &err)
+{
+  if (done_)
+    return;
+  done_ = true;
+
+  // The handler may hold the owner of the sockets, which holds this
+  handler_type handler;
+  handler.swap (handler_);
+  handler (err);
+}
+
+} // namespace server
+} // namespace mysqlproxy_tracker
@@ -0,0 +1,96 @@
+#ifndef MYSQLPROXY_TRACKER_PASSTHROUGH_HPP
+#define MYSQLPROXY_TRACKER_PASSTHROUGH_HPP
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <vector>
+
+#include "common/handler_allocator.hpp"
+#include "common/metrics.hpp"
+
+namespace mysqlproxy_tracker
+{
+namespace server
+{
+
+/// Relays the bytes of two sockets both ways without looking at them.
+/**
+ * With zero copy the bytes move from one socket to the other through a
+ * kernel pipe per direction with splice(2) and never reach user space;
+ * otherwise, or when no pipe could be made, they are read into a buffer
+ * per direction and written out again. Either way the bytes count as
+ * received from and sent to the client and the server.
+ */
+class passthrough : public boost::enable_shared_from_this<passthrough>,
+                    private boost::noncopyable
+{
+public:
+  typedef boost::asio::strand<boost::asio::io_context::executor_type>
+      strand_type;
+  typedef boost::function<void (const boost::system::error_code &)>
+      handler_type;
+
+  /// The sockets are connected and outlive the relay, handlers run on
+  /// strand.
+  passthrough (const strand_type &strand,
+               boost::asio::ip::tcp::socket &client,
+               boost::asio::ip::tcp::socket &server, bool zero_copy);
+  ~passthrough ();
+
+  /// Relay until either side closes or fails, then call handler once with
+  /// eof or the error. The sockets are left open.
+  void start (const handler_type &handler);
+
+  /// Whether the bytes go through kernel pipes.
+  bool zero_copy () const;
+
+  static bool zero_copy_supported ();
+
+private:
+  struct direction
+  {
+    boost::asio::ip::tcp::socket *from_;
+    boost::asio::ip::tcp::socket *to_;
+    mysqlproxy_common::metrics::counter received_;
+    mysqlproxy_common::metrics::counter sent_;
+    // Read and write ends of the pipe, and the bytes it holds
+    int pipe_[2];
+    std::size_t piped_;
+    // Bytes read and not written yet without zero copy
+    std::vector<uint8_t> buffer_;
+    // One wait, read or write is in flight per direction
+    mysqlproxy_common::handler_memory memory_;
+  };
+
+  // Splice the bytes of direction i until a socket would block
+  void transfer (std::size_t i);
+  void wait (std::size_t i, boost::asio::ip::tcp::socket &sock,
+             boost::asio::socket_base::wait_type what);
+  void on_ready (std::size_t i, const boost::system::error_code &err);
+
+  void copy (std::size_t i);
+  void on_copy_read (std::size_t i, const boost::system::error_code &err,
+                     std::size_t bytes_transferred);
+  void on_copy_write (std::size_t i, const boost::system::error_code &err,
+                      std::size_t bytes_transferred);
+
+  void finish (const boost::system::error_code &err);
+
+  strand_type strand_;
+  // Client to server, then server to client
+  direction directions_[2];
+  bool zero_copy_;
+  bool done_;
+  handler_type handler_;
+};
+
+typedef boost::shared_ptr<passthrough> passthrough_ptr;
+
+} // namespace server
+} // namespace mysqlproxy_tracker
+
+#endif // MYSQLPROXY_TRACKER_PASSTHROUGH_HPP
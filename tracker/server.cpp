@@ -3,15 +3,29 @@
 #include <boost/asio/placeholders.hpp>
 #include <boost/bind/bind.hpp>
 
+#include "common/metrics.hpp"
+#include "common/processor.hpp"
+
 namespace mysqlproxy_tracker
 {
 namespace server
 {
 
 boost::scoped_ptr<mysqlproxy_system::basic_logger> writer;
+std::string passthrough_port;
+
+#if defined(SO_REUSEPORT)
+namespace
+{
+typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>
+    reuse_port;
+} // namespace
+#endif // defined(SO_REUSEPORT)
 
-listener::listener (boost::asio::io_context &ioc)
-    : io_context_ (ioc), acceptor_ (io_context_), new_connection_ ()
+listener::listener (boost::asio::io_context &ioc, balancer &backends,
+                    bool passthrough)
+    : io_context_ (ioc), acceptor_ (io_context_), backends_ (backends),
+      passthrough_ (passthrough), new_connection_ ()
 {
 }
 
@@ -23,19 +37,31 @@ listener::run (const std::string &address, const std::string &port)
       = *resolver.resolve (address, port).begin ();
   acceptor_.open (endpoint.protocol ());
   acceptor_.set_option (boost::asio::ip::tcp::acceptor::reuse_address (true));
+#if defined(SO_REUSEPORT)
+  if (mysqlproxy_common::shared_nothing)
+    acceptor_.set_option (reuse_port (true));
+#endif // defined(SO_REUSEPORT)
   acceptor_.bind (endpoint);
   acceptor_.listen ();
 
-  writer.reset (
-      new mysqlproxy_system::basic_logger (io_context_, "Connection"));
-
   start_accept ();
 }
 
+bool
+listener::reuse_port_supported ()
+{
+#if defined(SO_REUSEPORT)
+  return true;
+#else
+  return false;
+#endif // defined(SO_REUSEPORT)
+}
+
 void
 listener::start_accept ()
 {
-  new_connection_.reset (new connection (io_context_, *writer));
+  new_connection_.reset (
+      new connection (io_context_, *writer, backends_, passthrough_));
   acceptor_.async_accept (new_connection_->client_socket (),
                           boost::bind (&listener::handle_accept, this,
                                        boost::asio::placeholders::error));
@@ -46,6 +72,8 @@ listener::handle_accept (const boost::system::error_code &e)
 {
   if (!e)
     {
+      mysqlproxy_common::metrics::add (
+          mysqlproxy_common::metrics::connections_accepted);
       new_connection_->start ();
     }
 
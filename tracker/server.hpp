@@ -5,6 +5,7 @@
 #include <boost/noncopyable.hpp>
 #include <boost/scoped_ptr.hpp>
 
+#include "balancer.hpp"
 #include "connection.hpp"
 #include "system/logger_service.hpp"
 
@@ -15,19 +16,36 @@ namespace server
 
 extern boost::scoped_ptr<mysqlproxy_system::basic_logger> writer;
 
+// Port whose clients are relayed without being parsed, none when empty
+extern std::string passthrough_port;
+
+/// Accepts the clients of one io_context.
+/**
+ * In shared_nothing mode every thread has a listener of its own on the same
+ * port (SO_REUSEPORT), the kernel spreads the connections over them and a
+ * connection stays on the thread that accepted it. The clients of a
+ * passthrough listener are relayed to their server as they are.
+ */
 class listener : private boost::noncopyable
 {
 public:
-  explicit listener (boost::asio::io_context &ioc);
+  /// Clients are spread over the servers of backends.
+  listener (boost::asio::io_context &ioc, balancer &backends,
+            bool passthrough = false);
 
   void run (const std::string &address, const std::string &port);
 
+  /// Whether listeners can share a port, as shared_nothing needs.
+  static bool reuse_port_supported ();
+
 private:
   void start_accept ();
   void handle_accept (const boost::system::error_code &e);
 
   boost::asio::io_context &io_context_;
   boost::asio::ip::tcp::acceptor acceptor_;
+  balancer &backends_;
+  bool passthrough_;
 
   connection_ptr new_connection_;
 };
@@ -1,8 +1,19 @@
 #include <boost/program_options.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
+#include <cstdlib>
 #include <iostream>
+#include <vector>
 
+#include "common/audit_log.hpp"
+#include "common/digest_stats.hpp"
+#include "common/packet_pool.hpp"
 #include "common/processor.hpp"
+#include "common/query_digest.hpp"
+#include "common/result_cache.hpp"
+#include "common/traffic_capture.hpp"
+#include "backend_pool.hpp"
+#include "metrics_server.hpp"
 #include "server.hpp"
 
 namespace mysqlproxy_tracker
@@ -10,19 +21,24 @@ namespace mysqlproxy_tracker
 
 std::string address, port;
 std::string output_file;
+std::string audit_log;
+std::string capture;
+std::vector<std::string> cache_rules;
+std::string log_level = "info";
+mysqlproxy_system::log_file_options log_file;
 
 } // namespace mysqlproxy_tracker
 
 static void
 run__thread_app (std::size_t index)
 {
-  mysqlproxy_common::processor::instance ().io_context ().run ();
+  mysqlproxy_common::processor::instance ().io_context (index).run ();
 }
 
 static void
 __signal_handler (boost::system::error_code const &ec, int sig)
 {
-  mysqlproxy_common::processor::instance ().io_context ().stop ();
+  mysqlproxy_common::processor::stop ();
 }
 
 int
@@ -35,6 +51,10 @@ main (int argc, char *argv[], char *envp[])
       boost::program_options::value<uint32_t> (&mysqlproxy_common::pool_size)
           ->default_value (boost::thread::hardware_concurrency ()),
       "Thread pool's size") (
+      "shared-nothing",
+      boost::program_options::bool_switch (&mysqlproxy_common::shared_nothing),
+      "One io_context, SO_REUSEPORT listener and set of server pools per "
+      "thread; pool sizes apply to each thread") (
       "address,a",
       boost::program_options::value<std::string> (&mysqlproxy_tracker::address)
           ->required (),
@@ -45,7 +65,210 @@ main (int argc, char *argv[], char *envp[])
       "Server port") ("output-file",
                       boost::program_options::value<std::string> (
                           &mysqlproxy_tracker::output_file),
-                      "Output log stream pathname") ("help", "This message");
+                      "Output log stream pathname") (
+      "log-level",
+      boost::program_options::value<std::string> (
+          &mysqlproxy_tracker::log_level)
+          ->default_value (mysqlproxy_tracker::log_level),
+      "Lowest level logged: debug, info, warning, error or critical") (
+      "log-flush-interval",
+      boost::program_options::value<std::size_t> (
+          &mysqlproxy_tracker::log_file.flush_interval)
+          ->default_value (mysqlproxy_tracker::log_file.flush_interval),
+      "Milliseconds a line waits at most before the output file is written") (
+      "log-rotate-size",
+      boost::program_options::value<uint64_t> (
+          &mysqlproxy_tracker::log_file.rotate_bytes)
+          ->default_value (mysqlproxy_tracker::log_file.rotate_bytes),
+      "Bytes after which the output file is rotated, never when 0") (
+      "log-rotate-interval",
+      boost::program_options::value<std::size_t> (
+          &mysqlproxy_tracker::log_file.rotate_interval)
+          ->default_value (mysqlproxy_tracker::log_file.rotate_interval),
+      "Seconds after which the output file is rotated, never when 0") (
+      "log-compress",
+      boost::program_options::bool_switch (
+          &mysqlproxy_tracker::log_file.compress),
+      "Gzip the rotated output files in the background") (
+      "query-log-sample",
+      boost::program_options::value<std::size_t> (
+          &mysqlproxy_tracker::server::query_log_sample)
+          ->default_value (mysqlproxy_tracker::server::query_log_sample),
+      "Log one COM_QUERY in this many, none when 0") (
+      "audit-log",
+      boost::program_options::value<std::string> (
+          &mysqlproxy_tracker::audit_log),
+      "Write every client command to binary segments named after this "
+      "path") (
+      "audit-segment-size",
+      boost::program_options::value<uint64_t> (
+          &mysqlproxy_common::audit_segment_bytes)
+          ->default_value (mysqlproxy_common::audit_segment_bytes),
+      "Bytes after which a new audit segment is started") (
+      "audit-flush-interval",
+      boost::program_options::value<std::size_t> (
+          &mysqlproxy_common::audit_flush_interval)
+          ->default_value (mysqlproxy_common::audit_flush_interval),
+      "Milliseconds an audit record waits at most before it is written") (
+      "audit-text-limit",
+      boost::program_options::value<std::size_t> (
+          &mysqlproxy_common::audit_text_limit)
+          ->default_value (mysqlproxy_common::audit_text_limit),
+      "Bytes of statement text kept per audit record") (
+      "capture",
+      boost::program_options::value<std::string> (
+          &mysqlproxy_tracker::capture),
+      "Record the client commands of every session for mysqlproxy_replay "
+      "to segments named after this path") (
+      "capture-segment-size",
+      boost::program_options::value<uint64_t> (
+          &mysqlproxy_common::capture_segment_bytes)
+          ->default_value (mysqlproxy_common::capture_segment_bytes),
+      "Bytes after which a new capture segment is started") (
+      "cache-rule",
+      boost::program_options::value<std::vector<std::string> > (
+          &mysqlproxy_tracker::cache_rules),
+      "Cache the results of the reads with the digest of a statement, as "
+      "TTL:statement with the TTL in milliseconds; repeat for several") (
+      "cache-size",
+      boost::program_options::value<std::size_t> (
+          &mysqlproxy_common::result_cache_bytes)
+          ->default_value (mysqlproxy_common::result_cache_bytes),
+      "Bytes of results the cache keeps") (
+      "cache-entry-size",
+      boost::program_options::value<std::size_t> (
+          &mysqlproxy_common::result_cache_entry_bytes)
+          ->default_value (mysqlproxy_common::result_cache_entry_bytes),
+      "Largest result the cache keeps") (
+      "coalesce",
+      boost::program_options::bool_switch (
+          &mysqlproxy_tracker::server::coalesce),
+      "Run identical reads arriving while one is in flight once and share "
+      "its response") (
+      "read-buffer-size",
+      boost::program_options::value<std::size_t> (
+          &mysqlproxy_tracker::server::read_buffer_size)
+          ->default_value (mysqlproxy_tracker::server::read_buffer_size),
+      "Initial receive buffer size per direction") (
+      "high-watermark",
+      boost::program_options::value<std::size_t> (
+          &mysqlproxy_tracker::server::high_watermark)
+          ->default_value (mysqlproxy_tracker::server::high_watermark),
+      "Bytes queued for a client before the server reads pause") (
+      "low-watermark",
+      boost::program_options::value<std::size_t> (
+          &mysqlproxy_tracker::server::low_watermark)
+          ->default_value (mysqlproxy_tracker::server::low_watermark),
+      "Bytes queued for a client at which the server reads resume") (
+      "cut-through-size",
+      boost::program_options::value<std::size_t> (
+          &mysqlproxy_tracker::server::cut_through_size)
+          ->default_value (mysqlproxy_tracker::server::cut_through_size),
+      "Payload bytes above which rows, continuation packets, LOAD DATA "
+      "files and the rest of long commands are relayed as they arrive") (
+      "passthrough-port",
+      boost::program_options::value<std::string> (
+          &mysqlproxy_tracker::server::passthrough_port),
+      "Port whose clients are relayed to a server of their own without "
+      "being parsed, disabled when not set") (
+      "passthrough-copy",
+      boost::program_options::bool_switch (
+          &mysqlproxy_tracker::server::passthrough_copy),
+      "Copy passthrough and replication traffic through user space instead "
+      "of splicing it") (
+      "pool-cache-bytes",
+      boost::program_options::value<std::size_t> (
+          &mysqlproxy_common::pool_cache_bytes)
+          ->default_value (mysqlproxy_common::pool_cache_bytes),
+      "Bytes of free packet buffers kept per thread and size class") (
+      "max-digest-length",
+      boost::program_options::value<std::size_t> (
+          &mysqlproxy_common::max_digest_length)
+          ->default_value (mysqlproxy_common::max_digest_length),
+      "Longest normalized statement text kept for a query digest") (
+      "digest-slots",
+      boost::program_options::value<std::size_t> (
+          &mysqlproxy_common::digest_stats_slots)
+          ->default_value (mysqlproxy_common::digest_stats_slots),
+      "Distinct digests each thread keeps statistics for") (
+      "backend-user",
+      boost::program_options::value<std::string> (
+          &mysqlproxy_tracker::server::backend_user),
+      "User of the pooled server sessions, enables pooling") (
+      "backend-password",
+      boost::program_options::value<std::string> (
+          &mysqlproxy_tracker::server::backend_password),
+      "Password of the pooled server sessions") (
+      "backend-database",
+      boost::program_options::value<std::string> (
+          &mysqlproxy_tracker::server::backend_database),
+      "Default database of the pooled server sessions") (
+      "pool-min",
+      boost::program_options::value<std::size_t> (
+          &mysqlproxy_tracker::server::pool_min_size)
+          ->default_value (mysqlproxy_tracker::server::pool_min_size),
+      "Server sessions kept open per backend") (
+      "pool-max",
+      boost::program_options::value<std::size_t> (
+          &mysqlproxy_tracker::server::pool_max_size)
+          ->default_value (mysqlproxy_tracker::server::pool_max_size),
+      "Maximum server sessions per backend") (
+      "pool-idle-timeout",
+      boost::program_options::value<std::size_t> (
+          &mysqlproxy_tracker::server::pool_idle_timeout)
+          ->default_value (mysqlproxy_tracker::server::pool_idle_timeout),
+      "Seconds before idle server sessions above the minimum are closed") (
+      "pool-ping-interval",
+      boost::program_options::value<std::size_t> (
+          &mysqlproxy_tracker::server::pool_ping_interval)
+          ->default_value (mysqlproxy_tracker::server::pool_ping_interval),
+      "Seconds before idle server sessions are pinged to keep them open") (
+      "multiplex",
+      boost::program_options::bool_switch (
+          &mysqlproxy_tracker::server::multiplex),
+      "Hold pooled sessions only while a statement or transaction runs; "
+      "needs --backend-user") (
+      "backend",
+      boost::program_options::value<std::vector<std::string> > (
+          &mysqlproxy_tracker::server::backend_addresses)
+          ->composing (),
+      "Server as host:port, repeat for several (default 127.0.0.1:3306)") (
+      "primary",
+      boost::program_options::value<std::string> (
+          &mysqlproxy_tracker::server::primary_address),
+      "Server taking the writes as host:port, the --backend servers then "
+      "take the reads; needs --backend-user") (
+      "balance",
+      boost::program_options::value<std::string> (
+          &mysqlproxy_tracker::server::balance_policy)
+          ->default_value (mysqlproxy_tracker::server::balance_policy),
+      "Server choice of new sessions: round-robin, least-outstanding or "
+      "peak-ewma") (
+      "ewma-decay",
+      boost::program_options::value<std::size_t> (
+          &mysqlproxy_tracker::server::ewma_decay)
+          ->default_value (mysqlproxy_tracker::server::ewma_decay),
+      "Milliseconds over which the peak-ewma latency decays") (
+      "failure-backoff",
+      boost::program_options::value<std::size_t> (
+          &mysqlproxy_tracker::server::failure_backoff)
+          ->default_value (mysqlproxy_tracker::server::failure_backoff),
+      "Seconds a server is skipped after a failed connect") (
+      "metrics-address",
+      boost::program_options::value<std::string> (
+          &mysqlproxy_tracker::server::metrics_address)
+          ->default_value (mysqlproxy_tracker::server::metrics_address),
+      "Address of the Prometheus metrics endpoint") (
+      "metrics-port",
+      boost::program_options::value<std::string> (
+          &mysqlproxy_tracker::server::metrics_port),
+      "Port serving GET /metrics, disabled when not set") (
+      "metrics-digests",
+      boost::program_options::value<std::size_t> (
+          &mysqlproxy_tracker::server::metrics_digests)
+          ->default_value (mysqlproxy_tracker::server::metrics_digests),
+      "Query digests with the most total latency exported on /metrics") (
+      "help", "This message");
 
   // Variable to store our command line arguments.
   boost::program_options::variables_map vm;
@@ -63,6 +286,63 @@ main (int argc, char *argv[], char *envp[])
       return 1;
     }
 
+  if (mysqlproxy_tracker::server::low_watermark
+      > mysqlproxy_tracker::server::high_watermark)
+    {
+      std::cerr << "The low watermark must not exceed the high watermark\n";
+      return 1;
+    }
+
+  if (mysqlproxy_tracker::server::cut_through_size < 1024)
+    {
+      std::cerr << "The cut through size must be 1024 bytes at least\n";
+      return 1;
+    }
+
+  if (mysqlproxy_common::shared_nothing
+      && !mysqlproxy_tracker::server::listener::reuse_port_supported ())
+    {
+      std::cerr << "Shared nothing needs SO_REUSEPORT, missing here\n";
+      return 1;
+    }
+
+  {
+    // In logger_service::severity_level order
+    static const char *const levels[]
+        = { "debug", "info", "warning", "error", "critical" };
+
+    std::size_t i = 0;
+    while (i < sizeof (levels) / sizeof (levels[0])
+           && mysqlproxy_tracker::log_level != levels[i])
+      ++i;
+    if (i == sizeof (levels) / sizeof (levels[0]))
+      {
+        std::cerr << "Unknown log level \"" << mysqlproxy_tracker::log_level
+                  << "\"\n";
+        return 1;
+      }
+    mysqlproxy_system::log_threshold.store (int (i));
+  }
+
+  for (std::size_t i = 0; i < mysqlproxy_tracker::cache_rules.size (); ++i)
+    {
+      const std::string &rule = mysqlproxy_tracker::cache_rules[i];
+      std::string::size_type colon = rule.find (':');
+      char *end = 0;
+      unsigned long ttl
+          = colon == std::string::npos
+                ? 0
+                : std::strtoul (rule.substr (0, colon).c_str (), &end, 10);
+      if (!ttl || *end || colon + 1 == rule.size ())
+        {
+          std::cerr << "Bad cache rule \"" << rule
+                    << "\", expected TTL:statement\n";
+          return 1;
+        }
+      mysqlproxy_common::result_cache::add_rule (rule.substr (colon + 1),
+                                                 ttl);
+    }
+
   mysqlproxy_tracker::server::writer.reset (
       new mysqlproxy_system::basic_logger (
           mysqlproxy_common::processor::instance ().io_context (), "Server"));
@@ -70,22 +350,139 @@ main (int argc, char *argv[], char *envp[])
   if (!mysqlproxy_tracker::output_file.empty ())
     {
       mysqlproxy_tracker::server::writer->use_file (
-          mysqlproxy_tracker::output_file);
+          mysqlproxy_tracker::output_file, mysqlproxy_tracker::log_file);
 
       CXXLOG_INFO (mysqlproxy_tracker::server::writer,
                    "Begin logging file: \"" << mysqlproxy_tracker::output_file
                                             << '\"');
     }
 
-  mysqlproxy_tracker::server::listener listen (
-      mysqlproxy_common::processor::instance ().io_context ());
-  listen.run (mysqlproxy_tracker::address, mysqlproxy_tracker::port);
+  try
+    {
+      if (!mysqlproxy_tracker::audit_log.empty ())
+        mysqlproxy_common::audit_log::open (mysqlproxy_tracker::audit_log);
+      if (!mysqlproxy_tracker::capture.empty ())
+        mysqlproxy_common::traffic_capture::open (mysqlproxy_tracker::capture);
+    }
+  catch (const std::exception &e)
+    {
+      std::cerr << e.what () << "\n";
+      return 1;
+    }
+
+  if (mysqlproxy_tracker::server::pool_min_size
+      > mysqlproxy_tracker::server::pool_max_size)
+    {
+      std::cerr << "The pool minimum must not exceed the pool maximum\n";
+      return 1;
+    }
+
+  if (mysqlproxy_tracker::server::multiplex
+      && mysqlproxy_tracker::server::backend_user.empty ())
+    {
+      std::cerr << "Multiplexing needs --backend-user\n";
+      return 1;
+    }
 
   BOOST_ASSERT (mysqlproxy_common::pool_size > 0);
 
+  CXXLOG_INFO (mysqlproxy_tracker::server::writer,
+               "Starting " << mysqlproxy_common::pool_size << " threads on "
+                           << mysqlproxy_common::processor::reactor ());
+
+  // Without shared_nothing all threads share the first io_context
+  std::size_t contexts
+      = mysqlproxy_common::shared_nothing ? mysqlproxy_common::pool_size : 1;
+
+  // Connections keep a reference to it from the first accept
+  mysqlproxy_tracker::server::writer.reset (
+      new mysqlproxy_system::basic_logger (
+          mysqlproxy_common::processor::instance ().io_context (),
+          "Connection"));
+
+  std::vector<boost::shared_ptr<mysqlproxy_tracker::server::balancer> >
+      backends;
+  std::vector<boost::shared_ptr<mysqlproxy_tracker::server::listener> >
+      listeners;
+
+  for (std::size_t i = 0; i < contexts; ++i)
+    {
+      boost::asio::io_context &ioc
+          = mysqlproxy_common::processor::instance ().io_context (i);
+
+      try
+        {
+          backends.push_back (
+              boost::shared_ptr<mysqlproxy_tracker::server::balancer> (
+                  mysqlproxy_tracker::server::balancer::create (
+                      ioc,
+                      !mysqlproxy_tracker::server::backend_user.empty ())));
+        }
+      catch (const std::exception &e)
+        {
+          std::cerr << "Backends: " << e.what () << "\n";
+          return 1;
+        }
+
+      listeners.push_back (
+          boost::shared_ptr<mysqlproxy_tracker::server::listener> (
+              new mysqlproxy_tracker::server::listener (ioc,
+                                                        *backends.back ())));
+      listeners.back ()->run (mysqlproxy_tracker::address,
+                              mysqlproxy_tracker::port);
+
+      if (!mysqlproxy_tracker::server::passthrough_port.empty ())
+        {
+          listeners.push_back (
+              boost::shared_ptr<mysqlproxy_tracker::server::listener> (
+                  new mysqlproxy_tracker::server::listener (
+                      ioc, *backends.back (), true)));
+          listeners.back ()->run (
+              mysqlproxy_tracker::address,
+              mysqlproxy_tracker::server::passthrough_port);
+        }
+    }
+
+  mysqlproxy_tracker::server::metrics_listener metrics (
+      mysqlproxy_common::processor::instance ().io_context ());
+  if (!mysqlproxy_tracker::server::metrics_port.empty ())
+    metrics.run (mysqlproxy_tracker::server::metrics_address,
+                 mysqlproxy_tracker::server::metrics_port);
+
+  for (std::size_t i = 0; i < contexts; ++i)
+    backends[i]->start (
+        mysqlproxy_common::processor::instance ().io_context (i),
+        *mysqlproxy_tracker::server::writer);
+
   mysqlproxy_common::thread_func = run__thread_app;
   mysqlproxy_common::signal_handler = __signal_handler;
   mysqlproxy_common::processor::exec ();
 
+  mysqlproxy_common::audit_log::close ();
+  mysqlproxy_common::traffic_capture::close ();
+
+  mysqlproxy_common::packet_pool::statistics pool
+      = mysqlproxy_common::packet_pool::stats ();
+  CXXLOG_INFO (mysqlproxy_tracker::server::writer,
+               "Packet pool: " << std::dec << pool.hits << " hits, "
+                               << pool.misses << " misses, hit rate "
+                               << pool.hit_rate () * 100 << '%');
+
+  std::vector<mysqlproxy_common::digest_summary> digests;
+  mysqlproxy_common::digest_stats::snapshot (digests);
+  for (std::size_t i = 0; i < digests.size () && i < 10; i++)
+    {
+      const mysqlproxy_common::digest_summary &d = digests[i];
+
+      CXXLOG_INFO (mysqlproxy_tracker::server::writer,
+                   "Digest " << std::hex << d.hash << std::dec << " \""
+                             << d.text << "\": " << d.count << " queries, "
+                             << d.errors << " errors, " << d.rows << " rows, "
+                             << d.bytes << " bytes, p50 "
+                             << d.percentile (0.5) << "us p99 "
+                             << d.percentile (0.99) << "us p999 "
+                             << d.percentile (0.999) << "us");
+    }
+
   return 0;
 }
\ No newline at end of file